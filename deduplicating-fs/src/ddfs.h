@@ -3,7 +3,13 @@
 
 #ifdef _KERNEL
 #include <sys/types.h>
+#include <sys/_task.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+#include <sys/sx.h>
 #else /* ! _KERNEL */
+#include <sys/types.h>
 #include <stdint.h>
 #endif /* _KERNEL */
 
@@ -15,22 +21,299 @@
 
 /* KVFS inode flags */
 #define DDFS_DEDUP_FREE 0x0001
+#define DDFS_DEDUP_DEAD 0x0002	/* removed from a full bucket; probes continue past it */
 #define DDFS_DEDUP_ACTIVE 0x0010
 
-/* 
- * On-disk representation of a ddfs dedup table entry.
+/*
+ * Dedup table layout, recorded in fs_ddformat by newfs-ddfs.
+ * Tables written before the table was hash-addressed have format 0.
+ */
+#define DDFS_DDFORMAT_LINEAR 0 /* unordered array, searched linearly */
+#define DDFS_DDFORMAT_HASH 1   /* hash-addressed buckets (ddfs_table.c) */
+#define DDFS_DDFORMAT_REVIDX 2 /* plus block number -> slot reverse index */
+#define DDFS_DDFORMAT_LOG 3    /* plus intent log of table changes */
+#define DDFS_DDFORMAT_REF32 4  /* plus 32-bit refcounts */
+#define DDFS_DDFORMAT_TAGGED 5 /* plus buckets laid out by field, with key tags */
+#define DDFS_DDFORMAT DDFS_DDFORMAT_TAGGED
+
+/* oldest format the kernel module and tools still read and write */
+#define DDFS_DDFORMAT_MIN DDFS_DDFORMAT_LOG
+#define DDFS_DDFORMAT_OK(f) ((f) >= DDFS_DDFORMAT_MIN && (f) <= DDFS_DDFORMAT)
+
+/* format of a table being upgraded by upgradeddfs, which nothing else will use */
+#define DDFS_DDFORMAT_UPGRADING (-1)
+
+/*
+ * Block fingerprint algorithm, recorded in fs_ddfingerprint by newfs-ddfs
+ * (see ddfs_fingerprint.c). Filesystems made before the field existed have 0.
+ */
+#define DDFS_FP_SHA1 0	 /* SHA-1 */
+#define DDFS_FP_SHA256 1 /* SHA-256, truncated to 160 bits */
+#define DDFS_FP_BLAKE3 2 /* BLAKE3, 160 bits of output */
+#define DDFS_FP_XXH64 3	 /* xxHash64, not collision resistant */
+#define DDFS_FP_MAX DDFS_FP_XXH64
+
+/* blocks with the same `fp` fingerprint must be compared before being shared */
+#define DDFS_FP_VERIFY(fp) ((fp) == DDFS_FP_XXH64)
+
+/*
+ * A ddfs dedup table entry, as read from the table (see ddentry_decode).
  * Contains a key, ref count, and block pointer.
  * The reference count is incremented when a 4k fragment hashes to the key in this entry,
  * and decremented when the old hash does not match the new hash.
  * When the reference count reaches 0, this entry is freed.
+ * A reference count that reaches DDFS_REFCOUNT_MAX of the table format is
+ * pinned there: it is never incremented or decremented again, and the block
+ * is never freed.
  */
-struct __attribute__((packed)) ddfs_dedup {
+struct ddfs_dedup {
 	uint8_t key[20];    /* 160 bit key */
-	uint16_t flags;	    /* flags. one of FREE | ACTIVE */
-	uint16_t ref_count; /* reference count*/
+	uint16_t flags;	    /* flags. one of FREE | DEAD | ACTIVE */
+	uint32_t ref_count; /* reference count*/
 	daddr_t blockptr;	/* block pointer for this key-value pair */
 };
 
+/*
+ * In format 3 and 4 tables and in intent log records, every entry takes
+ * DDFS_DEDUP_SIZE bytes. Format 3 stores the fields above in order, with a
+ * 16-bit refcount. From format 4 on, the refcount is 32 bits, and the flags
+ * take the top 8 bits of the 64-bit block pointer, which leaves 56 bits of
+ * fragment address:
+ *
+ *	format 3: key[20] | flags (16) | ref_count (16) | blockptr (64)
+ *	format 4: key[20] | ref_count (32) | flags (8) blockptr (56)
+ *
+ * Every slot has a flag set, so the top byte of the last word tells the two
+ * apart (it is 0 in format 3), which lets upgradeddfs resume a conversion.
+ * Format 5 log records are laid out like format 4 entries.
+ */
+#define DDFS_DEDUP_SIZE 32
+#define DDFS_DEDUP_BLKMASK ((1ULL << 56) - 1)
+
+/*
+ * Format 5 table blocks are laid out by field instead of by entry, each
+ * array indexed by slot:
+ *
+ *	struct ddfs_bucket (64) | tag[n] (16, padded to 8 bytes) |
+ *	blockptr[n] (64) | ref_count[n] (32) | key[n][20]
+ *
+ * The tag of an entry is bytes 8 and 9 of its key, which do not pick its home
+ * bucket. A lookup compares the tags of the whole bucket a word at a time and
+ * only reads the keys whose tag matches. The flags are the bitmaps in the
+ * header: a slot in neither is FREE, so a zeroed block is an empty bucket.
+ */
+struct ddfs_bucket {
+	uint64_t bk_active[2]; /* ACTIVE slots */
+	uint64_t bk_dead[2];   /* DEAD slots */
+	uint8_t bk_unused[32];
+};
+
+#define DDFS_BUCKET_MAXSLOTS 128 /* slots the bitmaps cover */
+#define DDFS_TAGGED_SLOTSIZE (2 + 8 + 4 + 20)
+
+/*
+ * Share of its entries a table is sized to fill when newfs-ddfs -D or growddfs
+ * is given the number of entries, in percent. Fuller tables overflow more keys
+ * into the next bucket, which lookups then read too.
+ */
+#define DDFS_TABLE_FILL 75
+
+/* refcount at which the entries of format `f` are pinned */
+#define DDFS_REFCOUNT_MAX(f) ((f) >= DDFS_DDFORMAT_REF32 ? UINT32_MAX : UINT16_MAX)
+
+/* refcount ddtable_unref and ddtable_refcount give a pinned entry, whatever its format */
+#define DDFS_REFS_PINNED UINT32_MAX
+
+/*
+ * Dedup intent log, a circular array of blocks following the reverse index.
+ * Log blocks record the new contents of table slots in the order they were
+ * changed, so a change is made durable by appending to the log, and table
+ * blocks can be written back lazily. The log is replayed into the table at
+ * mount. The block with sequence number `seq` is stored at `seq % nlog`.
+ */
+#define DDFS_LOG_MAGIC 0x64646c67 /* "ddlg" */
+#define DDFS_LOG_BLOCKS 1024	  /* log blocks reserved by newfs-ddfs */
+
+struct ddfs_loghdr {
+	uint32_t lh_magic;  /* DDFS_LOG_MAGIC */
+	uint32_t lh_nrec;   /* records following the header */
+	uint64_t lh_seq;    /* sequence number of this block, starting at 1 */
+	uint64_t lh_ckpt;   /* oldest block whose changes may be missing from the table */
+	uint32_t lh_cksum;  /* checksum of the whole block, with this field 0 */
+	uint32_t lh_unused;
+};
+
+struct __attribute__((packed)) ddfs_logrec {
+	int64_t lr_slot;		  /* table slot that changed */
+	uint8_t lr_entry[DDFS_DEDUP_SIZE]; /* its new contents, as in the table */
+};
+
+/* records that fit in a log block */
+#define DDFS_LOG_NRECS(bsize) \
+	((int)(((bsize) - sizeof(struct ddfs_loghdr)) / sizeof(struct ddfs_logrec)))
+
+/*
+ * Handle on a hash-addressed dedup table, shared by the kernel and the
+ * userland tools (see ddfs_table.c).
+ * Each table block is one bucket, and the reverse index from block pointer
+ * to slot is stored in the blocks following the table. Blocks are read and
+ * released through callbacks, so the same lookup and insert code runs
+ * against a mounted filesystem or against an image file.
+ * Buckets are locked in dt_nlocks stripes, also through callbacks, so that
+ * several threads can use the table at once.
+ */
+struct ddtable {
+	void *dt_devfd;	     /* ufsmount in the kernel, file descriptor in userland */
+	int dt_bsize;	     /* size of a table block */
+	int64_t dt_nbuckets; /* number of table blocks */
+	int dt_nentries;     /* entries per table block, from ddtable_nentries() */
+	int dt_format;	     /* fs_ddformat, which sets the layout of entries on disk */
+	int64_t dt_revblk;   /* first reverse index block */
+	int64_t dt_nrev;     /* reverse index entries (blocks in the filesystem) */
+	/* read block `blkno`, counted in table blocks from the start of the table */
+	int (*dt_bread)(void *devfd, int64_t blkno, void **datap, void **bufp);
+	/* release a buffer returned by dt_bread, writing it back if `dirty` */
+	int (*dt_brelse)(void *devfd, void *bufp, int dirty);
+	uint64_t dt_reads;  /* blocks read */
+	uint64_t dt_writes; /* blocks written back */
+	uint8_t *dt_freemap; /* buckets with a FREE or DEAD slot, 1 bit each, or NULL */
+	int64_t dt_nfree;    /* FREE and DEAD slots, maintained with dt_freemap */
+	int64_t dt_logblk;   /* first intent log block */
+	int64_t dt_nlog;     /* intent log blocks, 0 if there is no log */
+	/* if set, called with the new contents of every slot that changes, its bucket locked */
+	int (*dt_log)(void *devfd, int64_t slot, const struct ddfs_dedup *entry);
+	int dt_nlocks;	     /* bucket lock stripes, a power of 2, or 0 for no locking */
+	/* lock, try to lock (returning nonzero on success) and unlock stripe `stripe` */
+	void (*dt_lock)(void *devfd, int stripe);
+	int (*dt_trylock)(void *devfd, int stripe);
+	void (*dt_unlock)(void *devfd, int stripe);
+};
+
+/* size in bytes of the free bucket map of a table */
+#define DDTABLE_FREEMAP_SIZE(dt) (((dt)->dt_nbuckets + 7) / 8)
+
+/* Convert between a table-wide slot number and its bucket / index in the bucket */
+#define DDTABLE_SLOT(dt, bucket, idx) ((int64_t)(bucket) * (dt)->dt_nentries + (idx))
+#define DDTABLE_BUCKET(dt, slot) ((slot) / (dt)->dt_nentries)
+#define DDTABLE_IDX(dt, slot) ((int)((slot) % (dt)->dt_nentries))
+
+/* lock stripe of a bucket */
+#define DDTABLE_STRIPE(dt, bucket) ((int)((bucket) & ((dt)->dt_nlocks - 1)))
+
+/* ==================
+ * Dedup Table Functions (ddfs_table.c)
+ * ================== */
+
+/* read and write the DDFS_DEDUP_SIZE bytes of an entry at `p` in table format `format` */
+void ddentry_decode(int format, const void *p, struct ddfs_dedup *entry);
+void ddentry_encode(int format, void *p, const struct ddfs_dedup *entry);
+
+/* entries in a table block of `bsize` bytes in table format `format` */
+int ddtable_nentries(int format, int bsize);
+
+/* read and write entry `idx` of the table block `data`, and make `data` an empty bucket */
+void ddtable_getentry(const struct ddtable *dt, const void *data, int idx,
+    struct ddfs_dedup *entry);
+void ddtable_putentry(const struct ddtable *dt, void *data, int idx,
+    const struct ddfs_dedup *entry);
+void ddtable_initblock(const struct ddtable *dt, void *data);
+
+/* table blocks that hold `nentries` entries of format `format` at DDFS_TABLE_FILL */
+int64_t ddtable_sizefor(int format, int bsize, int64_t nentries);
+
+/* whether the refcount of `entry` is pinned (see struct ddfs_dedup) */
+#define DDTABLE_PINNED(dt, entry) ((entry)->ref_count == DDFS_REFCOUNT_MAX((dt)->dt_format))
+
+/* home bucket of a key */
+int64_t ddtable_bucket(const struct ddtable *dt, const uint8_t key[20]);
+
+/*
+ * lock and unlock the stripe of `bucket`. The functions below taking a key
+ * are called with the key's home bucket locked, and those taking a slot with
+ * the slot's bucket locked (see ddfs_table.c)
+ */
+void ddtable_lock(struct ddtable *dt, int64_t bucket);
+void ddtable_unlock(struct ddtable *dt, int64_t bucket);
+
+/* find the entry for `key`. returns 0 if found, ENOENT if not, or an errno */
+int ddtable_lookup(struct ddtable *dt, const uint8_t key[20], int64_t *out_slot,
+    struct ddfs_dedup *out_entry);
+
+/* take a reference on `key`, inserting it with block `in_block` if not present */
+int ddtable_ref(struct ddtable *dt, const uint8_t key[20], daddr_t in_block,
+    int64_t *out_slot, struct ddfs_dedup *out_entry);
+
+/* insert `key`, known not to be in the table, with block `in_block` */
+int ddtable_insert(struct ddtable *dt, const uint8_t key[20], daddr_t in_block,
+    int64_t *out_slot, struct ddfs_dedup *out_entry);
+
+/* take a reference on `key`, whose entry is known to be in `slot` */
+int ddtable_incref(struct ddtable *dt, int64_t slot, const uint8_t key[20],
+    struct ddfs_dedup *out_entry);
+
+/* drop a reference on the entry for `blockptr` in `slot`, freeing the entry at 0 */
+int ddtable_deref(struct ddtable *dt, int64_t slot, daddr_t blockptr,
+    struct ddfs_dedup *out_entry);
+
+/* find the slot of the entry whose block pointer is `blockptr` through the reverse index */
+int ddtable_findblk(struct ddtable *dt, daddr_t blockptr, int64_t *out_slot);
+
+/* read the entry for `blockptr` in `slot` */
+int ddtable_get(struct ddtable *dt, int64_t slot, daddr_t blockptr,
+    struct ddfs_dedup *out_entry);
+
+/* point the reverse index entry of the ACTIVE entry in `slot` back at it */
+int ddtable_revrepair(struct ddtable *dt, int64_t slot, const struct ddfs_dedup *entry);
+
+/* copy `entry` from another table into `dt`, leaving the reverse index alone */
+int ddtable_rehash(struct ddtable *dt, const struct ddfs_dedup *entry, int64_t *out_slot);
+
+/* record a FREE or DEAD slot in dt_freemap while building it (see ddtable_foreach) */
+void ddtable_freemap_set(struct ddtable *dt, int64_t slot);
+
+/* fill in the header checksum of a log block about to be written */
+void ddtable_logseal(const struct ddtable *dt, void *data);
+
+/* replay the intent log into the table, and return the next sequence number to use */
+int ddtable_replay(struct ddtable *dt, uint64_t *out_seq);
+
+/* call `fn` on every slot of the table */
+int ddtable_foreach(struct ddtable *dt,
+    void (*fn)(void *arg, int64_t slot, const struct ddfs_dedup *entry), void *arg);
+
+/* ==================
+ * Block Fingerprints (ddfs_fingerprint.c)
+ * ================== */
+
+/* compute the `fp` fingerprint of `size` bytes at `buf`. returns EINVAL for an unknown `fp` */
+int ddfs_fingerprint(int fp, const void *buf, size_t size, uint8_t key[20]);
+
+/* name of fingerprint algorithm `fp`, or NULL */
+const char *ddfs_fingerprint_name(int fp);
+
+/* fingerprint algorithm called `name`, or -1 */
+int ddfs_fingerprint_byname(const char *name);
+
+/* xxHash64 of `size` bytes at `buf` */
+uint64_t ddfs_xxh64(const void *buf, size_t size, uint64_t seed);
+
+/* BLAKE3 of `size` bytes at `buf`, writing `outlen` (at most 32) bytes of output */
+void ddfs_blake3(const void *buf, size_t size, uint8_t *out, size_t outlen);
+
+/* compute the `fp` fingerprints of `n` buffers of `size` bytes each, batching where possible */
+int ddfs_fingerprint_batch(int fp, const void *const bufs[], int n, size_t size,
+    uint8_t keys[][20]);
+
+/* whether the `size` bytes at `buf` are all zero; `size` is a multiple of 64 */
+int ddfs_iszero(const void *buf, size_t size);
+
+/* blocks hashed at once by ddfs_sha1_lanes() */
+#define DDFS_SHA1_LANES 4
+
+/* SHA-1 of DDFS_SHA1_LANES buffers of `size` bytes each (ddfs_sha1x.c) */
+void ddfs_sha1_lanes(const void *const bufs[DDFS_SHA1_LANES], size_t size,
+    uint8_t digests[][20]);
+
 #ifdef _KERNEL
 
 /* ==================
@@ -43,19 +326,213 @@ int str_to_key(const char *str, uint8_t *out_key);
 /* Convert 160-bit key to 40-digit string */
 int key_to_str(const uint8_t *key, char *out_str);
 
-/* hash a block with sha1 */
-int hash_block(uint8_t result[20], void *buf, size_t size);
+/* fingerprint a block with the algorithm of the filesystem `fs` */
+struct fs;
+int hash_block(const struct fs *fs, uint8_t result[20], void *buf, size_t size);
+
+/* fingerprint `n` blocks at once with the algorithm of the filesystem `fs` */
+int hash_blocks(const struct fs *fs, uint8_t results[][20], void *const bufs[], int n,
+    size_t size);
+
+/* ==================
+ * Kernel Dedup Cache (ddfs_cache.c)
+ * ================== */
+
+/*
+ * In-memory copy of an on-disk dedup entry, found either by key or by
+ * block pointer. Entries are replaced in CLOCK order.
+ */
+struct ddcache_entry {
+	LIST_ENTRY(ddcache_entry) de_keyhash; /* chain in dc_keyhash */
+	LIST_ENTRY(ddcache_entry) de_blkhash; /* chain in dc_blkhash */
+	struct ddfs_dedup de_entry;	      /* copy of the on-disk entry */
+	int64_t de_slot;		      /* slot of the entry in the table */
+	uint8_t de_flags;		      /* DE_VALID | DE_REFERENCED */
+};
+#define DE_VALID 0x01
+#define DE_REFERENCED 0x02 /* used since the clock hand last passed */
+
+LIST_HEAD(ddcache_head, ddcache_entry);
+
+/* Per-mount fingerprint cache */
+struct ddcache {
+	struct mtx dc_lock;		   /* protects everything below */
+	struct ddcache_entry *dc_entries;  /* all entries, in clock order */
+	u_long dc_size;			   /* number of entries */
+	u_long dc_hand;			   /* clock hand */
+	struct ddcache_head *dc_keyhash;   /* entries hashed by key */
+	u_long dc_keymask;
+	struct ddcache_head *dc_blkhash;   /* entries hashed by block pointer */
+	u_long dc_blkmask;
+};
+
+/* set up a cache sized by vfs.ddfs.cache_entries. a size of 0 disables the cache */
+void ddcache_init(struct ddcache *dc);
+
+/* free everything in the cache */
+void ddcache_destroy(struct ddcache *dc);
+
+/* find a cached entry by key. returns 1 and copies it out if found */
+int ddcache_findkey(struct ddcache *dc, const uint8_t key[20], int64_t *out_slot,
+    struct ddfs_dedup *out_entry);
+
+/* find a cached entry by block pointer. returns 1 and copies it out if found */
+int ddcache_findblk(struct ddcache *dc, daddr_t blockptr, int64_t *out_slot,
+    struct ddfs_dedup *out_entry);
+
+/* record the new contents of the entry in `slot`, dropping it if its refcount is 0 */
+void ddcache_update(struct ddcache *dc, int64_t slot, const struct ddfs_dedup *entry);
+
+/* ==================
+ * Kernel Dedup Bloom Filter (ddfs_bloom.c)
+ * ================== */
+
+/* Per-mount counting Bloom filter over the keys in the table */
+struct ddbloom {
+	struct mtx db_lock;	  /* protects db_counters */
+	uint8_t *db_counters;	  /* 4-bit counters, two per byte */
+	u_long db_bytes;	  /* size of db_counters, 0 if disabled */
+	uint64_t db_mask;	  /* number of counters - 1 */
+	int db_hashes;		  /* counters set per key */
+};
+
+/* set up a filter for `nslots` entries, sized by vfs.ddfs.bloom_bytes. 0 disables it */
+void ddbloom_init(struct ddbloom *db, int64_t nslots);
+
+/* free the filter */
+void ddbloom_destroy(struct ddbloom *db);
+
+/* add a key in the table to the filter */
+void ddbloom_add(struct ddbloom *db, const uint8_t key[20]);
+
+/* remove a key freed from the table from the filter */
+void ddbloom_remove(struct ddbloom *db, const uint8_t key[20]);
+
+/* returns 0 if `key` is definitely not in the table, 1 if it may be */
+int ddbloom_query(struct ddbloom *db, const uint8_t key[20]);
+
+/* count a key reported as possibly present that was not in the table */
+void ddbloom_falsepositive(struct ddbloom *db);
+
+/* ==================
+ * Kernel Post-Process Dedup Queue (ddfs_async.c)
+ * ================== */
+
+struct mount;
+
+/* A block of file data that was written out and waits to be deduplicated */
+struct ddasync_req {
+	ino_t ar_ino;	  /* inode of the file */
+	int64_t ar_lbn;	  /* logical block in the file */
+	daddr_t ar_blkno; /* block it was written to */
+};
+
+/*
+ * Per-mount queue of blocks deduplicated by worker threads after they are
+ * written, with the dedupasync mount option
+ */
+struct ddasync {
+	struct mtx da_lock;	      /* protects the queue */
+	struct mount *da_mp;
+	struct ddasync_req *da_queue; /* ring of da_size requests */
+	int da_size;		      /* 0 if disabled */
+	int da_head;		      /* next request to process */
+	int da_count;		      /* requests in the ring */
+	bool da_enabled;	      /* queue blocks rather than deduplicating them inline */
+	struct taskqueue *da_tq;      /* workers, created when first enabled */
+	struct task *da_tasks;	      /* one per worker */
+	int da_nthreads;
+};
+
+/* set up the queue of mount `mp`, sized by vfs.ddfs.async_queue */
+void ddasync_init(struct ddasync *da, struct mount *mp);
+
+/* free the queue, which must be disabled */
+void ddasync_destroy(struct ddasync *da);
+
+/* start or stop queueing blocks, waiting for the queue to drain when stopping. returns the old setting */
+bool ddasync_enable(struct ddasync *da, bool enable);
+
+/* queue a block for the workers. returns false if it must be deduplicated inline */
+bool ddasync_queue(struct ddasync *da, ino_t ino, int64_t lbn, daddr_t blkno);
 
 /* ==================
  * Kernel Dedup Functions
  * ================== */
 struct ufsmount;
 
+/*
+ * In-core dedup state of a mounted filesystem, hung off fs_ddmount
+ */
+struct ddfs_mount {
+	struct ddtable dm_table; /* on-disk dedup table */
+	struct ddcache dm_cache; /* fingerprint cache in front of dm_table */
+	struct ddbloom dm_bloom; /* filter of the keys in dm_table */
+	struct sx *dm_locks;	 /* dm_table.dt_nlocks bucket lock stripes */
+	struct mtx dm_flushlock; /* protects dm_dirty and dm_ndirty */
+	struct sx dm_flushsx;	 /* serializes flushes, protects the log */
+	daddr_t *dm_dirty;	 /* disk addresses of table blocks with delayed writes */
+	daddr_t *dm_flushing;	 /* the same, for the blocks being flushed */
+	int dm_ndirty;
+	int dm_maxdirty;	 /* 0 to write table blocks immediately */
+	uint8_t *dm_logdata;	 /* intent log block being filled */
+	uint64_t dm_logseq;	 /* its sequence number */
+	uint64_t dm_logckpt;	 /* oldest log block not known to be in the table */
+	struct ddasync dm_async; /* blocks to deduplicate in the background */
+};
+
+/* set up the dedup state of a filesystem being mounted */
+int ddtable_mount(struct ufsmount *mnt);
+
+/* replay the log and repair the reverse index of a filesystem upgraded to read-write */
+int ddtable_mount_rw(struct ufsmount *mnt);
+
+/* tear down the dedup state of a filesystem being unmounted */
+void ddtable_unmount(struct ufsmount *mnt);
+
+/* make the table changes so far durable, through the intent log if there is one */
+int ddtable_flush(struct ufsmount *mnt);
+
+/* write back every modified table block, so the log written so far is not needed */
+int ddtable_checkpoint(struct ufsmount *mnt);
+
 /* allocate a free space in the ddtable, or increment an existing key if found */
 int ddtable_alloc(struct ufsmount *mnt, uint8_t key[20], daddr_t in_block, daddr_t *out_block);
 
-/* decrement a key-value pair in the ddtable. removes the key-value pair if refcount == 0 */
-int ddtable_unref(struct ufsmount *mnt, daddr_t blocknum);
+/*
+ * decrement a key-value pair in the ddtable. removes the key-value pair if refcount == 0.
+ * sets `refs` to the new refcount. returns 0, ENOENT if `blocknum` has no entry, or an errno
+ */
+int ddtable_unref(struct ufsmount *mnt, daddr_t blocknum, uint32_t *refs);
+
+/* set `refs` to the references to `blocknum` in the ddtable. returns 0, ENOENT or an errno */
+int ddtable_refcount(struct ufsmount *mnt, daddr_t blocknum, uint32_t *refs);
+
+struct buf;
+struct ucred;
+struct vnode;
+
+/* point logical block `lbn` of a file at deduplicated block `newblk` instead of `oldblk` */
+int ffs_dedup_blkptr(struct vnode *vp, int64_t lbn, daddr_t oldblk, daddr_t newblk, int flags);
+
+/* make the block of a file held in `bp` safe to modify in place, copying it if shared */
+int ffs_dedup_unshare(struct vnode *vp, struct buf *bp, int flags, struct ucred *cred);
+
+/*
+ * deduplicate the block of file data in `bp` as it is written out, or queue it.
+ * returns true if the block was all zeros and became a hole, and the buffer
+ * must be dropped instead of written
+ */
+bool ffs_dedup_buf(struct buf *bp);
+
+/* deduplicate block `lbn` of inode `ino`, written out to `blkno` before, in the background */
+void ffs_dedup_block(struct mount *mp, ino_t ino, int64_t lbn, daddr_t blkno);
+
+/* full blocks of file data ffs_write() hashes together, 32KiB */
+#define DDFS_WRITE_BATCH 8
+
+/* deduplicate `n` (at most DDFS_WRITE_BATCH) blocks of one file, hashing them together */
+void ffs_dedup_bufs(struct buf **bps, int n);
 
 #endif /* _KERNEL */
 
@@ -2643,12 +2643,26 @@ ffs_blkfree(ump, fs, devvp, bno, size, inum, vtype, dephd, key)
 	 */
 	printf("ddfs_blkfree on block pointer %zd\n", bno);
 	/* read the block that wants to be deleted and hash it */
-	int refcount = ddtable_unref(ump, bno);
-	if (refcount > 0) {
-		printf("blkfree: refcount is now %d. Skipping free...\n", refcount);
+	uint32_t refcount;
+	int error = ddtable_unref(ump, bno, &refcount);
+	if (error == 0 && refcount == DDFS_REFS_PINNED) {
+		printf("blkfree: refcount is pinned. Skipping free...\n");
 		return;
 	}
-	printf("blkfree: found refcount of %d. Freeing...\n", refcount);
+	if (error == 0 && refcount > 0) {
+		printf("blkfree: refcount is now %u. Skipping free...\n", refcount);
+		return;
+	}
+	/* the block may still be shared, so leak it rather than free it */
+	if (error != 0 && error != ENOENT) {
+		printf("blkfree: error %d reading refcount. Skipping free...\n", error);
+		return;
+	}
+	printf("blkfree: %s. Freeing...\n", error == 0 ? "refcount is now 0" :
+	    "block has no dedup entry");
+	/* the table must not still point at the block on disk once it can be reused */
+	if (error == 0)
+		ddtable_flush(ump);
 	struct ffs_blkfree_trim_params *tp, *ntp;
 	struct trim_blkreq *blkelm;
 
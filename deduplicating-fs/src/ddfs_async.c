@@ -0,0 +1,167 @@
+/*
+ * Per-mount post-process dedup queue.
+ *
+ * With the dedupasync mount option, blocks of file data are written out as
+ * they are, and the buffer write path only queues them here. A pool of
+ * worker threads per mount then hashes each queued block and points the file
+ * at a block with the same contents (see ffs_dedup_block), so writers do not
+ * wait for the hash and the table lookup. Each worker has its own task, all
+ * taking blocks from the same ring, so blocks of different files are hashed
+ * and looked up on several CPUs at once; the table is locked per bucket.
+ *
+ * The queue is a fixed ring: a block that does not fit is deduplicated
+ * inline, as without the option. A queued block that is modified or moved
+ * before the worker gets to it is skipped, and queued again when it is next
+ * written out.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/priority.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+
+#include <machine/atomic.h>
+
+#include "ddfs.h"
+
+static MALLOC_DEFINE(M_DDASYNC, "ddfs_async", "ddfs post-process dedup queue");
+
+SYSCTL_DECL(_vfs_ddfs);
+
+static int ddasync_size = 16384;
+SYSCTL_INT(_vfs_ddfs, OID_AUTO, async_queue, CTLFLAG_RWTUN, &ddasync_size, 0,
+    "Blocks waiting for post-process dedup per mount (applies at mount, "
+    "0 always deduplicates inline)");
+
+static int ddasync_threads = 4;
+SYSCTL_INT(_vfs_ddfs, OID_AUTO, async_threads, CTLFLAG_RWTUN, &ddasync_threads, 0,
+    "Post-process dedup worker threads per mount (applies at mount)");
+
+static u_long ddasync_queued;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, async_queued, CTLFLAG_RD, &ddasync_queued, 0,
+    "Blocks queued for post-process dedup");
+
+static u_long ddasync_overflows;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, async_overflows, CTLFLAG_RD, &ddasync_overflows, 0,
+    "Blocks deduplicated inline because the post-process queue was full");
+
+static u_long ddasync_done;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, async_done, CTLFLAG_RD, &ddasync_done, 0,
+    "Queued blocks processed by the post-process dedup workers");
+
+static void
+ddasync_task(void *arg, int pending __unused)
+{
+	struct ddasync *da = arg;
+	struct ddasync_req req;
+
+	mtx_lock(&da->da_lock);
+	while (da->da_count > 0) {
+		req = da->da_queue[da->da_head];
+		da->da_head = (da->da_head + 1) % da->da_size;
+		da->da_count--;
+		mtx_unlock(&da->da_lock);
+		ffs_dedup_block(da->da_mp, req.ar_ino, req.ar_lbn, req.ar_blkno);
+		atomic_add_long(&ddasync_done, 1);
+		mtx_lock(&da->da_lock);
+	}
+	mtx_unlock(&da->da_lock);
+}
+
+/*
+ * Set up the queue of mount `mp`. It starts out disabled, and the worker
+ * threads are only started when it is first enabled.
+ */
+void
+ddasync_init(struct ddasync *da, struct mount *mp)
+{
+	bzero(da, sizeof(*da));
+	mtx_init(&da->da_lock, "ddasync", NULL, MTX_DEF);
+	da->da_mp = mp;
+	da->da_size = imax(ddasync_size, 0);
+	if (da->da_size > 0)
+		da->da_queue = malloc(da->da_size * sizeof(struct ddasync_req),
+		    M_DDASYNC, M_WAITOK);
+	da->da_nthreads = imax(ddasync_threads, 1);
+	da->da_tasks = malloc(da->da_nthreads * sizeof(struct task), M_DDASYNC,
+	    M_WAITOK | M_ZERO);
+	for (int i = 0; i < da->da_nthreads; i++)
+		TASK_INIT(&da->da_tasks[i], 0, ddasync_task, da);
+}
+
+/* Free the queue. It must have been disabled, which drained it */
+void
+ddasync_destroy(struct ddasync *da)
+{
+	KASSERT(!da->da_enabled && da->da_count == 0,
+	    ("ddasync_destroy: queue in use"));
+	if (da->da_tq != NULL)
+		taskqueue_free(da->da_tq);
+	free(da->da_queue, M_DDASYNC);
+	free(da->da_tasks, M_DDASYNC);
+	mtx_destroy(&da->da_lock);
+}
+
+/*
+ * Start or stop queueing blocks for the workers. Stopping waits until the
+ * workers have processed every queued block, so it must be done before the
+ * filesystem is suspended or made read-only. Returns the old setting.
+ */
+bool
+ddasync_enable(struct ddasync *da, bool enable)
+{
+	bool was;
+
+	if (enable && da->da_size == 0)
+		enable = false;
+	if (enable && da->da_tq == NULL) {
+		da->da_tq = taskqueue_create("ddasync", M_WAITOK,
+		    taskqueue_thread_enqueue, &da->da_tq);
+		taskqueue_start_threads(&da->da_tq, da->da_nthreads, PVFS, "ddfs async %s",
+		    da->da_mp->mnt_stat.f_mntonname);
+	}
+	mtx_lock(&da->da_lock);
+	was = da->da_enabled;
+	da->da_enabled = enable;
+	mtx_unlock(&da->da_lock);
+	if (!enable && da->da_tq != NULL)
+		taskqueue_drain_all(da->da_tq);
+	return (was);
+}
+
+/*
+ * Queue block `lbn` of inode `ino`, being written out to `blkno`, for the
+ * workers. Returns false if the block must be deduplicated inline instead,
+ * because the queue is disabled or full.
+ */
+bool
+ddasync_queue(struct ddasync *da, ino_t ino, int64_t lbn, daddr_t blkno)
+{
+	struct ddasync_req *req;
+
+	if (!da->da_enabled)
+		return (false);
+	mtx_lock(&da->da_lock);
+	if (!da->da_enabled || da->da_count == da->da_size) {
+		if (da->da_enabled)
+			atomic_add_long(&ddasync_overflows, 1);
+		mtx_unlock(&da->da_lock);
+		return (false);
+	}
+	req = &da->da_queue[(da->da_head + da->da_count) % da->da_size];
+	req->ar_ino = ino;
+	req->ar_lbn = lbn;
+	req->ar_blkno = blkno;
+	/* a worker drains the ring before it stops, so wake one per block up to all */
+	if (da->da_count++ < da->da_nthreads)
+		taskqueue_enqueue(da->da_tq, &da->da_tasks[da->da_count - 1]);
+	mtx_unlock(&da->da_lock);
+	atomic_add_long(&ddasync_queued, 1);
+	return (true);
+}
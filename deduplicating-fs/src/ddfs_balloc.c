@@ -70,9 +70,12 @@ __FBSDID("$FreeBSD$");
 #include <sys/buf.h>
 #include <sys/lock.h>
 #include <sys/mount.h>
+#include <sys/sysctl.h>
 #include <sys/vnode.h>
 #include <sys/vmmeter.h>
 
+#include <machine/atomic.h>
+
 #include <ufs/ufs/quota.h>
 #include "ddfs_inode.h"
 #include <ufs/ufs/ufs_extern.h>
@@ -84,6 +87,20 @@ __FBSDID("$FreeBSD$");
 
 #include "ddfs.h"
 
+SYSCTL_DECL(_vfs_ddfs);
+
+static u_long ffs_dedup_verifies;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, fp_verifies, CTLFLAG_RD, &ffs_dedup_verifies, 0,
+    "Blocks compared with a block of the same fingerprint before sharing it");
+
+static u_long ffs_dedup_collisions;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, fp_collisions, CTLFLAG_RD, &ffs_dedup_collisions, 0,
+    "Blocks not shared because they differed from a block of the same fingerprint");
+
+static u_long ffs_dedup_zeroblocks;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, zero_blocks, CTLFLAG_RD, &ffs_dedup_zeroblocks, 0,
+    "Blocks of zeros turned into holes instead of being written");
+
 /*
  * Balloc defines the structure of filesystem storage
  * by allocating the physical blocks on a device given
@@ -1052,10 +1069,9 @@ retry:
 		*lbns_remfree++ = lbn;
 		nbp = getblk(vp, lbn, fs->fs_bsize, 0, 0, gbflags);
 		nbp->b_blkno = fsbtodb(fs, nb);
-		if (flags & BA_CLRBUF) {
-			printf("clearing buf %d\n", __LINE__);
-			vfs_bio_clrbuf(bp);
-		}
+		/* XXX(ddfs): clear the new data block, not the indirect block */
+		if (flags & BA_CLRBUF)
+			vfs_bio_clrbuf(nbp);
 		if (DOINGSOFTDEP(vp))
 			softdep_setup_allocindir_page(ip, lbn, bp,
 			    indirs[i].in_off, nb, 0, nbp);
@@ -1204,3 +1220,381 @@ fail:
 	}
 	return (error);
 }
+
+/*
+ * XXX(ddfs): Switch the block pointer of logical block `lbn` of a file from
+ * `oldblk` to `newblk`, a deduplicated block with the same contents. Direct
+ * blocks are changed in the inode; others in the indirect block that maps
+ * them, which is written back like ffs_balloc_ufs2 writes it (the indirect
+ * block write waits for the dedup table, see ffs_geom_strategy). Returns
+ * EINVAL if `lbn` is not mapped to `oldblk`, leaving the file unchanged.
+ */
+int
+ffs_dedup_blkptr(struct vnode *vp, ufs_lbn_t lbn, ufs2_daddr_t oldblk,
+    ufs2_daddr_t newblk, int flags)
+{
+	struct inode *ip;
+	struct ufs2_dinode *dp;
+	struct fs *fs;
+	struct buf *bp;
+	struct indir indirs[UFS_NIADDR + 2];
+	ufs2_daddr_t nb, *bap;
+	int error, i, num;
+
+	ip = VTOI(vp);
+	dp = ip->i_din2;
+	fs = ITOFS(ip);
+	if (lbn < UFS_NDADDR) {
+		if (dp->di_db[lbn] != oldblk)
+			return (EINVAL);
+		dp->di_db[lbn] = newblk;
+		/* tell the system to fsync our newly modified inode */
+		UFS_INODE_SET_FLAG(ip, IN_MODIFIED | IN_NEEDSYNC);
+		return (0);
+	}
+	if ((error = ufs_getlbns(vp, lbn, indirs, &num)) != 0)
+		return (error);
+	/*
+	 * Walk down the indirect blocks, indirs[1] to indirs[num]. They all
+	 * exist, since ffs_balloc_ufs2 has just mapped `lbn`.
+	 */
+	--num;
+	nb = dp->di_ib[indirs[0].in_off];
+	for (i = 1; i <= num; i++) {
+		if (nb == 0)
+			return (EINVAL);
+		error = bread(vp, indirs[i].in_lbn, (int)fs->fs_bsize, NOCRED,
+		    &bp);
+		if (error != 0)
+			return (error);
+		bap = (ufs2_daddr_t *)bp->b_data;
+		nb = bap[indirs[i].in_off];
+		if (i < num)
+			bqrelse(bp);
+	}
+	if (nb != oldblk) {
+		brelse(bp);
+		return (EINVAL);
+	}
+	bap[indirs[num].in_off] = newblk;
+	if (flags & IO_SYNC)
+		return (bwrite(bp));
+	if (bp->b_bufsize == fs->fs_bsize)
+		bp->b_flags |= B_CLUSTEROK;
+	bdwrite(bp);
+	return (0);
+}
+
+/*
+ * XXX(ddfs): Make the block of a file held in `bp` safe to modify in place.
+ * A block that was written out before has a dedup table entry, and may be
+ * shared with other files. The file's reference is dropped, and if other
+ * files still hold one, the file is moved to a new block (copy on write):
+ * the buffer keeps its contents and is pointed at the new block.
+ * Buffers already modified since they were last written out were made safe
+ * then, and are left alone.
+ */
+int
+ffs_dedup_unshare(struct vnode *vp, struct buf *bp, int flags,
+    struct ucred *cred)
+{
+	struct inode *ip;
+	struct ufsmount *ump;
+	struct fs *fs;
+	ufs2_daddr_t oldblk, newb;
+	uint32_t refcount;
+	int error;
+
+	ip = VTOI(vp);
+	ump = ITOUMP(ip);
+	fs = ITOFS(ip);
+	if (fs->fs_ddmount == NULL || (bp->b_flags & B_DELWRI) != 0)
+		return (0);
+	oldblk = dbtofsb(fs, bp->b_blkno);
+	error = ddtable_refcount(ump, oldblk, &refcount);
+	if (error == ENOENT)
+		return (0);
+	if (error != 0)
+		return (error);
+	/* a pinned block may have any number of users, so it is always copied */
+	if (refcount <= 1) {
+		/* the block is the file's alone, drop its entry and keep it */
+		ddtable_unref(ump, oldblk, &refcount);
+		return (0);
+	}
+	UFS_LOCK(ump);
+	error = ffs_alloc(ip, bp->b_lblkno, oldblk, (int)fs->fs_bsize,
+	    flags | IO_BUFLOCKED, cred, &newb);
+	if (error != 0)
+		return (error);
+	if ((error = ffs_dedup_blkptr(vp, bp->b_lblkno, oldblk, newb,
+	    flags)) != 0) {
+		ffs_blkfree(ump, fs, ump->um_devvp, newb, fs->fs_bsize,
+		    ip->i_number, vp->v_type, NULL, SINGLETON_KEY);
+		return (error);
+	}
+	bp->b_blkno = fsbtodb(fs, newb);
+	/* drop the file's reference to the shared block, without freeing it */
+	ffs_blkfree(ump, fs, ump->um_devvp, oldblk, fs->fs_bsize,
+	    ip->i_number, vp->v_type, NULL, SINGLETON_KEY);
+#ifdef QUOTA
+	(void) chkdq(ip, -btodb(fs->fs_bsize), cred, FORCE);
+#endif
+	DIP_SET(ip, i_blocks, DIP(ip, i_blocks) - btodb(fs->fs_bsize));
+	UFS_INODE_SET_FLAG(ip, IN_CHANGE | IN_UPDATE);
+	return (0);
+}
+
+/*
+ * XXX(ddfs): Compare block `blkno` with the block of data at `data`, for
+ * fingerprints that are not collision resistant. Returns 0 if they are the
+ * same, EEXIST if they differ, or an error from reading the block.
+ * The block is read through the device vnode, and the buffer is invalidated
+ * so it does not linger as an alias of a file block.
+ */
+static int
+ffs_dedup_verify(struct ufsmount *ump, struct fs *fs, ufs2_daddr_t blkno,
+    const void *data)
+{
+	struct buf *bp;
+	int error;
+
+	atomic_add_long(&ffs_dedup_verifies, 1);
+	error = bread(ump->um_devvp, fsbtodb(fs, blkno), fs->fs_bsize, NOCRED, &bp);
+	if (error != 0)
+		return (error);
+	if (bcmp(bp->b_data, data, fs->fs_bsize) != 0) {
+		atomic_add_long(&ffs_dedup_collisions, 1);
+		error = EEXIST;
+	}
+	bp->b_flags |= B_INVAL | B_NOCACHE;
+	brelse(bp);
+	return (error);
+}
+
+/*
+ * XXX(ddfs): Whether the block of file data in `bp` can be deduplicated now.
+ *
+ * Block pointers can only be changed with the vnode locked exclusively, which
+ * it is for all but unusual write-outs; other buffers, and blocks the file
+ * ends in (which will be written again as the file grows), are written as
+ * they are and stay out of the table.
+ */
+static bool
+ffs_dedup_bufok(struct buf *bp)
+{
+	struct vnode *vp;
+	struct inode *ip;
+	struct fs *fs;
+	uint32_t refs;
+
+	vp = bp->b_vp;
+	if (vp == NULL || vp->v_type != VREG || bp->b_lblkno < 0 ||
+	    (bp->b_xflags & BX_ALTDATA) != 0 ||
+	    (bp->b_flags & B_CLUSTER) != 0 ||
+	    bp->b_bcount != DDFS_BLOCKSIZE || !buf_mapped(bp) ||
+	    VOP_ISLOCKED(vp) != LK_EXCLUSIVE)
+		return (false);
+	ip = VTOI(vp);
+	fs = ITOFS(ip);
+	if (fs->fs_ddmount == NULL ||
+	    ip->i_size < smalllblktosize(fs, bp->b_lblkno + 1))
+		return (false);
+	/*
+	 * already in the table, and not modified since (see ffs_dedup_unshare).
+	 * a pinned block is in the table too, and a block whose entry cannot be
+	 * read is not known to be the file's alone
+	 */
+	return (ddtable_refcount(ITOUMP(ip), dbtofsb(fs, bp->b_blkno), &refs) ==
+	    ENOENT);
+}
+
+/*
+ * XXX(ddfs): Deduplicate the block of file data in `bp`, whose fingerprint
+ * is `key`. If the dedup table has a block with the same contents, the file
+ * is pointed at it, the buffer is redirected to it, and the block the buffer
+ * was going to overwrite is freed. Otherwise the block is entered in the
+ * table as it is. If the filesystem's fingerprint is not collision resistant,
+ * the block in the table is compared with the buffer first.
+ */
+static void
+ffs_dedup_bufkey(struct buf *bp, uint8_t key[20])
+{
+	struct vnode *vp;
+	struct inode *ip;
+	struct ufsmount *ump;
+	struct fs *fs;
+	daddr_t oldblk, newblk;
+	int error, saved_inbdflush;
+
+	vp = bp->b_vp;
+	ip = VTOI(vp);
+	ump = ITOUMP(ip);
+	fs = ITOFS(ip);
+	oldblk = dbtofsb(fs, bp->b_blkno);
+	/* changing the block pointer must not recurse into buffer flushing */
+	saved_inbdflush = curthread_pflags_set(TDP_INBDFLUSH);
+	if (ddtable_alloc(ump, key, oldblk, &newblk) == 0 && newblk != oldblk) {
+		error = 0;
+		if (DDFS_FP_VERIFY(fs->fs_ddfingerprint))
+			error = ffs_dedup_verify(ump, fs, newblk, bp->b_data);
+		if (error == 0)
+			error = ffs_dedup_blkptr(vp, bp->b_lblkno, oldblk, newblk, 0);
+		if (error == 0) {
+			/* the buffer holds the same data as newblk, so write it there */
+			bp->b_blkno = fsbtodb(fs, newblk);
+			ffs_blkfree(ump, fs, ump->um_devvp, oldblk,
+			    fs->fs_bsize, ip->i_number, vp->v_type, NULL,
+			    SINGLETON_KEY);
+		} else {
+			/*
+			 * the file still points at oldblk (or only shares its
+			 * fingerprint with newblk), drop the reference on newblk
+			 */
+			ffs_blkfree(ump, fs, ump->um_devvp, newblk,
+			    fs->fs_bsize, ip->i_number, vp->v_type, NULL,
+			    SINGLETON_KEY);
+		}
+	}
+	curthread_pflags_restore(saved_inbdflush);
+}
+
+/*
+ * XXX(ddfs): Turn the block of file data in `bp`, which is all zeros, into a
+ * hole: the file's block pointer is cleared and the block freed, without
+ * hashing it or touching the dedup table. Zero blocks would otherwise all
+ * share one table entry, the busiest and first to run out of references.
+ * Reading a hole returns zeros, and writing to it allocates a block again.
+ * Blocks with soft updates dependencies are left alone.
+ * Returns true if the block became a hole.
+ */
+static bool
+ffs_dedup_hole(struct buf *bp)
+{
+	struct vnode *vp;
+	struct inode *ip;
+	struct ufsmount *ump;
+	struct fs *fs;
+	daddr_t oldblk;
+	int error, saved_inbdflush;
+
+	vp = bp->b_vp;
+	ip = VTOI(vp);
+	ump = ITOUMP(ip);
+	fs = ITOFS(ip);
+	if (!LIST_EMPTY(&bp->b_dep))
+		return (false);
+	oldblk = dbtofsb(fs, bp->b_blkno);
+	saved_inbdflush = curthread_pflags_set(TDP_INBDFLUSH);
+	error = ffs_dedup_blkptr(vp, bp->b_lblkno, oldblk, 0, 0);
+	curthread_pflags_restore(saved_inbdflush);
+	if (error != 0)
+		return (false);
+	ffs_blkfree(ump, fs, ump->um_devvp, oldblk, fs->fs_bsize, ip->i_number,
+	    vp->v_type, NULL, SINGLETON_KEY);
+#ifdef QUOTA
+	(void) chkdq(ip, -btodb(fs->fs_bsize), NOCRED, FORCE);
+#endif
+	DIP_SET(ip, i_blocks, DIP(ip, i_blocks) - btodb(fs->fs_bsize));
+	UFS_INODE_SET_FLAG(ip, IN_CHANGE | IN_UPDATE);
+	atomic_add_long(&ffs_dedup_zeroblocks, 1);
+	return (true);
+}
+
+/*
+ * XXX(ddfs): Deduplicate a block of file data as its buffer is written out,
+ * so each block is hashed once when it goes to disk, rather than on every
+ * write(2) to it. With the dedupasync mount option, the block is queued for
+ * the post-process worker instead (see ddfs_async.c). A block of zeros is
+ * turned into a hole before either, and true is returned: the block is no
+ * longer the file's, and the buffer must not be written to it.
+ */
+bool
+ffs_dedup_buf(struct buf *bp)
+{
+	struct inode *ip;
+	struct fs *fs;
+	uint8_t key[20];
+
+	if (!ffs_dedup_bufok(bp))
+		return (false);
+	if (ddfs_iszero(bp->b_data, DDFS_BLOCKSIZE) && ffs_dedup_hole(bp))
+		return (true);
+	ip = VTOI(bp->b_vp);
+	fs = ITOFS(ip);
+	if (ddasync_queue(&fs->fs_ddmount->dm_async, ip->i_number, bp->b_lblkno,
+	    dbtofsb(fs, bp->b_blkno)))
+		return (false);
+	if (hash_block(fs, key, bp->b_data, DDFS_BLOCKSIZE) != 0)
+		return (false);
+	ffs_dedup_bufkey(bp, key);
+	return (false);
+}
+
+/*
+ * XXX(ddfs): Deduplicate block `lbn` of inode `ino` in the background, after
+ * it was written out to `blkno` (see ddfs_async.c). The block is read back
+ * through the file's buffer cache, which waits for the write if it is still
+ * in progress. A block that was modified or moved since is left alone; it is
+ * queued again when it is next written out.
+ */
+void
+ffs_dedup_block(struct mount *mp, ino_t ino, ufs_lbn_t lbn, ufs2_daddr_t blkno)
+{
+	struct vnode *vp;
+	struct inode *ip;
+	struct fs *fs;
+	struct buf *bp;
+	uint8_t key[20];
+
+	if (vn_start_write(NULL, &mp, V_WAIT) != 0)
+		return;
+	if (VFS_VGET(mp, ino, LK_EXCLUSIVE, &vp) != 0)
+		goto out;
+	ip = VTOI(vp);
+	fs = ITOFS(ip);
+	if (vp->v_type != VREG || ip->i_size < smalllblktosize(fs, lbn + 1) ||
+	    bread(vp, lbn, fs->fs_bsize, NOCRED, &bp) != 0)
+		goto put;
+	if ((bp->b_flags & B_DELWRI) == 0 && dbtofsb(fs, bp->b_blkno) == blkno &&
+	    ffs_dedup_bufok(bp) &&
+	    hash_block(fs, key, bp->b_data, DDFS_BLOCKSIZE) == 0)
+		ffs_dedup_bufkey(bp, key);
+	bqrelse(bp);
+put:
+	vput(vp);
+out:
+	vn_finished_write(mp);
+}
+
+/*
+ * XXX(ddfs): Deduplicate up to DDFS_WRITE_BATCH blocks of one file, about to
+ * be written out together, hashing them all at once (see
+ * ddfs_fingerprint_batch). The buffers are then found in the table when they
+ * are written out, and are not hashed again. Blocks of zeros are not hashed,
+ * and become holes as they are written out (see ffs_dedup_hole).
+ */
+void
+ffs_dedup_bufs(struct buf **bps, int n)
+{
+	struct buf *todo[DDFS_WRITE_BATCH];
+	void *data[DDFS_WRITE_BATCH];
+	uint8_t keys[DDFS_WRITE_BATCH][20];
+	int i, ntodo;
+
+	KASSERT(n <= DDFS_WRITE_BATCH, ("ffs_dedup_bufs: %d buffers", n));
+	for (i = ntodo = 0; i < n; i++) {
+		/* with dedupasync, the blocks are queued as they are written out */
+		if (!ffs_dedup_bufok(bps[i]) ||
+		    ITOFS(VTOI(bps[i]->b_vp))->fs_ddmount->dm_async.da_enabled ||
+		    ddfs_iszero(bps[i]->b_data, DDFS_BLOCKSIZE))
+			continue;
+		todo[ntodo] = bps[i];
+		data[ntodo++] = bps[i]->b_data;
+	}
+	if (ntodo == 0 || hash_blocks(ITOFS(VTOI(todo[0]->b_vp)), keys, data, ntodo,
+	    DDFS_BLOCKSIZE) != 0)
+		return;
+	for (i = 0; i < ntodo; i++)
+		ffs_dedup_bufkey(todo[i], keys[i]);
+}
@@ -0,0 +1,209 @@
+/*
+ * Per-mount Bloom filter over the keys in the dedup table.
+ *
+ * Most blocks written are unique, and looking one up in the table costs at
+ * least one table block read only to find out it is not there. The filter
+ * answers "definitely not in the table" for most of those keys from memory,
+ * so ddtable_alloc can go straight to inserting them.
+ *
+ * Keys are removed when their entry is freed, so each position is a 4-bit
+ * counter rather than a bit. A counter that reaches 15 sticks there, since it
+ * no longer knows how many keys it counts; this can only cause false positives.
+ *
+ * The filter is built at mount by scanning the whole table (see ddtable_mount).
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/sysctl.h>
+
+#include <machine/atomic.h>
+
+#include "ddfs.h"
+
+static MALLOC_DEFINE(M_DDBLOOM, "ddfs_bloom", "ddfs dedup key Bloom filter");
+
+SYSCTL_DECL(_vfs_ddfs);
+
+static u_long ddbloom_bytes = 8 * 1024 * 1024;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, bloom_bytes, CTLFLAG_RWTUN, &ddbloom_bytes, 0,
+    "Maximum size of the per-mount dedup key Bloom filter, in bytes (applies at mount)");
+
+static int ddbloom_hashes = 4;
+SYSCTL_INT(_vfs_ddfs, OID_AUTO, bloom_hashes, CTLFLAG_RWTUN, &ddbloom_hashes, 0,
+    "Number of hash functions used by the Bloom filter (applies at mount)");
+
+static u_long ddbloom_memory;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, bloom_memory, CTLFLAG_RD, &ddbloom_memory, 0,
+    "Memory used by the Bloom filters of all mounted filesystems, in bytes");
+
+static u_long ddbloom_skips;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, bloom_skips, CTLFLAG_RD, &ddbloom_skips, 0,
+    "Keys the Bloom filter reported as new, skipping the table lookup");
+
+static u_long ddbloom_falsepos;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, bloom_false_positives, CTLFLAG_RD, &ddbloom_falsepos, 0,
+    "Keys the Bloom filter reported as possibly present that were new");
+
+/* false positives as a fraction of all new keys, in parts per million */
+static int
+sysctl_ddbloom_fp_rate(SYSCTL_HANDLER_ARGS)
+{
+	u_long fp = ddbloom_falsepos, skips = ddbloom_skips;
+	u_long ppm = fp + skips == 0 ? 0 : (uint64_t)fp * 1000000 / (fp + skips);
+
+	return (sysctl_handle_long(oidp, &ppm, 0, req));
+}
+SYSCTL_PROC(_vfs_ddfs, OID_AUTO, bloom_fp_rate,
+    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0, sysctl_ddbloom_fp_rate, "LU",
+    "Bloom filter false positive rate over new keys, in parts per million");
+
+#define DDBLOOM_MAX 15 /* counter value that sticks */
+#define DDBLOOM_MAXHASHES 16
+
+#define DDBLOOM_LOCK(db) mtx_lock(&(db)->db_lock)
+#define DDBLOOM_UNLOCK(db) mtx_unlock(&(db)->db_lock)
+
+/*
+ * Compute the counter positions of `key` by double hashing two words of it.
+ * Keys come from ddfs_fingerprint(), which fills all 160 bits uniformly
+ * whatever the algorithm, so their bits can be used as they are.
+ */
+static void
+ddbloom_positions(const struct ddbloom *db, const uint8_t key[20], uint64_t *pos)
+{
+	uint64_t h1, h2;
+
+	memcpy(&h1, key + 12, sizeof(h1));
+	memcpy(&h2, key + 4, sizeof(h2));
+	h2 |= 1;
+	for (int i = 0; i < db->db_hashes; i++)
+		pos[i] = (h1 + i * h2) & db->db_mask;
+}
+
+static inline u_int
+ddbloom_get(const struct ddbloom *db, uint64_t pos)
+{
+	return ((db->db_counters[pos >> 1] >> ((pos & 1) * 4)) & 0xf);
+}
+
+static inline void
+ddbloom_set(struct ddbloom *db, uint64_t pos, u_int val)
+{
+	int shift = (pos & 1) * 4;
+	uint8_t *p = &db->db_counters[pos >> 1];
+
+	*p = (*p & ~(0xf << shift)) | (val << shift);
+}
+
+/*
+ * Set up a filter for a table of `nslots` entries, using at most
+ * vfs.ddfs.bloom_bytes of memory (4 counters per slot is plenty).
+ * A size of 0 disables the filter: every key is reported as possibly present.
+ */
+void
+ddbloom_init(struct ddbloom *db, int64_t nslots)
+{
+	u_long bytes = ddbloom_bytes;
+
+	bzero(db, sizeof(struct ddbloom));
+	mtx_init(&db->db_lock, "ddbloom", NULL, MTX_DEF);
+	if ((uint64_t)nslots * 2 < bytes)
+		bytes = nslots * 2;
+	/* counters are addressed with a mask, so round down to a power of two */
+	if (bytes < 2)
+		return;
+	bytes = 1UL << (flsl(bytes) - 1);
+	db->db_counters = malloc(bytes, M_DDBLOOM, M_WAITOK | M_ZERO);
+	db->db_bytes = bytes;
+	db->db_mask = (uint64_t)bytes * 2 - 1;
+	db->db_hashes = imax(1, imin(ddbloom_hashes, DDBLOOM_MAXHASHES));
+	atomic_add_long(&ddbloom_memory, bytes);
+}
+
+void
+ddbloom_destroy(struct ddbloom *db)
+{
+	if (db->db_bytes != 0) {
+		free(db->db_counters, M_DDBLOOM);
+		atomic_subtract_long(&ddbloom_memory, db->db_bytes);
+		db->db_counters = NULL;
+		db->db_bytes = 0;
+	}
+	mtx_destroy(&db->db_lock);
+}
+
+void
+ddbloom_add(struct ddbloom *db, const uint8_t key[20])
+{
+	uint64_t pos[DDBLOOM_MAXHASHES];
+	u_int val;
+
+	if (db->db_bytes == 0)
+		return;
+	ddbloom_positions(db, key, pos);
+	DDBLOOM_LOCK(db);
+	for (int i = 0; i < db->db_hashes; i++) {
+		if ((val = ddbloom_get(db, pos[i])) < DDBLOOM_MAX)
+			ddbloom_set(db, pos[i], val + 1);
+	}
+	DDBLOOM_UNLOCK(db);
+}
+
+/* Remove a key that was added with ddbloom_add() */
+void
+ddbloom_remove(struct ddbloom *db, const uint8_t key[20])
+{
+	uint64_t pos[DDBLOOM_MAXHASHES];
+	u_int val;
+
+	if (db->db_bytes == 0)
+		return;
+	ddbloom_positions(db, key, pos);
+	DDBLOOM_LOCK(db);
+	for (int i = 0; i < db->db_hashes; i++) {
+		val = ddbloom_get(db, pos[i]);
+		KASSERT(val != 0, ("ddbloom_remove: key was not added"));
+		if (val != 0 && val < DDBLOOM_MAX)
+			ddbloom_set(db, pos[i], val - 1);
+	}
+	DDBLOOM_UNLOCK(db);
+}
+
+/*
+ * Returns 0 if `key` is definitely not in the table, 1 if it may be.
+ * A key reported as absent is counted in vfs.ddfs.bloom_skips.
+ */
+int
+ddbloom_query(struct ddbloom *db, const uint8_t key[20])
+{
+	uint64_t pos[DDBLOOM_MAXHASHES];
+	int present = 1;
+
+	if (db->db_bytes == 0)
+		return (1);
+	ddbloom_positions(db, key, pos);
+	DDBLOOM_LOCK(db);
+	for (int i = 0; i < db->db_hashes; i++) {
+		if (ddbloom_get(db, pos[i]) == 0) {
+			present = 0;
+			break;
+		}
+	}
+	DDBLOOM_UNLOCK(db);
+	if (!present)
+		atomic_add_long(&ddbloom_skips, 1);
+	return (present);
+}
+
+/* Record that a key reported as possibly present turned out to be new */
+void
+ddbloom_falsepositive(struct ddbloom *db)
+{
+	if (db->db_bytes != 0)
+		atomic_add_long(&ddbloom_falsepos, 1);
+}
@@ -0,0 +1,235 @@
+/*
+ * Per-mount dedup fingerprint cache.
+ *
+ * A bounded in-memory copy of recently used dedup table entries, consulted
+ * by ddtable_alloc and ddtable_unref before going to the on-disk table.
+ * Entries are found by key (when writing a block) or by block pointer (when
+ * freeing one), and replaced in CLOCK order once the cache is full.
+ *
+ * The cache is write-through: every change to the on-disk table is followed
+ * by a ddcache_update(), so a cached entry always matches the table.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mutex.h>
+#include <sys/sysctl.h>
+
+#include <machine/atomic.h>
+
+#include "ddfs.h"
+
+static MALLOC_DEFINE(M_DDCACHE, "ddfs_cache", "ddfs dedup fingerprint cache");
+
+SYSCTL_DECL(_vfs_ddfs);
+
+static u_long ddcache_entries = 65536;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, cache_entries, CTLFLAG_RWTUN, &ddcache_entries, 0,
+    "Size of the per-mount dedup fingerprint cache, in entries (applies at mount)");
+
+static u_long ddcache_hits;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, cache_hits, CTLFLAG_RD, &ddcache_hits, 0,
+    "Dedup table lookups answered by the fingerprint cache");
+
+static u_long ddcache_misses;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, cache_misses, CTLFLAG_RD, &ddcache_misses, 0,
+    "Dedup table lookups that missed the fingerprint cache");
+
+static u_long ddcache_evictions;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, cache_evictions, CTLFLAG_RD, &ddcache_evictions, 0,
+    "Entries evicted from the fingerprint cache to make room");
+
+#define DDCACHE_LOCK(dc) mtx_lock(&(dc)->dc_lock)
+#define DDCACHE_UNLOCK(dc) mtx_unlock(&(dc)->dc_lock)
+
+/* keys come from ddfs_fingerprint(), whose 160 bits are uniform for every algorithm */
+static inline struct ddcache_head *
+ddcache_keyhead(struct ddcache *dc, const uint8_t key[20])
+{
+	u_long h;
+	memcpy(&h, key + 8, sizeof(h));
+	return (&dc->dc_keyhash[h & dc->dc_keymask]);
+}
+
+static inline struct ddcache_head *
+ddcache_blkhead(struct ddcache *dc, daddr_t blockptr)
+{
+	return (&dc->dc_blkhash[blockptr & dc->dc_blkmask]);
+}
+
+/*
+ * Set up a cache of vfs.ddfs.cache_entries entries.
+ * A size of 0 disables the cache: every lookup misses and updates are ignored.
+ */
+void
+ddcache_init(struct ddcache *dc)
+{
+	u_long size = ddcache_entries;
+
+	bzero(dc, sizeof(struct ddcache));
+	mtx_init(&dc->dc_lock, "ddcache", NULL, MTX_DEF);
+	if (size == 0)
+		return;
+	dc->dc_entries = malloc(size * sizeof(struct ddcache_entry), M_DDCACHE,
+	    M_WAITOK | M_ZERO);
+	dc->dc_size = size;
+	dc->dc_keyhash = hashinit(size, M_DDCACHE, &dc->dc_keymask);
+	dc->dc_blkhash = hashinit(size, M_DDCACHE, &dc->dc_blkmask);
+}
+
+void
+ddcache_destroy(struct ddcache *dc)
+{
+	if (dc->dc_size != 0) {
+		/* hashdestroy insists on empty chains */
+		for (u_long i = 0; i < dc->dc_size; i++) {
+			struct ddcache_entry *de = &dc->dc_entries[i];
+			if (de->de_flags & DE_VALID) {
+				LIST_REMOVE(de, de_keyhash);
+				LIST_REMOVE(de, de_blkhash);
+			}
+		}
+		hashdestroy(dc->dc_keyhash, M_DDCACHE, dc->dc_keymask);
+		hashdestroy(dc->dc_blkhash, M_DDCACHE, dc->dc_blkmask);
+		free(dc->dc_entries, M_DDCACHE);
+	}
+	mtx_destroy(&dc->dc_lock);
+}
+
+static struct ddcache_entry *
+ddcache_lookup_key(struct ddcache *dc, const uint8_t key[20])
+{
+	struct ddcache_entry *de;
+
+	mtx_assert(&dc->dc_lock, MA_OWNED);
+	LIST_FOREACH(de, ddcache_keyhead(dc, key), de_keyhash) {
+		if (memcmp(de->de_entry.key, key, 20) == 0)
+			return (de);
+	}
+	return (NULL);
+}
+
+static void
+ddcache_remove(struct ddcache *dc, struct ddcache_entry *de)
+{
+	mtx_assert(&dc->dc_lock, MA_OWNED);
+	LIST_REMOVE(de, de_keyhash);
+	LIST_REMOVE(de, de_blkhash);
+	de->de_flags = 0;
+}
+
+/*
+ * Pick an entry to fill, evicting one if the cache is full.
+ * The clock hand skips (and clears) entries used since it last passed them.
+ */
+static struct ddcache_entry *
+ddcache_victim(struct ddcache *dc)
+{
+	struct ddcache_entry *de;
+
+	mtx_assert(&dc->dc_lock, MA_OWNED);
+	for (;;) {
+		de = &dc->dc_entries[dc->dc_hand];
+		if (++dc->dc_hand == dc->dc_size)
+			dc->dc_hand = 0;
+		if ((de->de_flags & DE_VALID) == 0)
+			return (de);
+		if (de->de_flags & DE_REFERENCED) {
+			de->de_flags &= ~DE_REFERENCED;
+			continue;
+		}
+		ddcache_remove(dc, de);
+		atomic_add_long(&ddcache_evictions, 1);
+		return (de);
+	}
+}
+
+static int
+ddcache_hit(struct ddcache_entry *de, int64_t *out_slot, struct ddfs_dedup *out_entry)
+{
+	if (de == NULL) {
+		atomic_add_long(&ddcache_misses, 1);
+		return (0);
+	}
+	de->de_flags |= DE_REFERENCED;
+	*out_slot = de->de_slot;
+	*out_entry = de->de_entry;
+	atomic_add_long(&ddcache_hits, 1);
+	return (1);
+}
+
+/*
+ * Find a cached entry by key.
+ * Returns 1 and copies out its slot and contents if found, 0 otherwise.
+ */
+int
+ddcache_findkey(struct ddcache *dc, const uint8_t key[20], int64_t *out_slot,
+    struct ddfs_dedup *out_entry)
+{
+	int found;
+
+	if (dc->dc_size == 0)
+		return (0);
+	DDCACHE_LOCK(dc);
+	found = ddcache_hit(ddcache_lookup_key(dc, key), out_slot, out_entry);
+	DDCACHE_UNLOCK(dc);
+	return (found);
+}
+
+/*
+ * Find a cached entry by block pointer.
+ * Returns 1 and copies out its slot and contents if found, 0 otherwise.
+ */
+int
+ddcache_findblk(struct ddcache *dc, daddr_t blockptr, int64_t *out_slot,
+    struct ddfs_dedup *out_entry)
+{
+	struct ddcache_entry *de;
+	int found;
+
+	if (dc->dc_size == 0)
+		return (0);
+	DDCACHE_LOCK(dc);
+	LIST_FOREACH(de, ddcache_blkhead(dc, blockptr), de_blkhash) {
+		if (de->de_entry.blockptr == blockptr)
+			break;
+	}
+	found = ddcache_hit(de, out_slot, out_entry);
+	DDCACHE_UNLOCK(dc);
+	return (found);
+}
+
+/*
+ * Record the new contents of the on-disk entry in `slot`.
+ * An entry whose refcount dropped to 0 is no longer in the table, so it is dropped.
+ */
+void
+ddcache_update(struct ddcache *dc, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct ddcache_entry *de;
+
+	if (dc->dc_size == 0)
+		return;
+	DDCACHE_LOCK(dc);
+	de = ddcache_lookup_key(dc, entry->key);
+	if (entry->ref_count == 0) {
+		if (de != NULL)
+			ddcache_remove(dc, de);
+		DDCACHE_UNLOCK(dc);
+		return;
+	}
+	if (de == NULL) {
+		de = ddcache_victim(dc);
+		de->de_entry = *entry;
+		LIST_INSERT_HEAD(ddcache_keyhead(dc, entry->key), de, de_keyhash);
+		LIST_INSERT_HEAD(ddcache_blkhead(dc, entry->blockptr), de, de_blkhash);
+	} else {
+		de->de_entry = *entry;
+	}
+	de->de_slot = slot;
+	de->de_flags = DE_VALID | DE_REFERENCED;
+	DDCACHE_UNLOCK(dc);
+}
@@ -0,0 +1,480 @@
+/*
+ * Block fingerprints.
+ *
+ * The key of a dedup table entry is a 160-bit fingerprint of the block's
+ * contents, computed with the algorithm recorded in fs_ddfingerprint by
+ * newfs-ddfs:
+ *
+ *   sha1	SHA-1 (what filesystems made before the field existed use)
+ *   sha256	SHA-256, truncated to 160 bits
+ *   blake3	BLAKE3, with 160 bits of output
+ *   xxh64	xxHash64, a fast non-cryptographic hash. Different blocks can
+ *		have the same fingerprint, so a block is only shared after
+ *		comparing it with the block already in the table (see
+ *		DDFS_FP_VERIFY).
+ *
+ * Every bit of a key is used somewhere (the table bucket, the fingerprint
+ * cache and the Bloom filter each take different bytes), so the 64-bit
+ * xxHash64 value is stretched to 160 bits with a mixing function.
+ *
+ * This file is built into the kernel module and into the userland tools.
+ */
+
+#include <sys/param.h>
+
+#ifndef _KERNEL
+#include <errno.h>
+#include <sha.h>
+#include <sha256.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#else /* _KERNEL */
+#include <sys/systm.h>
+#include <sys/proc.h>
+#include <crypto/sha1.h>
+#include <crypto/sha2/sha256.h>
+#ifdef __amd64__
+#include <machine/fpu.h>
+#endif
+#endif /* _KERNEL */
+
+#include "ddfs.h"
+
+/*
+ * Whether ddfs_fingerprint_batch() hashes SHA-1 blocks with ddfs_sha1_lanes().
+ * The kernel only builds the lanes with SSE2 on amd64; anywhere else they
+ * would be scalar code, which is slower than hashing one block at a time.
+ */
+#if !defined(_KERNEL)
+#define SHA1X_ENABLED 1
+#define SHA1X_ENTER()
+#define SHA1X_LEAVE()
+#elif defined(__amd64__)
+#define SHA1X_ENABLED 1
+#define SHA1X_ENTER() fpu_kern_enter(curthread, NULL, FPU_KERN_NOCTX)
+#define SHA1X_LEAVE() fpu_kern_leave(curthread, NULL)
+#else
+#define SHA1X_ENABLED 0
+#define SHA1X_ENTER()
+#define SHA1X_LEAVE()
+#endif
+
+static const char *const ddfs_fp_names[] = {
+	[DDFS_FP_SHA1] = "sha1",
+	[DDFS_FP_SHA256] = "sha256",
+	[DDFS_FP_BLAKE3] = "blake3",
+	[DDFS_FP_XXH64] = "xxh64",
+};
+
+/* ==================
+ * xxHash64
+ * ================== */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+static inline uint64_t
+load64le(const uint8_t *p)
+{
+	return ((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+	    (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56);
+}
+
+static inline uint32_t
+load32le(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return (acc * XXH_PRIME64_1);
+}
+
+static inline uint64_t
+xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return (acc * XXH_PRIME64_1 + XXH_PRIME64_4);
+}
+
+uint64_t
+ddfs_xxh64(const void *buf, size_t size, uint64_t seed)
+{
+	const uint8_t *p = buf, *end = p + size;
+	uint64_t h, v1, v2, v3, v4;
+
+	if (size >= 32) {
+		v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v2 = seed + XXH_PRIME64_2;
+		v3 = seed;
+		v4 = seed - XXH_PRIME64_1;
+		for (; end - p >= 32; p += 32) {
+			v1 = xxh64_round(v1, load64le(p));
+			v2 = xxh64_round(v2, load64le(p + 8));
+			v3 = xxh64_round(v3, load64le(p + 16));
+			v4 = xxh64_round(v4, load64le(p + 24));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME64_5;
+	}
+	h += size;
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round(0, load64le(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (end - p >= 4) {
+		h ^= load32le(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return (h);
+}
+
+/* splitmix64 finalizer, to stretch a 64-bit hash over the rest of the key */
+static inline uint64_t
+mix64(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return (x ^ (x >> 31));
+}
+
+/* ==================
+ * BLAKE3 (portable, one call per block)
+ * ================== */
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_CHUNK_START 0x01
+#define BLAKE3_CHUNK_END 0x02
+#define BLAKE3_PARENT 0x04
+#define BLAKE3_ROOT 0x08
+
+static const uint32_t blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* message word order of each round */
+static const uint8_t blake3_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t
+rotr32(uint32_t x, int r)
+{
+	return ((x >> r) | (x << (32 - r)));
+}
+
+#define BLAKE3_G(s, a, b, c, d, x, y) do {		\
+	s[a] = s[a] + s[b] + (x);			\
+	s[d] = rotr32(s[d] ^ s[a], 16);			\
+	s[c] = s[c] + s[d];				\
+	s[b] = rotr32(s[b] ^ s[c], 12);			\
+	s[a] = s[a] + s[b] + (y);			\
+	s[d] = rotr32(s[d] ^ s[a], 8);			\
+	s[c] = s[c] + s[d];				\
+	s[b] = rotr32(s[b] ^ s[c], 7);			\
+} while (0)
+
+/* compress one 64-byte block into the 16-word state `out` */
+static void
+blake3_compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+    uint8_t block_len, uint64_t counter, uint8_t flags, uint32_t out[16])
+{
+	uint32_t m[16], s[16];
+	const uint8_t *sc;
+
+	for (int i = 0; i < 16; i++)
+		m[i] = load32le(block + 4 * i);
+	for (int i = 0; i < 8; i++)
+		s[i] = cv[i];
+	s[8] = blake3_iv[0];
+	s[9] = blake3_iv[1];
+	s[10] = blake3_iv[2];
+	s[11] = blake3_iv[3];
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+	/* unrolled, so the schedule indexes are constants and m[] stays in registers */
+#define BLAKE3_ROUND(r) do {						\
+	sc = blake3_schedule[r];					\
+	BLAKE3_G(s, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);			\
+	BLAKE3_G(s, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);			\
+	BLAKE3_G(s, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);			\
+	BLAKE3_G(s, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);			\
+	BLAKE3_G(s, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);			\
+	BLAKE3_G(s, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);		\
+	BLAKE3_G(s, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);			\
+	BLAKE3_G(s, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);			\
+} while (0)
+	BLAKE3_ROUND(0);
+	BLAKE3_ROUND(1);
+	BLAKE3_ROUND(2);
+	BLAKE3_ROUND(3);
+	BLAKE3_ROUND(4);
+	BLAKE3_ROUND(5);
+	BLAKE3_ROUND(6);
+#undef BLAKE3_ROUND
+	for (int i = 0; i < 8; i++) {
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+/*
+ * The last compression of a node, left undone until it is known whether the
+ * node is the root of the tree.
+ */
+struct blake3_output {
+	uint32_t bo_cv[8];
+	uint8_t bo_block[BLAKE3_BLOCK_LEN];
+	uint8_t bo_len;
+	uint64_t bo_counter;
+	uint8_t bo_flags;
+};
+
+/* chaining value of a node that is not the root */
+static void
+blake3_output_cv(const struct blake3_output *o, uint32_t cv[8])
+{
+	uint32_t out[16];
+
+	blake3_compress(o->bo_cv, o->bo_block, o->bo_len, o->bo_counter, o->bo_flags, out);
+	memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void
+store_cv(uint8_t *p, const uint32_t cv[8])
+{
+	for (int i = 0; i < 32; i++)
+		p[i] = cv[i / 4] >> (8 * (i % 4));
+}
+
+/* hash a chunk of at most BLAKE3_CHUNK_LEN bytes, up to its last block */
+static void
+blake3_chunk(const uint8_t *in, size_t len, uint64_t counter, struct blake3_output *o)
+{
+	uint32_t cv[8], out[16];
+	uint8_t flags = BLAKE3_CHUNK_START;
+
+	memcpy(cv, blake3_iv, sizeof(cv));
+	for (; len > BLAKE3_BLOCK_LEN; in += BLAKE3_BLOCK_LEN, len -= BLAKE3_BLOCK_LEN) {
+		blake3_compress(cv, in, BLAKE3_BLOCK_LEN, counter, flags, out);
+		memcpy(cv, out, sizeof(cv));
+		flags = 0;
+	}
+	memcpy(o->bo_cv, cv, sizeof(cv));
+	memset(o->bo_block, 0, sizeof(o->bo_block));
+	memcpy(o->bo_block, in, len);
+	o->bo_len = len;
+	o->bo_counter = counter;
+	o->bo_flags = flags | BLAKE3_CHUNK_END;
+}
+
+/*
+ * Hash the subtree over `len` bytes starting at chunk `counter`. The left
+ * subtree always holds the largest power of two chunks that leaves some input
+ * for the right one. A 4KiB block is four chunks, so this recurses twice.
+ */
+static void
+blake3_subtree(const uint8_t *in, size_t len, uint64_t counter, struct blake3_output *o)
+{
+	uint8_t parent[BLAKE3_BLOCK_LEN];
+	uint32_t cv[8];
+	size_t left;
+
+	if (len <= BLAKE3_CHUNK_LEN) {
+		blake3_chunk(in, len, counter, o);
+		return;
+	}
+	for (left = BLAKE3_CHUNK_LEN; 2 * left < len; left *= 2)
+		;
+	blake3_subtree(in, left, counter, o);
+	blake3_output_cv(o, cv);
+	store_cv(parent, cv);
+	blake3_subtree(in + left, len - left, counter + left / BLAKE3_CHUNK_LEN, o);
+	blake3_output_cv(o, cv);
+	store_cv(parent + 32, cv);
+	memcpy(o->bo_cv, blake3_iv, sizeof(o->bo_cv));
+	memcpy(o->bo_block, parent, sizeof(parent));
+	o->bo_len = BLAKE3_BLOCK_LEN;
+	o->bo_counter = 0;
+	o->bo_flags = BLAKE3_PARENT;
+}
+
+/* BLAKE3 of `size` bytes, with up to 32 bytes of output */
+void
+ddfs_blake3(const void *buf, size_t size, uint8_t *out, size_t outlen)
+{
+	struct blake3_output o;
+	uint32_t root[16];
+	uint8_t digest[32];
+
+	blake3_subtree(buf, size, 0, &o);
+	blake3_compress(o.bo_cv, o.bo_block, o.bo_len, 0, o.bo_flags | BLAKE3_ROOT, root);
+	store_cv(digest, root);
+	memcpy(out, digest, MIN(outlen, sizeof(digest)));
+}
+
+/* ==================
+ * Fingerprints
+ * ================== */
+
+/* Compute the `fp` fingerprint of `size` bytes at `buf` into `key` */
+int
+ddfs_fingerprint(int fp, const void *buf, size_t size, uint8_t key[20])
+{
+	uint8_t digest[32];
+	uint64_t h;
+
+	switch (fp) {
+	case DDFS_FP_SHA1: {
+#ifdef _KERNEL
+		SHA1_CTX ctx;
+
+		sha1_init(&ctx);
+		sha1_loop(&ctx, buf, size);
+		sha1_result(&ctx, digest);
+#else
+		SHA_CTX ctx;
+
+		SHA1_Init(&ctx);
+		SHA1_Update(&ctx, buf, size);
+		SHA1_Final(digest, &ctx);
+#endif
+		break;
+	}
+	case DDFS_FP_SHA256: {
+		SHA256_CTX ctx;
+
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, buf, size);
+		SHA256_Final(digest, &ctx);
+		break;
+	}
+	case DDFS_FP_BLAKE3:
+		ddfs_blake3(buf, size, digest, 20);
+		break;
+	case DDFS_FP_XXH64:
+		h = ddfs_xxh64(buf, size, 0);
+		memcpy(digest, &h, sizeof(h));
+		h = mix64(h);
+		memcpy(digest + 8, &h, sizeof(h));
+		h = mix64(h);
+		memcpy(digest + 16, &h, 4);
+		break;
+	default:
+		return (EINVAL);
+	}
+	memcpy(key, digest, 20);
+	return (0);
+}
+
+/*
+ * Compute the `fp` fingerprints of `n` buffers of `size` bytes each into
+ * keys[0..n-1]. SHA-1 fingerprints are computed DDFS_SHA1_LANES at a time,
+ * other algorithms one buffer at a time.
+ */
+int
+ddfs_fingerprint_batch(int fp, const void *const bufs[], int n, size_t size,
+    uint8_t keys[][20])
+{
+	const void *lanes[DDFS_SHA1_LANES];
+	uint8_t digests[DDFS_SHA1_LANES][20];
+	int i, l, error;
+
+	for (i = 0; i < n; i += l) {
+		/* a single block is faster on its own than in a lane */
+		if (fp != DDFS_FP_SHA1 || !SHA1X_ENABLED || n - i == 1) {
+			if ((error = ddfs_fingerprint(fp, bufs[i], size, keys[i])) != 0)
+				return (error);
+			l = 1;
+			continue;
+		}
+		/* spare lanes hash the last buffer again */
+		for (l = 0; l < DDFS_SHA1_LANES; l++)
+			lanes[l] = bufs[MIN(i + l, n - 1)];
+		SHA1X_ENTER();
+		ddfs_sha1_lanes(lanes, size, digests);
+		SHA1X_LEAVE();
+		for (l = 0; l < DDFS_SHA1_LANES && i + l < n; l++)
+			memcpy(keys[i + l], digests[l], 20);
+	}
+	return (0);
+}
+
+/*
+ * Whether the `size` bytes at `buf` are all zero. `size` is a multiple of 64
+ * and `buf` is 8-byte aligned, as blocks are. The words of each 64-byte line
+ * are ORed together and tested once, which compilers turn into vector code
+ * where it is allowed (the kernel is built without it, and gets 8 loads and
+ * one branch per line). A block with data usually stops at its first line.
+ */
+int
+ddfs_iszero(const void *buf, size_t size)
+{
+	const uint64_t *p = buf, *end = p + size / sizeof(*p);
+
+	for (; p < end; p += 8)
+		if ((p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) != 0)
+			return (0);
+	return (1);
+}
+
+/* Name of fingerprint algorithm `fp`, or NULL if there is no such algorithm */
+const char *
+ddfs_fingerprint_name(int fp)
+{
+	if (fp < 0 || fp > DDFS_FP_MAX)
+		return (NULL);
+	return (ddfs_fp_names[fp]);
+}
+
+/* Fingerprint algorithm called `name`, or -1 if there is no such algorithm */
+int
+ddfs_fingerprint_byname(const char *name)
+{
+	for (int fp = 0; fp <= DDFS_FP_MAX; fp++)
+		if (strcmp(ddfs_fp_names[fp], name) == 0)
+			return (fp);
+	return (-1);
+}
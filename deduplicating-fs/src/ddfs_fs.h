@@ -54,6 +54,8 @@
  * are given in the super block as:
  *	[fs->fs_sblkno]		Super-block
  *  [fs->fs_ddblkno]	Dedup table blocks [XXX(ddfs)]
+ *  [fs->fs_ddrevblkno]	Dedup reverse index blocks [XXX(ddfs)]
+ *  [fs->fs_ddlogblkno]	Dedup intent log blocks [XXX(ddfs)]
  *	[fs->fs_cblkno]		Cylinder group block
  *	[fs->fs_iblkno]		Inode blocks
  *	[fs->fs_dblkno]		Data blocks
@@ -292,17 +294,21 @@ struct csum_total {
  *   fs_active is used when creating snapshots; it points to a bitmap
  *	of cylinder groups for which the free-block bitmap has changed
  *	since the snapshot operation began.
+ *   fs_ddmount XXX(ddfs): references the in-core dedup state of a
+ *	mounted filesystem, set up by ddtable_mount
  */
 struct fs_summary_info {
 	uint8_t	*si_contigdirs;		/* (u) # of contig. allocated dirs */
 	struct	csum *si_csp;		/* (u) cg summary info buffer */
 	int32_t	*si_maxcluster;		/* (u) max cluster in each cyl group */
 	u_int	*si_active;		/* (u) used by snapshots to track fs */
+	struct	ddfs_mount *si_ddmount;	/* XXX(ddfs): in-core dedup state */
 };
 #define fs_contigdirs	fs_si->si_contigdirs
 #define fs_csp		fs_si->si_csp
 #define fs_maxcluster	fs_si->si_maxcluster
 #define fs_active	fs_si->si_active
+#define fs_ddmount	fs_si->si_ddmount
 
 /*
  * Super block for an FFS filesystem.
@@ -399,7 +405,14 @@ struct fs {
 	int32_t	 fs_save_cgsize;	/* save real cg size to use fs_bsize */
 	ufs_time_t fs_mtime;		/* Last mount or fsck time. */
 	int32_t  fs_sujfree;		/* SUJ free list */
-	int32_t	 fs_sparecon32[21];	/* reserved for future constants */
+	int32_t	 fs_ddformat;		/* XXX(ddfs): dedup table layout */
+	int32_t	 fs_ddrevblkno;		/* XXX(ddfs): offset of dedup reverse index */
+	int32_t	 fs_ddrevfrags;		/* XXX(ddfs): fragments of dedup reverse index */
+	int32_t	 fs_ddlogblkno;		/* XXX(ddfs): offset of dedup intent log */
+	int32_t	 fs_ddlogfrags;		/* XXX(ddfs): fragments of dedup intent log */
+	int32_t	 fs_ddfingerprint;	/* XXX(ddfs): block fingerprint algorithm */
+	int32_t	 fs_ddrevstale;		/* XXX(ddfs): rebuild dedup reverse index from table */
+	int32_t	 fs_sparecon32[14];	/* reserved for future constants */
 	u_int32_t fs_ckhash;		/* if CK_SUPERBLOCK, its check-hash */
 	u_int32_t fs_metackhash;	/* metadata check-hash, see CK_ below */
 	int32_t  fs_flags;		/* see FS_ flags below */
@@ -630,9 +643,9 @@ struct cg {
 #define	cgmeta(fs, c)	(cgdmin(fs, c))				/* meta data */
 #define	cgdmin(fs, c)	(cgstart(fs, c) + (fs)->fs_dblkno)	/* 1st data */
 #define	cgimin(fs, c)	(cgstart(fs, c) + (fs)->fs_iblkno)	/* inode blk */
-/* XXX(ddfs): cgsblock starts after dedup table */
-#define	cgsblock(fs, c)	(cgstart(fs, c) + (fs)->fs_ddblkno \
-		+ (fs)->fs_dedupfrags)	/* super blk */
+/* XXX(ddfs): cgsblock starts after dedup table, reverse index and log */
+#define	cgsblock(fs, c)	(cgstart(fs, c) + (fs)->fs_ddlogblkno \
+		+ (fs)->fs_ddlogfrags)	/* super blk */
 #define	cgtod(fs, c)	(cgstart(fs, c) + (fs)->fs_cblkno)	/* cg block */
 #define	cgstart(fs, c)							\
        ((fs)->fs_magic == FS_DDFS_MAGIC ? cgbase(fs, c) :		\
@@ -69,6 +69,8 @@ __FBSDID("$FreeBSD$");
 #include "ddfs_fs.h"
 #include <ufs/ffs/ffs_extern.h>
 
+#include "ddfs.h"
+
 static int ffs_indirtrunc(struct inode *, ufs2_daddr_t, ufs2_daddr_t,
 	    ufs2_daddr_t, int, ufs2_daddr_t *);
 
@@ -145,6 +147,14 @@ ffs_update(vp, waitfor)
 	 * snapshot vnode to prevent it from being removed while we are
 	 * waiting for the buffer.
 	 */
+	/*
+	 * XXX(ddfs): block pointers in the inode may have been switched to
+	 * deduplicated blocks. Their dedup table references must be on disk
+	 * before the inode is.
+	 */
+	error = ddtable_flush(ITOUMP(ip));
+	if (error != 0)
+		return (error);
 	flags = 0;
 	if (IS_SNAPSHOT(ip))
 		flags = GB_LOCK_NOWAIT;
@@ -496,6 +506,12 @@ ffs_truncate(vp, length, flags, cred)
 			ufsdirhash_dirtrunc(ip, length);
 #endif
 		size = blksize(fs, ip, lbn);
+		/* XXX(ddfs): the block may be shared, and is modified in place */
+		if (vp->v_type != VDIR && offset != 0 &&
+		    (error = ffs_dedup_unshare(vp, bp, flags, cred)) != 0) {
+			brelse(bp);
+			return (error);
+		}
 		if (vp->v_type != VDIR && offset != 0)
 			bzero((char *)bp->b_data + offset,
 			    (u_int)(size - offset));
@@ -0,0 +1,129 @@
+/*
+ * Multi-buffer SHA-1.
+ *
+ * SHA-1 is a serial chain of 80 rounds per 64-byte block, which leaves most
+ * of a CPU's execution units idle. Hashing DDFS_SHA1_LANES independent blocks
+ * at once, one lane of a vector per block, runs the same rounds for every
+ * lane with each instruction.
+ *
+ * The lanes are written with the compiler's vector extensions, so this file
+ * is plain C: the kernel module builds it with SSE2 on amd64 (see the
+ * Makefile) and must only call it between fpu_kern_enter() and
+ * fpu_kern_leave(); elsewhere the compiler lowers the vectors to scalar code.
+ *
+ * This file is built into the kernel module and into the userland tools.
+ */
+
+#include <sys/param.h>
+
+#ifndef _KERNEL
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#else /* _KERNEL */
+#include <sys/systm.h>
+#endif /* _KERNEL */
+
+#include "ddfs.h"
+
+typedef uint32_t sha1x_vec __attribute__((vector_size(4 * DDFS_SHA1_LANES)));
+
+#define SHA1X_ROL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline uint32_t
+load32be(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+	    (uint32_t)p[3]);
+}
+
+/* one round of every lane, expanding the message schedule in place after round 16 */
+#define SHA1X_ROUND(r, f, k) do {					\
+	if ((r) >= 16)							\
+		w[(r) & 15] = SHA1X_ROL(w[((r) - 3) & 15] ^		\
+		    w[((r) - 8) & 15] ^ w[((r) - 14) & 15] ^ w[(r) & 15], 1); \
+	t = SHA1X_ROL(a, 5) + (f) + e + (k) + w[(r) & 15];		\
+	e = d;								\
+	d = c;								\
+	c = SHA1X_ROL(b, 30);						\
+	b = a;								\
+	a = t;								\
+} while (0)
+
+/* compress the 64-byte block at blk[lane] of every lane into h */
+static void
+sha1x_compress(sha1x_vec h[5], const uint8_t *const blk[DDFS_SHA1_LANES])
+{
+	sha1x_vec w[16], a, b, c, d, e, t;
+	int r;
+
+	for (int i = 0; i < 16; i++)
+		for (int l = 0; l < DDFS_SHA1_LANES; l++)
+			w[i][l] = load32be(blk[l] + 4 * i);
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	for (r = 0; r < 20; r++)
+		SHA1X_ROUND(r, (b & c) | (~b & d), 0x5A827999);
+	for (; r < 40; r++)
+		SHA1X_ROUND(r, b ^ c ^ d, 0x6ED9EBA1);
+	for (; r < 60; r++)
+		SHA1X_ROUND(r, (b & c) | (b & d) | (c & d), 0x8F1BBCDC);
+	for (; r < 80; r++)
+		SHA1X_ROUND(r, b ^ c ^ d, 0xCA62C1D6);
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+/*
+ * SHA-1 of DDFS_SHA1_LANES buffers of `size` bytes each, written to
+ * digests[lane]. Unused lanes may point at the same buffer as a used one.
+ */
+void
+ddfs_sha1_lanes(const void *const bufs[DDFS_SHA1_LANES], size_t size,
+    uint8_t digests[][20])
+{
+	static const uint32_t iv[5] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0,
+	};
+	uint8_t tail[DDFS_SHA1_LANES][128];
+	const uint8_t *blk[DDFS_SHA1_LANES];
+	sha1x_vec h[5];
+	size_t off, rem, taillen;
+	uint64_t bits = (uint64_t)size * 8;
+
+	for (int i = 0; i < 5; i++)
+		for (int l = 0; l < DDFS_SHA1_LANES; l++)
+			h[i][l] = iv[i];
+	for (off = 0; size - off >= 64; off += 64) {
+		for (int l = 0; l < DDFS_SHA1_LANES; l++)
+			blk[l] = (const uint8_t *)bufs[l] + off;
+		sha1x_compress(h, blk);
+	}
+
+	/* the padding and length take one or two more blocks */
+	rem = size - off;
+	taillen = rem + 9 <= 64 ? 64 : 128;
+	for (int l = 0; l < DDFS_SHA1_LANES; l++) {
+		memset(tail[l], 0, taillen);
+		memcpy(tail[l], (const uint8_t *)bufs[l] + off, rem);
+		tail[l][rem] = 0x80;
+		for (int i = 0; i < 8; i++)
+			tail[l][taillen - 1 - i] = bits >> (8 * i);
+	}
+	for (off = 0; off < taillen; off += 64) {
+		for (int l = 0; l < DDFS_SHA1_LANES; l++)
+			blk[l] = tail[l] + off;
+		sha1x_compress(h, blk);
+	}
+
+	for (int l = 0; l < DDFS_SHA1_LANES; l++)
+		for (int i = 0; i < 5; i++)
+			for (int j = 0; j < 4; j++)
+				digests[l][4 * i + j] = h[i][l] >> (24 - 8 * j);
+}
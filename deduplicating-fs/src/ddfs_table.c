@@ -0,0 +1,1102 @@
+/*
+ * Hash-addressed dedup table.
+ *
+ * The dedup region is an array of buckets, one per table block. A key's
+ * home bucket is selected by its leading 64 bits, which are uniformly
+ * distributed since ddfs_fingerprint() fills all 160 bits of a key uniformly,
+ * whatever the algorithm. When a bucket is full, inserts overflow into the
+ * next bucket (wrapping at the end of the table), so a
+ * lookup walks forward from the home bucket until it finds the key or
+ * reaches a bucket with a never-used FREE slot: nothing can have overflowed
+ * past a bucket that was never full.
+ *
+ * Format 5 buckets are laid out by field (see struct ddfs_bucket): a bucket is
+ * searched by comparing the 16-bit tags of its keys a word at a time, and
+ * only the keys whose tag matches are compared in full. Older formats store
+ * whole entries, which are decoded and compared one by one.
+ *
+ * FREE slots are only ever created by newfs-ddfs. Removing an entry from a
+ * bucket that still has a FREE slot frees it again, but removing one from a
+ * full bucket leaves a DEAD tombstone so probes for keys that overflowed
+ * past the bucket keep going. Both FREE and DEAD slots are reused by inserts.
+ *
+ * Entries are also found by block pointer when a block is freed. For that,
+ * the reverse index following the table maps every block number of the
+ * filesystem to the slot holding it (plus one, so that 0 means no entry).
+ * It is updated only when an entry is inserted or removed, not when its
+ * refcount changes.
+ *
+ * Optionally, the caller keeps a bitmap of the buckets that have a reusable
+ * slot in dt_freemap, built at mount from a scan of the table. Inserting a key
+ * known to be new then reads only the bucket it ends up in, however many full
+ * buckets it overflows past.
+ *
+ * Refcounts saturate: an entry whose refcount reaches the largest value its
+ * format can store is pinned, and neither ddtable_ref() nor ddtable_deref()
+ * change it again. Its block stays allocated for good, which leaks it once
+ * the last file lets go of it, but a count that wrapped around would free a
+ * block still in use.
+ *
+ * Every change to a slot is also passed to the dt_log callback, which the
+ * kernel uses to append it to the intent log following the reverse index.
+ * ddtable_replay() applies the log to the table again when mounting.
+ *
+ * Several threads can use the table at once. Buckets are locked in
+ * dt_nlocks stripes, and the contents of a bucket only change with its stripe
+ * locked, including the dt_log call for the change: changes to a slot reach
+ * the log in the order they were made to the table, even when a slot freed
+ * under one key is reused by another. A key is only inserted with its home
+ * bucket locked, so two threads cannot insert the same key. Buffers are
+ * held by one thread at a time (by the kernel's buffer locks, or the
+ * userland callbacks), and only one at a time, so lookups need no lock: a
+ * bucket never gets a FREE slot back once a key overflowed past it, and a
+ * probe never stops early. The bucket locks are taken before any buffer,
+ * and a second one is only ever taken with ddtable_ref_common()'s trylock
+ * or in stripe order. The counters and dt_freemap are updated atomically.
+ * ddtable_replay() and ddtable_foreach() are for mount time and take no
+ * locks.
+ *
+ * This file is built into the kernel module and into the userland tools;
+ * all I/O goes through the dt_bread/dt_brelse callbacks in struct ddtable.
+ */
+
+#include <sys/param.h>
+
+#ifndef _KERNEL
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#else /* _KERNEL */
+#include <sys/systm.h>
+#endif /* _KERNEL */
+
+#include "ddfs.h"
+
+/* shared counters and dt_freemap bits, which are changed under different bucket locks */
+#define DDT_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define DDT_SETBIT(map, i) \
+	__atomic_fetch_or(&(map)[(i) / NBBY], 1 << ((i) % NBBY), __ATOMIC_RELAXED)
+#define DDT_CLRBIT(map, i) \
+	__atomic_fetch_and(&(map)[(i) / NBBY], ~(1 << ((i) % NBBY)), __ATOMIC_RELAXED)
+
+static int ddtable_ref_common(struct ddtable *dt, const uint8_t key[20], bool absent,
+    daddr_t in_block, int64_t *out_slot, struct ddfs_dedup *out_entry);
+
+/* on-disk layout of format 3 entries; later formats are packed by hand */
+struct __attribute__((packed)) ddfs_dedup16 {
+	uint8_t key[20];
+	uint16_t flags;
+	uint16_t ref_count;
+	int64_t blockptr;
+};
+
+/*
+ * Read the entry at `p`, laid out as in tables of format `format`, or in the
+ * intent log of a format 5 table (see struct ddfs_dedup).
+ */
+void
+ddentry_decode(int format, const void *p, struct ddfs_dedup *entry)
+{
+	struct ddfs_dedup16 e16;
+	uint64_t word;
+	uint32_t refs;
+
+	if (format < DDFS_DDFORMAT_REF32) {
+		memcpy(&e16, p, sizeof(e16));
+		memcpy(entry->key, e16.key, 20);
+		entry->flags = e16.flags;
+		entry->ref_count = e16.ref_count;
+		entry->blockptr = e16.blockptr;
+		return;
+	}
+	memcpy(entry->key, p, 20);
+	memcpy(&refs, (const uint8_t *)p + 20, sizeof(refs));
+	memcpy(&word, (const uint8_t *)p + 24, sizeof(word));
+	entry->flags = word >> 56;
+	entry->ref_count = refs;
+	entry->blockptr = word & DDFS_DEDUP_BLKMASK;
+}
+
+/* Write `entry` to `p` the way ddentry_decode() reads it back */
+void
+ddentry_encode(int format, void *p, const struct ddfs_dedup *entry)
+{
+	struct ddfs_dedup16 e16;
+	uint64_t word;
+	uint32_t refs;
+
+	if (format < DDFS_DDFORMAT_REF32) {
+		memcpy(e16.key, entry->key, 20);
+		e16.flags = entry->flags;
+		e16.ref_count = entry->ref_count;
+		e16.blockptr = entry->blockptr;
+		memcpy(p, &e16, sizeof(e16));
+		return;
+	}
+	refs = entry->ref_count;
+	word = ((uint64_t)entry->flags << 56) | ((uint64_t)entry->blockptr & DDFS_DEDUP_BLKMASK);
+	memcpy(p, entry->key, 20);
+	memcpy((uint8_t *)p + 20, &refs, sizeof(refs));
+	memcpy((uint8_t *)p + 24, &word, sizeof(word));
+}
+
+/*
+ * Offsets of the arrays of a format 5 table block of `n` entries (see
+ * struct ddfs_bucket). The tags are padded to whole 64-bit words, which
+ * keeps the block pointers aligned.
+ */
+#define DDBKT_TAGS(n) sizeof(struct ddfs_bucket)
+#define DDBKT_PTRS(n) (DDBKT_TAGS(n) + roundup((size_t)(n), 4) * sizeof(uint16_t))
+#define DDBKT_REFS(n) (DDBKT_PTRS(n) + (size_t)(n) * sizeof(int64_t))
+#define DDBKT_KEYS(n) (DDBKT_REFS(n) + (size_t)(n) * sizeof(uint32_t))
+#define DDBKT_END(n) (DDBKT_KEYS(n) + (size_t)(n) * 20)
+
+/* tag of a key in format 5 buckets */
+static inline uint16_t
+ddkey_tag(const uint8_t key[20])
+{
+	return ((uint16_t)(key[8] << 8 | key[9]));
+}
+
+/* Entries per table block: as many as the bitmaps cover and the arrays fit */
+int
+ddtable_nentries(int format, int bsize)
+{
+	int n;
+
+	if (format < DDFS_DDFORMAT_TAGGED)
+		return (bsize / DDFS_DEDUP_SIZE);
+	n = MIN(DDFS_BUCKET_MAXSLOTS,
+	    (bsize - (int)sizeof(struct ddfs_bucket)) / DDFS_TAGGED_SLOTSIZE);
+	while (n > 0 && DDBKT_END(n) > (size_t)bsize)
+		n--;
+	return (n);
+}
+
+/*
+ * Read entry `idx` of the table block `data`. In format 5 only ACTIVE slots
+ * have contents; the others read as zeroed entries with their flag.
+ */
+void
+ddtable_getentry(const struct ddtable *dt, const void *data, int idx,
+    struct ddfs_dedup *entry)
+{
+	const uint8_t *p = data;
+	struct ddfs_bucket hdr;
+	int n = dt->dt_nentries;
+	int64_t ptr;
+
+	if (dt->dt_format < DDFS_DDFORMAT_TAGGED) {
+		ddentry_decode(dt->dt_format, p + idx * DDFS_DEDUP_SIZE, entry);
+		return;
+	}
+	memcpy(&hdr, p, sizeof(hdr));
+	if (hdr.bk_active[idx / 64] & (1ULL << (idx % 64))) {
+		entry->flags = DDFS_DEDUP_ACTIVE;
+		memcpy(entry->key, p + DDBKT_KEYS(n) + idx * 20, 20);
+		memcpy(&entry->ref_count, p + DDBKT_REFS(n) + idx * sizeof(uint32_t),
+		    sizeof(uint32_t));
+		memcpy(&ptr, p + DDBKT_PTRS(n) + idx * sizeof(int64_t), sizeof(ptr));
+		entry->blockptr = ptr;
+		return;
+	}
+	bzero(entry, sizeof(*entry));
+	entry->flags = (hdr.bk_dead[idx / 64] & (1ULL << (idx % 64))) ? DDFS_DEDUP_DEAD :
+	    DDFS_DEDUP_FREE;
+}
+
+/* Write `entry` to entry `idx` of the table block `data` */
+void
+ddtable_putentry(const struct ddtable *dt, void *data, int idx,
+    const struct ddfs_dedup *entry)
+{
+	uint8_t *p = data;
+	struct ddfs_bucket hdr;
+	uint64_t bit = 1ULL << (idx % 64);
+	int n = dt->dt_nentries;
+	uint16_t tag = 0;
+	uint32_t refs = 0;
+	int64_t ptr = 0;
+
+	if (dt->dt_format < DDFS_DDFORMAT_TAGGED) {
+		ddentry_encode(dt->dt_format, p + idx * DDFS_DEDUP_SIZE, entry);
+		return;
+	}
+	memcpy(&hdr, p, sizeof(hdr));
+	hdr.bk_active[idx / 64] &= ~bit;
+	hdr.bk_dead[idx / 64] &= ~bit;
+	if (entry->flags & DDFS_DEDUP_ACTIVE) {
+		hdr.bk_active[idx / 64] |= bit;
+		tag = ddkey_tag(entry->key);
+		refs = entry->ref_count;
+		ptr = entry->blockptr;
+		memcpy(p + DDBKT_KEYS(n) + idx * 20, entry->key, 20);
+	} else {
+		if (entry->flags & DDFS_DEDUP_DEAD)
+			hdr.bk_dead[idx / 64] |= bit;
+		bzero(p + DDBKT_KEYS(n) + idx * 20, 20);
+	}
+	memcpy(p, &hdr, sizeof(hdr));
+	memcpy(p + DDBKT_TAGS(n) + idx * sizeof(uint16_t), &tag, sizeof(tag));
+	memcpy(p + DDBKT_REFS(n) + idx * sizeof(uint32_t), &refs, sizeof(refs));
+	memcpy(p + DDBKT_PTRS(n) + idx * sizeof(int64_t), &ptr, sizeof(ptr));
+}
+
+int64_t
+ddtable_sizefor(int format, int bsize, int64_t nentries)
+{
+	int64_t fill = MAX(1, (int64_t)ddtable_nentries(format, bsize) * DDFS_TABLE_FILL / 100);
+
+	return (MAX(1, howmany(nentries, fill)));
+}
+
+/* Fill the table block `data` with FREE slots, as newfs-ddfs does */
+void
+ddtable_initblock(const struct ddtable *dt, void *data)
+{
+	struct ddfs_dedup free_entry;
+
+	bzero(data, dt->dt_bsize);
+	if (dt->dt_format >= DDFS_DDFORMAT_TAGGED)
+		return;
+	bzero(&free_entry, sizeof(free_entry));
+	free_entry.flags = DDFS_DEDUP_FREE;
+	for (int i = 0; i < dt->dt_nentries; i++)
+		ddentry_encode(dt->dt_format, (uint8_t *)data + i * DDFS_DEDUP_SIZE,
+		    &free_entry);
+}
+
+/*
+ * Bitmaps of the ACTIVE, the reusable (FREE or DEAD) and the FREE slots of
+ * format 5 bucket `data`, 64 slots per word. Bits past the last slot are clear.
+ */
+static void
+ddbkt_maps(const struct ddtable *dt, const void *data, uint64_t amap[2],
+    uint64_t rmap[2], uint64_t fmap[2])
+{
+	struct ddfs_bucket hdr;
+	uint64_t valid;
+	int nbits;
+
+	memcpy(&hdr, data, sizeof(hdr));
+	for (int w = 0; w < 2; w++) {
+		nbits = MIN(64, MAX(0, dt->dt_nentries - 64 * w));
+		valid = nbits == 64 ? ~0ULL : (1ULL << nbits) - 1;
+		amap[w] = hdr.bk_active[w] & valid;
+		rmap[w] = ~hdr.bk_active[w] & valid;
+		fmap[w] = ~(hdr.bk_active[w] | hdr.bk_dead[w]) & valid;
+	}
+}
+
+static int
+ddtable_bread(struct ddtable *dt, int64_t blkno, void **datap, void **bufp)
+{
+	DDT_ADD(&dt->dt_reads, 1);
+	return ((*dt->dt_bread)(dt->dt_devfd, blkno, datap, bufp));
+}
+
+static int
+ddtable_brelse(struct ddtable *dt, void *bufp, int dirty)
+{
+	if (dirty)
+		DDT_ADD(&dt->dt_writes, 1);
+	return ((*dt->dt_brelse)(dt->dt_devfd, bufp, dirty));
+}
+
+/* Pass the new contents of `slot` to the intent log, if there is one */
+static inline int
+ddtable_log(struct ddtable *dt, int64_t slot, const struct ddfs_dedup *entry)
+{
+	if (dt->dt_log == NULL)
+		return (0);
+	return ((*dt->dt_log)(dt->dt_devfd, slot, entry));
+}
+
+/*
+ * Record a reusable slot while building dt_freemap.
+ * The caller allocates the map zeroed, with dt_nfree set to 0, and calls this
+ * for every FREE or DEAD slot in the table.
+ */
+void
+ddtable_freemap_set(struct ddtable *dt, int64_t slot)
+{
+	DDT_SETBIT(dt->dt_freemap, DDTABLE_BUCKET(dt, slot));
+	DDT_ADD(&dt->dt_nfree, 1);
+}
+
+/* Bring the dt_freemap bit of `bucket` up to date with its contents in `data` */
+static void
+ddfreemap_update(struct ddtable *dt, int64_t bucket, const void *data)
+{
+	uint64_t amap[2], rmap[2], fmap[2];
+	struct ddfs_dedup entry;
+
+	if (dt->dt_format >= DDFS_DDFORMAT_TAGGED) {
+		ddbkt_maps(dt, data, amap, rmap, fmap);
+		if ((rmap[0] | rmap[1]) != 0)
+			DDT_SETBIT(dt->dt_freemap, bucket);
+		else
+			DDT_CLRBIT(dt->dt_freemap, bucket);
+		return;
+	}
+	for (int i = 0; i < dt->dt_nentries; i++) {
+		ddtable_getentry(dt, data, i, &entry);
+		if (entry.flags & (DDFS_DEDUP_FREE | DDFS_DEDUP_DEAD)) {
+			DDT_SETBIT(dt->dt_freemap, bucket);
+			return;
+		}
+	}
+	DDT_CLRBIT(dt->dt_freemap, bucket);
+}
+
+/*
+ * First bucket with a reusable slot at or after `bucket` in probe order,
+ * or -1 if the table is full.
+ */
+static int64_t
+ddfreemap_next(const struct ddtable *dt, int64_t bucket)
+{
+	int64_t nbytes = DDTABLE_FREEMAP_SIZE(dt);
+
+	for (int64_t n = 0; n < dt->dt_nbuckets; n++) {
+		/* skip whole bytes of full buckets */
+		if (bucket % NBBY == 0 && dt->dt_freemap[bucket / NBBY] == 0 &&
+		    bucket / NBBY < nbytes - 1) {
+			n += NBBY - 1;
+			bucket += NBBY;
+			continue;
+		}
+		if (isset(dt->dt_freemap, bucket))
+			return (bucket);
+		if (++bucket == dt->dt_nbuckets)
+			bucket = 0;
+	}
+	return (-1);
+}
+
+/*
+ * Location of the reverse index entry for `blockptr`
+ */
+#define DDREV_PER_BLOCK(dt) ((dt)->dt_bsize / (int)sizeof(int64_t))
+#define DDREV_BLKNO(dt, bno) ((dt)->dt_revblk + (bno) / DDREV_PER_BLOCK(dt))
+#define DDREV_IDX(dt, bno) ((int)((bno) % DDREV_PER_BLOCK(dt)))
+
+/*
+ * Point the reverse index entry for `blockptr` at `slot`, or clear it if `slot` is -1.
+ */
+static int
+ddrev_set(struct ddtable *dt, daddr_t blockptr, int64_t slot)
+{
+	int64_t value = slot + 1;
+	void *data, *bp;
+	int error;
+
+	if (blockptr < 0 || blockptr >= dt->dt_nrev)
+		return (EINVAL);
+	error = ddtable_bread(dt, DDREV_BLKNO(dt, blockptr), &data, &bp);
+	if (error != 0)
+		return (error);
+	memcpy((uint8_t *)data + DDREV_IDX(dt, blockptr) * sizeof(int64_t), &value,
+	    sizeof(int64_t));
+	return (ddtable_brelse(dt, bp, 1));
+}
+
+/*
+ * Home bucket of a key: the leading 64 bits of the key, modulo the number of buckets.
+ */
+int64_t
+ddtable_bucket(const struct ddtable *dt, const uint8_t key[20])
+{
+	uint64_t prefix = 0;
+	for (int i = 0; i < 8; i++)
+		prefix = (prefix << 8) | key[i];
+	return (prefix % dt->dt_nbuckets);
+}
+
+void
+ddtable_lock(struct ddtable *dt, int64_t bucket)
+{
+	if (dt->dt_nlocks != 0)
+		(*dt->dt_lock)(dt->dt_devfd, DDTABLE_STRIPE(dt, bucket));
+}
+
+void
+ddtable_unlock(struct ddtable *dt, int64_t bucket)
+{
+	if (dt->dt_nlocks != 0)
+		(*dt->dt_unlock)(dt->dt_devfd, DDTABLE_STRIPE(dt, bucket));
+}
+
+/*
+ * ddbucket_search() for format 5 buckets. The tags are compared 4 at a time
+ * in 64-bit words: XORing a word with the tag in every lane leaves a zero
+ * lane where the tag matches, and the test below sets the top bit of exactly
+ * those lanes (no carry crosses lanes). Only the slots of a word with a match
+ * are looked at one by one, and only ACTIVE ones with the same tag have their
+ * key compared, so a miss reads the header and the tags but no keys.
+ */
+static int
+ddbkt_search(const struct ddtable *dt, const void *data, const uint8_t key[20],
+    int *reuse, bool *hasfree)
+{
+	const uint64_t low = 0x7fff7fff7fff7fffULL;
+	const uint8_t *p = data;
+	uint64_t amap[2], rmap[2], fmap[2], pattern, word, x;
+	int n = dt->dt_nentries;
+	uint16_t tag, tags[4];
+
+	ddbkt_maps(dt, data, amap, rmap, fmap);
+	if (rmap[0] != 0)
+		*reuse = __builtin_ctzll(rmap[0]);
+	else if (rmap[1] != 0)
+		*reuse = 64 + __builtin_ctzll(rmap[1]);
+	else
+		*reuse = -1;
+	*hasfree = (fmap[0] | fmap[1]) != 0;
+	if (key == NULL || (amap[0] | amap[1]) == 0)
+		return (-1);
+	tag = ddkey_tag(key);
+	pattern = (uint64_t)tag * 0x0001000100010001ULL;
+	for (int w = 0; w < n; w += 4) {
+		memcpy(&word, p + DDBKT_TAGS(n) + w * sizeof(uint16_t), sizeof(word));
+		x = word ^ pattern;
+		if (~(((x & low) + low) | x | low) == 0)
+			continue;
+		memcpy(tags, &word, sizeof(tags));
+		for (int i = w; i < MIN(w + 4, n); i++)
+			if (tags[i - w] == tag && (amap[i / 64] & (1ULL << (i % 64))) &&
+			    memcmp(p + DDBKT_KEYS(n) + i * 20, key, 20) == 0)
+				return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Search a single bucket for `key`, or only for free space if `key` is NULL.
+ * Returns the index of the matching entry, or -1 if it is not in this bucket.
+ * On a miss, `reuse` is set to the first FREE or DEAD slot in the bucket (or -1),
+ * and `hasfree` to whether the bucket has a FREE slot, which ends the probe.
+ */
+static int
+ddbucket_search(const struct ddtable *dt, const void *data, const uint8_t key[20],
+    int *reuse, bool *hasfree)
+{
+	struct ddfs_dedup entry;
+
+	if (dt->dt_format >= DDFS_DDFORMAT_TAGGED)
+		return (ddbkt_search(dt, data, key, reuse, hasfree));
+	*reuse = -1;
+	*hasfree = false;
+	for (int i = 0; i < dt->dt_nentries; i++) {
+		ddtable_getentry(dt, data, i, &entry);
+		if (entry.flags & (DDFS_DEDUP_FREE | DDFS_DEDUP_DEAD)) {
+			if (*reuse == -1)
+				*reuse = i;
+			if (entry.flags & DDFS_DEDUP_FREE)
+				*hasfree = true;
+			continue;
+		}
+		if (key != NULL && memcmp(key, entry.key, 20) == 0)
+			return (i);
+	}
+	return (-1);
+}
+
+/* Whether the bucket `data` has a FREE slot */
+static bool
+ddbucket_hasfree(const struct ddtable *dt, const void *data)
+{
+	uint64_t amap[2], rmap[2], fmap[2];
+	struct ddfs_dedup entry;
+
+	if (dt->dt_format >= DDFS_DDFORMAT_TAGGED) {
+		ddbkt_maps(dt, data, amap, rmap, fmap);
+		return ((fmap[0] | fmap[1]) != 0);
+	}
+	for (int i = 0; i < dt->dt_nentries; i++) {
+		ddtable_getentry(dt, data, i, &entry);
+		if (entry.flags & DDFS_DEDUP_FREE)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Walk the probe sequence for `key`, starting at its home bucket.
+ *
+ * Sets `slotp` to the slot holding `key`, or -1 if the key is not in the table,
+ * and `reusep` to the first reusable slot on the probe path (-1 if there is none,
+ * i.e. the table is full).
+ * If the key was found, the buffer of its bucket is returned held in `datap`/`bufp`.
+ * Otherwise the last bucket read is returned held only if it contains `reusep`,
+ * and `bufp` is set to NULL when nothing is held.
+ * The caller is responsible for releasing a held buffer with ddtable_brelse().
+ *
+ * If the caller knows `key` is `absent` from the table, keys are not compared
+ * and the walk stops at the first reusable slot, whose bucket is returned held.
+ */
+static int
+ddtable_probe(struct ddtable *dt, const uint8_t key[20], bool absent, int64_t *slotp,
+    int64_t *reusep, void **datap, void **bufp)
+{
+	int64_t bucket = ddtable_bucket(dt, key);
+	int error, idx, reuse;
+	bool hasfree;
+
+	*slotp = -1;
+	*reusep = -1;
+	*bufp = NULL;
+	if (absent && dt->dt_freemap != NULL &&
+	    (bucket = ddfreemap_next(dt, bucket)) == -1)
+		return (0);
+	for (int64_t n = 0; n < dt->dt_nbuckets; n++) {
+		error = ddtable_bread(dt, bucket, datap, bufp);
+		if (error != 0) {
+			*bufp = NULL;
+			return (error);
+		}
+		idx = ddbucket_search(dt, *datap, absent ? NULL : key, &reuse, &hasfree);
+		if (idx != -1) {
+			*slotp = DDTABLE_SLOT(dt, bucket, idx);
+			return (0);
+		}
+		if (*reusep == -1 && reuse != -1)
+			*reusep = DDTABLE_SLOT(dt, bucket, reuse);
+		if (hasfree || (absent && reuse != -1)) {
+			/* end of the probe sequence: keep the bucket if we insert into it */
+			if (*reusep == -1 || DDTABLE_BUCKET(dt, *reusep) != bucket) {
+				ddtable_brelse(dt, *bufp, 0);
+				*bufp = NULL;
+			}
+			return (0);
+		}
+		ddtable_brelse(dt, *bufp, 0);
+		*bufp = NULL;
+		if (++bucket == dt->dt_nbuckets)
+			bucket = 0;
+	}
+	return (0);
+}
+
+/*
+ * Look up `key` without modifying the table.
+ * The home bucket of `key` need not be locked, but the entry may have changed
+ * by the time this returns if it is not.
+ * Returns 0 and fills in `out_slot` and `out_entry` (either may be NULL) if found,
+ * ENOENT if the key is not in the table, or an errno from reading the table.
+ */
+int
+ddtable_lookup(struct ddtable *dt, const uint8_t key[20], int64_t *out_slot,
+    struct ddfs_dedup *out_entry)
+{
+	int64_t slot, reuse;
+	void *data, *bp;
+	int error;
+
+	error = ddtable_probe(dt, key, false, &slot, &reuse, &data, &bp);
+	if (error != 0)
+		return (error);
+	if (slot != -1 && out_entry != NULL)
+		ddtable_getentry(dt, data, DDTABLE_IDX(dt, slot), out_entry);
+	if (bp != NULL)
+		ddtable_brelse(dt, bp, 0);
+	if (slot == -1)
+		return (ENOENT);
+	if (out_slot != NULL)
+		*out_slot = slot;
+	return (0);
+}
+
+/*
+ * Take a reference on `key`.
+ * If the key is already in the table its refcount is incremented (unless it is
+ * pinned), and the entry points at the block already holding that data. Otherwise a new entry pointing
+ * at `in_block` is inserted.
+ * Sets `out_slot` (if non-null) to the slot of the entry and `out_entry` to its
+ * updated contents.
+ * Called with the home bucket of `key` locked, which may be dropped and taken
+ * again if the entry is in a bucket of another lock stripe.
+ * Returns 0 on success, ENOSPC if the table is full, or an errno.
+ */
+int
+ddtable_ref(struct ddtable *dt, const uint8_t key[20], daddr_t in_block,
+    int64_t *out_slot, struct ddfs_dedup *out_entry)
+{
+	return (ddtable_ref_common(dt, key, false, in_block, out_slot, out_entry));
+}
+
+/*
+ * Insert `key`, which the caller knows is not in the table, pointing at `in_block`.
+ * Unlike ddtable_ref() this stops at the first reusable slot on the probe path
+ * instead of searching the rest of it for the key.
+ * Sets `out_slot` (if non-null) and `out_entry` like ddtable_ref(), and is
+ * called with the same lock.
+ */
+int
+ddtable_insert(struct ddtable *dt, const uint8_t key[20], daddr_t in_block,
+    int64_t *out_slot, struct ddfs_dedup *out_entry)
+{
+	return (ddtable_ref_common(dt, key, true, in_block, out_slot, out_entry));
+}
+
+/*
+ * Lock the stripe of `bucket`, where the entry for a key whose `home` bucket
+ * is locked ends up, unless it is the same stripe or `*heldp` already.
+ * Blocking on it with `home` locked could deadlock with a thread doing the
+ * same the other way around, so if it is busy, the buffer `bp` (if any) is
+ * released and both stripes are locked again in order. Returns false if so:
+ * the table may have changed, and the caller must probe again.
+ */
+static bool
+ddtable_lock_other(struct ddtable *dt, int64_t home, int64_t bucket, int *heldp,
+    void *bp)
+{
+	int stripe, hstripe;
+
+	if (dt->dt_nlocks == 0)
+		return (true);
+	stripe = DDTABLE_STRIPE(dt, bucket);
+	hstripe = DDTABLE_STRIPE(dt, home);
+	if (stripe == hstripe || stripe == *heldp)
+		return (true);
+	if (*heldp != -1)
+		(*dt->dt_unlock)(dt->dt_devfd, *heldp);
+	*heldp = stripe;
+	if ((*dt->dt_trylock)(dt->dt_devfd, stripe))
+		return (true);
+	if (bp != NULL)
+		ddtable_brelse(dt, bp, 0);
+	(*dt->dt_unlock)(dt->dt_devfd, hstripe);
+	(*dt->dt_lock)(dt->dt_devfd, MIN(stripe, hstripe));
+	(*dt->dt_lock)(dt->dt_devfd, MAX(stripe, hstripe));
+	return (false);
+}
+
+static int
+ddtable_ref_common(struct ddtable *dt, const uint8_t key[20], bool absent,
+    daddr_t in_block, int64_t *out_slot, struct ddfs_dedup *out_entry)
+{
+	struct ddfs_dedup entry;
+	int64_t home = ddtable_bucket(dt, key), slot, reuse;
+	int held = -1; /* stripe locked here, besides that of `home` */
+	bool inserted = false;
+	void *data, *bp;
+	int error;
+
+retry:
+	error = ddtable_probe(dt, key, absent, &slot, &reuse, &data, &bp);
+	if (error != 0)
+		goto out;
+	if ((slot != -1 || reuse != -1) &&
+	    !ddtable_lock_other(dt, home, DDTABLE_BUCKET(dt, slot != -1 ? slot : reuse),
+	    &held, bp)) {
+		/* `key` may have been inserted while `home` was unlocked */
+		absent = false;
+		goto retry;
+	}
+	if (slot != -1) {
+		/* found a match. update refcount, unless it is pinned */
+		ddtable_getentry(dt, data, DDTABLE_IDX(dt, slot), &entry);
+		if (DDTABLE_PINNED(dt, &entry)) {
+			ddtable_brelse(dt, bp, 0);
+			if (out_slot != NULL)
+				*out_slot = slot;
+			*out_entry = entry;
+			goto out;
+		}
+		entry.ref_count++;
+	} else {
+		if (reuse == -1) {
+			error = ENOSPC;
+			goto out;
+		}
+		/*
+		 * The reusable slot may be in an earlier bucket than the last one
+		 * read, which another thread may have filled since.
+		 */
+		if (bp == NULL) {
+			if ((error = ddtable_bread(dt, DDTABLE_BUCKET(dt, reuse), &data,
+			    &bp)) != 0)
+				goto out;
+			ddtable_getentry(dt, data, DDTABLE_IDX(dt, reuse), &entry);
+			if ((entry.flags & (DDFS_DEDUP_FREE | DDFS_DEDUP_DEAD)) == 0) {
+				ddtable_brelse(dt, bp, 0);
+				goto retry;
+			}
+		}
+		slot = reuse;
+		bzero(&entry, sizeof(struct ddfs_dedup));
+		memcpy(entry.key, key, 20);
+		entry.flags = DDFS_DEDUP_ACTIVE;
+		entry.ref_count = 1;
+		entry.blockptr = in_block;
+		inserted = true;
+	}
+	ddtable_putentry(dt, data, DDTABLE_IDX(dt, slot), &entry);
+	if (inserted && dt->dt_freemap != NULL) {
+		DDT_ADD(&dt->dt_nfree, -1);
+		ddfreemap_update(dt, DDTABLE_BUCKET(dt, slot), data);
+	}
+	error = ddtable_brelse(dt, bp, 1);
+	/* a new entry also needs a reverse index entry */
+	if (error == 0 && inserted)
+		error = ddrev_set(dt, entry.blockptr, slot);
+	if (error == 0)
+		error = ddtable_log(dt, slot, &entry);
+	if (out_slot != NULL)
+		*out_slot = slot;
+	*out_entry = entry;
+out:
+	if (held != -1)
+		(*dt->dt_unlock)(dt->dt_devfd, held);
+	return (error);
+}
+
+/*
+ * Take another reference on the entry for `key`, already known to be in `slot`.
+ * This skips the probe when the caller has cached the location of the entry.
+ * Sets `out_entry` to the updated entry. Called with the bucket of `slot` locked.
+ * Returns 0 on success, ENOENT if `slot` does not hold `key`, or an errno.
+ */
+int
+ddtable_incref(struct ddtable *dt, int64_t slot, const uint8_t key[20],
+    struct ddfs_dedup *out_entry)
+{
+	struct ddfs_dedup entry;
+	int idx = DDTABLE_IDX(dt, slot);
+	void *data, *bp;
+	int error;
+
+	error = ddtable_bread(dt, DDTABLE_BUCKET(dt, slot), &data, &bp);
+	if (error != 0)
+		return (error);
+	ddtable_getentry(dt, data, idx, &entry);
+	if ((entry.flags & DDFS_DEDUP_ACTIVE) == 0 || memcmp(entry.key, key, 20) != 0) {
+		ddtable_brelse(dt, bp, 0);
+		return (ENOENT);
+	}
+	if (DDTABLE_PINNED(dt, &entry)) {
+		*out_entry = entry;
+		return (ddtable_brelse(dt, bp, 0));
+	}
+	entry.ref_count++;
+	ddtable_putentry(dt, data, idx, &entry);
+	*out_entry = entry;
+	error = ddtable_brelse(dt, bp, 1);
+	if (error == 0)
+		error = ddtable_log(dt, slot, &entry);
+	return (error);
+}
+
+/*
+ * Drop a reference on the entry for `blockptr` in `slot`.
+ * When the refcount reaches 0 the entry is removed from the table. A pinned
+ * entry is left as it is.
+ * Sets `out_entry` to the entry with its decremented refcount; the key and block
+ * pointer are returned even if the entry was removed.
+ * Called with the bucket of `slot` locked.
+ * Returns 0 on success, ENOENT if the slot holds no entry for `blockptr` (the
+ * reverse index can be stale after a crash), or an errno.
+ */
+int
+ddtable_deref(struct ddtable *dt, int64_t slot, daddr_t blockptr,
+    struct ddfs_dedup *out_entry)
+{
+	struct ddfs_dedup entry;
+	int idx = DDTABLE_IDX(dt, slot);
+	void *data, *bp;
+	int error;
+
+	error = ddtable_bread(dt, DDTABLE_BUCKET(dt, slot), &data, &bp);
+	if (error != 0)
+		return (error);
+	ddtable_getentry(dt, data, idx, &entry);
+	if ((entry.flags & DDFS_DEDUP_ACTIVE) == 0 || entry.blockptr != blockptr) {
+		ddtable_brelse(dt, bp, 0);
+		return (ENOENT);
+	}
+	/* a pinned entry may have more references than it counts */
+	if (DDTABLE_PINNED(dt, &entry)) {
+		*out_entry = entry;
+		return (ddtable_brelse(dt, bp, 0));
+	}
+	entry.ref_count--;
+	*out_entry = entry;
+	if (entry.ref_count == 0) {
+		/*
+		 * Ref count is now 0, so we delete this entry.
+		 * It can only become FREE again if no key overflowed past this bucket,
+		 * i.e. the bucket has never been full.
+		 */
+		bzero(&entry, sizeof(struct ddfs_dedup));
+		entry.flags = ddbucket_hasfree(dt, data) ? DDFS_DEDUP_FREE : DDFS_DEDUP_DEAD;
+		if (dt->dt_freemap != NULL) {
+			DDT_ADD(&dt->dt_nfree, 1);
+			DDT_SETBIT(dt->dt_freemap, DDTABLE_BUCKET(dt, slot));
+		}
+	}
+	ddtable_putentry(dt, data, idx, &entry);
+	error = ddtable_brelse(dt, bp, 1);
+	if (error == 0 && out_entry->ref_count == 0)
+		error = ddrev_set(dt, out_entry->blockptr, -1);
+	if (error == 0)
+		error = ddtable_log(dt, slot, &entry);
+	return (error);
+}
+
+/*
+ * Read the entry for `blockptr` in `slot`, as found by ddtable_findblk().
+ * The bucket of `slot` must be locked for the entry to stay as returned.
+ * Returns 0, ENOENT if the slot holds no entry for `blockptr`, or an errno.
+ */
+int
+ddtable_get(struct ddtable *dt, int64_t slot, daddr_t blockptr,
+    struct ddfs_dedup *out_entry)
+{
+	void *data, *bp;
+	int error;
+
+	error = ddtable_bread(dt, DDTABLE_BUCKET(dt, slot), &data, &bp);
+	if (error != 0)
+		return (error);
+	ddtable_getentry(dt, data, DDTABLE_IDX(dt, slot), out_entry);
+	ddtable_brelse(dt, bp, 0);
+	if ((out_entry->flags & DDFS_DEDUP_ACTIVE) == 0 ||
+	    out_entry->blockptr != blockptr)
+		return (ENOENT);
+	return (0);
+}
+
+/*
+ * Find the entry whose block pointer is `blockptr` through the reverse index.
+ * Returns 0 and sets `out_slot` if found, ENOENT if not, or an errno.
+ */
+int
+ddtable_findblk(struct ddtable *dt, daddr_t blockptr, int64_t *out_slot)
+{
+	int64_t value;
+	void *data, *bp;
+	int error;
+
+	if (blockptr < 0 || blockptr >= dt->dt_nrev)
+		return (ENOENT);
+	error = ddtable_bread(dt, DDREV_BLKNO(dt, blockptr), &data, &bp);
+	if (error != 0)
+		return (error);
+	memcpy(&value, (uint8_t *)data + DDREV_IDX(dt, blockptr) * sizeof(int64_t),
+	    sizeof(int64_t));
+	ddtable_brelse(dt, bp, 0);
+	if (value == 0)
+		return (ENOENT);
+	*out_slot = value - 1;
+	return (0);
+}
+
+/*
+ * Make the reverse index entry of the ACTIVE entry in `slot` point back at it.
+ * Table and reverse index blocks are written back independently, so after a
+ * crash an entry may be missing from the reverse index; this is called for
+ * every entry when mounting a filesystem that was not unmounted cleanly.
+ * Stale reverse index entries left behind are caught by ddtable_deref().
+ */
+int
+ddtable_revrepair(struct ddtable *dt, int64_t slot, const struct ddfs_dedup *entry)
+{
+	int64_t revslot;
+	int error;
+
+	error = ddtable_findblk(dt, entry->blockptr, &revslot);
+	if (error == 0 && revslot == slot)
+		return (0);
+	if (error != 0 && error != ENOENT)
+		return (error);
+	return (ddrev_set(dt, entry->blockptr, slot));
+}
+
+/*
+ * Copy the ACTIVE `entry` of another table, with its refcount, into the first
+ * reusable slot of its probe sequence in `dt`, which must not hold its key.
+ * Used by growddfs to rehash a table into a larger one. Neither the reverse
+ * index nor the log are updated: the new table takes the place of the old one
+ * only once it is complete, and the reverse index is then rebuilt with
+ * ddtable_revrepair().
+ * Returns 0 and sets `out_slot`, ENOSPC if the table is full, or an errno.
+ */
+int
+ddtable_rehash(struct ddtable *dt, const struct ddfs_dedup *entry, int64_t *out_slot)
+{
+	int64_t slot, reuse;
+	void *data, *bp;
+	int error;
+
+	error = ddtable_probe(dt, entry->key, true, &slot, &reuse, &data, &bp);
+	if (error != 0)
+		return (error);
+	if (reuse == -1)
+		return (ENOSPC);
+	ddtable_putentry(dt, data, DDTABLE_IDX(dt, reuse), entry);
+	*out_slot = reuse;
+	return (ddtable_brelse(dt, bp, 1));
+}
+
+/*
+ * Checksum of a log block: 32-bit FNV-1a over the block, with lh_cksum as 0.
+ */
+static uint32_t
+ddlog_cksum(const struct ddtable *dt, const void *data)
+{
+	const uint8_t *p = data;
+	const size_t off = offsetof(struct ddfs_loghdr, lh_cksum);
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < (size_t)dt->dt_bsize; i++) {
+		uint8_t c = (i >= off && i < off + sizeof(uint32_t)) ? 0 : p[i];
+		h = (h ^ c) * 16777619u;
+	}
+	return (h);
+}
+
+void
+ddtable_logseal(const struct ddtable *dt, void *data)
+{
+	struct ddfs_loghdr *hdr = data;
+
+	hdr->lh_cksum = ddlog_cksum(dt, data);
+}
+
+/*
+ * Read the header of the log block at position `pos`.
+ * Returns 1 if the block is a complete log block that belongs there, 0 if it
+ * was never written or was torn, or -1 with `errorp` set if it cannot be read.
+ */
+static int
+ddlog_read(struct ddtable *dt, int64_t pos, struct ddfs_loghdr *hdr, void **datap,
+    void **bufp, int *errorp)
+{
+	int error;
+
+	error = ddtable_bread(dt, dt->dt_logblk + pos, datap, bufp);
+	if (error != 0) {
+		*errorp = error;
+		return (-1);
+	}
+	memcpy(hdr, *datap, sizeof(struct ddfs_loghdr));
+	return (hdr->lh_magic == DDFS_LOG_MAGIC && hdr->lh_seq != 0 &&
+	    (int64_t)(hdr->lh_seq % dt->dt_nlog) == pos &&
+	    hdr->lh_nrec <= (uint32_t)DDFS_LOG_NRECS(dt->dt_bsize) &&
+	    hdr->lh_cksum == ddlog_cksum(dt, *datap));
+}
+
+/* Redo one logged change: `slot` holds `entry` */
+static int
+ddlog_apply(struct ddtable *dt, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct ddfs_dedup old;
+	int64_t revslot;
+	void *data, *bp;
+	int error;
+
+	if (slot < 0 || slot >= dt->dt_nbuckets * dt->dt_nentries)
+		return (EINVAL);
+	error = ddtable_bread(dt, DDTABLE_BUCKET(dt, slot), &data, &bp);
+	if (error != 0)
+		return (error);
+	ddtable_getentry(dt, data, DDTABLE_IDX(dt, slot), &old);
+	ddtable_putentry(dt, data, DDTABLE_IDX(dt, slot), entry);
+	error = ddtable_brelse(dt, bp, 1);
+	/* drop the reverse index entry of whatever was in the slot before */
+	if (error == 0 && (old.flags & DDFS_DEDUP_ACTIVE) &&
+	    ((entry->flags & DDFS_DEDUP_ACTIVE) == 0 || old.blockptr != entry->blockptr) &&
+	    ddtable_findblk(dt, old.blockptr, &revslot) == 0 && revslot == slot)
+		error = ddrev_set(dt, old.blockptr, -1);
+	if (error == 0 && (entry->flags & DDFS_DEDUP_ACTIVE))
+		error = ddrev_set(dt, entry->blockptr, slot);
+	return (error);
+}
+
+/*
+ * Replay the intent log into the table.
+ * Finds the newest complete log block, and redoes every change recorded from
+ * the checkpoint it names up to itself, in order. Changes are full slot
+ * contents, so replaying changes the table already has is harmless.
+ * Sets `out_seq` to the sequence number the next log block should use.
+ * Returns 0 on success or an errno.
+ */
+int
+ddtable_replay(struct ddtable *dt, uint64_t *out_seq)
+{
+	struct ddfs_loghdr hdr;
+	struct ddfs_logrec rec;
+	struct ddfs_dedup entry;
+	uint64_t last = 0, ckpt = 0;
+	void *data, *bp;
+	int valid, error = 0;
+
+	*out_seq = 1;
+	if (dt->dt_nlog == 0)
+		return (0);
+	for (int64_t pos = 0; pos < dt->dt_nlog; pos++) {
+		valid = ddlog_read(dt, pos, &hdr, &data, &bp, &error);
+		if (valid < 0)
+			return (error);
+		if (valid && hdr.lh_seq > last) {
+			last = hdr.lh_seq;
+			ckpt = hdr.lh_ckpt;
+		}
+		ddtable_brelse(dt, bp, 0);
+	}
+	if (last == 0)
+		return (0);
+	*out_seq = last + 1;
+	/* the log never holds more than dt_nlog blocks past the checkpoint */
+	if (ckpt == 0 || ckpt > last || last - ckpt >= (uint64_t)dt->dt_nlog)
+		ckpt = last >= (uint64_t)dt->dt_nlog ? last - dt->dt_nlog + 1 : 1;
+	for (uint64_t seq = ckpt; seq <= last; seq++) {
+		valid = ddlog_read(dt, seq % dt->dt_nlog, &hdr, &data, &bp, &error);
+		if (valid < 0)
+			return (error);
+		/* a block that never made it to disk has nothing to redo */
+		if (valid == 0 || hdr.lh_seq != seq) {
+			ddtable_brelse(dt, bp, 0);
+			continue;
+		}
+		for (uint32_t i = 0; i < hdr.lh_nrec && error == 0; i++) {
+			memcpy(&rec, (uint8_t *)data + sizeof(struct ddfs_loghdr) +
+			    i * sizeof(struct ddfs_logrec), sizeof(struct ddfs_logrec));
+			ddentry_decode(dt->dt_format, rec.lr_entry, &entry);
+			error = ddlog_apply(dt, rec.lr_slot, &entry);
+		}
+		ddtable_brelse(dt, bp, 0);
+		if (error != 0)
+			return (error);
+	}
+	return (0);
+}
+
+/*
+ * Call `fn` on every slot of the table, in order, whatever its state.
+ * Used to build in-memory summaries of the table at mount time.
+ */
+int
+ddtable_foreach(struct ddtable *dt,
+    void (*fn)(void *arg, int64_t slot, const struct ddfs_dedup *entry), void *arg)
+{
+	struct ddfs_dedup entry;
+	void *data, *bp;
+	int error;
+
+	for (int64_t bucket = 0; bucket < dt->dt_nbuckets; bucket++) {
+		error = ddtable_bread(dt, bucket, &data, &bp);
+		if (error != 0)
+			return (error);
+		for (int i = 0; i < dt->dt_nentries; i++) {
+			ddtable_getentry(dt, data, i, &entry);
+			(*fn)(arg, DDTABLE_SLOT(dt, bucket, i), &entry);
+		}
+		ddtable_brelse(dt, bp, 0);
+	}
+	return (0);
+}
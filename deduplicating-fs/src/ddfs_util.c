@@ -1,9 +1,15 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/buf.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
 #include <sys/mount.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
 #include <sys/vnode.h>
 
+#include <machine/atomic.h>
+
 #include <ufs/ufs/quota.h>
 #include "ddfs_inode.h"
 #include <ufs/ufs/ufs_extern.h>
@@ -12,10 +18,29 @@
 #include "ddfs_fs.h"
 #include <ufs/ffs/ffs_extern.h>
 
-#include <crypto/sha1.h>
-
 #include "ddfs.h"
 
+static MALLOC_DEFINE(M_DDFS, "ddfs", "ddfs per-mount dedup state");
+
+SYSCTL_NODE(_vfs, OID_AUTO, ddfs, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "DDFS deduplication");
+
+static int ddtable_flush_blocks = 256;
+SYSCTL_INT(_vfs_ddfs, OID_AUTO, flush_blocks, CTLFLAG_RWTUN, &ddtable_flush_blocks, 0,
+    "Dedup table blocks with delayed writes before they are written "
+    "(applies at mount, 0 writes every update immediately)");
+
+static int ddtable_locks = 256;
+SYSCTL_INT(_vfs_ddfs, OID_AUTO, table_locks, CTLFLAG_RWTUN, &ddtable_locks, 0,
+    "Dedup table bucket lock stripes per mount (applies at mount, rounded "
+    "down to a power of 2)");
+
+static u_long ddtable_log_writes;
+SYSCTL_ULONG(_vfs_ddfs, OID_AUTO, log_writes, CTLFLAG_RD, &ddtable_log_writes, 0,
+    "Dedup intent log blocks written");
+
+static int ddtable_logwrite(struct ufsmount *mnt, bool force);
+
 /* Copied from /usr/src/sys/fs/nfsserver/nfs_nfsdsubs.c
  * Translate an ASCII hex digit to it's binary value (between 0x0 and 0xf).
  * Return -1 if the char isn't a hex digit.
@@ -82,159 +107,586 @@ key_to_str(const uint8_t *key, char *out_str)
 	return (0);
 }
 
+/*
+ * Fingerprint a block with the algorithm newfs-ddfs chose for `fs`.
+ */
+int
+hash_block(const struct fs *fs, uint8_t hash_result[20], void *buf, size_t size)
+{
+	return (ddfs_fingerprint(fs->fs_ddfingerprint, buf, size, hash_result));
+}
+
+/*
+ * Fingerprint `n` blocks at once with the algorithm of `fs`.
+ */
 int
-hash_block(uint8_t hash_result[SHA1_RESULTLEN], void *buf, size_t size)
+hash_blocks(const struct fs *fs, uint8_t hash_results[][20], void *const bufs[],
+    int n, size_t size)
 {
-	SHA1_CTX ctx = { 0 };
-	sha1_init(&ctx);
-	sha1_loop(&ctx, buf, size);
-	sha1_result(&ctx, hash_result);
-	return 0;
+	return (ddfs_fingerprint_batch(fs->fs_ddfingerprint, (const void *const *)bufs,
+	    n, size, hash_results));
 }
 
 /*
- * Helper function for ddtable_alloc and ddtable_unref.
- * Finds a dedup table entry with matching `key` or `targetblock`, whichever is non-null.
- *
- * Sets the `out_idx` to the location of the entry in the buffer pointed to by `bp`.
- * If `first_free` is non-null, will set to the location of the first free space in the buffer
- * pointed to by `freebp`.
- * Note that this is *not necesscarily* the same buffer as `bp`.
- * The caller must be careful to avoid a double free when releasing these buffers.
- *
- * Returns 0 on successful find, and 1 if not found.
- * The caller is responsible for freeing the buffer `bp` with `bwrite()` or `brelse()`.
+ * Callbacks for the shared table code in ddfs_table.c.
+ * Table blocks are filesystem blocks counted from fs_ddblkno.
  */
 static int
-ddtable_locate(struct ufsmount *mnt, uint8_t key[20], struct buf **bp, daddr_t *out_idx, daddr_t *first_free, struct buf **freebp, daddr_t *targetblock)
+ddtable_bread_mnt(void *devfd, int64_t blkno, void **datap, void **bufp)
 {
+	struct ufsmount *mnt = devfd;
 	struct fs *fs = mnt->um_fs;
-	int error = 0;
-	daddr_t freespot = -1;
-
-	const uint64_t num_blocks = fs->fs_dedupfrags / fs->fs_frag;
-	const uint64_t entries_per_block = fs->fs_bsize / sizeof(struct ddfs_dedup);
-	/* helper variable to avoid freeing the buffer for the free block */
-	bool found;
-	for (int i = 0; i < num_blocks; i++) {
-		found = false;
-		daddr_t dd_lbn = fsbtodb(fs, fs->fs_ddblkno + i * fs->fs_frag);
-		error = bread(mnt->um_devvp, dd_lbn, fs->fs_bsize, NOCRED, bp);
-		if (error != 0) {
-			printf("  bread error %d\n", error);
-			return (error);
-		}
-		/* read through each entry in this block */
-		struct ddfs_dedup entry;
-		for (int k = 0; k < entries_per_block; k++) {
-			daddr_t idx = k * sizeof(struct ddfs_dedup);
-			memcpy(&entry, (*bp)->b_data + idx, sizeof(struct ddfs_dedup));
-			if (entry.flags & DDFS_DEDUP_FREE) {
-				if (freespot == -1 && freebp != NULL) {
-					/* mark the first free spot we find,
-					 * in case we need to allocate a new entry */
-					freespot = idx;
-					*freebp = *bp;
-					found = true;
-				}
-				continue;
-			}
-
-			if (targetblock != NULL) {
-				if (entry.blockptr == *targetblock) {
-					*out_idx = idx;
-					goto out;
-				}
-
-			} else if (key != NULL) {
-				if (memcmp(key, entry.key, 20) == 0) {
-					/* found matching entry on disk. */
-					*out_idx = idx;
-					error = 0;
-					goto out;
-				}
-			}
-		}
+	struct buf *bp;
+	int error;
+
+	daddr_t dd_lbn = fsbtodb(fs, fs->fs_ddblkno + blkno * fs->fs_frag);
+	error = bread(mnt->um_devvp, dd_lbn, fs->fs_bsize, NOCRED, &bp);
+	if (error != 0) {
+		printf("  bread error %d\n", error);
+		return (error);
+	}
+	*datap = bp->b_data;
+	*bufp = bp;
+	return (0);
+}
+
+/*
+ * Modified table blocks are written with bdwrite(), and remembered in dm_dirty
+ * so ddtable_writeback() can push them all out. Many table updates to the
+ * same block between two writebacks then cost a single write.
+ */
+static int
+ddtable_brelse_mnt(void *devfd, void *bufp, int dirty)
+{
+	struct ufsmount *mnt = devfd;
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	struct buf *bp = bufp;
+	int i;
+
+	if (!dirty) {
+		brelse(bp);
+		return (0);
+	}
+	mtx_lock(&dm->dm_flushlock);
+	for (i = 0; i < dm->dm_ndirty; i++) {
+		if (dm->dm_dirty[i] == bp->b_blkno)
+			break;
+	}
+	if (i == dm->dm_maxdirty) {
 		/*
-		 * If we didn't find anything AND we didn't
-		 * find a free spot, release the buffer.
+		 * Too many delayed table writes. Waiting for a writeback here could
+		 * deadlock on a buffer we hold, so write this one now. With an
+		 * intent log the change is already safe, and the next writeback
+		 * waits for the write to finish.
 		 */
-		if (!found) {
-			brelse(*bp);
+		mtx_unlock(&dm->dm_flushlock);
+		if (dm->dm_table.dt_nlog == 0)
+			return (bwrite(bp));
+		bawrite(bp);
+		return (0);
+	}
+	if (i == dm->dm_ndirty)
+		dm->dm_dirty[dm->dm_ndirty++] = bp->b_blkno;
+	mtx_unlock(&dm->dm_flushlock);
+	bdwrite(bp);
+	return (0);
+}
+
+/*
+ * Bucket lock stripes. Table blocks are read and written with them held, so
+ * they are sx locks. Two of them can be held at once (see ddfs_table.c).
+ */
+static void
+ddtable_lock_mnt(void *devfd, int stripe)
+{
+	struct ufsmount *mnt = devfd;
+
+	sx_xlock(&mnt->um_fs->fs_ddmount->dm_locks[stripe]);
+}
+
+static int
+ddtable_trylock_mnt(void *devfd, int stripe)
+{
+	struct ufsmount *mnt = devfd;
+
+	return (sx_try_xlock(&mnt->um_fs->fs_ddmount->dm_locks[stripe]));
+}
+
+static void
+ddtable_unlock_mnt(void *devfd, int stripe)
+{
+	struct ufsmount *mnt = devfd;
+
+	sx_xunlock(&mnt->um_fs->fs_ddmount->dm_locks[stripe]);
+}
+
+/*
+ * Write back the table blocks modified since the last writeback, and wait for
+ * the writes to complete. Called with dm_flushsx held, so that a writeback
+ * returning early cannot overtake writes still in progress in another one.
+ */
+static int
+ddtable_writeback(struct ufsmount *mnt)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm = fs->fs_ddmount;
+	struct bufobj *bo = &mnt->um_devvp->v_bufobj;
+	struct buf *bp;
+	daddr_t *blks;
+	int i, n, ret, error = 0;
+
+	sx_assert(&dm->dm_flushsx, SA_XLOCKED);
+	mtx_lock(&dm->dm_flushlock);
+	n = dm->dm_ndirty;
+	blks = dm->dm_dirty;
+	dm->dm_dirty = dm->dm_flushing;
+	dm->dm_flushing = blks;
+	dm->dm_ndirty = 0;
+	mtx_unlock(&dm->dm_flushlock);
+
+	/* start all of the writes, then wait for them */
+	for (i = 0; i < n; i++) {
+		bp = getblk(mnt->um_devvp, blks[i], fs->fs_bsize, 0, 0, 0);
+		/* the buffer daemon may have written it already */
+		if (bp->b_flags & B_DELWRI)
+			bawrite(bp);
+		else
+			brelse(bp);
+	}
+	for (i = 0; i < n; i++) {
+		bp = getblk(mnt->um_devvp, blks[i], fs->fs_bsize, 0, 0, 0);
+		/* a failed write leaves the buffer dirty, so retry it synchronously */
+		if (bp->b_flags & B_DELWRI) {
+			if ((ret = bwrite(bp)) != 0 && error == 0)
+				error = ret;
+		} else {
+			brelse(bp);
 		}
 	}
-	/* didn't find the entry */
-	error = 1;
-out:
-	/* if caller requested free spot, give it to them */
-	if (first_free != NULL) {
-		*first_free = freespot;
+	/* and for the writes started by ddtable_brelse_mnt when dm_dirty was full */
+	if (dm->dm_table.dt_nlog != 0) {
+		BO_LOCK(bo);
+		bufobj_wwait(bo, 0, 0);
+		BO_UNLOCK(bo);
+	}
+	return (error);
+}
+
+/*
+ * Record the new contents of `slot` in the fingerprint cache, and append them
+ * to the intent log block being filled, writing the block out first if it is
+ * full. The bucket of `slot` is locked, so both see the changes to a slot in
+ * the order they were made to the table.
+ */
+static int
+ddtable_log_mnt(void *devfd, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct ufsmount *mnt = devfd;
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	struct ddfs_loghdr *hdr = (struct ddfs_loghdr *)dm->dm_logdata;
+	struct ddfs_logrec rec;
+	int error = 0;
+
+	ddcache_update(&dm->dm_cache, slot, entry);
+	if (dm->dm_table.dt_nlog == 0)
+		return (0);
+	sx_xlock(&dm->dm_flushsx);
+	if (hdr->lh_nrec == DDFS_LOG_NRECS(dm->dm_table.dt_bsize))
+		error = ddtable_logwrite(mnt, false);
+	if (error == 0) {
+		rec.lr_slot = slot;
+		ddentry_encode(dm->dm_table.dt_format, rec.lr_entry, entry);
+		memcpy(dm->dm_logdata + sizeof(struct ddfs_loghdr) +
+		    hdr->lh_nrec * sizeof(struct ddfs_logrec), &rec, sizeof(rec));
+		hdr->lh_nrec++;
 	}
+	sx_xunlock(&dm->dm_flushsx);
 	return (error);
 }
 
 /*
- * Allocate a free space in the ddtable, or increment an existing key if found
+ * Write the log block being filled to its place in the log, and wait for it.
+ * Log blocks are never rewritten once written, so a torn write can only lose
+ * records that were not flushed yet. If the log is about to wrap over blocks
+ * whose changes may not be in the table yet, the table is written back first.
+ * An empty block is only written if `force` is set, to record a checkpoint.
+ * Called with dm_flushsx held.
+ */
+static int
+ddtable_logwrite(struct ufsmount *mnt, bool force)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm = fs->fs_ddmount;
+	struct ddtable *dt = &dm->dm_table;
+	struct ddfs_loghdr *hdr = (struct ddfs_loghdr *)dm->dm_logdata;
+	struct buf *bp;
+	daddr_t dbn;
+	int error;
+
+	sx_assert(&dm->dm_flushsx, SA_XLOCKED);
+	if (hdr->lh_nrec == 0 && !force)
+		return (0);
+	if (dm->dm_logseq - dm->dm_logckpt >= (uint64_t)dt->dt_nlog) {
+		if ((error = ddtable_writeback(mnt)) != 0)
+			return (error);
+		dm->dm_logckpt = dm->dm_logseq;
+	}
+	hdr->lh_magic = DDFS_LOG_MAGIC;
+	hdr->lh_seq = dm->dm_logseq;
+	hdr->lh_ckpt = dm->dm_logckpt;
+	ddtable_logseal(dt, dm->dm_logdata);
+	dbn = fsbtodb(fs, fs->fs_ddblkno +
+	    (dt->dt_logblk + dm->dm_logseq % dt->dt_nlog) * fs->fs_frag);
+	bp = getblk(mnt->um_devvp, dbn, fs->fs_bsize, 0, 0, 0);
+	memcpy(bp->b_data, dm->dm_logdata, fs->fs_bsize);
+	if ((error = bwrite(bp)) != 0)
+		return (error);
+	atomic_add_long(&ddtable_log_writes, 1);
+	dm->dm_logseq++;
+	bzero(dm->dm_logdata, fs->fs_bsize);
+	return (0);
+}
+
+/*
+ * Make the table updates so far durable before the inode or free block map
+ * updates that depend on them: append them to the intent log or, if the
+ * filesystem has none, write back the table blocks.
+ */
+int
+ddtable_flush(struct ufsmount *mnt)
+{
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	int error;
+
+	if (dm == NULL)
+		return (0);
+	sx_xlock(&dm->dm_flushsx);
+	if (dm->dm_table.dt_nlog != 0)
+		error = ddtable_logwrite(mnt, false);
+	else
+		error = ddtable_writeback(mnt);
+	sx_xunlock(&dm->dm_flushsx);
+	return (error);
+}
+
+/*
+ * Write back every modified table block, so that the intent log written so
+ * far is no longer needed, and record that in the log so the next mount has
+ * nothing to replay.
+ */
+int
+ddtable_checkpoint(struct ufsmount *mnt)
+{
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	int error = 0;
+
+	if (dm == NULL)
+		return (0);
+	sx_xlock(&dm->dm_flushsx);
+	/* replay must not roll back table blocks written with changes not logged yet */
+	if (dm->dm_table.dt_nlog != 0)
+		error = ddtable_logwrite(mnt, false);
+	if (error == 0)
+		error = ddtable_writeback(mnt);
+	if (error == 0 && dm->dm_table.dt_nlog != 0) {
+		dm->dm_logckpt = dm->dm_logseq;
+		error = ddtable_logwrite(mnt, true);
+	}
+	sx_xunlock(&dm->dm_flushsx);
+	return (error);
+}
+
+/* state of the table scan done by ddtable_mount */
+struct ddtable_scan {
+	struct ddfs_mount *ds_dm;
+	int ds_repair; /* repair the reverse index after an unclean unmount */
+	int ds_error;
+};
+
+static void
+ddtable_mount_scan(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct ddtable_scan *ds = arg;
+	struct ddfs_mount *dm = ds->ds_dm;
+	int error;
+
+	if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0) {
+		ddtable_freemap_set(&dm->dm_table, slot);
+		return;
+	}
+	ddbloom_add(&dm->dm_bloom, entry->key);
+	if (ds->ds_repair && ds->ds_error == 0 &&
+	    (error = ddtable_revrepair(&dm->dm_table, slot, entry)) != 0)
+		ds->ds_error = error;
+}
+
+/*
+ * Bring the in-core dedup state of a filesystem up to date with its table.
+ * The intent log is replayed into the table first, unless the filesystem is
+ * read-only. Filling the Bloom filter and the free bucket map then reads the
+ * whole table once. If the filesystem was not unmounted cleanly, the reverse
+ * index is also checked against the table, since their blocks are written
+ * back separately, and likewise if growddfs was interrupted after moving the
+ * table (fs_ddrevstale). Neither is repaired on a read-only filesystem.
+ */
+static int
+ddtable_load(struct ufsmount *mnt)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm = fs->fs_ddmount;
+	struct ddtable *dt = &dm->dm_table;
+	struct ddtable_scan ds;
+	uint64_t seq;
+	int error;
+
+	/* a read-only mount can neither replay the log nor append to it */
+	dt->dt_nlog = fs->fs_ronly != 0 ? 0 : fs->fs_ddlogfrags / fs->fs_frag;
+	error = ddtable_replay(dt, &seq);
+	dm->dm_logseq = seq;
+	dm->dm_logckpt = seq;
+	if (error == 0)
+		error = ddtable_checkpoint(mnt);
+	dt->dt_log = ddtable_log_mnt;
+
+	ds.ds_dm = dm;
+	/* growddfs moves every entry, and leaves the reverse index stale if interrupted */
+	ds.ds_repair = ((fs->fs_flags & FS_UNCLEAN) != 0 || fs->fs_ddrevstale != 0) &&
+	    fs->fs_ronly == 0;
+	ds.ds_error = 0;
+	if (error == 0)
+		error = ddtable_foreach(dt, ddtable_mount_scan, &ds);
+	if (error == 0)
+		error = ds.ds_error;
+	if (error == 0 && ds.ds_repair)
+		error = ddtable_checkpoint(mnt);
+	/* written to the disk with the superblock when the mount is finished */
+	if (error == 0 && ds.ds_repair)
+		fs->fs_ddrevstale = 0;
+	return (error);
+}
+
+/*
+ * Set up the in-core dedup state of a filesystem being mounted, and load it
+ * from the table (see ddtable_load).
+ */
+int
+ddtable_mount(struct ufsmount *mnt)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm;
+	struct ddtable *dt;
+	int error, i;
+
+	dm = malloc(sizeof(struct ddfs_mount), M_DDFS, M_WAITOK | M_ZERO);
+	dt = &dm->dm_table;
+	dt->dt_devfd = mnt;
+	dt->dt_bsize = fs->fs_bsize;
+	dt->dt_nbuckets = fs->fs_dedupfrags / fs->fs_frag;
+	dt->dt_nentries = ddtable_nentries(fs->fs_ddformat, fs->fs_bsize);
+	dt->dt_format = fs->fs_ddformat;
+	dt->dt_revblk = (fs->fs_ddrevblkno - fs->fs_ddblkno) / fs->fs_frag;
+	dt->dt_nrev = fs->fs_size;
+	dt->dt_logblk = (fs->fs_ddlogblkno - fs->fs_ddblkno) / fs->fs_frag;
+	dt->dt_nlog = fs->fs_ddlogfrags / fs->fs_frag;
+	dt->dt_bread = ddtable_bread_mnt;
+	dt->dt_brelse = ddtable_brelse_mnt;
+	dt->dt_nlocks = 1 << (flsl(imax(ddtable_locks, 1)) - 1);
+	dt->dt_lock = ddtable_lock_mnt;
+	dt->dt_trylock = ddtable_trylock_mnt;
+	dt->dt_unlock = ddtable_unlock_mnt;
+	dm->dm_locks = malloc(dt->dt_nlocks * sizeof(struct sx), M_DDFS,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < dt->dt_nlocks; i++)
+		sx_init_flags(&dm->dm_locks[i], "ddbucket", SX_DUPOK);
+	ddcache_init(&dm->dm_cache);
+	dt->dt_freemap = malloc(DDTABLE_FREEMAP_SIZE(dt), M_DDFS, M_WAITOK | M_ZERO);
+	ddbloom_init(&dm->dm_bloom, dt->dt_nbuckets * dt->dt_nentries);
+	mtx_init(&dm->dm_flushlock, "ddflush", NULL, MTX_DEF);
+	sx_init(&dm->dm_flushsx, "ddflushsx");
+	dm->dm_maxdirty = ddtable_flush_blocks;
+	dm->dm_dirty = malloc(imax(dm->dm_maxdirty, 1) * sizeof(daddr_t), M_DDFS, M_WAITOK);
+	dm->dm_flushing = malloc(imax(dm->dm_maxdirty, 1) * sizeof(daddr_t), M_DDFS,
+	    M_WAITOK);
+	dm->dm_logdata = malloc(fs->fs_bsize, M_DDFS, M_WAITOK | M_ZERO);
+	ddasync_init(&dm->dm_async, mnt->um_mountp);
+	/* repairs write through ddtable_brelse_mnt, which finds dm here */
+	fs->fs_ddmount = dm;
+
+	if ((error = ddtable_load(mnt)) != 0) {
+		ddtable_unmount(mnt);
+		return (error);
+	}
+	return (0);
+}
+
+/*
+ * Finish setting up the dedup state of a filesystem being upgraded from
+ * read-only to read-write. The table was read without the intent log, which a
+ * read-only mount cannot replay, so the log is replayed now and the free
+ * bucket map, the Bloom filter and the cache are built again from the table.
+ * The reverse index is repaired as at a read-write mount. On failure the
+ * filesystem is left as a read-only mount would have it.
+ */
+int
+ddtable_mount_rw(struct ufsmount *mnt)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm = fs->fs_ddmount;
+	struct ddtable *dt;
+	int error;
+
+	if (dm == NULL)
+		return (0);
+	dt = &dm->dm_table;
+	ddcache_destroy(&dm->dm_cache);
+	ddcache_init(&dm->dm_cache);
+	ddbloom_destroy(&dm->dm_bloom);
+	ddbloom_init(&dm->dm_bloom, dt->dt_nbuckets * dt->dt_nentries);
+	bzero(dt->dt_freemap, DDTABLE_FREEMAP_SIZE(dt));
+	dt->dt_nfree = 0;
+	if ((error = ddtable_load(mnt)) != 0)
+		dt->dt_nlog = 0;
+	return (error);
+}
+
+/*
+ * Tear down the in-core dedup state of a filesystem being unmounted.
+ */
+void
+ddtable_unmount(struct ufsmount *mnt)
+{
+	struct fs *fs = mnt->um_fs;
+	struct ddfs_mount *dm = fs->fs_ddmount;
+
+	if (dm == NULL)
+		return;
+	/* the table blocks stay on the device vnode, which is flushed on unmount */
+	ddtable_flush(mnt);
+	ddasync_destroy(&dm->dm_async);
+	ddbloom_destroy(&dm->dm_bloom);
+	ddcache_destroy(&dm->dm_cache);
+	sx_destroy(&dm->dm_flushsx);
+	mtx_destroy(&dm->dm_flushlock);
+	for (int i = 0; i < dm->dm_table.dt_nlocks; i++)
+		sx_destroy(&dm->dm_locks[i]);
+	free(dm->dm_locks, M_DDFS);
+	free(dm->dm_dirty, M_DDFS);
+	free(dm->dm_flushing, M_DDFS);
+	free(dm->dm_logdata, M_DDFS);
+	free(dm->dm_table.dt_freemap, M_DDFS);
+	free(dm, M_DDFS);
+	fs->fs_ddmount = NULL;
+}
+
+/*
+ * Allocate a free space in the ddtable, or increment an existing key if found.
+ * The fingerprint cache is checked first, so a cached key skips the table probe.
+ * A key the Bloom filter has never seen is inserted without searching the table.
+ * The Bloom filter is checked and updated with the home bucket of the key
+ * locked, so two threads cannot both take it for new. The cache is updated by
+ * ddtable_log_mnt.
  */
 int ddtable_alloc(struct ufsmount *mnt, uint8_t key[20], daddr_t in_block,
 		daddr_t *out_block)
 {
-	daddr_t block_idx, freespot;
-	struct buf *bp, *freebp;
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	struct ddtable *dt = &dm->dm_table;
 	struct ddfs_dedup entry;
+	int64_t slot, home;
+	int error = ENOENT;
 
-	int notfound = ddtable_locate(mnt, key, &bp, &block_idx, &freespot, &freebp, NULL);
-	if (notfound) {
-		printf("ddtable_alloc: allocating a new entry with block pointer %zu\n", in_block);
-		/* didn't find a match in the table, so allocate a new entry at the spot we saved */
-		entry.flags |= DDFS_DEDUP_ACTIVE;
-		entry.ref_count = 1;
-		entry.blockptr = in_block;
-		memcpy(entry.key, key, 20);
-		/* write the new entry to disk */
-		memcpy(freebp->b_data + freespot, &entry, sizeof(struct ddfs_dedup));
-		bwrite(freebp);
-		/* allocated a new entry, so out bptr == in bptr */
-		*out_block = entry.blockptr;
-	} else {
-		/* found a match. update refcount */
-		memcpy(&entry, bp->b_data + block_idx, sizeof(struct ddfs_dedup));
-		printf("ddtable_alloc: incrementing ref count on bno %zu\n", entry.blockptr);
-		entry.ref_count++;
-		*out_block = entry.blockptr;
-		/* update entry on disk */
-		memcpy(bp->b_data + block_idx, &entry, sizeof(struct ddfs_dedup));
-		bwrite(bp);
+	if (ddcache_findkey(&dm->dm_cache, key, &slot, &entry)) {
+		ddtable_lock(dt, DDTABLE_BUCKET(dt, slot));
+		error = ddtable_incref(dt, slot, key, &entry);
+		ddtable_unlock(dt, DDTABLE_BUCKET(dt, slot));
 	}
+	if (error == ENOENT) {
+		home = ddtable_bucket(dt, key);
+		ddtable_lock(dt, home);
+		if (ddbloom_query(&dm->dm_bloom, key) == 0) {
+			error = ddtable_insert(dt, key, in_block, &slot, &entry);
+		} else {
+			error = ddtable_ref(dt, key, in_block, &slot, &entry);
+			if (error == 0 && entry.ref_count == 1 && entry.blockptr == in_block)
+				ddbloom_falsepositive(&dm->dm_bloom);
+		}
+		if (error == 0 && entry.ref_count == 1 && entry.blockptr == in_block)
+			ddbloom_add(&dm->dm_bloom, key);
+		ddtable_unlock(dt, home);
+	}
+	if (error != 0) {
+		printf("ddtable_alloc: error %d, not deduplicating bno %zu\n", error, in_block);
+		/* keep the freshly written block as-is */
+		*out_block = in_block;
+		return (error);
+	}
+	*out_block = entry.blockptr;
+	if (*out_block == in_block)
+		printf("ddtable_alloc: allocated a new entry with block pointer %zu\n", in_block);
+	else
+		printf("ddtable_alloc: incremented ref count on bno %zu\n", *out_block);
 	return (0);
 }
 
 /*
  * Decrement a key-value pair in the ddtable.
  * Removes the entry from the table if refcount == 0.
- * Returns the updated refcount of the block, or -1 if not found.
- * If the refcount is 0, the caller is responsible for removing the block.
+ * Sets `refs` to the updated refcount of the block, or DDFS_REFS_PINNED if the
+ * entry is pinned, in which case the block must never be freed.
+ * Returns 0, ENOENT if the block has no entry, or an errno.
+ * If the refcount is 0, the caller is responsible for removing the block,
+ * after a ddtable_flush() so the table no longer points at it on disk.
  */
-int ddtable_unref(struct ufsmount *mnt, daddr_t blocknum)
+int ddtable_unref(struct ufsmount *mnt, daddr_t blocknum, uint32_t *refs)
 {
-	daddr_t block_idx;
-	struct buf *bp;
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	struct ddtable *dt = &dm->dm_table;
 	struct ddfs_dedup entry;
+	int64_t slot;
+	int error;
 
-	int notfound = ddtable_locate(mnt, NULL, &bp, &block_idx, NULL, NULL, &blocknum);
-	if (notfound)
-		return (-1);
+	if (!ddcache_findblk(&dm->dm_cache, blocknum, &slot, &entry) &&
+	    ddtable_findblk(dt, blocknum, &slot) != 0)
+		return (ENOENT);
+	ddtable_lock(dt, DDTABLE_BUCKET(dt, slot));
+	error = ddtable_deref(dt, slot, blocknum, &entry);
+	ddtable_unlock(dt, DDTABLE_BUCKET(dt, slot));
+	if (error != 0)
+		return (error);
+	if (entry.ref_count == 0)
+		ddbloom_remove(&dm->dm_bloom, entry.key);
+	*refs = DDTABLE_PINNED(dt, &entry) ? DDFS_REFS_PINNED : entry.ref_count;
+	return (0);
+}
 
-	/* found a match. update refcount */
-	memcpy(&entry, bp->b_data + block_idx, sizeof(struct ddfs_dedup));
-	if (--entry.ref_count == 0) {
-		/* ref count is now 0, so we delete this entry */
-		bzero(&entry, sizeof(struct ddfs_dedup));
-		entry.flags = DDFS_DEDUP_FREE;
-	}
-	/* update entry on disk */
-	memcpy(bp->b_data + block_idx, &entry, sizeof(struct ddfs_dedup));
-	bwrite(bp);
+/*
+ * Set `refs` to the refcount of the entry for `blocknum` in the ddtable, or
+ * DDFS_REFS_PINNED if it is pinned.
+ * Returns 0, ENOENT if the block has no entry, or an errno.
+ */
+int ddtable_refcount(struct ufsmount *mnt, daddr_t blocknum, uint32_t *refs)
+{
+	struct ddfs_mount *dm = mnt->um_fs->fs_ddmount;
+	struct ddtable *dt;
+	struct ddfs_dedup entry;
+	int64_t slot;
+	int error;
 
-	return (entry.ref_count);
+	if (dm == NULL)
+		return (ENOENT);
+	dt = &dm->dm_table;
+	if (!ddcache_findblk(&dm->dm_cache, blocknum, &slot, &entry)) {
+		if (ddtable_findblk(dt, blocknum, &slot) != 0)
+			return (ENOENT);
+		/* the cache must not get an older copy than a concurrent update gave it */
+		ddtable_lock(dt, DDTABLE_BUCKET(dt, slot));
+		error = ddtable_get(dt, slot, blocknum, &entry);
+		if (error == 0)
+			ddcache_update(&dm->dm_cache, slot, &entry);
+		ddtable_unlock(dt, DDTABLE_BUCKET(dt, slot));
+		if (error != 0)
+			return (error);
+	}
+	*refs = DDTABLE_PINNED(dt, &entry) ? DDFS_REFS_PINNED : entry.ref_count;
+	return (0);
 }
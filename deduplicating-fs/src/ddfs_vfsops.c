@@ -83,6 +83,8 @@ __FBSDID("$FreeBSD$");
 
 #include <ddb/ddb.h>
 
+#include "ddfs.h"
+
 static uma_zone_t uma_inode, uma_ufs1, uma_ufs2;
 VFS_SMR_DECLARE;
 
@@ -126,6 +128,7 @@ MODULE_VERSION(ddfs, 1);
 
 static b_strategy_t ffs_geom_strategy;
 static b_write_t ffs_bufwrite;
+static b_write_t ffs_dedup_bufwrite;
 
 static struct buf_ops ffs_ops = {
 	.bop_name =	"FFS",
@@ -139,6 +142,15 @@ static struct buf_ops ffs_ops = {
 #endif
 };
 
+/* XXX(ddfs): buffer ops of file vnodes, deduplicating file data as it is written */
+static struct buf_ops ffs_file_ops = {
+	.bop_name =	"DDFS file",
+	.bop_write =	ffs_dedup_bufwrite,
+	.bop_strategy =	bufstrategy,
+	.bop_sync =	bufsync,
+	.bop_bdflush =	bufbdflush,
+};
+
 /*
  * Note that userquota and groupquota options are not currently used
  * by UFS/FFS code and generally mount(8) does not pass those options
@@ -148,7 +160,8 @@ static struct buf_ops ffs_ops = {
 static const char *ffs_opts[] = { "acls", "async", "noatime", "noclusterr",
     "noclusterw", "noexec", "export", "force", "from", "groupquota",
     "multilabel", "nfsv4acls", "fsckpid", "snapshot", "nosuid", "suiddir",
-    "nosymfollow", "sync", "union", "userquota", "untrusted", NULL };
+    "nosymfollow", "sync", "union", "userquota", "untrusted",
+    "dedupasync", NULL };
 
 static int ffs_enxio_enable = 1;
 SYSCTL_DECL(_vfs_ffs);
@@ -485,6 +498,8 @@ ffs_mount(struct mount *mp)
 		}
 		if (fs->fs_ronly == 0 &&
 		    vfs_flagopt(mp->mnt_optnew, "ro", NULL, 0)) {
+			/* XXX(ddfs): the dedup worker writes, so stop it first */
+			ddasync_enable(&fs->fs_ddmount->dm_async, false);
 			/*
 			 * Flush any dirty data and suspend filesystem.
 			 */
@@ -518,6 +533,11 @@ ffs_mount(struct mount *mp)
 				fs->fs_pendingblocks = 0;
 				fs->fs_pendinginodes = 0;
 			}
+			/* XXX(ddfs): the dedup table must be on disk before it is marked clean */
+			if ((error = ddtable_checkpoint(ump)) != 0) {
+				vfs_write_resume(mp, 0);
+				return (error);
+			}
 			if ((fs->fs_flags & (FS_UNCLEAN | FS_NEEDSFSCK)) == 0)
 				fs->fs_clean = 1;
 			if ((error = ffs_sbupdate(ump, MNT_WAIT, 0)) != 0) {
@@ -622,6 +642,18 @@ ffs_mount(struct mount *mp)
 				vfs_write_resume(mp, 0);
 				return (error);
 			}
+			/*
+			 * XXX(ddfs): the read-only mount skipped the intent log
+			 * and the reverse index repair; catch up before writing.
+			 */
+			if ((error = ddtable_mount_rw(ump)) != 0) {
+				fs->fs_ronly = 1;
+				MNT_ILOCK(mp);
+				mp->mnt_flag |= saved_mnt_flag;
+				MNT_IUNLOCK(mp);
+				vfs_write_resume(mp, 0);
+				return (error);
+			}
 			fs->fs_clean = 0;
 			if ((error = ffs_sbupdate(ump, MNT_WAIT, 0)) != 0) {
 				fs->fs_ronly = 1;
@@ -811,6 +843,11 @@ ffs_mount(struct mount *mp)
 		mp->mnt_kern_flag |= MNTK_FPLOOKUP;
 	MNT_IUNLOCK(mp);
 
+	/* XXX(ddfs): deduplicate written blocks in the background if asked to */
+	ump = VFSTOUFS(mp);
+	ddasync_enable(&ump->um_fs->fs_ddmount->dm_async, ump->um_fs->fs_ronly == 0 &&
+	    vfs_getopt(mp->mnt_optnew, "dedupasync", NULL, NULL) == 0);
+
 	vfs_mountedfrom(mp, fspec);
 	return (0);
 }
@@ -1072,6 +1109,20 @@ ffs_mountfs(odevvp, mp, td)
 		loc = STDSB_NOHASHFAIL;
 	if ((error = ffs_sbget(devvp, &fs, loc, M_UFSMNT, ffs_use_bread)) != 0)
 		goto out;
+	/* XXX(ddfs): the dedup table must be laid out the way ddfs_table.c expects */
+	if (!DDFS_DDFORMAT_OK(fs->fs_ddformat)) {
+		vfs_mount_error(mp, "%s has dedup table format %d, expected %d to %d. "
+		    "Re-run newfs-ddfs, or upgradeddfs to finish an upgrade.",
+		    fs->fs_fsmnt, fs->fs_ddformat, DDFS_DDFORMAT_MIN, DDFS_DDFORMAT);
+		error = EINVAL;
+		goto out;
+	}
+	if (ddfs_fingerprint_name(fs->fs_ddfingerprint) == NULL) {
+		vfs_mount_error(mp, "%s has unknown block fingerprint algorithm %d",
+		    fs->fs_fsmnt, fs->fs_ddfingerprint);
+		error = EINVAL;
+		goto out;
+	}
 	fs->fs_flags &= ~FS_UNCLEAN;
 	if (fs->fs_clean == 0) {
 		fs->fs_flags |= FS_UNCLEAN;
@@ -1276,11 +1327,16 @@ ffs_mountfs(odevvp, mp, td)
 		mp->mnt_time = fs->fs_time;
 	}
 
+	/* XXX(ddfs): set up the dedup table state before any file I/O */
+	if ((error = ddtable_mount(ump)) != 0)
+		goto out;
+
 	if (ronly == 0) {
 		fs->fs_mtime = time_second;
 		if ((fs->fs_flags & FS_DOSOFTDEP) &&
 		    (error = softdep_mount(devvp, mp, fs, cred)) != 0) {
 			ffs_flushfiles(mp, FORCECLOSE, td);
+			ddtable_unmount(ump);
 			goto out;
 		}
 		if (fs->fs_snapinum[0] != 0)
@@ -1469,6 +1525,7 @@ ffs_unmount(mp, mntflags)
 	struct ufsmount *ump = VFSTOUFS(mp);
 	struct fs *fs;
 	int error, flags, susp;
+	bool dedupasync;
 #ifdef UFS_EXTATTR
 	int e_restart;
 #endif
@@ -1491,6 +1548,8 @@ ffs_unmount(mp, mntflags)
 		e_restart = 1;
 	}
 #endif
+	/* XXX(ddfs): finish the queued dedup work while files can still be written */
+	dedupasync = ddasync_enable(&fs->fs_ddmount->dm_async, false);
 	if (susp) {
 		error = vfs_write_suspend_umnt(mp);
 		if (error != 0)
@@ -1502,6 +1561,10 @@ ffs_unmount(mp, mntflags)
 		error = ffs_flushfiles(mp, flags, td);
 	if (error != 0 && !ffs_fsfail_cleanup(ump, error))
 		goto fail;
+	/* XXX(ddfs): the dedup table must be on disk before it is marked clean */
+	error = ddtable_checkpoint(ump);
+	if (error != 0 && !ffs_fsfail_cleanup(ump, error))
+		goto fail;
 
 	UFS_LOCK(ump);
 	if (fs->fs_pendingblocks != 0 || fs->fs_pendinginodes != 0) {
@@ -1555,6 +1618,7 @@ ffs_unmount(mp, mntflags)
 		free(mp->mnt_gjprovider, M_UFSMNT);
 		mp->mnt_gjprovider = NULL;
 	}
+	ddtable_unmount(ump);
 	free(fs->fs_csp, M_UFSMNT);
 	free(fs->fs_si, M_UFSMNT);
 	free(fs, M_UFSMNT);
@@ -1575,6 +1639,7 @@ fail:
 	if (susp)
 		vfs_write_resume(mp, VR_START_WRITE);
 fail1:
+	ddasync_enable(&fs->fs_ddmount->dm_async, dedupasync);
 #ifdef UFS_EXTATTR
 	if (e_restart) {
 		ufs_extattr_uepm_init(&ump->um_extattr);
@@ -1690,6 +1755,39 @@ ffs_statfs(mp, sbp)
 	return (0);
 }
 
+/*
+ * XXX(ddfs): free dedup table slots of the mounted filesystems. statfs(2)
+ * has no field for them, and its spare fields are not ours to fill.
+ */
+SYSCTL_DECL(_vfs_ddfs);
+
+static int
+sysctl_ddfs_table_free(SYSCTL_HANDLER_ARGS)
+{
+	struct mount *mp, *nmp;
+	struct ddfs_mount *dm;
+	u_long nfree = 0;
+
+	mtx_lock(&mountlist_mtx);
+	for (mp = TAILQ_FIRST(&mountlist); mp != NULL; mp = nmp) {
+		if (mp->mnt_vfc != &ddfs_vfsconf ||
+		    vfs_busy(mp, MBF_NOWAIT | MBF_MNTLSTLOCK) != 0) {
+			nmp = TAILQ_NEXT(mp, mnt_list);
+			continue;
+		}
+		if ((dm = VFSTOUFS(mp)->um_fs->fs_ddmount) != NULL)
+			nfree += dm->dm_table.dt_nfree;
+		mtx_lock(&mountlist_mtx);
+		nmp = TAILQ_NEXT(mp, mnt_list);
+		vfs_unbusy(mp);
+	}
+	mtx_unlock(&mountlist_mtx);
+	return (sysctl_handle_long(oidp, &nfree, 0, req));
+}
+SYSCTL_PROC(_vfs_ddfs, OID_AUTO, table_free,
+    CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0, sysctl_ddfs_table_free, "LU",
+    "Free and dead dedup table slots of the mounted filesystems");
+
 static bool
 sync_doupdate(struct inode *ip)
 {
@@ -1732,6 +1830,9 @@ ffs_sync_lazy(mp)
 
 	allerror = 0;
 	td = curthread;
+	/* XXX(ddfs): periodically make dedup table updates durable */
+	if ((error = ddtable_flush(VFSTOUFS(mp))) != 0)
+		allerror = error;
 	if ((mp->mnt_flag & MNT_NOATIME) != 0) {
 #ifdef QUOTA
 		qsync(mp);
@@ -1886,6 +1987,9 @@ loop:
 			goto loop;
 	}
 
+	/* XXX(ddfs): write back dedup table updates, and retire the intent log */
+	if ((error = ddtable_checkpoint(ump)) != 0)
+		allerror = error;
 	devvp = ump->um_devvp;
 	bo = &devvp->v_bufobj;
 	BO_LOCK(bo);
@@ -2005,6 +2109,7 @@ ffs_vgetf(mp, ino, flags, vpp, ffs_flags)
 	VN_LOCK_AREC(vp);
 	vp->v_data = ip;
 	vp->v_bufobj.bo_bsize = fs->fs_bsize;
+	vp->v_bufobj.bo_ops = &ffs_file_ops;
 	ip->i_vnode = vp;
 	ip->i_ump = ump;
 	ip->i_number = ino;
@@ -2587,6 +2692,24 @@ normal_write:
 	return (bufwrite(bp));
 }
 
+/*
+ * XXX(ddfs): Write a buffer of a file vnode, deduplicating the block of data
+ * it holds first (see ffs_dedup_buf). A block of zeros that became a hole is
+ * not written: the buffer is invalidated, and reads find the hole.
+ */
+static int
+ffs_dedup_bufwrite(struct buf *bp)
+{
+	if ((bp->b_flags & B_INVAL) == 0 && ffs_dedup_buf(bp)) {
+		bundirty(bp);
+		bp->b_flags |= B_INVAL | B_NOCACHE;
+		bp->b_flags &= ~B_CACHE;
+		brelse(bp);
+		return (0);
+	}
+	return (bufwrite(bp));
+}
+
 static void
 ffs_geom_strategy(struct bufobj *bo, struct buf *bp)
 {
@@ -2644,6 +2767,21 @@ ffs_geom_strategy(struct bufobj *bo, struct buf *bp)
 				}
 			}
 		}
+		/*
+		 * XXX(ddfs): an indirect block may point at deduplicated blocks
+		 * whose references are not on disk yet. Make them durable first,
+		 * like ffs_update does before writing an inode.
+		 */
+		if (bp->b_vp != NULL && bp->b_vp != vp &&
+		    bp->b_vp->v_mount != NULL && bp->b_lblkno < 0 &&
+		    (bp->b_xflags & BX_ALTDATA) == 0 &&
+		    (error = ddtable_flush(VFSTOUFS(bp->b_vp->v_mount))) != 0) {
+			bp->b_error = error;
+			bp->b_ioflags |= BIO_ERROR;
+			bp->b_flags &= ~B_BARRIER;
+			bufdone(bp);
+			return;
+		}
 #ifdef SOFTUPDATES
 		if ((bp->b_flags & B_CLUSTER) != 0) {
 			TAILQ_FOREACH(tbp, &bp->b_cluster.cluster_head,
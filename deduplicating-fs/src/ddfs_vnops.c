@@ -822,6 +822,21 @@ ffs_read(ap)
 	return (error);
 }
 
+/*
+ * XXX(ddfs): Deduplicate the full blocks ffs_write() has held back, hashing
+ * them together, and start writing them.
+ */
+static void
+ffs_write_batch(struct buf **batch, int *nbatch)
+{
+	if (*nbatch == 0)
+		return;
+	ffs_dedup_bufs(batch, *nbatch);
+	for (int i = 0; i < *nbatch; i++)
+		bawrite(batch[i]);
+	*nbatch = 0;
+}
+
 /*
  * Vnode op for writing.
  */
@@ -845,9 +860,8 @@ ffs_write(ap)
 	ssize_t resid;
 	int seqcount;
 	int blkoffset, error, flags, ioflag, size, xfersize;
-
-	struct ufsmount *ump;
-	struct ufs2_dinode *dp;
+	struct buf *batch[DDFS_WRITE_BATCH];
+	int nbatch;
 
 	vp = ap->a_vp;
 	if (DOINGSUJ(vp))
@@ -867,9 +881,6 @@ ffs_write(ap)
 	seqcount = ap->a_ioflag >> IO_SEQSHIFT;
 	ip = VTOI(vp);
 
-	ump = VFSTOUFS(vp->v_mount);
-	dp = ip->i_din2;
-
 #ifdef INVARIANTS
 	if (uio->uio_rw != UIO_WRITE)
 		panic("ffs_write: mode");
@@ -916,6 +927,7 @@ ffs_write(ap)
 		flags |= IO_SYNC;
 	flags |= BA_UNMAPPED;
 
+	nbatch = 0;
 	for (error = 0; uio->uio_resid > 0;) {
 		lbn = lblkno(fs, uio->uio_offset);
 		blkoffset = blkoff(fs, uio->uio_offset);
@@ -940,6 +952,13 @@ ffs_write(ap)
 			vnode_pager_setsize(vp, ip->i_size);
 			break;
 		}
+		/* XXX(ddfs): a block written out before may be shared with other files */
+		error = ffs_dedup_unshare(vp, bp, flags, ap->a_cred);
+		if (error != 0) {
+			brelse(bp);
+			vnode_pager_setsize(vp, ip->i_size);
+			break;
+		}
 		if ((ioflag & (IO_SYNC|IO_INVAL)) == (IO_SYNC|IO_INVAL))
 			bp->b_flags |= B_NOCACHE;
 
@@ -954,12 +973,11 @@ ffs_write(ap)
 			xfersize = size;
 
 		/*
-		 * XXX(ddfs): hash each 4k block in the buffer.
-		 * Can't use non-memory mapped buffer, since it is not (easily) possible to
-		 * read in the buffer from the page and memcpy it so we can hash it, and memcpy it
-		 * back to the buffer so we can write it.
-		 * The only easy solution was to modify ffs_balloc_ufs2 in ddfs_balloc.c to
-		 * remove the GB_UNMAPPED flag anywhere. This _forces_ the buffer for each file
+		 * XXX(ddfs): the block is hashed and deduplicated when the buffer is
+		 * written out (see ffs_dedup_buf), so each block is hashed once when it
+		 * goes to disk rather than on every write to it. Hashing needs a memory
+		 * mapped buffer, so ffs_balloc_ufs2 in ddfs_balloc.c does not use the
+		 * GB_UNMAPPED flag anywhere. This _forces_ the buffer for each file
 		 * to be memory mapped with an underlying vm_object
 		 */
 		if (!buf_mapped(bp)) {
@@ -971,27 +989,6 @@ ffs_write(ap)
 		/* write the new file */
 		error = vn_io_fault_uiomove(bp->b_data + blkoffset, xfersize, uio);
 
-		uint8_t hash[20];
-		char strhash[DDFS_KEY_STRLEN + 1];
-		hash_block(hash, bp->b_data + blkoffset, DDFS_BLOCKSIZE);
-		key_to_str(hash, strhash);
-		printf("got hash for new block: %s\n", strhash);
-
-		/* find hash in dedup table */
-		daddr_t newblk;
-		daddr_t oldblk = dp->di_db[lbn];
-		ddtable_alloc(ump, hash, oldblk, &newblk);
-		if (newblk != oldblk) {
-			/* we are deduplicating a block, so update block pointer in-place */
-			printf("updating block pointer: %zu -> %zu\n", oldblk, newblk);
-			dp->di_db[lbn] = newblk;
-			/* free up the "block" fragment that was allocated above */
-			ffs_blkfree(ump, fs, ump->um_devvp, oldblk, DDFS_BLOCKSIZE,
-				ip->i_number, vp->v_type, NULL, SINGLETON_KEY);
-			/* tell the system to fsync our newly modified inode */
-			UFS_INODE_SET_FLAG(ip, IN_MODIFIED | IN_NEEDSYNC);
-		}
-
 		/*
 		 * If the buffer is not already filled and we encounter an
 		 * error while trying to fill it, we have to clear out any
@@ -1018,36 +1015,34 @@ ffs_write(ap)
 		/*
 		 * If IO_SYNC each buffer is written synchronously.  Otherwise
 		 * if we have a severe page deficiency write the buffer
-		 * asynchronously.  Otherwise try to cluster, and if that
-		 * doesn't do it then either do an async write (if O_DIRECT),
-		 * or a delayed write (if not).
+		 * asynchronously.  Otherwise either do an async write (if the
+		 * block is full or O_DIRECT), or a delayed write (if not).
+		 *
+		 * XXX(ddfs): buffers are not clustered, since each block is
+		 * deduplicated on its own as it is written out, and may be
+		 * redirected away from the blocks next to it. Full blocks are
+		 * held until DDFS_WRITE_BATCH of them can be hashed together.
 		 */
 		if (ioflag & IO_SYNC) {
 			(void)bwrite(bp);
 		} else if (vm_page_count_severe() ||
 			    buf_dirty_count_severe() ||
 			    (ioflag & IO_ASYNC)) {
-			bp->b_flags |= B_CLUSTEROK;
 			bawrite(bp);
 		} else if (xfersize + blkoffset == fs->fs_bsize) {
-			if ((vp->v_mount->mnt_flag & MNT_NOCLUSTERW) == 0) {
-				bp->b_flags |= B_CLUSTEROK;
-				cluster_write(vp, bp, ip->i_size, seqcount,
-				    GB_UNMAPPED);
-			} else {
-				bawrite(bp);
-			}
+			batch[nbatch++] = bp;
+			if (nbatch == DDFS_WRITE_BATCH)
+				ffs_write_batch(batch, &nbatch);
 		} else if (ioflag & IO_DIRECT) {
-			bp->b_flags |= B_CLUSTEROK;
 			bawrite(bp);
 		} else {
-			bp->b_flags |= B_CLUSTEROK;
 			bdwrite(bp);
 		}
 		if (error || xfersize == 0)
 			break;
 		UFS_INODE_SET_FLAG(ip, IN_CHANGE | IN_UPDATE);
 	}
+	ffs_write_batch(batch, &nbatch);
 	/*
 	 * If we successfully wrote any data, and we are not the superuser
 	 * we clear the setuid and setgid bits as a precaution against
@@ -0,0 +1,379 @@
+// Crash consistency test for the dedup table write ordering.
+// Runs the dedup table code from src/ddfs_table.c against a small image file,
+// with a write-back cache in front of it that follows the same rules as the
+// kernel module: table blocks get delayed writes, every table change is
+// appended to the intent log, and the log is written before an inode that may
+// point at a deduplicated block is written and before a block whose last
+// reference was dropped is freed. Any other dirty block may be written at any
+// time, like the buffer daemon would. The log is small, so it wraps often.
+//
+// Each cycle does random file writes on a fresh image, then "loses power" by
+// throwing away everything not yet written, replays the log, and checks the
+// table against the inode that made it to disk: every block the inode points
+// at must have an entry whose refcount is at least the number of pointers to
+// it. Then it recovers the way ddtable_mount and fsck do after an unclean
+// unmount, and writes some more.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ddfs.h"
+
+#define BLOCK_SIZE 4096
+#define NBUCKETS 16                               // table blocks
+#define NDATA 4096                                // data blocks, block 0 is never used
+#define NREV (NDATA * 8 / BLOCK_SIZE)             // reverse index blocks
+#define NPTRS (BLOCK_SIZE / (int)sizeof(int64_t)) // block pointers in the inode
+#define NCONTENTS 300                             // distinct block contents written
+
+// image layout, in blocks
+#define TABLE_BLK 0
+#define REV_BLK (TABLE_BLK + NBUCKETS)
+#define LOG_BLK (REV_BLK + NREV)
+#define NLOG 8 // intent log blocks
+#define INODE_BLK (LOG_BLK + NLOG)
+#define CG_BLK (INODE_BLK + 1) // one byte per data block, 1 if allocated
+#define NBLOCKS (CG_BLK + 1)
+
+static int img_fd;
+static uint8_t cache[NBLOCKS][BLOCK_SIZE]; // every block of the image
+static bool dirty[NBLOCKS];                // modified, not written yet
+static bool table_dirty[NBLOCKS];          // table blocks to write on the next flush
+static int64_t inode[NPTRS];               // in-core copy of the inode
+static int64_t pending_free[NPTRS];        // blocks to free once the inode is written
+static int npending;
+static uint8_t logdata[BLOCK_SIZE];        // log block being filled, like dm_logdata
+static uint64_t logseq, logckpt;
+
+static void disk_write(int blk) {
+    if (pwrite(img_fd, cache[blk], BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) != BLOCK_SIZE) {
+        printf("crash_test() -> pwrite: exiting with error number %d\n", errno);
+        exit(1);
+    }
+    dirty[blk] = false;
+    table_dirty[blk] = false;
+}
+
+// lose everything that was not written to the image
+static void power_loss(void) {
+    if (pread(img_fd, cache, sizeof(cache), 0) != (ssize_t)sizeof(cache)) {
+        printf("crash_test() -> pread: exiting with error number %d\n", errno);
+        exit(1);
+    }
+    memset(dirty, 0, sizeof(dirty));
+    memset(table_dirty, 0, sizeof(table_dirty));
+    memcpy(inode, cache[INODE_BLK], sizeof(inode));
+    npending = 0;
+    memset(logdata, 0, sizeof(logdata));
+}
+
+// table callbacks: table blocks are delayed writes, like ddtable_brelse_mnt
+static int cache_bread(void *devfd, int64_t blkno, void **datap, void **bufp) {
+    (void)devfd;
+    *datap = cache[TABLE_BLK + blkno];
+    *bufp = cache[TABLE_BLK + blkno];
+    return 0;
+}
+
+static int cache_brelse(void *devfd, void *bufp, int isdirty) {
+    (void)devfd;
+    int blk = ((uint8_t(*)[BLOCK_SIZE])bufp - cache);
+    if (isdirty) {
+        dirty[blk] = true;
+        table_dirty[blk] = true;
+    }
+    return 0;
+}
+
+// ddtable_writeback
+static void table_writeback(void) {
+    for (int blk = 0; blk < NBLOCKS; blk++) {
+        if (table_dirty[blk]) {
+            disk_write(blk);
+        }
+    }
+}
+
+// ddtable_logwrite
+static void log_write(struct ddtable *dt, bool force) {
+    struct ddfs_loghdr *hdr = (struct ddfs_loghdr *)logdata;
+    if (hdr->lh_nrec == 0 && !force) {
+        return;
+    }
+    if (logseq - logckpt >= NLOG) {
+        table_writeback();
+        logckpt = logseq;
+    }
+    hdr->lh_magic = DDFS_LOG_MAGIC;
+    hdr->lh_seq = logseq;
+    hdr->lh_ckpt = logckpt;
+    ddtable_logseal(dt, logdata);
+    int blk = LOG_BLK + logseq % NLOG;
+    memcpy(cache[blk], logdata, BLOCK_SIZE);
+    disk_write(blk);
+    logseq++;
+    memset(logdata, 0, sizeof(logdata));
+}
+
+// ddtable_log_mnt, the dt_log callback
+static int log_append(void *devfd, int64_t slot, const struct ddfs_dedup *entry) {
+    struct ddtable *dt = devfd;
+    struct ddfs_loghdr *hdr = (struct ddfs_loghdr *)logdata;
+    if (hdr->lh_nrec == DDFS_LOG_NRECS(BLOCK_SIZE)) {
+        log_write(dt, false);
+    }
+    struct ddfs_logrec rec = {.lr_slot = slot};
+    ddentry_encode(dt->dt_format, rec.lr_entry, entry);
+    memcpy(logdata + sizeof(*hdr) + hdr->lh_nrec * sizeof(rec), &rec, sizeof(rec));
+    hdr->lh_nrec++;
+    return 0;
+}
+
+// ddtable_flush
+static void table_flush(struct ddtable *dt) {
+    log_write(dt, false);
+}
+
+// ddtable_checkpoint
+static void checkpoint(struct ddtable *dt) {
+    log_write(dt, false);
+    table_writeback();
+    logckpt = logseq;
+    log_write(dt, true);
+}
+
+// the buffer daemon writes out some dirty block
+static void bufdaemon(void) {
+    int blk = rand() % NBLOCKS;
+    if (dirty[blk]) {
+        disk_write(blk);
+    }
+}
+
+// stands in for the SHA-1 of a block, distinct for every content
+static void make_key(int content, uint8_t key[20]) {
+    uint32_t h = (content + 1) * 2654435761u;
+    for (int i = 0; i < 20; i++) {
+        key[i] = (uint8_t)(h >> (i % 4 * 8)) ^ (uint8_t)(i * 37);
+    }
+}
+
+static int64_t cg_alloc(void) {
+    for (int64_t b = 1; b < NDATA; b++) {
+        if (cache[CG_BLK][b] == 0) {
+            cache[CG_BLK][b] = 1;
+            dirty[CG_BLK] = true;
+            return b;
+        }
+    }
+    return 0;
+}
+
+static void cg_free(int64_t b) {
+    cache[CG_BLK][b] = 0;
+    dirty[CG_BLK] = true;
+}
+
+// ffs_blkfree: drop a reference, and only free the block with the last one
+static void blkfree(struct ddtable *dt, int64_t b) {
+    struct ddfs_dedup entry;
+    int64_t slot;
+    if (ddtable_findblk(dt, b, &slot) == 0 && ddtable_deref(dt, slot, b, &entry) == 0) {
+        if (entry.ref_count > 0) {
+            return;
+        }
+        // the table is flushed before the block can be reused
+        table_flush(dt);
+    }
+    cg_free(b);
+}
+
+// ffs_update: the table goes to disk before the inode, and blocks the inode
+// no longer points at are freed after it (like ffs_truncate)
+static void update_inode(struct ddtable *dt) {
+    table_flush(dt);
+    memcpy(cache[INODE_BLK], inode, sizeof(inode));
+    disk_write(INODE_BLK);
+    for (int i = 0; i < npending; i++) {
+        blkfree(dt, pending_free[i]);
+    }
+    npending = 0;
+}
+
+// ffs_write of one block, deduplicated by ddtable_alloc
+static void write_block(struct ddtable *dt, int lbn, int content) {
+    struct ddfs_dedup entry;
+    uint8_t key[20];
+    int64_t b = cg_alloc();
+    if (b == 0 || npending == NPTRS) {
+        return;
+    }
+    make_key(content, key);
+    if (ddtable_ref(dt, key, b, NULL, &entry) != 0) {
+        cg_free(b);
+        return;
+    }
+    if (entry.blockptr != b) {
+        // deduplicated: the new block was never referenced
+        cg_free(b);
+    }
+    if (inode[lbn] != 0) {
+        pending_free[npending++] = inode[lbn];
+    }
+    inode[lbn] = entry.blockptr;
+}
+
+static void mkimage(const char *path, const struct ddtable *dt) {
+    memset(cache, 0, sizeof(cache));
+    for (int blk = TABLE_BLK; blk < TABLE_BLK + NBUCKETS; blk++) {
+        ddtable_initblock(dt, cache[blk]);
+    }
+    img_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (img_fd < 0) {
+        printf("crash_test() -> open: exiting with error number %d\n", errno);
+        exit(1);
+    }
+    for (int blk = 0; blk < NBLOCKS; blk++) {
+        disk_write(blk);
+    }
+    power_loss();
+    logseq = logckpt = 1;
+}
+
+// what ddtable_mount does first: replay the log, with logging turned off
+static void replay(struct ddtable *dt) {
+    uint64_t seq;
+    dt->dt_log = NULL;
+    if (ddtable_replay(dt, &seq) != 0) {
+        printf("crash_test() -> ddtable_replay failed\n");
+        exit(1);
+    }
+    logseq = logckpt = seq;
+}
+
+// recovery after power loss, run on every slot of the table
+static void recover(void *arg, int64_t slot, const struct ddfs_dedup *entry) {
+    if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0) {
+        return;
+    }
+    // what ddtable_mount does after an unclean unmount
+    if (ddtable_revrepair(arg, slot, entry) != 0) {
+        printf("crash_test() -> ddtable_revrepair failed on slot %lld\n", (long long)slot);
+        exit(1);
+    }
+    // and what fsck has to do: blocks held by the table are in use, even if
+    // the inodes referencing them were lost
+    cache[CG_BLK][entry->blockptr] = 1;
+}
+
+// fsck rebuilds the block map from the inode and the table
+static void fsck(struct ddtable *dt) {
+    memset(cache[CG_BLK], 0, BLOCK_SIZE);
+    for (int lbn = 0; lbn < NPTRS; lbn++) {
+        cache[CG_BLK][inode[lbn]] = 1;
+    }
+    ddtable_foreach(dt, recover, dt);
+    checkpoint(dt);
+    disk_write(CG_BLK);
+    dt->dt_log = log_append;
+}
+
+// check the table against the inode on disk, returns the number of problems
+static int verify(struct ddtable *dt, int cycle) {
+    struct ddfs_dedup entry;
+    int64_t slot;
+    int errors = 0;
+    for (int lbn = 0; lbn < NPTRS; lbn++) {
+        int64_t b = inode[lbn];
+        if (b == 0) {
+            continue;
+        }
+        int refs = 0;
+        for (int i = 0; i < NPTRS; i++) {
+            refs += inode[i] == b;
+        }
+        if (ddtable_findblk(dt, b, &slot) != 0) {
+            printf("cycle %d: block %lld of lbn %d has no dedup entry\n", cycle,
+                   (long long)b, lbn);
+            errors++;
+            continue;
+        }
+        void *data, *bp;
+        cache_bread(NULL, DDTABLE_BUCKET(dt, slot), &data, &bp);
+        ddtable_getentry(dt, data, DDTABLE_IDX(dt, slot), &entry);
+        if (!(entry.flags & DDFS_DEDUP_ACTIVE) || entry.blockptr != b) {
+            printf("cycle %d: reverse index of block %lld points at the wrong slot\n", cycle,
+                   (long long)b);
+            errors++;
+        } else if (entry.ref_count < (uint32_t)refs) {
+            printf("cycle %d: block %lld has refcount %u but %d references\n", cycle,
+                   (long long)b, entry.ref_count, refs);
+            errors++;
+        } else if (ddtable_lookup(dt, entry.key, &slot, NULL) != 0) {
+            printf("cycle %d: key of block %lld not found by lookup\n", cycle, (long long)b);
+            errors++;
+        }
+    }
+    return errors;
+}
+
+int main(int argc, char const *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "crash_test.img";
+    int cycles = argc > 2 ? atoi(argv[2]) : 100;
+    srand(argc > 3 ? atoi(argv[3]) : 1);
+
+    struct ddtable dt;
+    memset(&dt, 0, sizeof(dt));
+    dt.dt_bsize = BLOCK_SIZE;
+    dt.dt_nbuckets = NBUCKETS;
+    dt.dt_nentries = ddtable_nentries(DDFS_DDFORMAT, BLOCK_SIZE);
+    dt.dt_format = DDFS_DDFORMAT;
+    dt.dt_revblk = REV_BLK - TABLE_BLK;
+    dt.dt_nrev = NDATA;
+    dt.dt_logblk = LOG_BLK - TABLE_BLK;
+    dt.dt_nlog = NLOG;
+    dt.dt_devfd = &dt;
+    dt.dt_bread = cache_bread;
+    dt.dt_brelse = cache_brelse;
+    dt.dt_log = log_append;
+
+    int errors = 0;
+    for (int cycle = 0; cycle < cycles; cycle++) {
+        mkimage(path, &dt);
+        // two crashes per image, so writes after a recovery are exercised too
+        for (int crash = 0; crash < 2; crash++) {
+            int steps = 1 + rand() % 3000;
+            for (int i = 0; i < steps; i++) {
+                write_block(&dt, rand() % NPTRS, rand() % NCONTENTS);
+                if (rand() % 50 == 0) {
+                    update_inode(&dt);
+                }
+                if (rand() % 3 == 0) {
+                    bufdaemon();
+                }
+                if (rand() % 500 == 0) {
+                    // ffs_sync
+                    checkpoint(&dt);
+                }
+            }
+            power_loss();
+            replay(&dt);
+            errors += verify(&dt, cycle);
+            fsck(&dt);
+        }
+        close(img_fd);
+    }
+    unlink(path);
+    if (errors > 0) {
+        printf("crash_test failed: %d errors in %d cycles\n", errors, cycles);
+        return 1;
+    }
+    printf("crash_test passed: %d cycles\n", cycles);
+    return 0;
+}
@@ -55,9 +55,9 @@ int main(int argc, char const *argv[]) {
     print_result(ret, test_str, &count);
 
     // Intiate edge case tests.
-    // ret = test_max("test_max", flags); // max file size test
-    // test_str = "test_max";
-    // print_result(ret, test_str, &count);
+    ret = test_max("/mnt/test_max", flags); // large file test
+    test_str = "test_max";
+    print_result(ret, test_str, &count);
 
     ret = test_enoent();  // removing a file twice test
     test_str = "test_enoent";
@@ -73,7 +73,7 @@ int main(int argc, char const *argv[]) {
     // }
 
     // Display results.
-    printf("Total number of tests passed: %d/%d\n", count, 8);
+    printf("Total number of tests passed: %d/%d\n", count, 9);
 
     return 0;
 }
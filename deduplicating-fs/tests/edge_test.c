@@ -2,6 +2,9 @@
 // Includes things like writing more than the max file size, opening files with
 // wrong permissions, etc.
 
+#include <sys/param.h>
+#include <sys/mount.h>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -11,27 +14,83 @@
 
 #include "edge_test.h"
 
-// According to the assignment spec, the max file size is "slightly over 32 GiB"
-// Doing the math, this works out to exactly 32.545 GiB as a max file size.
-// This test simply check to see if this max file size is enforced.
+// Large file test. Writes the same block at offsets mapped by the direct block
+// pointers and by the single, double and triple indirect blocks (up to 33 GiB,
+// past what the assignment spec calls the max file size), and reads them all
+// back. Every block after the first deduplicates against it, so the file must
+// only use a handful of blocks of free space, mostly indirect blocks.
 int test_max(char *path, int flags) {
-    // open a file
-    int ret = open(path, flags);
-    if (ret < 0) {
+    // block numbers: last direct, first single indirect, last single indirect,
+    // first double indirect, first triple indirect, and the one at 33 GiB
+    const off_t blocks[] = {
+        0,
+        SIZE_NDADDR - 1,
+        SIZE_NDADDR,
+        SIZE_NDADDR + SIZE_NINDIR - 1,
+        SIZE_NDADDR + SIZE_NINDIR,
+        SIZE_NDADDR + SIZE_NINDIR + SIZE_NINDIR * SIZE_NINDIR,
+        33 * (SIZE_GIGA / SIZE_BLOCK),
+    };
+    const int nblocks = sizeof(blocks) / sizeof(blocks[0]);
+    char block[SIZE_BLOCK];
+    char readback[SIZE_BLOCK];
+    struct statfs before, after;
+
+    int fd = open(path, flags, 0644);
+    if (fd < 0) {
         printf("test_max() -> open: exiting with error number %d\n", errno);
-        return ret;
+        return fd;
+    }
+    if (fstatfs(fd, &before) < 0) {
+        printf("test_max() -> fstatfs: exiting with error number %d\n", errno);
+        close(fd);
+        return -1;
+    }
+    memset(block, 'a', SIZE_BLOCK);
+    for (int i = 0; i < nblocks; i++) {
+        if (pwrite(fd, block, SIZE_BLOCK, blocks[i] * SIZE_BLOCK) != SIZE_BLOCK) {
+            printf("test_max() -> pwrite: block %lld, exiting with error number %d\n",
+                   (long long)blocks[i], errno);
+            close(fd);
+            return -1;
+        }
+    }
+    // push the indirect blocks out, so their block pointers are read back from disk
+    if (fsync(fd) < 0 || fstatfs(fd, &after) < 0) {
+        printf("test_max() -> fsync: exiting with error number %d\n", errno);
+        close(fd);
+        return -1;
     }
-    // Try to write 33 Gib of data to a single file
-    for (int i = 0; i < 33; i++) {
-        char *massive = calloc(SIZE_GIGA, sizeof(char));
-        memset(massive, 'a', SIZE_GIGA);
-        int err = write(ret, massive, SIZE_GIGA);
-        if (err) {
-            printf("Iteration: %d\n", i);
-            printf("test_max() -> write: exiting with error number %d\n", errno);
-            return err;
+    for (int i = 0; i < nblocks; i++) {
+        if (pread(fd, readback, SIZE_BLOCK, blocks[i] * SIZE_BLOCK) != SIZE_BLOCK ||
+            memcmp(readback, block, SIZE_BLOCK) != 0) {
+            printf("test_max() -> pread: block %lld does not match what was written\n",
+                   (long long)blocks[i]);
+            close(fd);
+            return -1;
         }
-        free(massive);
+    }
+    // a hole between two written blocks must still read as zeros
+    memset(block, 0, SIZE_BLOCK);
+    if (pread(fd, readback, SIZE_BLOCK, (SIZE_NDADDR + 1) * SIZE_BLOCK) != SIZE_BLOCK ||
+        memcmp(readback, block, SIZE_BLOCK) != 0) {
+        printf("test_max() -> pread: hole does not read as zeros\n");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    // one data block, and 8 indirect blocks for the offsets above: the single
+    // indirect, the double indirect and its first child, the triple indirect
+    // and its first two levels, and two more under triple index 31 for the
+    // block at 33 GiB. signed, as blocks freed meanwhile can make it negative
+    long long used = (long long)before.f_bfree - (long long)after.f_bfree;
+    if (used > 9) {
+        printf("test_max() -> %lld blocks used, blocks were not deduplicated\n", used);
+        return -1;
+    }
+    if (unlink(path) < 0) {
+        printf("test_max() -> unlink: exiting with error number %d\n", errno);
+        return -1;
     }
     return 0;
 }
@@ -1,6 +1,9 @@
 // Header file for edge_test.c
 
 #define SIZE_GIGA 1073741824 // number of bytes in a gigabyte
+#define SIZE_BLOCK 4096      // ddfs block size
+#define SIZE_NDADDR 12       // direct block pointers in an inode
+#define SIZE_NINDIR (SIZE_BLOCK / 8) // block pointers in an indirect block
 
 // Function declarations
 int test_max(char *path, int flags);
@@ -0,0 +1,66 @@
+// Benchmark for freeing deduplicated blocks.
+// Writes a file of unique 4k blocks to /mnt, then times how long it takes to
+// remove it. Every freed block drops a reference in the dedup table, so this
+// measures the cost of ddtable_unref. Run it against the old and new module
+// to compare.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PATH "/mnt/rm_bench.dat"
+#define BLOCK_SIZE 4096
+#define SIZE_MEGA 1048576
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char const *argv[]) {
+    // file size in MiB, 1GiB by default
+    long size_mb = 1024;
+    if (argc > 1) {
+        size_mb = strtol(argv[1], NULL, 10);
+    }
+    long nblocks = size_mb * (SIZE_MEGA / BLOCK_SIZE);
+
+    int fd = open(BENCH_PATH, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        printf("rm_bench() -> open: exiting with error number %d\n", errno);
+        return 1;
+    }
+    // tag each block with its block number so no two blocks deduplicate, over
+    // a non-zero fill so that block 0 is not all zeros, which would be a hole
+    uint64_t block[BLOCK_SIZE / sizeof(uint64_t)];
+    memset(block, 0xa5, sizeof(block));
+    double start = now();
+    for (long i = 0; i < nblocks; i++) {
+        block[0] = i;
+        if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+            printf("rm_bench() -> write: exiting with error number %d\n", errno);
+            return 1;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    double written = now();
+    printf("wrote %ld blocks (%ld MiB) in %.3f s\n", nblocks, size_mb, written - start);
+
+    start = now();
+    if (unlink(BENCH_PATH) < 0) {
+        printf("rm_bench() -> unlink: exiting with error number %d\n", errno);
+        return 1;
+    }
+    sync();
+    double removed = now() - start;
+    printf("removed %ld MiB in %.3f s (%.1f us per block)\n", size_mb, removed,
+        removed * 1e6 / nblocks);
+    return 0;
+}
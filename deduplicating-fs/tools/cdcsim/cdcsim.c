@@ -0,0 +1,341 @@
+/*
+ * cdcsim: estimate how much more of a set of files content-defined chunking
+ * would deduplicate than the fixed 4KiB blocks of ddfs.
+ *
+ * Every regular file under the given paths is split two ways:
+ *
+ * - into DDFS_BLOCKSIZE blocks, deduplicated the way ddfs does it: only full
+ *   blocks are shared, and a file's partial last block is always stored;
+ * - into variable-size chunks whose boundaries are picked by the content,
+ *   with FastCDC: a gear hash is rolled over the data, and a chunk ends where
+ *   the bits of the hash picked by a mask are all zero. A stricter mask is used before the average size
+ *   and a looser one after it, which keeps chunk sizes close to the average.
+ *   Chunks are at least `min` and at most `max` bytes long.
+ *
+ * An insertion or deletion moves every fixed block boundary after it, but the
+ * content-defined boundaries come back in step a few chunks later, so files
+ * that differ by small edits still share most of their chunks.
+ *
+ * Chunks and blocks are fingerprinted with the ddfs algorithm given by -H, and
+ * counted in an in-memory table of their keys. Stored bytes are the sum of the
+ * sizes of the distinct chunks; the metadata estimate is a dedup table entry
+ * per distinct chunk plus a chunk map entry per chunk of each file, since
+ * variable-size chunks could not be found through the inode's block pointers.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ddfs.h"
+
+/* bytes read from a file at once */
+#define READ_SIZE (1 << 20)
+
+/* chunk map entry per chunk: 64-bit block pointer and 32-bit offset and length */
+#define CHUNKMAP_ENTRY 16
+
+/* a distinct chunk */
+struct chunkent {
+	uint8_t key[20];
+	uint32_t size; /* 0 if the slot is empty */
+};
+
+/* distinct chunks of one way of splitting the files */
+struct chunkset {
+	struct chunkent *ents;
+	uint64_t nslots, nents;
+	uint64_t chunks;       /* chunks seen */
+	uint64_t stored;       /* bytes in distinct chunks */
+	uint64_t unshareable;  /* bytes stored without being looked up (partial blocks) */
+};
+
+static uint64_t gear[256];
+static size_t cdc_min = DDFS_BLOCKSIZE / 4, cdc_avg = DDFS_BLOCKSIZE,
+    cdc_max = DDFS_BLOCKSIZE * 4;
+static uint64_t mask_s, mask_l;
+static int fp = DDFS_FP_SHA1;
+
+static void
+usage(void)
+{
+	printf("cdcsim [-H algorithm] [-m min] [-a avg] [-M max] path ...\n");
+	printf("-H algorithm\t\tfingerprint algorithm, as for newfs-ddfs -H (default sha1)\n");
+	printf("-a avg\t\t\taverage chunk size, a power of 2 (default %d)\n", DDFS_BLOCKSIZE);
+	printf("-m min\t\t\tsmallest chunk (default avg / 4)\n");
+	printf("-M max\t\t\tlargest chunk (default avg * 4)\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* splitmix64, used to fill the gear table */
+static uint64_t
+splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+/* a mask of the `bits` top bits, which depend on the last 64 bytes rolled in */
+static uint64_t
+topmask(int bits)
+{
+	return (~0ULL << (64 - bits));
+}
+
+/*
+ * Length of the chunk starting at `p`, of which `n` bytes are available.
+ * Returns `n` if no boundary is found in them before `cdc_max`.
+ */
+static size_t
+cdc_cut(const uint8_t *p, size_t n)
+{
+	uint64_t h = 0;
+	size_t i, normal;
+
+	if (n <= cdc_min)
+		return (n);
+	if (n > cdc_max)
+		n = cdc_max;
+	normal = n < cdc_avg ? n : cdc_avg;
+	for (i = cdc_min; i < normal; i++) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & mask_s) == 0)
+			return (i + 1);
+	}
+	for (; i < n; i++) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & mask_l) == 0)
+			return (i + 1);
+	}
+	return (n);
+}
+
+static void
+chunkset_init(struct chunkset *cs)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->nslots = 1 << 16;
+	if ((cs->ents = calloc(cs->nslots, sizeof(*cs->ents))) == NULL)
+		err(1, "chunk table");
+}
+
+/* slot of `key` in `ents`, or of the empty slot it would go into */
+static uint64_t
+chunkset_slot(const struct chunkent *ents, uint64_t nslots, const uint8_t key[20])
+{
+	uint64_t h;
+
+	memcpy(&h, key, sizeof(h));
+	for (h &= nslots - 1; ents[h].size != 0; h = (h + 1) & (nslots - 1))
+		if (memcmp(ents[h].key, key, 20) == 0)
+			break;
+	return (h);
+}
+
+/* count a chunk of `size` bytes at `p`, storing it if it was not seen before */
+static void
+chunkset_add(struct chunkset *cs, const uint8_t *p, size_t size)
+{
+	struct chunkent *ents;
+	uint8_t key[20];
+	uint64_t s;
+	int error;
+
+	if ((error = ddfs_fingerprint(fp, p, size, key)) != 0)
+		errx(1, "fingerprint: %s", strerror(error));
+	cs->chunks++;
+	s = chunkset_slot(cs->ents, cs->nslots, key);
+	if (cs->ents[s].size != 0)
+		return;
+	memcpy(cs->ents[s].key, key, 20);
+	cs->ents[s].size = size;
+	cs->nents++;
+	cs->stored += size;
+	/* keep the table at most half full */
+	if (cs->nents * 2 <= cs->nslots)
+		return;
+	if ((ents = calloc(cs->nslots * 2, sizeof(*ents))) == NULL)
+		err(1, "chunk table");
+	for (uint64_t i = 0; i < cs->nslots; i++)
+		if (cs->ents[i].size != 0)
+			ents[chunkset_slot(ents, cs->nslots * 2, cs->ents[i].key)] = cs->ents[i];
+	free(cs->ents);
+	cs->ents = ents;
+	cs->nslots *= 2;
+}
+
+/* split the file `path` both ways */
+static int
+scan_file(const char *path, uint8_t *buf, struct chunkset *fixed, struct chunkset *cdc)
+{
+	size_t avail = 0, pos = 0, n;
+	ssize_t r;
+	int fd, eof = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (errno);
+	/* `buf` holds avail bytes from `pos`; chunks are cut once cdc_max are there */
+	while (!eof || avail > 0) {
+		if (!eof && avail < cdc_max) {
+			memmove(buf, buf + pos, avail);
+			pos = 0;
+			if ((r = read(fd, buf + avail, READ_SIZE)) < 0) {
+				close(fd);
+				return (errno);
+			}
+			eof = r == 0;
+			avail += r;
+			continue;
+		}
+		n = cdc_cut(buf + pos, avail);
+		chunkset_add(cdc, buf + pos, n);
+		pos += n;
+		avail -= n;
+	}
+	close(fd);
+
+	/* read it again for the fixed blocks, which are cheap to find */
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (errno);
+	while ((r = read(fd, buf, READ_SIZE)) > 0) {
+		for (n = 0; n + DDFS_BLOCKSIZE <= (size_t)r; n += DDFS_BLOCKSIZE)
+			chunkset_add(fixed, buf + n, DDFS_BLOCKSIZE);
+		if (n < (size_t)r) {
+			/* a short read only happens at the end of the file */
+			fixed->chunks++;
+			fixed->stored += r - n;
+			fixed->unshareable += r - n;
+		}
+	}
+	close(fd);
+	return (r < 0 ? errno : 0);
+}
+
+static void
+report(const char *what, const struct chunkset *cs, uint64_t bytes, uint64_t meta)
+{
+	printf("%s: %" PRIu64 " chunks (%" PRIu64 " distinct, %.0f bytes on average), "
+	       "%.1f MiB stored, ratio %.3f, %.1f MiB metadata\n",
+	    what, cs->chunks, cs->nents, cs->chunks == 0 ? 0.0 : (double)bytes / cs->chunks,
+	    cs->stored / 1048576.0, cs->stored == 0 ? 1.0 : (double)bytes / cs->stored,
+	    meta / 1048576.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct chunkset fixed, cdc;
+	FTS *fts;
+	FTSENT *f;
+	uint8_t *buf;
+	uint64_t files = 0, bytes = 0, fixedmeta, cdcmeta;
+	char label[64];
+	double start;
+	int ch, bits, error;
+
+	while ((ch = getopt(argc, argv, "hH:m:a:M:")) != -1) {
+		switch (ch) {
+		case 'H':
+			if ((fp = ddfs_fingerprint_byname(optarg)) == -1)
+				errx(1, "unknown fingerprint algorithm %s", optarg);
+			break;
+		case 'm':
+			cdc_min = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			cdc_avg = strtoul(optarg, NULL, 0);
+			if (cdc_avg < 64 || (cdc_avg & (cdc_avg - 1)) != 0)
+				errx(1, "-a must be a power of 2, at least 64");
+			cdc_min = cdc_avg / 4;
+			cdc_max = cdc_avg * 4;
+			break;
+		case 'M':
+			cdc_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		usage();
+		exit(1);
+	}
+	if (cdc_min == 0 || cdc_min > cdc_avg || cdc_avg > cdc_max)
+		errx(1, "need 0 < min <= avg <= max");
+
+	for (int i = 0; i < 256; i++)
+		gear[i] = splitmix64(i);
+	/* normalized chunking: 2 bits stricter before the average, 2 looser after */
+	for (bits = 0; ((size_t)1 << bits) < cdc_avg; bits++)
+		;
+	mask_s = topmask(bits + 2);
+	mask_l = topmask(bits - 2);
+
+	if ((buf = malloc(READ_SIZE + cdc_max)) == NULL)
+		err(1, "read buffer");
+	chunkset_init(&fixed);
+	chunkset_init(&cdc);
+	start = now();
+	if ((fts = fts_open(argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL)
+		err(1, "fts_open");
+	while ((f = fts_read(fts)) != NULL) {
+		if (f->fts_info == FTS_DNR || f->fts_info == FTS_ERR || f->fts_info == FTS_NS)
+			warnx("%s: %s", f->fts_path, strerror(f->fts_errno));
+		if (f->fts_info != FTS_F)
+			continue;
+		if ((error = scan_file(f->fts_accpath, buf, &fixed, &cdc)) != 0) {
+			warnx("%s: %s", f->fts_path, strerror(error));
+			continue;
+		}
+		files++;
+		bytes += f->fts_statp->st_size;
+	}
+	fts_close(fts);
+
+	printf("%" PRIu64 " files, %.1f MiB, read in %.3f s\n", files, bytes / 1048576.0,
+	    now() - start);
+	/* fixed blocks are found through the inode, and only need dedup table entries */
+	fixedmeta = fixed.nents * DDFS_DEDUP_SIZE;
+	cdcmeta = cdc.nents * DDFS_DEDUP_SIZE + cdc.chunks * CHUNKMAP_ENTRY;
+	snprintf(label, sizeof(label), "fixed %d", DDFS_BLOCKSIZE);
+	report(label, &fixed, bytes, fixedmeta);
+	if (fixed.unshareable > 0)
+		printf("%s: %.1f MiB in partial last blocks, which ddfs never shares\n", label,
+		    fixed.unshareable / 1048576.0);
+	snprintf(label, sizeof(label), "fastcdc %zu/%zu/%zu", cdc_min, cdc_avg, cdc_max);
+	report(label, &cdc, bytes, cdcmeta);
+	/* negative if content-defined chunking does worse */
+	if (fixed.stored > 0)
+		printf("fastcdc saves %.1f%% of the stored bytes, %.1f%% counting metadata\n",
+		    100.0 * ((double)fixed.stored - cdc.stored) / fixed.stored,
+		    100.0 * ((double)(fixed.stored + fixedmeta) - (double)(cdc.stored + cdcmeta)) /
+			(fixed.stored + fixedmeta));
+	free(fixed.ents);
+	free(cdc.ents);
+	free(buf);
+	return (0);
+}
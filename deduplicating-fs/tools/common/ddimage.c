@@ -0,0 +1,458 @@
+/*
+ * ddimage: access to an unmounted ddfs filesystem, shared by the tools that
+ * read or change one in place (see ddimage.h).
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ddimage.h"
+
+/* table and reverse index blocks written at once */
+#define WRITE_BLOCKS 256
+
+/* a table block read from the image */
+struct imagebuf {
+	int64_t blkno;
+	uint8_t data[];
+};
+
+/* ddtable_foreach() state of copy_entry() and rev_entry() */
+struct copystate {
+	struct ddtable *from;
+	struct ddtable *to;
+	uint64_t nentries;
+	int error;
+};
+
+double
+ddimage_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int
+ddimage_read(struct ddimage *img, off_t off, void *buf, size_t size)
+{
+	if (pread(img->fd, buf, size, off) != (ssize_t)size)
+		return (EIO);
+	return (0);
+}
+
+int
+ddimage_write(struct ddimage *img, off_t off, const void *buf, size_t size)
+{
+	if (pwrite(img->fd, buf, size, off) != (ssize_t)size)
+		return (EIO);
+	return (0);
+}
+
+/* ffs_sbget() read callback */
+static int
+image_sbread(void *devfd, off_t loc, void **bufp, int size)
+{
+	struct ddimage *img = devfd;
+
+	if ((*bufp = malloc(size)) == NULL)
+		return (ENOSPC);
+	return (ddimage_read(img, loc, *bufp, size));
+}
+
+/* ffs_sbput() write callback */
+static int
+image_sbwrite(void *devfd, off_t loc, void *buf, int size)
+{
+	return (ddimage_write(devfd, loc, buf, size));
+}
+
+void
+ddimage_open(struct ddimage *img, const char *device, int flags)
+{
+	int error;
+
+	memset(img, 0, sizeof(*img));
+	if ((img->fd = open(device, flags)) < 0)
+		err(1, "%s", device);
+	if ((error = ffs_sbget(img, &img->fs, STDSB, NULL, image_sbread)) != 0)
+		errx(1, "%s: reading superblock: %s", device, strerror(error));
+}
+
+void
+ddimage_close(struct ddimage *img)
+{
+	free(img->fs->fs_csp);
+	free(img->fs->fs_si);
+	free(img->fs);
+	close(img->fd);
+	img->fs = NULL;
+	img->fd = -1;
+}
+
+void
+ddimage_flush(struct ddimage *img)
+{
+	if (fsync(img->fd) != 0)
+		err(1, "fsync");
+}
+
+void
+ddimage_write_sb(struct ddimage *img)
+{
+	int error;
+
+	if ((error = ffs_sbput(img, img->fs, img->fs->fs_sblockloc, image_sbwrite)) != 0)
+		errx(1, "writing superblock: %s", strerror(error));
+	ddimage_flush(img);
+}
+
+void
+ddimage_cg_read(struct ddimage *img, int c, struct cg *cgp)
+{
+	struct fs *fs = img->fs;
+	uint32_t ckhash;
+
+	if (ddimage_read(img, (off_t)cgtod(fs, c) * fs->fs_fsize, cgp, fs->fs_cgsize) != 0)
+		err(1, "reading cylinder group %d", c);
+	if (!cg_chkmagic(cgp))
+		errx(1, "cylinder group %d: bad magic number, run fsck", c);
+	if ((fs->fs_metackhash & CK_CYLGRP) == 0)
+		return;
+	ckhash = cgp->cg_ckhash;
+	cgp->cg_ckhash = 0;
+	if (calculate_crc32c(~0L, cgp, fs->fs_cgsize) != ckhash)
+		errx(1, "cylinder group %d: bad check-hash, run fsck", c);
+	cgp->cg_ckhash = ckhash;
+}
+
+void
+ddimage_cg_write(struct ddimage *img, int c, struct cg *cgp)
+{
+	struct fs *fs = img->fs;
+
+	cgp->cg_time = time(NULL);
+	cgp->cg_old_time = cgp->cg_time;
+	if ((fs->fs_metackhash & CK_CYLGRP) != 0) {
+		cgp->cg_ckhash = 0;
+		cgp->cg_ckhash = calculate_crc32c(~0L, cgp, fs->fs_cgsize);
+	}
+	if (ddimage_write(img, (off_t)cgtod(fs, c) * fs->fs_fsize, cgp, fs->fs_cgsize) != 0)
+		err(1, "writing cylinder group %d", c);
+}
+
+static int
+image_bread(void *devfd, int64_t blkno, void **datap, void **bufp)
+{
+	struct ddimage_table *t = devfd;
+	struct imagebuf *ib;
+
+	if ((ib = malloc(sizeof(*ib) + t->dt.dt_bsize)) == NULL)
+		return (ENOMEM);
+	if (t->blklocks != NULL)
+		pthread_mutex_lock(&t->blklocks[(uint64_t)blkno % DDIMAGE_BLKLOCKS]);
+	if (ddimage_read(t->img, t->off + blkno * t->dt.dt_bsize, ib->data,
+	    t->dt.dt_bsize) != 0) {
+		if (t->blklocks != NULL)
+			pthread_mutex_unlock(&t->blklocks[(uint64_t)blkno % DDIMAGE_BLKLOCKS]);
+		free(ib);
+		return (EIO);
+	}
+	ib->blkno = blkno;
+	*datap = ib->data;
+	*bufp = ib;
+	return (0);
+}
+
+static int
+image_brelse(void *devfd, void *bufp, int dirty)
+{
+	struct ddimage_table *t = devfd;
+	struct imagebuf *ib = bufp;
+	int error = 0;
+
+	if (dirty)
+		error = ddimage_write(t->img, t->off + ib->blkno * t->dt.dt_bsize, ib->data,
+		    t->dt.dt_bsize);
+	if (t->blklocks != NULL)
+		pthread_mutex_unlock(&t->blklocks[(uint64_t)ib->blkno % DDIMAGE_BLKLOCKS]);
+	free(ib);
+	return (error);
+}
+
+static void
+image_lock(void *devfd, int stripe)
+{
+	struct ddimage_table *t = devfd;
+
+	pthread_mutex_lock(&t->locks[stripe]);
+}
+
+static int
+image_trylock(void *devfd, int stripe)
+{
+	struct ddimage_table *t = devfd;
+
+	return (pthread_mutex_trylock(&t->locks[stripe]) == 0);
+}
+
+static void
+image_unlock(void *devfd, int stripe)
+{
+	struct ddimage_table *t = devfd;
+
+	pthread_mutex_unlock(&t->locks[stripe]);
+}
+
+void
+ddimage_table_init(struct ddimage_table *t, struct ddimage *img, int64_t blkno,
+    int64_t nbuckets, int format)
+{
+	struct fs *fs = img->fs;
+	struct ddtable *dt = &t->dt;
+
+	memset(t, 0, sizeof(*t));
+	t->img = img;
+	t->off = (off_t)blkno * fs->fs_fsize;
+	dt->dt_devfd = t;
+	dt->dt_bsize = fs->fs_bsize;
+	dt->dt_nbuckets = nbuckets;
+	dt->dt_nentries = ddtable_nentries(format, fs->fs_bsize);
+	dt->dt_format = format;
+	dt->dt_revblk = (fs->fs_ddrevblkno - blkno) / fs->fs_frag;
+	dt->dt_nrev = fs->fs_size;
+	dt->dt_logblk = (fs->fs_ddlogblkno - blkno) / fs->fs_frag;
+	dt->dt_nlog = fs->fs_ddlogfrags / fs->fs_frag;
+	dt->dt_bread = image_bread;
+	dt->dt_brelse = image_brelse;
+}
+
+void
+ddimage_table_locks(struct ddimage_table *t, int nlocks)
+{
+	struct ddtable *dt = &t->dt;
+
+	if ((t->blklocks = calloc(DDIMAGE_BLKLOCKS, sizeof(*t->blklocks))) == NULL ||
+	    (t->locks = calloc(nlocks, sizeof(*t->locks))) == NULL)
+		err(1, "table locks");
+	for (int i = 0; i < DDIMAGE_BLKLOCKS; i++)
+		pthread_mutex_init(&t->blklocks[i], NULL);
+	for (int i = 0; i < nlocks; i++)
+		pthread_mutex_init(&t->locks[i], NULL);
+	dt->dt_nlocks = nlocks;
+	dt->dt_lock = image_lock;
+	dt->dt_trylock = image_trylock;
+	dt->dt_unlock = image_unlock;
+}
+
+void
+ddimage_table_free(struct ddimage_table *t)
+{
+	if (t->blklocks != NULL)
+		for (int i = 0; i < DDIMAGE_BLKLOCKS; i++)
+			pthread_mutex_destroy(&t->blklocks[i]);
+	if (t->locks != NULL)
+		for (int i = 0; i < t->dt.dt_nlocks; i++)
+			pthread_mutex_destroy(&t->locks[i]);
+	free(t->blklocks);
+	free(t->locks);
+	t->blklocks = NULL;
+	t->locks = NULL;
+}
+
+int
+ddimage_log_checkpoint(struct ddimage_table *t)
+{
+	struct ddtable *dt = &t->dt;
+	struct ddfs_loghdr *hdr;
+	uint64_t seq;
+	int error;
+
+	if ((error = ddtable_replay(dt, &seq)) != 0 || dt->dt_nlog == 0)
+		return (error);
+	if ((hdr = calloc(1, dt->dt_bsize)) == NULL)
+		return (ENOMEM);
+	hdr->lh_magic = DDFS_LOG_MAGIC;
+	hdr->lh_seq = seq;
+	hdr->lh_ckpt = seq;
+	ddtable_logseal(dt, hdr);
+	error = ddimage_write(t->img, t->off + (dt->dt_logblk + seq % dt->dt_nlog) * dt->dt_bsize,
+	    hdr, dt->dt_bsize);
+	free(hdr);
+	return (error);
+}
+
+void
+ddimage_table_fill(struct ddimage_table *t, int64_t first, int64_t nblk, const void *data)
+{
+	size_t bsize = t->dt.dt_bsize;
+	uint8_t *buf;
+	int64_t n;
+
+	if ((buf = malloc(WRITE_BLOCKS * bsize)) == NULL)
+		err(1, "table blocks");
+	for (int i = 0; i < WRITE_BLOCKS; i++)
+		memcpy(buf + i * bsize, data, bsize);
+	for (int64_t b = first; b < first + nblk; b += n) {
+		n = MIN(WRITE_BLOCKS, first + nblk - b);
+		if (ddimage_write(t->img, t->off + b * bsize, buf, n * bsize) != 0)
+			err(1, "writing table block %jd", (intmax_t)b);
+	}
+	free(buf);
+	ddimage_flush(t->img);
+}
+
+void
+ddimage_log_clear(struct ddimage_table *t)
+{
+	struct ddtable *dt = &t->dt;
+	uint8_t *zero;
+
+	if ((zero = calloc(1, dt->dt_bsize)) == NULL)
+		err(1, "log block");
+	ddimage_table_fill(t, dt->dt_logblk, dt->dt_nlog, zero);
+	free(zero);
+}
+
+/* ddtable_foreach() callback copying the ACTIVE entries into the new table */
+static void
+copy_entry(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct copystate *cs = arg;
+	struct ddfs_dedup copy;
+	int64_t newslot;
+	int error;
+
+	if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0 || cs->error != 0)
+		return;
+	/* an entry pinned in 16 bits stays pinned in 32 */
+	copy = *entry;
+	if (DDTABLE_PINNED(cs->from, entry))
+		copy.ref_count = DDFS_REFCOUNT_MAX(cs->to->dt_format);
+	if ((error = ddtable_rehash(cs->to, &copy, &newslot)) != 0)
+		cs->error = error;
+	else
+		cs->nentries++;
+}
+
+uint64_t
+ddimage_table_copy(struct ddimage_table *from, struct ddimage_table *to)
+{
+	struct copystate cs;
+	int error;
+
+	memset(&cs, 0, sizeof(cs));
+	cs.from = &from->dt;
+	cs.to = &to->dt;
+	if ((error = ddtable_foreach(&from->dt, copy_entry, &cs)) != 0 ||
+	    (error = cs.error) != 0)
+		errx(1, "copying the table: %s", strerror(error));
+	ddimage_flush(to->img);
+	return (cs.nentries);
+}
+
+/* ddtable_foreach() callback pointing the reverse index at the ACTIVE entries */
+static void
+rev_entry(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct copystate *cs = arg;
+	int error;
+
+	if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0 || cs->error != 0)
+		return;
+	if ((error = ddtable_revrepair(cs->to, slot, entry)) != 0)
+		cs->error = error;
+	else
+		cs->nentries++;
+}
+
+uint64_t
+ddimage_rev_rebuild(struct ddimage_table *t)
+{
+	struct ddtable *dt = &t->dt;
+	struct fs *fs = t->img->fs;
+	struct copystate cs;
+	uint8_t *zero;
+	int error;
+
+	if ((zero = calloc(1, dt->dt_bsize)) == NULL)
+		err(1, "reverse index block");
+	ddimage_table_fill(t, dt->dt_revblk, fs->fs_ddrevfrags / fs->fs_frag, zero);
+	free(zero);
+	memset(&cs, 0, sizeof(cs));
+	cs.to = dt;
+	if ((error = ddtable_foreach(dt, rev_entry, &cs)) != 0 || (error = cs.error) != 0)
+		errx(1, "rebuilding reverse index: %s", strerror(error));
+	ddimage_flush(t->img);
+	return (cs.nentries);
+}
+
+int64_t
+ddimage_find_region(struct ddimage *img, int64_t nblk)
+{
+	struct fs *fs = img->fs;
+	struct cg *cgp;
+	int64_t start = -1, run = 0;
+
+	if ((cgp = malloc(fs->fs_cgsize)) == NULL)
+		err(1, "cylinder group");
+	for (int c = 0; c < fs->fs_ncg && run < nblk; c++) {
+		ddimage_cg_read(img, c, cgp);
+		for (int64_t b = 0; b < fragstoblks(fs, cgp->cg_ndblk) && run < nblk; b++) {
+			if (!ffs_isblock(fs, cg_blksfree(cgp), b)) {
+				run = 0;
+				continue;
+			}
+			if (run++ == 0)
+				start = cgbase(fs, c) + blkstofrags(fs, b);
+		}
+	}
+	free(cgp);
+	return (run < nblk ? -1 : start);
+}
+
+void
+ddimage_region_acct(struct ddimage *img, int64_t start, int64_t nblk, int cnt)
+{
+	struct fs *fs = img->fs;
+	struct cg *cgp;
+	ufs1_daddr_t bno;
+	int64_t d = start, end = start + blkstofrags(fs, nblk);
+	int c;
+
+	if ((cgp = malloc(fs->fs_cgsize)) == NULL)
+		err(1, "cylinder group");
+	while (d < end) {
+		c = dtog(fs, d);
+		ddimage_cg_read(img, c, cgp);
+		for (; d < end && dtog(fs, d) == c; d += fs->fs_frag) {
+			bno = fragstoblks(fs, dtogd(fs, d));
+			if (ffs_isblock(fs, cg_blksfree(cgp), bno) != (cnt < 0))
+				errx(1, "block %jd is %s", (intmax_t)d,
+				    cnt < 0 ? "in use" : "already free");
+			if (cnt < 0)
+				ffs_clrblock(fs, cg_blksfree(cgp), bno);
+			else
+				ffs_setblock(fs, cg_blksfree(cgp), bno);
+			ffs_clusteracct(fs, cgp, bno, cnt);
+			cgp->cg_cs.cs_nbfree += cnt;
+			fs->fs_cs(fs, c).cs_nbfree += cnt;
+			fs->fs_cstotal.cs_nbfree += cnt;
+		}
+		ddimage_cg_write(img, c, cgp);
+	}
+	free(cgp);
+	ddimage_flush(img);
+	ddimage_write_sb(img);
+}
@@ -0,0 +1,125 @@
+/*
+ * ddimage: access to an unmounted ddfs filesystem, shared by the tools that
+ * read or change one in place.
+ *
+ * The dedup table code of ddfs_table.c reads and writes table blocks through
+ * the callbacks in struct ddtable. A struct ddimage_table hands it the blocks
+ * of a table in the image, with the locks the kernel would take if the tool
+ * runs the table code from several threads.
+ */
+
+#ifndef DDIMAGE_H
+#define DDIMAGE_H
+
+#include <sys/types.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ddfs.h"
+#include "ddfs_dinode.h"
+#include "ddfs_fs.h"
+
+/* from ddfs_subr.c, and calculate_crc32c() from libufs */
+#define STDSB -1 /* search the standard superblock locations */
+struct malloc_type;
+int ffs_sbget(void *devfd, struct fs **fsp, off_t altsblock, struct malloc_type *filltype,
+    int (*readfunc)(void *devfd, off_t loc, void **bufp, int size));
+int ffs_sbput(void *devfd, struct fs *fs, off_t loc,
+    int (*writefunc)(void *devfd, off_t loc, void *buf, int size));
+void ffs_update_dinode_ckhash(struct fs *fs, struct ufs2_dinode *dip);
+int ffs_isblock(struct fs *fs, unsigned char *cp, ufs1_daddr_t h);
+void ffs_clrblock(struct fs *fs, u_char *cp, ufs1_daddr_t h);
+void ffs_setblock(struct fs *fs, unsigned char *cp, ufs1_daddr_t h);
+void ffs_clusteracct(struct fs *fs, struct cg *cgp, ufs1_daddr_t blkno, int cnt);
+uint32_t calculate_crc32c(uint32_t crc, const void *buf, size_t size);
+
+/* table blocks are held by one thread at a time, like kernel buffers */
+#define DDIMAGE_BLKLOCKS 1024
+
+/* an open filesystem: the devfd handed to the superblock callbacks */
+struct ddimage {
+	int fd;
+	struct fs *fs;
+};
+
+/* a dedup table in the image: the devfd handed to the table callbacks */
+struct ddimage_table {
+	struct ddimage *img;
+	off_t off;		   /* byte offset of the table */
+	pthread_mutex_t *blklocks; /* DDIMAGE_BLKLOCKS, held from bread to brelse, or NULL */
+	pthread_mutex_t *locks;	   /* bucket lock stripes of the table, or NULL */
+	struct ddtable dt;
+};
+
+/* seconds of CLOCK_MONOTONIC, for timing */
+double ddimage_now(void);
+
+/* open `device` with open(2) `flags` and read its superblock, or exit */
+void ddimage_open(struct ddimage *img, const char *device, int flags);
+void ddimage_close(struct ddimage *img);
+
+/* read or write `size` bytes at byte `off`. return 0 or EIO */
+int ddimage_read(struct ddimage *img, off_t off, void *buf, size_t size);
+int ddimage_write(struct ddimage *img, off_t off, const void *buf, size_t size);
+
+/* fsync(2) the image, and write the superblock and flush, or exit */
+void ddimage_flush(struct ddimage *img);
+void ddimage_write_sb(struct ddimage *img);
+
+/* read cylinder group `c`, checking its magic number and check-hash, or write it, or exit */
+void ddimage_cg_read(struct ddimage *img, int c, struct cg *cgp);
+void ddimage_cg_write(struct ddimage *img, int c, struct cg *cgp);
+
+/*
+ * set up `t` for the table of format `format` and `nbuckets` blocks at
+ * fragment `blkno`, with the reverse index and intent log of the superblock
+ */
+void ddimage_table_init(struct ddimage_table *t, struct ddimage *img, int64_t blkno,
+    int64_t nbuckets, int format);
+
+/* take the table block and bucket locks, `nlocks` stripes of them, or exit */
+void ddimage_table_locks(struct ddimage_table *t, int nlocks);
+void ddimage_table_free(struct ddimage_table *t);
+
+/*
+ * replay the intent log into the table, and write an empty log block after
+ * it, so mounting does not replay changes older than the tool's over them
+ */
+int ddimage_log_checkpoint(struct ddimage_table *t);
+
+/* zero every intent log block, so that nothing is replayed from it, or exit */
+void ddimage_log_clear(struct ddimage_table *t);
+
+/* write `nblk` copies of the block `data` from block `first` of table `t` on, or exit */
+void ddimage_table_fill(struct ddimage_table *t, int64_t first, int64_t nblk,
+    const void *data);
+
+/*
+ * copy the ACTIVE entries of `from`, with their refcounts, to where their keys
+ * hash in `to`, which may be of a later format, or exit. returns the number of
+ * entries copied
+ */
+uint64_t ddimage_table_copy(struct ddimage_table *from, struct ddimage_table *to);
+
+/*
+ * zero the reverse index, and fill it in again from the table `t`, or exit.
+ * returns the number of entries in it
+ */
+uint64_t ddimage_rev_rebuild(struct ddimage_table *t);
+
+/*
+ * find the first `nblk` free blocks in a row, which may run on from the end of
+ * one cylinder group into the start of the next. returns the fragment number
+ * of the first, or -1
+ */
+int64_t ddimage_find_region(struct ddimage *img, int64_t nblk);
+
+/*
+ * allocate (`cnt` -1) or free (`cnt` 1) the `nblk` blocks from fragment `start`
+ * on in the cylinder group maps and the summary information, and write the
+ * superblock with it, or exit
+ */
+void ddimage_region_acct(struct ddimage *img, int64_t start, int64_t nblk, int cnt);
+
+#endif /* DDIMAGE_H */
@@ -0,0 +1,354 @@
+/*
+ * ddbench: benchmark the dedup table code from ddfs_table.c
+ * against an unmounted ddfs image file or disk device.
+ *
+ * Keys are generated from a seeded PRNG, so lookups can regenerate
+ * the keys that were inserted without having to store them.
+ *
+ * Each phase can be run from several threads, with the bucket locks of the
+ * table taken the way the kernel takes them, to measure how the table code
+ * scales. Given several thread counts, the phases are run once per count,
+ * each run inserting keys of its own.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ddimage.h"
+
+/* most thread counts given with -t */
+#define MAXRUNS 16
+
+static void
+usage(void)
+{
+	printf("ddbench -f image [-m] [-n inserts] [-l lookups] [-u unrefs] [-s seed] "
+	       "[-t threads[,threads...]] [-L locks]\n");
+	printf("-f image\t\tddfs image file or device (must not be mounted)\n");
+	printf("-n inserts\t\tnumber of keys to insert (default 0)\n");
+	printf("-l lookups\t\tnumber of lookups, half hits and half misses (default 0)\n");
+	printf("-u unrefs\t\tnumber of inserted keys to unref by block pointer (default 0)\n");
+	printf("-s seed\t\t\tseed used to generate keys (default 1)\n");
+	printf("-m\t\t\tbuild the free bucket map first, and insert keys as known-new\n");
+	printf("-t threads\t\tthreads running each phase; several counts run the phases once each\n"
+	       "\t\t\t(default 1)\n");
+	printf("-L locks\t\tbucket lock stripes, a power of 2 (default 1024)\n");
+}
+
+/* ddtable_foreach callback building the free bucket map */
+static void
+freemap_scan(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0)
+		ddtable_freemap_set(arg, slot);
+}
+
+/* splitmix64, used to generate uniformly distributed keys */
+static uint64_t
+splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+/* the i-th key for `seed`, standing in for the SHA-1 of a block */
+static void
+gen_key(uint64_t seed, uint64_t i, uint8_t key[20])
+{
+	uint64_t x = splitmix64(seed ^ splitmix64(i));
+	for (int b = 0; b < 20; b++) {
+		if (b % 8 == 0 && b != 0)
+			x = splitmix64(x);
+		key[b] = x >> (8 * (b % 8));
+	}
+}
+
+/* phases of a run, each timed on its own */
+enum phase { INSERT, LOOKUP, UNREF, NPHASES };
+static const char *phase_names[NPHASES] = { "insert", "lookup", "unref" };
+
+/* the part of a phase run by one thread */
+struct worker {
+	pthread_t thread;
+	struct ddtable *dt;
+	enum phase phase;
+	uint64_t lo, hi;  /* operations [lo, hi) of the phase */
+	uint64_t base;	  /* first key of the run */
+	uint64_t seed;
+	uint64_t inserted; /* keys inserted by the run, that lookups hit */
+	int mflag;
+	uint64_t hits;	/* lookups that found their key */
+	int error;
+	uint64_t failed; /* operation that failed with `error` */
+};
+
+/*
+ * Key `base + i` is inserted with block pointer `base + i + 1`, with its home
+ * bucket locked like ddtable_alloc() does.
+ */
+static int
+do_insert(struct worker *w, uint64_t i)
+{
+	struct ddfs_dedup entry;
+	uint8_t key[20];
+	int64_t home;
+	int error;
+
+	gen_key(w->seed, w->base + i, key);
+	home = ddtable_bucket(w->dt, key);
+	ddtable_lock(w->dt, home);
+	if (w->mflag)
+		error = ddtable_insert(w->dt, key, (daddr_t)(w->base + i) + 1, NULL, &entry);
+	else
+		error = ddtable_ref(w->dt, key, (daddr_t)(w->base + i) + 1, NULL, &entry);
+	ddtable_unlock(w->dt, home);
+	return (error);
+}
+
+/* even lookups hit keys inserted with this seed (in any earlier run), odd ones miss */
+static int
+do_lookup(struct worker *w, uint64_t i)
+{
+	uint8_t key[20];
+	int error;
+
+	if (i % 2 == 0)
+		gen_key(w->seed, w->base + (i / 2) % w->inserted, key);
+	else
+		gen_key(~w->seed, w->base + i, key);
+	error = ddtable_lookup(w->dt, key, NULL, NULL);
+	if (error == 0)
+		w->hits++;
+	return (error == ENOENT ? 0 : error);
+}
+
+/* drop the reference taken by an insert, the way ffs_blkfree does */
+static int
+do_unref(struct worker *w, uint64_t i)
+{
+	struct ddfs_dedup entry;
+	daddr_t blockptr = (daddr_t)(w->base + i) + 1;
+	int64_t slot;
+	int error;
+
+	if ((error = ddtable_findblk(w->dt, blockptr, &slot)) != 0)
+		return (error);
+	ddtable_lock(w->dt, DDTABLE_BUCKET(w->dt, slot));
+	error = ddtable_deref(w->dt, slot, blockptr, &entry);
+	ddtable_unlock(w->dt, DDTABLE_BUCKET(w->dt, slot));
+	return (error);
+}
+
+static void *
+worker_main(void *arg)
+{
+	static int (*const ops[NPHASES])(struct worker *, uint64_t) = {
+		do_insert, do_lookup, do_unref,
+	};
+	struct worker *w = arg;
+
+	for (uint64_t i = w->lo; i < w->hi; i++) {
+		if ((w->error = (*ops[w->phase])(w, i)) != 0) {
+			w->failed = i;
+			break;
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Run `nops` operations of `phase` split between `nthreads` threads.
+ * Returns the number of seconds taken, and sets `hitsp` to the lookup hits.
+ */
+static double
+run_phase(struct worker *proto, enum phase phase, uint64_t nops, int nthreads,
+    uint64_t *hitsp)
+{
+	struct worker *w;
+	double start;
+	int error;
+
+	if ((w = calloc(nthreads, sizeof(*w))) == NULL)
+		err(1, "workers");
+	start = ddimage_now();
+	for (int t = 0; t < nthreads; t++) {
+		w[t] = *proto;
+		w[t].phase = phase;
+		w[t].lo = nops * t / nthreads;
+		w[t].hi = nops * (t + 1) / nthreads;
+		if ((error = pthread_create(&w[t].thread, NULL, worker_main, &w[t])) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+	*hitsp = 0;
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(w[t].thread, NULL);
+		if (w[t].error != 0)
+			errx(1, "%s %" PRIu64 ": %s", phase_names[phase], w[t].failed,
+			    strerror(w[t].error));
+		*hitsp += w[t].hits;
+	}
+	start = ddimage_now() - start;
+	free(w);
+	return (start);
+}
+
+static double
+report(const char *what, int nthreads, uint64_t ops, double secs, struct ddtable *dt)
+{
+	printf("%s (%d thread%s): %" PRIu64 " ops in %.3f s, %.0f ops/sec, "
+	       "%.2f blocks read/op, %.2f blocks written/op\n",
+	    what, nthreads, nthreads == 1 ? "" : "s", ops, secs, ops / secs,
+	    (double)dt->dt_reads / ops, (double)dt->dt_writes / ops);
+	dt->dt_reads = 0;
+	dt->dt_writes = 0;
+	return (ops / secs);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+	char *device = NULL, *p;
+	uint64_t ninserts = 0, nlookups = 0, nunrefs = 0, seed = 1;
+	struct ddimage img;
+	struct ddimage_table t;
+	struct fs *fs;
+	struct ddtable *dt;
+	struct worker proto;
+	double rate[MAXRUNS][NPHASES];
+	uint64_t hits;
+	int error, mflag = 0, nlocks = 1024, nruns = 0, threads[MAXRUNS];
+
+	while ((ch = getopt(argc, argv, "hf:mn:l:u:s:t:L:")) != -1) {
+		switch (ch) {
+		case 'm':
+			mflag = 1;
+			break;
+		case 'f':
+			device = optarg;
+			break;
+		case 'n':
+			ninserts = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			nlookups = strtoull(optarg, NULL, 0);
+			break;
+		case 'u':
+			nunrefs = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			for (p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+				if (nruns == MAXRUNS)
+					errx(1, "at most %d thread counts", MAXRUNS);
+				if ((threads[nruns++] = atoi(p)) < 1)
+					errx(1, "bad thread count %s", p);
+			}
+			break;
+		case 'L':
+			nlocks = atoi(optarg);
+			if (nlocks < 1 || (nlocks & (nlocks - 1)) != 0)
+				errx(1, "-L must be a power of 2");
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (device == NULL) {
+		usage();
+		exit(1);
+	}
+	if (nruns == 0)
+		threads[nruns++] = 1;
+	/* each run inserts keys of its own, and unrefs without inserts would repeat */
+	if (nruns > 1 && nunrefs > 0 && ninserts == 0)
+		errx(1, "-u without -n takes a single thread count");
+
+	ddimage_open(&img, device, ninserts + nunrefs > 0 ? O_RDWR : O_RDONLY);
+	fs = img.fs;
+	if (!DDFS_DDFORMAT_OK(fs->fs_ddformat))
+		errx(1, "%s: dedup table format %d, expected %d to %d", device,
+		    fs->fs_ddformat, DDFS_DDFORMAT_MIN, DDFS_DDFORMAT);
+	ddimage_table_init(&t, &img, fs->fs_ddblkno, fs->fs_dedupfrags / fs->fs_frag,
+	    fs->fs_ddformat);
+	ddimage_table_locks(&t, nlocks);
+	dt = &t.dt;
+	printf("%s: %" PRId64 " buckets of %d entries (%" PRId64 " entries)\n", device,
+	    dt->dt_nbuckets, dt->dt_nentries, dt->dt_nbuckets * dt->dt_nentries);
+
+	/* every inserted key gets its own block pointer, which must exist in the filesystem */
+	if (ninserts * nruns >= (uint64_t)dt->dt_nrev || nunrefs >= (uint64_t)dt->dt_nrev)
+		errx(1, "%s: only has %" PRId64 " blocks", device, dt->dt_nrev);
+	if (nunrefs > ninserts && ninserts > 0)
+		errx(1, "cannot unref more keys than were inserted");
+
+	/* changes not in the table yet would undo ours when the log is replayed at mount */
+	if (ninserts + nunrefs > 0 && (error = ddimage_log_checkpoint(&t)) != 0)
+		errx(1, "replaying intent log: %s", strerror(error));
+
+	if (mflag) {
+		double start = ddimage_now();
+		if ((dt->dt_freemap = calloc(1, DDTABLE_FREEMAP_SIZE(dt))) == NULL)
+			err(1, "free bucket map");
+		if ((error = ddtable_foreach(dt, freemap_scan, dt)) != 0)
+			errx(1, "scanning table: %s", strerror(error));
+		report("scan", 1, dt->dt_nbuckets, ddimage_now() - start, dt);
+		printf("scan: %" PRId64 " free slots\n", dt->dt_nfree);
+	}
+
+	memset(&proto, 0, sizeof(proto));
+	proto.dt = dt;
+	proto.seed = seed;
+	proto.mflag = mflag;
+	proto.inserted = ninserts > 0 ? ninserts : nlookups;
+	for (int r = 0; r < nruns; r++) {
+		proto.base = r * ninserts;
+		if (ninserts > 0)
+			rate[r][INSERT] = report("insert", threads[r], ninserts,
+			    run_phase(&proto, INSERT, ninserts, threads[r], &hits), dt);
+		if (nlookups > 0) {
+			rate[r][LOOKUP] = report("lookup", threads[r], nlookups,
+			    run_phase(&proto, LOOKUP, nlookups, threads[r], &hits), dt);
+			printf("lookup: %" PRIu64 " hits, %" PRIu64 " misses\n", hits,
+			    nlookups - hits);
+		}
+		if (nunrefs > 0)
+			rate[r][UNREF] = report("unref", threads[r], nunrefs,
+			    run_phase(&proto, UNREF, nunrefs, threads[r], &hits), dt);
+	}
+
+	/* ops/sec of each run relative to the first */
+	if (nruns > 1) {
+		uint64_t nops[NPHASES] = { ninserts, nlookups, nunrefs };
+		for (int ph = 0; ph < NPHASES; ph++) {
+			if (nops[ph] == 0)
+				continue;
+			printf("%s scaling:", phase_names[ph]);
+			for (int r = 0; r < nruns; r++)
+				printf(" %dT %.2fx", threads[r], rate[r][ph] / rate[0][ph]);
+			printf("\n");
+		}
+	}
+	if (mflag)
+		printf("%" PRId64 " free slots left\n", dt->dt_nfree);
+	free(dt->dt_freemap);
+	ddimage_table_free(&t);
+	ddimage_close(&img);
+	return (0);
+}
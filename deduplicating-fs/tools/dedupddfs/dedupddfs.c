@@ -0,0 +1,711 @@
+/*
+ * dedupddfs: deduplicate the file data already on an unmounted ddfs
+ * filesystem.
+ *
+ * The kernel only deduplicates blocks as they are written out, so blocks
+ * written while the dedup table was full, or by anything writing the image
+ * directly, are never shared. This finds every full data block of a regular
+ * file that is not in the table yet and enters it, the way the kernel would
+ * have when it was written:
+ *
+ * 1. the table is scanned once for the blocks it already holds;
+ * 2. the inodes of every cylinder group are read, and the file blocks not in
+ *    the table are marked in a bitmap (a file's last block, if partial, is
+ *    left alone like the kernel leaves it);
+ * 3. the marked blocks are read in block order, 1MiB at a time, and hashed
+ *    and entered into the table by worker threads. A block whose key is
+ *    already there takes a reference on the block in the table instead, and
+ *    is remembered as a duplicate. Blocks of zeros are not hashed, and are
+ *    remembered as duplicates of a hole, like the kernel makes them;
+ * 4. the inodes and indirect blocks are read again, and the pointers to
+ *    duplicates are switched to the blocks that replace them, or cleared;
+ * 5. the duplicates are freed in the cylinder group maps and the summary
+ *    information.
+ *
+ * Each step is flushed to the disk before the next one starts, so stopping
+ * part way through leaks blocks (table references with fewer pointers to
+ * them, or duplicates nothing points at) but never frees a block in use.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ddimage.h"
+
+/* blocks hashed at once, as many as the kernel hashes for one write(2) */
+#define HASH_BATCH 8
+
+/* bucket lock stripes of the table */
+#define IMAGE_LOCKS 1024
+
+/* blocks read from the disk at once; a multiple of NBBY, so chunks share no bitmap bytes */
+#define CHUNK_BLOCKS 256
+
+/* the filesystem being deduplicated */
+struct image {
+	struct ddimage di;
+	struct fs *fs; /* di.fs */
+	struct ddimage_table t;
+	int64_t nblocks;  /* filesystem blocks, the size of the bitmaps below */
+	uint8_t *intable; /* blocks with an entry in the table */
+	uint8_t *cand;	  /* file blocks to hash; after hashing, the duplicates */
+};
+
+/* a duplicate block, and the block in the table with the same contents (0 for zeros) */
+struct remap {
+	daddr_t from, to;
+};
+
+/* CHUNK_BLOCKS blocks read for the workers */
+struct chunk {
+	struct chunk *next;
+	int64_t first; /* first block read */
+	int nblks;
+	uint8_t *data;
+};
+
+/* chunks handed from the reading thread to the workers and back */
+struct chunkq {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	struct chunk *full, **fulltail; /* read, waiting to be hashed */
+	struct chunk *free;
+	int eof;   /* nothing more will be read */
+	int error; /* a worker failed */
+};
+
+/* a hashing thread */
+struct worker {
+	pthread_t thread;
+	struct image *img;
+	struct chunkq *q;
+	uint8_t *verify; /* block compared with a matching one for DDFS_FP_VERIFY */
+	uint64_t hashed, unique, dups, zeros, collisions, pinned;
+	struct remap *remaps;
+	size_t nremaps, maxremaps;
+	int error;
+};
+
+/* what walk_inodes() does with each file block pointer */
+enum walk { COLLECT, REMAP };
+
+struct walkstate {
+	struct image *img;
+	enum walk what;
+	struct remap *remaps; /* REMAP: sorted by `from` */
+	size_t nremaps;
+	int64_t nfull;	  /* full blocks of the current file */
+	int64_t nholes;	  /* REMAP: blocks of the current file turned into holes */
+	uint64_t nptrs;	  /* COLLECT: block pointers seen */
+	uint64_t changed; /* REMAP: block pointers switched */
+};
+
+static void
+usage(void)
+{
+	printf("dedupddfs -f device [-j threads] [-v]\n");
+	printf("-f device\t\tddfs filesystem (must not be mounted)\n");
+	printf("-j threads\t\tthreads hashing blocks (default: one per CPU)\n");
+	printf("-v\t\t\treport each step as it finishes\n");
+}
+
+/* ddtable_foreach callback marking the blocks the table holds */
+static void
+table_scan(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	struct image *img = arg;
+	int64_t b;
+
+	if ((entry->flags & DDFS_DEDUP_ACTIVE) == 0)
+		return;
+	b = fragstoblks(img->fs, entry->blockptr);
+	if (entry->blockptr >= 0 && b < img->nblocks)
+		setbit(img->intable, b);
+}
+
+static int
+remap_cmp(const void *a, const void *b)
+{
+	const struct remap *ra = a, *rb = b;
+
+	return ((ra->from > rb->from) - (ra->from < rb->from));
+}
+
+/*
+ * Visit the pointer `*bpp` to block `lbn` of the current file. Returns 1 if it
+ * was changed.
+ */
+static int
+walk_ptr(struct walkstate *ws, ufs2_daddr_t *bpp, int64_t lbn)
+{
+	struct fs *fs = ws->img->fs;
+	struct remap key, *r;
+	int64_t b;
+
+	if (*bpp == 0 || lbn >= ws->nfull)
+		return (0);
+	b = fragstoblks(fs, *bpp);
+	if (*bpp < 0 || b >= ws->img->nblocks || blkstofrags(fs, b) != *bpp)
+		errx(1, "bad block pointer %jd, run fsck", (intmax_t)*bpp);
+	switch (ws->what) {
+	case COLLECT:
+		ws->nptrs++;
+		if (isset(ws->img->intable, b))
+			return (0);
+		if (isset(ws->img->cand, b))
+			errx(1, "block %jd is used twice, run fsck", (intmax_t)*bpp);
+		setbit(ws->img->cand, b);
+		return (0);
+	case REMAP:
+		if (isclr(ws->img->cand, b))
+			return (0);
+		key.from = *bpp;
+		r = bsearch(&key, ws->remaps, ws->nremaps, sizeof(key), remap_cmp);
+		if (r == NULL)
+			errx(1, "block %jd has no replacement", (intmax_t)*bpp);
+		*bpp = r->to;
+		if (r->to == 0)
+			ws->nholes++;
+		ws->changed++;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Visit the block pointers in indirect block `blkno` at `level` (0 maps data
+ * blocks), the first of which maps block `*lbnp` of the file. Advances `*lbnp`
+ * past the blocks it maps, and writes the block back if pointers were changed.
+ */
+static void
+walk_indir(struct walkstate *ws, ufs2_daddr_t blkno, int level, int64_t *lbnp)
+{
+	struct image *img = ws->img;
+	struct fs *fs = img->fs;
+	ufs2_daddr_t *bap;
+	int64_t span = 1;
+	int dirty = 0;
+
+	for (int l = 0; l < level; l++)
+		span *= NINDIR(fs);
+	if (blkno < 0 || blkno >= fs->fs_size)
+		errx(1, "bad indirect block pointer %jd, run fsck", (intmax_t)blkno);
+	/* nothing to do below a block mapping only the partial block or past it */
+	if (*lbnp >= ws->nfull) {
+		*lbnp += span * NINDIR(fs);
+		return;
+	}
+	if ((bap = malloc(fs->fs_bsize)) == NULL)
+		err(1, "indirect block");
+	if (ddimage_read(&img->di, (off_t)blkno * fs->fs_fsize, bap, fs->fs_bsize) != 0)
+		err(1, "reading indirect block %jd", (intmax_t)blkno);
+	for (int i = 0; i < NINDIR(fs); i++) {
+		if (level == 0)
+			dirty |= walk_ptr(ws, &bap[i], (*lbnp)++);
+		else if (bap[i] == 0)
+			*lbnp += span;
+		else
+			walk_indir(ws, bap[i], level - 1, lbnp);
+	}
+	if (dirty && ddimage_write(&img->di, (off_t)blkno * fs->fs_fsize, bap, fs->fs_bsize) != 0)
+		err(1, "writing indirect block %jd", (intmax_t)blkno);
+	free(bap);
+}
+
+/* visit the data block pointers of a file. Returns 1 if the inode was changed */
+static int
+walk_file(struct walkstate *ws, struct ufs2_dinode *dip)
+{
+	struct fs *fs = ws->img->fs;
+	int64_t lbn, span = 1;
+	int dirty = 0;
+
+	ws->nfull = dip->di_size / fs->fs_bsize;
+	ws->nholes = 0;
+	for (lbn = 0; lbn < UFS_NDADDR; lbn++)
+		dirty |= walk_ptr(ws, &dip->di_db[lbn], lbn);
+	for (int level = 0; level < UFS_NIADDR; level++) {
+		span *= NINDIR(fs);
+		if (dip->di_ib[level] == 0)
+			lbn += span;
+		else
+			walk_indir(ws, dip->di_ib[level], level, &lbn);
+	}
+	if (ws->nholes > 0) {
+		dip->di_blocks -= ws->nholes * (fs->fs_bsize / DEV_BSIZE);
+		dirty = 1;
+	}
+	return (dirty);
+}
+
+/*
+ * Visit the regular files of every cylinder group, reading each group's
+ * initialized inodes at once, and writing back the inode blocks that changed.
+ */
+static void
+walk_inodes(struct walkstate *ws)
+{
+	struct image *img = ws->img;
+	struct fs *fs = img->fs;
+	struct ufs2_dinode *dp;
+	struct cg *cgp;
+	uint8_t *dirty;
+	size_t size;
+	int ninodes, nblks;
+
+	if ((cgp = malloc(fs->fs_cgsize)) == NULL ||
+	    (dp = malloc((size_t)fs->fs_ipg * sizeof(*dp))) == NULL ||
+	    (dirty = malloc(howmany(fs->fs_ipg, INOPB(fs)))) == NULL)
+		err(1, "inode buffers");
+	for (int c = 0; c < fs->fs_ncg; c++) {
+		ddimage_cg_read(&img->di, c, cgp);
+		ninodes = MIN(cgp->cg_initediblk, (uint32_t)fs->fs_ipg);
+		nblks = howmany(ninodes, INOPB(fs));
+		size = (size_t)nblks * fs->fs_bsize;
+		if (ddimage_read(&img->di, (off_t)cgimin(fs, c) * fs->fs_fsize, dp, size) != 0)
+			err(1, "reading inodes of cylinder group %d", c);
+		memset(dirty, 0, nblks);
+		for (int i = 0; i < ninodes; i++) {
+			if (isclr(cg_inosused(cgp), i) || (dp[i].di_mode & IFMT) != IFREG)
+				continue;
+			if (walk_file(ws, &dp[i])) {
+				ffs_update_dinode_ckhash(fs, &dp[i]);
+				dirty[i / INOPB(fs)] = 1;
+			}
+		}
+		for (int b = 0; b < nblks; b++) {
+			if (dirty[b] &&
+			    ddimage_write(&img->di, (off_t)(cgimin(fs, c) + blkstofrags(fs, b)) * fs->fs_fsize,
+			    (uint8_t *)dp + (size_t)b * fs->fs_bsize, fs->fs_bsize) != 0)
+				err(1, "writing inodes of cylinder group %d", c);
+		}
+	}
+	free(dirty);
+	free(dp);
+	free(cgp);
+}
+
+/* record that block `from` is to be replaced by `to` */
+static int
+add_remap(struct worker *w, daddr_t from, daddr_t to)
+{
+	struct remap *r;
+
+	if (w->nremaps == w->maxremaps) {
+		w->maxremaps = MAX(2 * w->maxremaps, 1024);
+		if ((r = realloc(w->remaps, w->maxremaps * sizeof(*r))) == NULL)
+			return (ENOMEM);
+		w->remaps = r;
+	}
+	w->remaps[w->nremaps].from = from;
+	w->remaps[w->nremaps].to = to;
+	w->nremaps++;
+	return (0);
+}
+
+/*
+ * Enter block `blkno`, whose key is `key`, into the table, with its home
+ * bucket locked like ddtable_alloc() does. A block whose key is in the table
+ * already takes a reference on the block there, and is recorded as a remap.
+ */
+static int
+dedup_block(struct worker *w, daddr_t blkno, const uint8_t *data, const uint8_t key[20])
+{
+	struct image *img = w->img;
+	struct ddtable *dt = &img->t.dt;
+	struct ddfs_dedup entry;
+	int64_t home = ddtable_bucket(dt, key);
+	int error;
+
+	/* no other thread takes a reference on `key` while its home bucket is locked */
+	ddtable_lock(dt, home);
+	error = ddtable_lookup(dt, key, NULL, &entry);
+	if (error == 0) {
+		if (DDFS_FP_VERIFY(img->fs->fs_ddfingerprint)) {
+			if ((error = ddimage_read(&img->di, (off_t)entry.blockptr * img->fs->fs_fsize,
+			    w->verify, img->fs->fs_bsize)) != 0)
+				goto out;
+			if (memcmp(w->verify, data, img->fs->fs_bsize) != 0) {
+				w->collisions++;
+				goto out;
+			}
+		}
+	} else if (error != ENOENT)
+		goto out;
+	if ((error = ddtable_ref(dt, key, blkno, NULL, &entry)) != 0)
+		goto out;
+	if (entry.blockptr == blkno) {
+		w->unique++;
+		goto out;
+	}
+	if ((error = add_remap(w, blkno, entry.blockptr)) != 0)
+		goto out;
+	w->dups++;
+	if (DDTABLE_PINNED(dt, &entry))
+		w->pinned++;
+	ddtable_unlock(dt, home);
+	return (0);
+out:
+	ddtable_unlock(dt, home);
+	/* only duplicates stay marked */
+	clrbit(img->cand, fragstoblks(img->fs, blkno));
+	return (error);
+}
+
+/*
+ * Hash the marked blocks of a chunk, HASH_BATCH at a time, and enter them.
+ * Blocks of zeros are replaced by holes instead.
+ */
+static int
+hash_chunk(struct worker *w, struct chunk *ch)
+{
+	struct image *img = w->img;
+	struct fs *fs = img->fs;
+	const void *bufs[HASH_BATCH];
+	uint8_t keys[HASH_BATCH][20];
+	daddr_t blknos[HASH_BATCH];
+	int i = 0, n, error;
+
+	while (i < ch->nblks) {
+		for (n = 0; n < HASH_BATCH && i < ch->nblks; i++) {
+			if (isclr(img->cand, ch->first + i))
+				continue;
+			if (ddfs_iszero(ch->data + (size_t)i * fs->fs_bsize, fs->fs_bsize)) {
+				if ((error = add_remap(w, blkstofrags(fs, ch->first + i), 0)) != 0)
+					return (error);
+				w->zeros++;
+				continue;
+			}
+			bufs[n] = ch->data + (size_t)i * fs->fs_bsize;
+			blknos[n++] = blkstofrags(fs, ch->first + i);
+		}
+		if ((error = ddfs_fingerprint_batch(fs->fs_ddfingerprint, bufs, n, fs->fs_bsize,
+		    keys)) != 0)
+			return (error);
+		w->hashed += n;
+		for (int j = 0; j < n; j++)
+			if ((error = dedup_block(w, blknos[j], bufs[j], keys[j])) != 0)
+				return (error);
+	}
+	return (0);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct chunkq *q = w->q;
+	struct chunk *ch;
+
+	pthread_mutex_lock(&q->mtx);
+	for (;;) {
+		while (q->full == NULL && !q->eof && !q->error)
+			pthread_cond_wait(&q->cv, &q->mtx);
+		if ((ch = q->full) == NULL || q->error)
+			break;
+		if ((q->full = ch->next) == NULL)
+			q->fulltail = &q->full;
+		pthread_mutex_unlock(&q->mtx);
+		w->error = hash_chunk(w, ch);
+		pthread_mutex_lock(&q->mtx);
+		ch->next = q->free;
+		q->free = ch;
+		if (w->error != 0)
+			q->error = 1;
+		pthread_cond_broadcast(&q->cv);
+		if (w->error != 0)
+			break;
+	}
+	pthread_mutex_unlock(&q->mtx);
+	return (NULL);
+}
+
+/*
+ * Read the marked blocks in order, the span of each chunk of CHUNK_BLOCKS
+ * holding any in one read, while `nthreads` workers hash them. Returns the
+ * duplicates found, sorted by block.
+ */
+static struct remap *
+hash_blocks(struct image *img, int nthreads, size_t *nremapsp, struct worker *total)
+{
+	struct fs *fs = img->fs;
+	struct chunkq q;
+	struct chunk *chunks, *ch;
+	struct worker *w;
+	struct remap *remaps;
+	int64_t first, last = 0;
+	size_t n;
+	int error;
+
+	memset(&q, 0, sizeof(q));
+	pthread_mutex_init(&q.mtx, NULL);
+	pthread_cond_init(&q.cv, NULL);
+	q.fulltail = &q.full;
+	/* two chunks per worker, so the next one is read while one is hashed */
+	if ((chunks = calloc(2 * nthreads, sizeof(*chunks))) == NULL ||
+	    (w = calloc(nthreads, sizeof(*w))) == NULL)
+		err(1, "workers");
+	for (int i = 0; i < 2 * nthreads; i++) {
+		if ((chunks[i].data = malloc((size_t)CHUNK_BLOCKS * fs->fs_bsize)) == NULL)
+			err(1, "read buffers");
+		chunks[i].next = q.free;
+		q.free = &chunks[i];
+	}
+	for (int t = 0; t < nthreads; t++) {
+		w[t].img = img;
+		w[t].q = &q;
+		if ((w[t].verify = malloc(fs->fs_bsize)) == NULL)
+			err(1, "workers");
+		if ((error = pthread_create(&w[t].thread, NULL, worker_main, &w[t])) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
+	}
+
+	for (int64_t c = 0; c < img->nblocks && !q.error; c += CHUNK_BLOCKS) {
+		first = -1;
+		for (int64_t b = c; b < MIN(c + CHUNK_BLOCKS, img->nblocks); b++) {
+			if (isset(img->cand, b)) {
+				if (first == -1)
+					first = b;
+				last = b;
+			}
+		}
+		if (first == -1)
+			continue;
+		pthread_mutex_lock(&q.mtx);
+		while (q.free == NULL && !q.error)
+			pthread_cond_wait(&q.cv, &q.mtx);
+		if (q.error) {
+			pthread_mutex_unlock(&q.mtx);
+			break;
+		}
+		ch = q.free;
+		q.free = ch->next;
+		pthread_mutex_unlock(&q.mtx);
+
+		ch->first = first;
+		ch->nblks = last - first + 1;
+		if (ddimage_read(&img->di, (off_t)first * fs->fs_bsize, ch->data,
+		    (size_t)ch->nblks * fs->fs_bsize) != 0)
+			err(1, "reading blocks %jd-%jd", (intmax_t)blkstofrags(fs, first),
+			    (intmax_t)blkstofrags(fs, last));
+
+		pthread_mutex_lock(&q.mtx);
+		ch->next = NULL;
+		*q.fulltail = ch;
+		q.fulltail = &ch->next;
+		pthread_cond_broadcast(&q.cv);
+		pthread_mutex_unlock(&q.mtx);
+	}
+	pthread_mutex_lock(&q.mtx);
+	q.eof = 1;
+	pthread_cond_broadcast(&q.cv);
+	pthread_mutex_unlock(&q.mtx);
+
+	memset(total, 0, sizeof(*total));
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(w[t].thread, NULL);
+		if (w[t].error != 0)
+			errx(1, "hashing blocks: %s", strerror(w[t].error));
+		total->hashed += w[t].hashed;
+		total->unique += w[t].unique;
+		total->dups += w[t].dups;
+		total->zeros += w[t].zeros;
+		total->collisions += w[t].collisions;
+		total->pinned += w[t].pinned;
+	}
+	if ((remaps = malloc(MAX(total->dups + total->zeros, 1) * sizeof(*remaps))) == NULL)
+		err(1, "remaps");
+	n = 0;
+	for (int t = 0; t < nthreads; t++) {
+		if (w[t].nremaps > 0)
+			memcpy(&remaps[n], w[t].remaps, w[t].nremaps * sizeof(*remaps));
+		n += w[t].nremaps;
+		free(w[t].remaps);
+		free(w[t].verify);
+	}
+	qsort(remaps, n, sizeof(*remaps), remap_cmp);
+	*nremapsp = n;
+	for (int i = 0; i < 2 * nthreads; i++)
+		free(chunks[i].data);
+	free(chunks);
+	free(w);
+	return (remaps);
+}
+
+/* free the duplicates `remaps`, sorted by block, in the cylinder group maps */
+static void
+free_blocks(struct image *img, const struct remap *remaps, size_t nremaps)
+{
+	struct fs *fs = img->fs;
+	struct cg *cgp;
+	ufs1_daddr_t bno;
+	size_t i = 0;
+	int c;
+
+	if ((cgp = malloc(fs->fs_cgsize)) == NULL)
+		err(1, "cylinder group");
+	while (i < nremaps) {
+		c = dtog(fs, remaps[i].from);
+		ddimage_cg_read(&img->di, c, cgp);
+		for (; i < nremaps && dtog(fs, remaps[i].from) == c; i++) {
+			bno = fragstoblks(fs, dtogd(fs, remaps[i].from));
+			if (ffs_isblock(fs, cg_blksfree(cgp), bno))
+				errx(1, "block %jd is already free", (intmax_t)remaps[i].from);
+			ffs_setblock(fs, cg_blksfree(cgp), bno);
+			ffs_clusteracct(fs, cgp, bno, 1);
+			cgp->cg_cs.cs_nbfree++;
+			fs->fs_cs(fs, c).cs_nbfree++;
+			fs->fs_cstotal.cs_nbfree++;
+		}
+		ddimage_cg_write(&img->di, c, cgp);
+	}
+	free(cgp);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, error, nthreads = 0, vflag = 0;
+	char *device = NULL;
+	struct image *img;
+	struct fs *fs;
+	struct ddtable *dt;
+	struct walkstate ws;
+	struct remap *remaps;
+	struct worker total;
+	size_t nremaps;
+	uint64_t ncand = 0;
+	double start, secs;
+
+	while ((ch = getopt(argc, argv, "hf:j:v")) != -1) {
+		switch (ch) {
+		case 'f':
+			device = optarg;
+			break;
+		case 'j':
+			if ((nthreads = atoi(optarg)) < 1)
+				errx(1, "bad thread count %s", optarg);
+			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (device == NULL) {
+		usage();
+		exit(1);
+	}
+	if (nthreads == 0 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nthreads = 1;
+
+	if ((img = calloc(1, sizeof(*img))) == NULL)
+		err(1, "image");
+	ddimage_open(&img->di, device, O_RDWR);
+	fs = img->fs = img->di.fs;
+	if (!DDFS_DDFORMAT_OK(fs->fs_ddformat))
+		errx(1, "%s: dedup table format %d, expected %d to %d", device,
+		    fs->fs_ddformat, DDFS_DDFORMAT_MIN, DDFS_DDFORMAT);
+	if (fs->fs_bsize != DDFS_BLOCKSIZE)
+		errx(1, "%s: block size %d, only %d byte blocks are deduplicated", device,
+		    fs->fs_bsize, DDFS_BLOCKSIZE);
+	if (ddfs_fingerprint_name(fs->fs_ddfingerprint) == NULL)
+		errx(1, "%s: unknown fingerprint algorithm %d", device, fs->fs_ddfingerprint);
+	/* a read-write mount clears fs_clean on the disk until it is unmounted */
+	if (fs->fs_clean == 0 || (fs->fs_flags & (FS_UNCLEAN | FS_NEEDSFSCK)) != 0)
+		errx(1, "%s: not clean; unmount it, or run fsck", device);
+	/* a snapshot may hold the only copy of a block a file no longer points at */
+	if (fs->fs_snapinum[0] != 0)
+		errx(1, "%s: has snapshots, remove them first", device);
+
+	ddimage_table_init(&img->t, &img->di, fs->fs_ddblkno, fs->fs_dedupfrags / fs->fs_frag,
+	    fs->fs_ddformat);
+	ddimage_table_locks(&img->t, IMAGE_LOCKS);
+	dt = &img->t.dt;
+
+	img->nblocks = fragstoblks(fs, fs->fs_size);
+	if ((img->intable = calloc(1, howmany(img->nblocks, NBBY))) == NULL ||
+	    (img->cand = calloc(1, howmany(img->nblocks, NBBY))) == NULL)
+		err(1, "block bitmaps");
+
+	/* entries only in the log would be missed, and replaying it at mount would undo ours */
+	if ((error = ddimage_log_checkpoint(&img->t)) != 0)
+		errx(1, "replaying intent log: %s", strerror(error));
+	start = ddimage_now();
+	if ((error = ddtable_foreach(dt, table_scan, img)) != 0)
+		errx(1, "scanning table: %s", strerror(error));
+	if (vflag)
+		printf("scanned %jd table blocks in %.3f s\n", (intmax_t)dt->dt_nbuckets,
+		    ddimage_now() - start);
+
+	start = ddimage_now();
+	memset(&ws, 0, sizeof(ws));
+	ws.img = img;
+	ws.what = COLLECT;
+	walk_inodes(&ws);
+	for (int64_t b = 0; b < img->nblocks; b++)
+		if (isset(img->cand, b))
+			ncand++;
+	if (vflag)
+		printf("scanned %d cylinder groups in %.3f s\n", fs->fs_ncg, ddimage_now() - start);
+	printf("%s: %ju full file blocks, %ju not in the dedup table\n", device,
+	    (uintmax_t)ws.nptrs, (uintmax_t)ncand);
+
+	start = ddimage_now();
+	remaps = hash_blocks(img, nthreads, &nremaps, &total);
+	ddimage_flush(&img->di);
+	secs = ddimage_now() - start;
+	printf("hashed %ju blocks in %.3f s (%.0f MiB/s, %d thread%s)\n",
+	    (uintmax_t)total.hashed, secs,
+	    total.hashed * (double)fs->fs_bsize / (1 << 20) / MAX(secs, 1e-6), nthreads,
+	    nthreads == 1 ? "" : "s");
+	printf("%ju unique, %ju duplicates, %ju blocks of zeros\n", (uintmax_t)total.unique,
+	    (uintmax_t)total.dups, (uintmax_t)total.zeros);
+	if (total.collisions > 0)
+		printf("%ju blocks matched a block with other contents, and were left alone\n",
+		    (uintmax_t)total.collisions);
+	if (total.pinned > 0)
+		printf("%ju duplicates share blocks whose refcount is pinned, and will never be freed\n",
+		    (uintmax_t)total.pinned);
+
+	if (nremaps > 0) {
+		start = ddimage_now();
+		ws.what = REMAP;
+		ws.remaps = remaps;
+		ws.nremaps = nremaps;
+		walk_inodes(&ws);
+		ddimage_flush(&img->di);
+		if (ws.changed != nremaps)
+			errx(1, "switched %ju block pointers, expected %zu", (uintmax_t)ws.changed,
+			    nremaps);
+		free_blocks(img, remaps, nremaps);
+		ddimage_write_sb(&img->di);
+		if (vflag)
+			printf("switched block pointers and freed blocks in %.3f s\n",
+			    ddimage_now() - start);
+	}
+	printf("%zu blocks (%ju MiB) freed\n", nremaps,
+	    (uintmax_t)((uint64_t)nremaps * fs->fs_bsize >> 20));
+
+	free(remaps);
+	free(img->cand);
+	free(img->intable);
+	ddimage_table_free(&img->t);
+	ddimage_close(&img->di);
+	free(img);
+	return (0);
+}
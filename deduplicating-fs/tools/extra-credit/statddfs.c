@@ -1,136 +1,377 @@
-#include <sys/disk.h>
-#include <sys/ioctl.h>
-#include <sys/mount.h>
-#include <sys/stat.h>
+/*
+ * statddfs: report how much space deduplication saves on a ddfs filesystem,
+ * and how full and well spread its dedup table is, as JSON.
+ *
+ * The table is read straight from the device in large sequential reads,
+ * split into contiguous ranges of buckets between threads. Each thread keeps
+ * statistics of its own, which are added together at the end:
+ *
+ * - entries by state, references, entries whose refcount is pinned, and the
+ *   blocks and bytes saved. A pinned entry may have any number of references,
+ *   so it is counted apart and left out of the references and savings;
+ * - histograms of the refcounts of active entries, of the active entries per
+ *   bucket, and of the probe length of each entry (the buckets a lookup reads
+ *   to find it, 1 if it is in its home bucket);
+ * - the runs of consecutive buckets without a free slot, which is what a
+ *   lookup of a key that is not in the table reads;
+ * - the most shared blocks.
+ *
+ * Histogram bins are powers of 2: a bin holds the values from `min` to `max`.
+ * The table is read as it is on the disk, so on a mounted filesystem it may
+ * be behind the intent log.
+ */
+
+#include <sys/param.h>
 
-#include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
-#include "ddfs.h"
-#include "ddfs_fs.h"
+#include "ddimage.h"
+
+/* table blocks read at once by a thread, 4MiB */
+#define READ_BLOCKS 1024
+
+/* histogram bins: 0, then [2^(i-1), 2^i - 1] for bin i */
+#define NBINS 64
+#define BIN(v) ((v) == 0 ? 0 : flsll(v))
+
+/* an entry of the most shared blocks */
+struct shared {
+	uint32_t refs;
+	bool pinned;
+	daddr_t blockptr;
+	uint8_t key[20];
+};
+
+/* statistics of a range of buckets */
+struct stats {
+	pthread_t thread;
+	int64_t lo, hi; /* buckets [lo, hi) */
+	uint64_t active, dead, free, refs, pinned;
+	uint64_t refhist[NBINS];
+	uint64_t fillhist[NBINS];
+	uint64_t probehist[NBINS];
+	uint64_t probesum, probemax;
+	struct shared *top; /* min-heap of the `ntop` most shared blocks */
+	int ntop;
+	int error;
+};
+
+static struct ddimage img;
+static struct ddimage_table table;
+static struct ddtable *dt = &table.dt;
+static uint8_t *hasfree; /* buckets with a free slot */
+static int maxtop = 10;
+
+static void
+usage(void)
+{
+	printf("statddfs -f device [-t threads] [-n top]\n");
+	printf("-f device\t\tddfs filesystem or image\n");
+	printf("-t threads\t\tthreads reading the table (default: one per CPU)\n");
+	printf("-n top\t\t\tnumber of most shared blocks to list (default 10)\n");
+}
+
+/* add `s` to the min-heap of the most shared blocks in `st` */
+static void
+top_add(struct stats *st, const struct shared *s)
+{
+	struct shared *h = st->top, tmp;
+	int i, c;
+
+	if (st->ntop == maxtop) {
+		if (maxtop == 0 || s->refs <= h[0].refs)
+			return;
+		/* replace the least shared, and sift it down */
+		h[0] = *s;
+		for (i = 0; (c = 2 * i + 1) < st->ntop; i = c) {
+			if (c + 1 < st->ntop && h[c + 1].refs < h[c].refs)
+				c++;
+			if (h[i].refs <= h[c].refs)
+				break;
+			tmp = h[i];
+			h[i] = h[c];
+			h[c] = tmp;
+		}
+		return;
+	}
+	/* append, and sift it up */
+	h[i = st->ntop++] = *s;
+	for (; i > 0 && h[(i - 1) / 2].refs > h[i].refs; i = (i - 1) / 2) {
+		tmp = h[i];
+		h[i] = h[(i - 1) / 2];
+		h[(i - 1) / 2] = tmp;
+	}
+}
+
+/* account for `bucket`, whose table block is `data` */
+static void
+scan_bucket(struct stats *st, int64_t bucket, const uint8_t *data)
+{
+	struct ddfs_dedup entry;
+	struct shared s;
+	uint64_t probe, fill = 0;
+
+	for (int i = 0; i < dt->dt_nentries; i++) {
+		ddtable_getentry(dt, data, i, &entry);
+		if (entry.flags & DDFS_DEDUP_FREE) {
+			st->free++;
+			hasfree[bucket] = 1;
+			continue;
+		}
+		if (entry.flags & DDFS_DEDUP_DEAD) {
+			st->dead++;
+			continue;
+		}
+		if ((entry.flags & DDFS_DEDUP_ACTIVE) == 0)
+			continue;
+		st->active++;
+		st->refhist[BIN(entry.ref_count)]++;
+		if (DDTABLE_PINNED(dt, &entry))
+			st->pinned++;
+		else
+			st->refs += entry.ref_count;
+		fill++;
+		/* buckets probed from the home bucket to this one, wrapping around */
+		probe = (bucket - ddtable_bucket(dt, entry.key) + dt->dt_nbuckets) %
+		    dt->dt_nbuckets + 1;
+		st->probehist[BIN(probe)]++;
+		st->probesum += probe;
+		st->probemax = MAX(st->probemax, probe);
+		if (entry.ref_count > 1) {
+			s.refs = entry.ref_count;
+			s.pinned = DDTABLE_PINNED(dt, &entry);
+			s.blockptr = entry.blockptr;
+			memcpy(s.key, entry.key, sizeof(s.key));
+			top_add(st, &s);
+		}
+	}
+	st->fillhist[BIN(fill)]++;
+}
 
-void
-usage()
+static void *
+scan_main(void *arg)
 {
-	printf("mkkvfs [-f device]\n");
-	printf("-f device\t\tThe file to read\n");
+	struct stats *st = arg;
+	uint8_t *buf;
+	int64_t b, n;
+	size_t size;
+
+	if ((buf = malloc((size_t)READ_BLOCKS * dt->dt_bsize)) == NULL) {
+		st->error = ENOMEM;
+		return (NULL);
+	}
+	for (b = st->lo; b < st->hi; b += n) {
+		n = MIN(READ_BLOCKS, st->hi - b);
+		size = n * dt->dt_bsize;
+		if ((st->error = ddimage_read(&img, table.off + b * dt->dt_bsize, buf, size)) != 0)
+			break;
+		for (int64_t i = 0; i < n; i++)
+			scan_bucket(st, b + i, buf + i * dt->dt_bsize);
+	}
+	free(buf);
+	return (NULL);
+}
+
+static void
+print_hist(const char *name, const uint64_t hist[NBINS], const char *end)
+{
+	const char *sep = "";
+
+	printf("  \"%s\": [", name);
+	for (int i = 0; i < NBINS; i++) {
+		if (hist[i] == 0)
+			continue;
+		printf("%s\n    {\"min\": %" PRIu64 ", \"max\": %" PRIu64 ", \"count\": %" PRIu64 "}",
+		    sep, i == 0 ? 0 : (uint64_t)1 << (i - 1), i == 0 ? 0 : ((uint64_t)1 << i) - 1,
+		    hist[i]);
+		sep = ",";
+	}
+	printf("\n  ]%s\n", end);
+}
+
+static int
+shared_cmp(const void *a, const void *b)
+{
+	const struct shared *sa = a, *sb = b;
+
+	if (sa->refs != sb->refs)
+		return (sa->refs < sb->refs ? 1 : -1);
+	return ((sa->blockptr > sb->blockptr) - (sa->blockptr < sb->blockptr));
 }
 
 int
-main(int argc, char** argv) {
-	int ch;
-	//uint8_t buf[DDFS_BLOCKSIZE];
+main(int argc, char **argv)
+{
+	int ch, error, nthreads = 0, ntop;
 	char *device = NULL;
-	int error;
-	int fd;
-	char readbuffer[SBLOCKSIZE + 1];
-   int read_size;
-	int num_used_dedup_entries;
-   int tot_ref_count;
-   
-	while ((ch = getopt(argc, argv, "hf:")) != -1) {
+	struct fs *fs;
+	struct stats *st, tot;
+	struct shared *top;
+	uint64_t runhist[NBINS], run, runmax, nruns, slots, unpinned;
+	int64_t first;
+	double start;
+
+	while ((ch = getopt(argc, argv, "hf:t:n:")) != -1) {
 		switch (ch) {
-		/* get device name */
-		case 'f': {
+		case 'f':
 			device = optarg;
 			break;
-		}
-		/* print usage menu */
-		case 'h': {
-			usage();
-			exit(1);
-		}
+		case 't':
+			if ((nthreads = atoi(optarg)) < 1)
+				errx(1, "bad thread count %s", optarg);
+			break;
+		case 'n':
+			if ((maxtop = atoi(optarg)) < 0)
+				errx(1, "bad count %s", optarg);
+			break;
+		case 'h':
 		default:
 			usage();
 			exit(1);
 		}
 	}
-	argv += optind;
-	argc -= optind;
-
-	if (device != NULL)
-		printf("%s\n", device);
-	else
-		printf("Got no filename\n");
-	fd = open(device, O_RDONLY);
-	if (fd <= 0) {
-		printf("Could not open file\n");
+	if (device == NULL) {
+		usage();
 		exit(1);
 	}
-   lseek(fd, SBLOCK_UFS2, SEEK_SET);
-	read_size = read(fd, readbuffer, SBLOCKSIZE);
-	struct fs check;
-   int32_t dedup_offset;
-   int32_t n_dedup_blocks;
-   int32_t n_dedup_entries;
-   int32_t curr_block_no;
-   int32_t n_dedup_entries_per_block;
-   int64_t space_saved;
-	if (strlen(readbuffer) == 0) {
-		perror("Empty file");
-      close(fd);
-		exit(1);
+	if (nthreads == 0 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		nthreads = 1;
+
+	ddimage_open(&img, device, O_RDONLY);
+	fs = img.fs;
+	if (!DDFS_DDFORMAT_OK(fs->fs_ddformat))
+		errx(1, "%s: dedup table format %d, expected %d to %d", device,
+		    fs->fs_ddformat, DDFS_DDFORMAT_MIN, DDFS_DDFORMAT);
+	ddimage_table_init(&table, &img, fs->fs_ddblkno, fs->fs_dedupfrags / fs->fs_frag,
+	    fs->fs_ddformat);
+	if (dt->dt_nbuckets == 0)
+		errx(1, "%s: no dedup table", device);
+	if ((hasfree = calloc(dt->dt_nbuckets, 1)) == NULL ||
+	    (st = calloc(nthreads, sizeof(*st))) == NULL)
+		err(1, "statistics");
+
+	/* threads take ranges of whole reads, so that all of them are the same size */
+	nthreads = MIN(nthreads, howmany(dt->dt_nbuckets, READ_BLOCKS));
+	start = ddimage_now();
+	for (int t = 0; t < nthreads; t++) {
+		st[t].lo = howmany(dt->dt_nbuckets, READ_BLOCKS) * t / nthreads * READ_BLOCKS;
+		st[t].hi = MIN(howmany(dt->dt_nbuckets, READ_BLOCKS) * (t + 1) / nthreads *
+		    READ_BLOCKS, dt->dt_nbuckets);
+		if ((st[t].top = calloc(MAX(maxtop, 1), sizeof(struct shared))) == NULL)
+			err(1, "statistics");
+		if ((error = pthread_create(&st[t].thread, NULL, scan_main, &st[t])) != 0)
+			errx(1, "pthread_create: %s", strerror(error));
 	}
-/*
- * superblock is located at SBLOCK_UFS2 byte offset
- * read in the superblock (struct fs in ddfs_fs.h)
- * get the offset for the dedup table (fs->fs_ddblkno)
- * get the number of 4k blocks in the dedup table (fs->fs_dedupfrags)
- * read the dedup table and count all the active entries
- */
+	memset(&tot, 0, sizeof(tot));
+	if ((top = calloc(MAX(nthreads * maxtop, 1), sizeof(*top))) == NULL)
+		err(1, "statistics");
+	ntop = 0;
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(st[t].thread, NULL);
+		if (st[t].error != 0)
+			errx(1, "%s: reading table: %s", device, strerror(st[t].error));
+		tot.active += st[t].active;
+		tot.dead += st[t].dead;
+		tot.free += st[t].free;
+		tot.refs += st[t].refs;
+		tot.pinned += st[t].pinned;
+		tot.probesum += st[t].probesum;
+		tot.probemax = MAX(tot.probemax, st[t].probemax);
+		for (int i = 0; i < NBINS; i++) {
+			tot.refhist[i] += st[t].refhist[i];
+			tot.fillhist[i] += st[t].fillhist[i];
+			tot.probehist[i] += st[t].probehist[i];
+		}
+		memcpy(&top[ntop], st[t].top, st[t].ntop * sizeof(*top));
+		ntop += st[t].ntop;
+		free(st[t].top);
+	}
+	qsort(top, ntop, sizeof(*top), shared_cmp);
+	ntop = MIN(ntop, maxtop);
 
-	memcpy(&check, readbuffer, sizeof(struct fs));
-	if (check.fs_magic != FS_DDFS_MAGIC) {
-		printf("Error: incorrectly formatted file. Please try a different file\n");
-		close(fd);
-		exit(1);
-	} else {
-		printf("Got correctly formatted file\n");
+	/*
+	 * Runs of buckets without a free slot. A run reaching the end of the
+	 * table continues at the start, where the probes wrap around to.
+	 */
+	memset(runhist, 0, sizeof(runhist));
+	runmax = nruns = 0;
+	for (first = 0; first < dt->dt_nbuckets && !hasfree[first]; first++)
+		;
+	run = first;
+	for (int64_t b = first; b < dt->dt_nbuckets; b++) {
+		if (!hasfree[b]) {
+			run++;
+			continue;
+		}
+		if (run > 0) {
+			runhist[BIN(run)]++;
+			runmax = MAX(runmax, run);
+			nruns++;
+		}
+		run = 0;
+	}
+	if (run > 0) {
+		runhist[BIN(run)]++;
+		runmax = MAX(runmax, run);
+		nruns++;
 	}
-   dedup_offset = check.fs_ddblkno;
-	//lseek(fd, dedup_offset, SEEK_SET);
-	num_used_dedup_entries = 0;
-   tot_ref_count = 0;
-   
-   /* get the number of blocks containing dedup entries and the total number of dedup entries */
-   n_dedup_blocks = check.fs_dedupfrags;
-   n_dedup_entries_per_block = DDFS_BLOCKSIZE / sizeof(struct ddfs_dedup);
-   n_dedup_entries = n_dedup_blocks * n_dedup_entries_per_block;
-   printf("superblock offset = %d\n", SBLOCK_UFS2);
-   printf("n_dedup_blocks = %d\n", n_dedup_blocks);
-   printf("n_dedup_entries = %d\n", n_dedup_entries);
-   printf("n_dedup_entries_per_block = %d\n", n_dedup_entries_per_block);
-	for (curr_block_no = 1; curr_block_no <= n_dedup_blocks; curr_block_no++) {
-      int i;
-      struct ddfs_dedup check;
-      
-      memset(readbuffer, 0, DDFS_BLOCKSIZE + 1);
-      read_size = read(fd, readbuffer, DDFS_BLOCKSIZE);
-      readbuffer[DDFS_BLOCKSIZE] = 0;
-      if (read_size < 0) {
-         perror("dedup read error");
-         close(fd);
-         exit(1);
-      }
-      for (i = 0; i < n_dedup_entries_per_block; i++) {
-         memcpy(&check, readbuffer + (i * sizeof(check)), sizeof(check));
-/*printf("got check with key = '%s', flags = %d, ref_count = %d\n", check.key, check.flags, check.ref_count);*/
-         if (check.flags & DDFS_DEDUP_ACTIVE) {
-            num_used_dedup_entries++;
-            tot_ref_count += check.ref_count;
-         }
-      }
-   }
-	close(fd);
-   printf("You have used %d data block(s) with %d references to the data\n\n", num_used_dedup_entries, tot_ref_count);
-   space_saved = (tot_ref_count - num_used_dedup_entries) * DDFS_BLOCKSIZE;
-   printf("You have saved %jd space!\n", space_saved);
-	return 0;
+	slots = (uint64_t)dt->dt_nbuckets * dt->dt_nentries;
+
+	printf("{\n");
+	printf("  \"device\": \"%s\",\n", device);
+	printf("  \"seconds\": %.3f,\n", ddimage_now() - start);
+	printf("  \"threads\": %d,\n", nthreads);
+	printf("  \"block_size\": %d,\n", fs->fs_bsize);
+	printf("  \"format\": %d,\n", fs->fs_ddformat);
+	printf("  \"buckets\": %" PRId64 ",\n", dt->dt_nbuckets);
+	printf("  \"entries_per_bucket\": %d,\n", dt->dt_nentries);
+	printf("  \"slots\": %" PRIu64 ",\n", slots);
+	printf("  \"active\": %" PRIu64 ",\n", tot.active);
+	printf("  \"dead\": %" PRIu64 ",\n", tot.dead);
+	printf("  \"free\": %" PRIu64 ",\n", tot.free);
+	printf("  \"load_factor\": %.6f,\n", (double)tot.active / slots);
+	printf("  \"references\": %" PRIu64 ",\n", tot.refs);
+	printf("  \"pinned\": %" PRIu64 ",\n", tot.pinned);
+	/* pinned entries count neither in `refs` nor here */
+	unpinned = tot.active - tot.pinned;
+	printf("  \"blocks_saved\": %" PRIu64 ",\n", tot.refs - unpinned);
+	printf("  \"bytes_saved\": %" PRIu64 ",\n", (tot.refs - unpinned) * fs->fs_bsize);
+	printf("  \"dedup_ratio\": %.3f,\n",
+	    unpinned == 0 ? 1.0 : (double)tot.refs / unpinned);
+	print_hist("refcounts", tot.refhist, ",");
+	print_hist("bucket_fill", tot.fillhist, ",");
+	printf("  \"probe_length_mean\": %.3f,\n",
+	    tot.active == 0 ? 0.0 : (double)tot.probesum / tot.active);
+	printf("  \"probe_length_max\": %" PRIu64 ",\n", tot.probemax);
+	print_hist("probe_lengths", tot.probehist, ",");
+	printf("  \"full_runs\": %" PRIu64 ",\n", nruns);
+	printf("  \"full_run_max\": %" PRIu64 ",\n", runmax);
+	print_hist("full_run_lengths", runhist, ",");
+	printf("  \"most_shared\": [");
+	for (int i = 0; i < ntop; i++) {
+		printf("%s\n    {\"block\": %" PRId64 ", \"refs\": %" PRIu32 ", \"pinned\": %s, "
+		    "\"key\": \"", i == 0 ? "" : ",", (int64_t)top[i].blockptr, top[i].refs,
+		    top[i].pinned ? "true" : "false");
+		for (int k = 0; k < 20; k++)
+			printf("%02x", top[i].key[k]);
+		printf("\"}");
+	}
+	printf("\n  ]\n}\n");
+
+	free(top);
+	free(st);
+	free(hasfree);
+	ddimage_close(&img);
+	return (0);
 }
@@ -0,0 +1,170 @@
+/*
+ * fpbench: benchmark the block fingerprint algorithms from ddfs_fingerprint.c
+ * over 4KiB blocks.
+ *
+ * Blocks are filled from a seeded PRNG and fingerprinted in a loop over a
+ * working set of configurable size, so the working set can be made to fit in
+ * the CPU caches or not. For fingerprints that are not collision resistant,
+ * the cost of comparing each block with a copy of itself (what the kernel
+ * does when a fingerprint is found in the table) is reported separately.
+ * Each algorithm is also timed through ddfs_fingerprint_batch(), the way
+ * ffs_write() hashes the full blocks of a large write.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ddfs.h"
+
+static void
+usage(void)
+{
+	printf("fpbench [-a algorithm] [-b batch] [-n blocks] [-w workset] [-s seed]\n");
+	printf("-a algorithm\t\tsha1, sha256, blake3 or xxh64 (default all of them)\n");
+	printf("-b batch\t\tblocks per ddfs_fingerprint_batch() call (default 8)\n");
+	printf("-n blocks\t\tnumber of blocks to fingerprint (default 262144)\n");
+	printf("-w workset\t\tsize of the working set in KiB (default 16384)\n");
+	printf("-s seed\t\t\tseed used to fill blocks (default 1)\n");
+}
+
+/* splitmix64, used to fill blocks */
+static uint64_t
+splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+report(const char *what, uint64_t blocks, double secs)
+{
+	printf("%-14s %" PRIu64 " blocks in %.3f s, %.0f blocks/sec, %.1f MiB/s, "
+	       "%.0f ns/block\n",
+	    what, blocks, secs, blocks / secs,
+	    blocks * (double)DDFS_BLOCKSIZE / secs / (1024 * 1024), secs * 1e9 / blocks);
+}
+
+/*
+ * fingerprint `nblocks` blocks of `ws`, cycling through its `wsblocks` blocks,
+ * one at a time and then `batch` at a time
+ */
+static void
+bench(int fp, const uint8_t *ws, const uint8_t *copy, uint64_t wsblocks,
+    uint64_t nblocks, int batch)
+{
+	const void *bufs[batch];
+	uint8_t key[20], keys[batch][20];
+	uint64_t sum = 0, i;
+	double start;
+	char what[32];
+
+	start = now();
+	for (i = 0; i < nblocks; i++) {
+		ddfs_fingerprint(fp, ws + (i % wsblocks) * DDFS_BLOCKSIZE, DDFS_BLOCKSIZE,
+		    key);
+		sum += key[0];
+	}
+	report(ddfs_fingerprint_name(fp), nblocks, now() - start);
+
+	start = now();
+	for (i = 0; i < nblocks; i += batch) {
+		for (int b = 0; b < batch; b++)
+			bufs[b] = ws + ((i + b) % wsblocks) * DDFS_BLOCKSIZE;
+		ddfs_fingerprint_batch(fp, bufs, batch, DDFS_BLOCKSIZE, keys);
+		sum += keys[0][0];
+	}
+	snprintf(what, sizeof(what), "%s x%d", ddfs_fingerprint_name(fp), batch);
+	report(what, i, now() - start);
+
+	if (DDFS_FP_VERIFY(fp)) {
+		start = now();
+		for (i = 0; i < nblocks; i++) {
+			const uint8_t *b = ws + (i % wsblocks) * DDFS_BLOCKSIZE;
+
+			ddfs_fingerprint(fp, b, DDFS_BLOCKSIZE, key);
+			sum += key[0];
+			sum += memcmp(b, copy + (i % wsblocks) * DDFS_BLOCKSIZE,
+			    DDFS_BLOCKSIZE) == 0;
+		}
+		snprintf(what, sizeof(what), "%s+verify", ddfs_fingerprint_name(fp));
+		report(what, nblocks, now() - start);
+	}
+
+	/* keep the compiler from dropping the loops */
+	if (sum == 1)
+		printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, fp = -1, batch = 8;
+	uint64_t nblocks = 262144, wskib = 16384, seed = 1, wsblocks, x;
+	uint8_t *ws, *copy;
+
+	while ((ch = getopt(argc, argv, "ha:b:n:w:s:")) != -1) {
+		switch (ch) {
+		case 'a':
+			if ((fp = ddfs_fingerprint_byname(optarg)) < 0)
+				errx(1, "%s: unknown fingerprint", optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'n':
+			nblocks = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			wskib = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	wsblocks = wskib * 1024 / DDFS_BLOCKSIZE;
+	if (nblocks == 0 || wsblocks == 0 || batch <= 0) {
+		usage();
+		exit(1);
+	}
+
+	if ((ws = malloc(wsblocks * DDFS_BLOCKSIZE)) == NULL ||
+	    (copy = malloc(wsblocks * DDFS_BLOCKSIZE)) == NULL)
+		err(1, "allocating a %" PRIu64 " KiB working set", wskib);
+	x = seed;
+	for (uint64_t i = 0; i < wsblocks * DDFS_BLOCKSIZE / sizeof(x); i++) {
+		x = splitmix64(x);
+		memcpy(ws + i * sizeof(x), &x, sizeof(x));
+	}
+	memcpy(copy, ws, wsblocks * DDFS_BLOCKSIZE);
+	printf("%" PRIu64 " KiB working set of %d byte blocks\n", wskib, DDFS_BLOCKSIZE);
+
+	for (int i = 0; i <= DDFS_FP_MAX; i++)
+		if (fp < 0 || fp == i)
+			bench(i, ws, copy, wsblocks, nblocks, batch);
+	free(ws);
+	free(copy);
+	return (0);
+}
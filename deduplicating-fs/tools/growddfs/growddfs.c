@@ -0,0 +1,188 @@
+/*
+ * growddfs: move the dedup table of an unmounted ddfs filesystem to a larger
+ * region, so that it holds more entries.
+ *
+ * newfs-ddfs sizes the table for a fraction of the disk, or for the number of
+ * entries given with -D. Once it is full, new blocks are no longer
+ * deduplicated. This makes room for more entries without reformatting:
+ *
+ * 1. the intent log is replayed into the table, and cleared, since its
+ *    records name slots of the old table;
+ * 2. a run of free blocks large enough for the new table is allocated in the
+ *    cylinder group maps;
+ * 3. the new table is written with empty buckets, and every entry of the old
+ *    one is copied, with its refcount, to where its key hashes in the new one;
+ * 4. the superblock is switched to the new table, and marked as having a
+ *    stale reverse index (fs_ddrevstale);
+ * 5. the blocks of the old table are freed, unless it is the one newfs-ddfs
+ *    placed ahead of the first cylinder group, which stays reserved;
+ * 6. the reverse index is rebuilt from the new table, and the mark cleared.
+ *
+ * Each step is flushed to the disk before the next one starts. The old table
+ * is left as it is until the superblock is switched, so stopping before then
+ * only leaks the new region, and stopping before the old table is freed leaks
+ * that. A reverse index left stale is rebuilt by running growddfs again, or by
+ * the kernel module at the next read-write mount.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libutil.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ddimage.h"
+
+static void
+usage(void)
+{
+	printf("growddfs -f device -n entries [-v]\n");
+	printf("-f device\t\tddfs filesystem (must not be mounted)\n");
+	printf("-n entries\t\tentries to make room for (k, m, g suffixes)\n");
+	printf("-v\t\t\tprint the time each step takes\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, error, vflag = 0;
+	char *device = NULL;
+	struct ddimage *img;
+	struct fs *fs;
+	struct ddimage_table *from, *to;
+	uint64_t ncopied, nrev;
+	uint64_t seq;
+	int64_t nentries = 0, nbuckets, oldblkno, oldbuckets, newblkno;
+	uint8_t *empty;
+	double start;
+
+	while ((ch = getopt(argc, argv, "hf:n:v")) != -1) {
+		switch (ch) {
+		case 'f':
+			device = optarg;
+			break;
+		case 'n':
+			if (expand_number(optarg, (uint64_t *)&nentries) < 0 || nentries <= 0)
+				errx(1, "bad entry count %s", optarg);
+			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (device == NULL || nentries == 0) {
+		usage();
+		exit(1);
+	}
+
+	if ((img = calloc(1, sizeof(*img))) == NULL ||
+	    (from = calloc(1, sizeof(*from))) == NULL ||
+	    (to = calloc(1, sizeof(*to))) == NULL)
+		err(1, "image");
+	ddimage_open(img, device, O_RDWR);
+	fs = img->fs;
+	if (!DDFS_DDFORMAT_OK(fs->fs_ddformat))
+		errx(1, "%s: dedup table format %d, expected %d to %d", device,
+		    fs->fs_ddformat, DDFS_DDFORMAT_MIN, DDFS_DDFORMAT);
+	/* a read-write mount clears fs_clean on the disk until it is unmounted */
+	if (fs->fs_clean == 0 || (fs->fs_flags & (FS_UNCLEAN | FS_NEEDSFSCK)) != 0)
+		errx(1, "%s: not clean; unmount it, or run fsck", device);
+	/* a snapshot would still claim the blocks given to the new table */
+	if (fs->fs_snapinum[0] != 0)
+		errx(1, "%s: has snapshots, remove them first", device);
+	/* table blocks are addressed relative to fs_ddblkno, in whole blocks */
+	if (fs->fs_ddblkno % fs->fs_frag != 0 || fs->fs_ddrevblkno % fs->fs_frag != 0 ||
+	    fs->fs_ddlogblkno % fs->fs_frag != 0)
+		errx(1, "%s: dedup regions are not block aligned", device);
+
+	oldblkno = fs->fs_ddblkno;
+	oldbuckets = fs->fs_dedupfrags / fs->fs_frag;
+	ddimage_table_init(from, img, oldblkno, oldbuckets, fs->fs_ddformat);
+	if (fs->fs_ddrevstale != 0) {
+		printf("%s: finishing an interrupted run\n", device);
+		nrev = ddimage_rev_rebuild(from);
+		fs->fs_ddrevstale = 0;
+		ddimage_write_sb(img);
+		printf("%s: rebuilt the reverse index of %ju entries\n", device,
+		    (uintmax_t)nrev);
+	}
+
+	nbuckets = ddtable_sizefor(fs->fs_ddformat, fs->fs_bsize, nentries);
+	if (nbuckets <= oldbuckets) {
+		printf("%s: the dedup table has room for %jd entries already (%jd blocks)\n",
+		    device, (intmax_t)oldbuckets * from->dt.dt_nentries * DDFS_TABLE_FILL / 100,
+		    (intmax_t)oldbuckets);
+		exit(0);
+	}
+	if ((uint64_t)freespace(fs, fs->fs_minfree) < (uint64_t)blkstofrags(fs, nbuckets))
+		errx(1, "%s: %jd blocks for the table are more than the free space",
+		    device, (intmax_t)nbuckets);
+
+	start = ddimage_now();
+	/* the intent log names slots of the old table: replay it, then zero it */
+	if ((error = ddtable_replay(&from->dt, &seq)) != 0)
+		errx(1, "%s: replaying intent log: %s", device, strerror(error));
+	ddimage_flush(img);
+	ddimage_log_clear(from);
+	if ((newblkno = ddimage_find_region(img, nbuckets)) == -1)
+		errx(1, "%s: no %jd free blocks in a row for the table", device,
+		    (intmax_t)nbuckets);
+	/* fs_ddblkno and fs_dedupfrags are 32 bits */
+	if (newblkno + blkstofrags(fs, nbuckets) > INT32_MAX)
+		errx(1, "%s: no room for the table in the first %d fragments", device,
+		    INT32_MAX);
+	ddimage_region_acct(img, newblkno, nbuckets, -1);
+	if (vflag)
+		printf("cleared the intent log and allocated %jd blocks at %jd in %.3f s\n",
+		    (intmax_t)nbuckets, (intmax_t)newblkno, ddimage_now() - start);
+
+	start = ddimage_now();
+	ddimage_table_init(to, img, newblkno, nbuckets, fs->fs_ddformat);
+	if ((empty = malloc(fs->fs_bsize)) == NULL)
+		err(1, "table block");
+	ddtable_initblock(&to->dt, empty);
+	ddimage_table_fill(to, 0, nbuckets, empty);
+	free(empty);
+	ncopied = ddimage_table_copy(from, to);
+	if (vflag)
+		printf("copied %ju entries in %.3f s\n", (uintmax_t)ncopied, ddimage_now() - start);
+
+	/* from here on the new table is the one in use */
+	fs->fs_ddblkno = newblkno;
+	fs->fs_dedupfrags = blkstofrags(fs, nbuckets);
+	fs->fs_ddrevstale = 1;
+	ddimage_write_sb(img);
+	/* the space newfs-ddfs set aside in the first cylinder group holds no file data */
+	if (oldblkno >= cgsblock(fs, 0))
+		ddimage_region_acct(img, oldblkno, oldbuckets, 1);
+
+	start = ddimage_now();
+	nrev = ddimage_rev_rebuild(to);
+	fs->fs_ddrevstale = 0;
+	ddimage_write_sb(img);
+	if (vflag)
+		printf("rebuilt the reverse index in %.3f s\n", ddimage_now() - start);
+	printf("%s: moved %ju entries from %jd to %jd table blocks at %jd, with room for %jd\n",
+	    device, (uintmax_t)ncopied, (intmax_t)oldbuckets, (intmax_t)nbuckets,
+	    (intmax_t)newblkno, (intmax_t)nbuckets * to->dt.dt_nentries * DDFS_TABLE_FILL / 100);
+	if (nrev != ncopied)
+		errx(1, "%s: %ju entries in the reverse index, expected %ju", device,
+		    (uintmax_t)nrev, (uintmax_t)ncopied);
+
+	ddimage_close(img);
+	free(to);
+	free(from);
+	free(img);
+	return (0);
+}
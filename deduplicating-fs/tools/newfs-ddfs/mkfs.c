@@ -304,13 +304,38 @@ restart:
 		sblock.fs_frag);
 	/*
 	 * XXX(ddfs): how many fragments (4K blocks) are we using for dedup tracking?
+	 * A table sized with -D can be grown later with growddfs.
 	 */
 	uint64_t extra = roundup(mediasize / DEDUP_FRAC, sblock.fs_fsize);
 	sblock.fs_ddblkno = sblock.fs_sblkno + howmany(SBLOCKSIZE, sblock.fs_fsize);
 	sblock.fs_dedupfrags = roundup(howmany(extra, sblock.fs_fsize), sblock.fs_frag);
+	if (ddentries > 0) {
+		int64_t nbuckets = ddtable_sizefor(ddformat, sblock.fs_bsize, ddentries);
+
+		if (nbuckets * sblock.fs_bsize > mediasize / 2) {
+			printf("dedup table for %jd entries takes %jd blocks, "
+			    "more than half of the disk\n", (intmax_t)ddentries,
+			    (intmax_t)nbuckets);
+			exit(19);
+		}
+		sblock.fs_dedupfrags = nbuckets * sblock.fs_frag;
+	}
+	sblock.fs_ddformat = ddformat;
+	sblock.fs_ddfingerprint = fingerprint;
+	/*
+	 * XXX(ddfs): the reverse index follows the dedup table,
+	 * with one 64-bit slot number for every fragment in the filesystem.
+	 */
+	sblock.fs_ddrevblkno = sblock.fs_ddblkno + sblock.fs_dedupfrags;
+	sblock.fs_ddrevfrags = roundup(howmany(sblock.fs_size * sizeof(int64_t),
+	    sblock.fs_fsize), sblock.fs_frag);
+	/* XXX(ddfs): and the intent log follows the reverse index */
+	sblock.fs_ddlogblkno = sblock.fs_ddrevblkno + sblock.fs_ddrevfrags;
+	sblock.fs_ddlogfrags = roundup(howmany((int64_t)DDFS_LOG_BLOCKS * sblock.fs_bsize,
+	    sblock.fs_fsize), sblock.fs_frag);
 	/* XXX(ddfs): shift over start of cylinder group by our dedup tracking offset */
 	sblock.fs_cblkno =
-		roundup(sblock.fs_ddblkno + sblock.fs_dedupfrags, sblock.fs_frag) +
+		roundup(sblock.fs_ddlogblkno + sblock.fs_ddlogfrags, sblock.fs_frag) +
 	    roundup(howmany(SBLOCKSIZE, sblock.fs_fsize), sblock.fs_frag);
 	sblock.fs_iblkno = sblock.fs_cblkno + sblock.fs_frag;
 	sblock.fs_maxfilesize = sblock.fs_bsize * UFS_NDADDR - 1;
@@ -321,6 +346,15 @@ restart:
 	printf("Allocated %d dedup blocks\n", sblock.fs_dedupfrags);
 	printf("Placed superblock at offset %d\n", sblock.fs_sblkno);
 	printf("Placed dedup at offset %d\n", sblock.fs_ddblkno);
+	printf("Placed dedup reverse index at offset %d (%d blocks)\n",
+	    sblock.fs_ddrevblkno, sblock.fs_ddrevfrags);
+	printf("Placed dedup intent log at offset %d (%d blocks)\n",
+	    sblock.fs_ddlogblkno, sblock.fs_ddlogfrags);
+	printf("Fingerprinting blocks with %s\n",
+	    ddfs_fingerprint_name(sblock.fs_ddfingerprint));
+	printf("Dedup table format %d, with %d-bit refcounts and %d entries per block\n",
+	    sblock.fs_ddformat, sblock.fs_ddformat >= DDFS_DDFORMAT_REF32 ? 32 : 16,
+	    ddtable_nentries(sblock.fs_ddformat, sblock.fs_bsize));
 	printf("Placed cylinderblock at offset %d\n", sblock.fs_cblkno);
 	printf("Placed inode at offset %d\n", sblock.fs_iblkno);
 
@@ -678,19 +712,33 @@ restart:
 		pp->p_frag = sblock.fs_frag;
 		pp->p_cpg = sblock.fs_fpg;
 	}
-	/* XXX(ddfs): initilize dedup table */
-	struct ddfs_dedup free_entry = {0};
-	free_entry.flags = DDFS_DEDUP_FREE;
-	char buf[sblock.fs_fsize];
-	for (int i = 0; i < sblock.fs_fsize; i += sizeof(struct ddfs_dedup)) {
-		memcpy(buf + i, &free_entry, sizeof(struct ddfs_dedup));
-	}
-	for (int i = 0; i < sblock.fs_dedupfrags; i++) {
+	/* XXX(ddfs): initilize dedup table, one bucket per block */
+	struct ddtable dt = {0};
+	dt.dt_bsize = sblock.fs_bsize;
+	dt.dt_format = sblock.fs_ddformat;
+	dt.dt_nentries = ddtable_nentries(sblock.fs_ddformat, sblock.fs_bsize);
+	char bucket[sblock.fs_bsize];
+	ddtable_initblock(&dt, bucket);
+	for (int i = 0; i < sblock.fs_dedupfrags; i += sblock.fs_frag) {
 		/* XXX: convert "fragment block number" to disk-segment logical block number */
 		daddr_t lbn = (sblock.fs_fsize / DEV_BSIZE) * (sblock.fs_ddblkno + i);
-		if (bwrite(&disk, lbn, buf, sblock.fs_fsize) < 0)
+		if (bwrite(&disk, lbn, bucket, sblock.fs_bsize) < 0)
 			err(36, "wtfs: error writing dedup table\n");
 	}
+	/* XXX(ddfs): no block has a dedup entry yet */
+	char buf[sblock.fs_fsize];
+	memset(buf, 0, sblock.fs_fsize);
+	for (int i = 0; i < sblock.fs_ddrevfrags; i++) {
+		daddr_t lbn = (sblock.fs_fsize / DEV_BSIZE) * (sblock.fs_ddrevblkno + i);
+		if (bwrite(&disk, lbn, buf, sblock.fs_fsize) < 0)
+			err(36, "wtfs: error writing dedup reverse index\n");
+	}
+	/* XXX(ddfs): and nothing to replay from the log */
+	for (int i = 0; i < sblock.fs_ddlogfrags; i++) {
+		daddr_t lbn = (sblock.fs_fsize / DEV_BSIZE) * (sblock.fs_ddlogblkno + i);
+		if (bwrite(&disk, lbn, buf, sblock.fs_fsize) < 0)
+			err(36, "wtfs: error writing dedup intent log\n");
+	}
 }
 
 /*
@@ -83,7 +83,12 @@ __FBSDID("$FreeBSD$");
 
 #include "newfs.h"
 
+#include "ddfs.h"
+
 int	Eflag;			/* Erase previous disk contents */
+int	fingerprint = DDFS_FP_SHA1; /* XXX(ddfs): block fingerprint algorithm */
+int	ddformat = DDFS_DDFORMAT; /* XXX(ddfs): dedup table format */
+int64_t	ddentries;		/* XXX(ddfs): dedup table entries to size it for */
 int	Lflag;			/* add a volume label */
 int	Nflag;			/* run without writing file system */
 int	Oflag = 2;		/* file system format (1 => UFS1, 2 => UFS2) */
@@ -141,11 +146,22 @@ main(int argc, char *argv[])
 	part_name = 'c';
 	reserved = 0;
 	while ((ch = getopt(argc, argv,
-	    "EJL:NO:RS:T:UXa:b:c:d:e:f:g:h:i:jk:lm:no:p:r:s:t")) != -1)
+	    "D:EH:JL:NO:RS:T:UW:Xa:b:c:d:e:f:g:h:i:jk:lm:no:p:r:s:t")) != -1)
 		switch (ch) {
+		case 'D':
+			/* XXX(ddfs): instead of a fixed fraction of the disk */
+			if (expand_number(optarg, (uint64_t *)&ddentries) < 0 ||
+			    ddentries <= 0)
+				errx(1, "%s: bad dedup table entry count", optarg);
+			break;
 		case 'E':
 			Eflag = 1;
 			break;
+		case 'H':
+			if ((fingerprint = ddfs_fingerprint_byname(optarg)) < 0)
+				errx(1, "%s: unknown fingerprint: use `sha1', "
+				    "`sha256', `blake3' or `xxh64'", optarg);
+			break;
 		case 'J':
 			Jflag = 1;
 			break;
@@ -175,6 +191,15 @@ main(int argc, char *argv[])
 		case 'R':
 			Rflag = 1;
 			break;
+		case 'W':
+			/* XXX(ddfs): 16-bit refcounts for modules older than format 4 */
+			if (strcmp(optarg, "16") == 0)
+				ddformat = DDFS_DDFORMAT_LOG;
+			else if (strcmp(optarg, "32") == 0)
+				ddformat = DDFS_DDFORMAT;
+			else
+				errx(1, "%s: bad refcount width: use 16 or 32", optarg);
+			break;
 		case 'S':
 			rval = expand_number_int(optarg, &sectorsize);
 			if (rval < 0 || sectorsize <= 0)
@@ -465,7 +490,10 @@ usage(void)
 	    getprogname(),
 	    " [device-type]");
 	fprintf(stderr, "where fsoptions are:\n");
+	fprintf(stderr, "\t-D dedup table entries to make room for\n");
 	fprintf(stderr, "\t-E Erase previous disk content\n");
+	fprintf(stderr,
+	    "\t-H block fingerprint (sha1, sha256, blake3 or xxh64)\n");
 	fprintf(stderr, "\t-J Enable journaling via gjournal\n");
 	fprintf(stderr, "\t-L volume label to add to superblock\n");
 	fprintf(stderr,
@@ -475,6 +503,7 @@ usage(void)
 	fprintf(stderr, "\t-S sector size\n");
 	fprintf(stderr, "\t-T disktype\n");
 	fprintf(stderr, "\t-U enable soft updates\n");
+	fprintf(stderr, "\t-W dedup refcount width in bits (16 or 32)\n");
 	fprintf(stderr, "\t-a maximum contiguous blocks\n");
 	fprintf(stderr, "\t-b block size\n");
 	fprintf(stderr, "\t-c blocks per cylinders group\n");
@@ -79,6 +79,9 @@
  * variables set up by front end.
  */
 extern int	Eflag;		/* Erase previous disk contents */
+extern int	fingerprint;	/* XXX(ddfs): block fingerprint algorithm */
+extern int	ddformat;	/* XXX(ddfs): dedup table format */
+extern int64_t	ddentries;	/* XXX(ddfs): dedup table entries to size it for */
 extern int	Lflag;		/* add a volume label */
 extern int	Nflag;		/* run mkfs without writing file system */
 extern int	Oflag;		/* build UFS1 format file system */
@@ -0,0 +1,327 @@
+/*
+ * upgradeddfs: convert the dedup table of an unmounted ddfs filesystem to
+ * 32-bit refcounts.
+ *
+ * Format 3 tables count references in 16 bits. Format 4 entries have the same
+ * size with 32-bit refcounts, so every entry stays in its slot, and the
+ * buckets, the reverse index and the files are left as they are:
+ *
+ * 1. the intent log is replayed into the table, which is then the only copy
+ *    of the entries;
+ * 2. the superblock is marked as being upgraded, which neither the kernel
+ *    module nor the other tools will touch;
+ * 3. the log is cleared, since its records are laid out like table entries;
+ * 4. every table block is read, 1MiB at a time, and its entries rewritten in
+ *    the new layout;
+ * 5. the superblock is written with the new format.
+ *
+ * Format 4 entries can be told from format 3 ones (see struct ddfs_dedup), so
+ * a run that was interrupted is finished by running upgradeddfs again.
+ *
+ * Tables of formats 0 to 2 have no intent log, and formats 0 and 1 no reverse
+ * index, so there is nowhere to put them in place. They lie ahead of the first
+ * cylinder group, in the area every cylinder group skips (cgsblock), and are
+ * moved to the data area in the current format, like growddfs does:
+ *
+ * 1. a run of free blocks is allocated for a table of the current format and
+ *    a reverse index after it;
+ * 2. the new table is written with empty buckets, and every entry of the old
+ *    one is copied, with its refcount, to where its key hashes in it;
+ * 3. the superblock is switched to the new table, with the intent log in the
+ *    tail of the old area, so that cgsblock stays where it was. It is marked
+ *    as being upgraded, and as having a stale reverse index (fs_ddrevstale);
+ * 4. the log is cleared, and the reverse index built from the new table;
+ * 5. the superblock is written with the new format.
+ *
+ * Stopping before step 3 leaks the new region, and running upgradeddfs again
+ * starts over. Stopping after it is finished by running upgradeddfs again.
+ * The head of the old area is left unused.
+ *
+ * Each step is flushed to the disk before the next one starts. Format 5
+ * buckets hold fewer entries than format 4 ones, so every entry would move to
+ * another slot; getting the format 5 layout from format 3 takes newfs-ddfs.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ddimage.h"
+
+/* table blocks converted at once */
+#define CONVERT_BLOCKS 256
+
+static void
+usage(void)
+{
+	printf("upgradeddfs -f device\n");
+	printf("-f device\t\tddfs filesystem (must not be mounted)\n");
+}
+
+/* write the superblock with dedup table format `format` */
+static void
+write_sb(struct ddimage *img, int format)
+{
+	img->fs->fs_ddformat = format;
+	ddimage_write_sb(img);
+}
+
+/* ddtable_foreach() callback counting the ACTIVE entries */
+static void
+count_entry(void *arg, int64_t slot, const struct ddfs_dedup *entry)
+{
+	if (entry->flags & DDFS_DEDUP_ACTIVE)
+		(*(int64_t *)arg)++;
+}
+
+/*
+ * Rewrite the format 3 entries of the table as `format` entries. Returns the
+ * number of entries converted; entries an earlier run converted are skipped.
+ */
+static uint64_t
+convert_table(struct ddimage_table *t, int format)
+{
+	struct ddtable *dt = &t->dt;
+	struct ddfs_dedup entry;
+	uint8_t *buf, *p;
+	uint64_t word, nconv = 0;
+	int64_t nblk;
+	size_t size;
+	bool dirty;
+
+	if ((buf = malloc((size_t)CONVERT_BLOCKS * dt->dt_bsize)) == NULL)
+		err(1, "table blocks");
+	for (int64_t first = 0; first < dt->dt_nbuckets; first += nblk) {
+		nblk = MIN(CONVERT_BLOCKS, dt->dt_nbuckets - first);
+		size = (size_t)nblk * dt->dt_bsize;
+		if (ddimage_read(t->img, t->off + first * dt->dt_bsize, buf, size) != 0)
+			err(1, "reading table block %jd", (intmax_t)first);
+		dirty = false;
+		for (int64_t i = 0; i < nblk * dt->dt_nentries; i++) {
+			p = buf + i * DDFS_DEDUP_SIZE;
+			/* format 4 keeps the flags in the top byte, where format 3 has 0 */
+			memcpy(&word, p + 24, sizeof(word));
+			if ((word >> 56) != 0)
+				continue;
+			ddentry_decode(DDFS_DDFORMAT_LOG, p, &entry);
+			/* an entry pinned in 16 bits stays pinned in 32 */
+			if (entry.ref_count == DDFS_REFCOUNT_MAX(DDFS_DDFORMAT_LOG))
+				entry.ref_count = DDFS_REFCOUNT_MAX(format);
+			ddentry_encode(format, p, &entry);
+			nconv++;
+			dirty = true;
+		}
+		if (dirty && ddimage_write(t->img, t->off + first * dt->dt_bsize, buf, size) != 0)
+			err(1, "writing table block %jd", (intmax_t)first);
+	}
+	free(buf);
+	ddimage_flush(t->img);
+	return (nconv);
+}
+
+/*
+ * Upgrade the format 3 table in place. `from` is DDFS_DDFORMAT_UPGRADING when
+ * finishing an interrupted run.
+ */
+static void
+upgrade_inplace(struct ddimage *img, const char *device, int from)
+{
+	struct fs *fs = img->fs;
+	struct ddimage_table *t;
+	uint64_t seq, nconv;
+	int error;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err(1, "table");
+	ddimage_table_init(t, img, fs->fs_ddblkno, fs->fs_dedupfrags / fs->fs_frag,
+	    DDFS_DDFORMAT_LOG);
+	/* an interrupted run replayed the log already, and may have cleared it */
+	if (from == DDFS_DDFORMAT_LOG) {
+		if ((error = ddtable_replay(&t->dt, &seq)) != 0)
+			errx(1, "%s: replaying intent log: %s", device, strerror(error));
+		ddimage_flush(img);
+		write_sb(img, DDFS_DDFORMAT_UPGRADING);
+	} else
+		printf("%s: finishing an interrupted upgrade\n", device);
+	ddimage_log_clear(t);
+	nconv = convert_table(t, DDFS_DDFORMAT_REF32);
+	write_sb(img, DDFS_DDFORMAT_REF32);
+	printf("%s: converted %ju entries in %jd table blocks to format %d\n", device,
+	    (uintmax_t)nconv, (intmax_t)t->dt.dt_nbuckets, DDFS_DDFORMAT_REF32);
+	free(t);
+}
+
+/*
+ * Clear the intent log of the new table, build its reverse index, and switch
+ * the superblock to the current format. Returns the entries of the index.
+ */
+static uint64_t
+finish_rehash(struct ddimage *img)
+{
+	struct fs *fs = img->fs;
+	struct ddimage_table *t;
+	uint64_t nrev;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		err(1, "table");
+	ddimage_table_init(t, img, fs->fs_ddblkno, fs->fs_dedupfrags / fs->fs_frag,
+	    DDFS_DDFORMAT);
+	ddimage_log_clear(t);
+	nrev = ddimage_rev_rebuild(t);
+	fs->fs_ddrevstale = 0;
+	write_sb(img, DDFS_DDFORMAT);
+	free(t);
+	return (nrev);
+}
+
+/* Move the format `from` (0 to 2) table into a new table of the current format */
+static void
+upgrade_rehash(struct ddimage *img, const char *device, int from)
+{
+	struct fs *fs = img->fs;
+	struct ddimage_table *old, *new;
+	uint64_t ncopied, nrev;
+	int64_t oldend, oldbuckets, nactive = 0, nbuckets, revfrags, nlog, newblkno;
+	uint8_t *empty;
+	int error;
+
+	/* a snapshot would still claim the blocks given to the new table */
+	if (fs->fs_snapinum[0] != 0)
+		errx(1, "%s: has snapshots, remove them first", device);
+	/* the end of the area ahead of the first cylinder group, which cgsblock skips */
+	if (from == DDFS_DDFORMAT_REVIDX)
+		oldend = (int64_t)fs->fs_ddrevblkno + fs->fs_ddrevfrags;
+	else
+		oldend = (int64_t)fs->fs_ddblkno + fs->fs_dedupfrags;
+	/* log blocks are addressed relative to the new table, in whole blocks */
+	nlog = MIN(DDFS_LOG_BLOCKS, (rounddown(oldend, fs->fs_frag) -
+	    roundup(fs->fs_ddblkno, fs->fs_frag)) / fs->fs_frag);
+	if (nlog < 2)
+		errx(1, "%s: no room for the intent log ahead of the first cylinder group",
+		    device);
+
+	if ((old = calloc(1, sizeof(*old))) == NULL || (new = calloc(1, sizeof(*new))) == NULL)
+		err(1, "table");
+	oldbuckets = fs->fs_dedupfrags / fs->fs_frag;
+	ddimage_table_init(old, img, fs->fs_ddblkno, oldbuckets, from);
+	if ((error = ddtable_foreach(&old->dt, count_entry, &nactive)) != 0)
+		errx(1, "%s: reading the table: %s", device, strerror(error));
+	/* room for as many entries as the old table had */
+	nbuckets = ddtable_sizefor(DDFS_DDFORMAT, fs->fs_bsize, MAX(nactive,
+	    oldbuckets * old->dt.dt_nentries * DDFS_TABLE_FILL / 100));
+	revfrags = roundup(howmany((int64_t)fs->fs_size * (int64_t)sizeof(int64_t),
+	    fs->fs_fsize), fs->fs_frag);
+	if ((uint64_t)freespace(fs, fs->fs_minfree) <
+	    (uint64_t)(blkstofrags(fs, nbuckets) + revfrags))
+		errx(1, "%s: %jd blocks for the table and reverse index are more than the "
+		    "free space", device, (intmax_t)(nbuckets + revfrags / fs->fs_frag));
+	if ((newblkno = ddimage_find_region(img, nbuckets + revfrags / fs->fs_frag)) == -1)
+		errx(1, "%s: no %jd free blocks in a row for the table and reverse index",
+		    device, (intmax_t)(nbuckets + revfrags / fs->fs_frag));
+	/* fs_ddblkno, fs_ddrevblkno and the frags are 32 bits */
+	if (newblkno + blkstofrags(fs, nbuckets) + revfrags > INT32_MAX)
+		errx(1, "%s: no room for the table in the first %d fragments", device,
+		    INT32_MAX);
+	ddimage_region_acct(img, newblkno, nbuckets + revfrags / fs->fs_frag, -1);
+
+	/* not written to the disk until the new table is complete */
+	fs->fs_ddrevblkno = newblkno + blkstofrags(fs, nbuckets);
+	fs->fs_ddrevfrags = revfrags;
+	fs->fs_ddlogblkno = rounddown(oldend, fs->fs_frag) - blkstofrags(fs, nlog);
+	fs->fs_ddlogfrags = oldend - fs->fs_ddlogblkno;
+	ddimage_table_init(new, img, newblkno, nbuckets, DDFS_DDFORMAT);
+	if ((empty = malloc(fs->fs_bsize)) == NULL)
+		err(1, "table block");
+	ddtable_initblock(&new->dt, empty);
+	ddimage_table_fill(new, 0, nbuckets, empty);
+	free(empty);
+	ncopied = ddimage_table_copy(old, new);
+
+	/* from here on the new table is the one in use; the log overwrites the old one */
+	fs->fs_ddblkno = newblkno;
+	fs->fs_dedupfrags = blkstofrags(fs, nbuckets);
+	fs->fs_ddrevstale = 1;
+	write_sb(img, DDFS_DDFORMAT_UPGRADING);
+	nrev = finish_rehash(img);
+	printf("%s: moved %ju entries from %jd format %d table blocks to %jd format %d ones "
+	    "at %jd\n", device, (uintmax_t)ncopied, (intmax_t)oldbuckets, from,
+	    (intmax_t)nbuckets, DDFS_DDFORMAT, (intmax_t)newblkno);
+	if (nrev != ncopied)
+		errx(1, "%s: %ju entries in the reverse index, expected %ju", device,
+		    (uintmax_t)nrev, (uintmax_t)ncopied);
+	free(new);
+	free(old);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch, from;
+	char *device = NULL;
+	struct ddimage *img;
+	struct fs *fs;
+	uint64_t nrev;
+
+	while ((ch = getopt(argc, argv, "hf:")) != -1) {
+		switch (ch) {
+		case 'f':
+			device = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (device == NULL) {
+		usage();
+		exit(1);
+	}
+
+	if ((img = calloc(1, sizeof(*img))) == NULL)
+		err(1, "image");
+	ddimage_open(img, device, O_RDWR);
+	fs = img->fs;
+	from = fs->fs_ddformat;
+	if (from >= DDFS_DDFORMAT_REF32 && DDFS_DDFORMAT_OK(from)) {
+		printf("%s: dedup table format %d has 32-bit refcounts already\n", device, from);
+		exit(0);
+	}
+	if (from != DDFS_DDFORMAT_UPGRADING &&
+	    (from < DDFS_DDFORMAT_LINEAR || from > DDFS_DDFORMAT_LOG))
+		errx(1, "%s: unknown dedup table format %d", device, from);
+	/* a read-write mount clears fs_clean on the disk until it is unmounted */
+	if (fs->fs_clean == 0 || (fs->fs_flags & (FS_UNCLEAN | FS_NEEDSFSCK)) != 0)
+		errx(1, "%s: not clean; unmount it, or run fsck", device);
+	/* the top byte of a format 4 block pointer holds the flags */
+	if ((uint64_t)fs->fs_size > DDFS_DEDUP_BLKMASK)
+		errx(1, "%s: too many fragments for format %d", device, DDFS_DDFORMAT_REF32);
+
+	/*
+	 * Being upgraded with a stale reverse index means the table was moved
+	 * already. growddfs rebuilds the reverse index of a format 3 table.
+	 */
+	if (from == DDFS_DDFORMAT_LOG && fs->fs_ddrevstale != 0)
+		errx(1, "%s: the reverse index is stale; run growddfs first", device);
+	if (from == DDFS_DDFORMAT_UPGRADING && fs->fs_ddrevstale != 0) {
+		printf("%s: finishing an interrupted upgrade\n", device);
+		nrev = finish_rehash(img);
+		printf("%s: rebuilt the reverse index of %ju entries\n", device,
+		    (uintmax_t)nrev);
+	} else if (from == DDFS_DDFORMAT_LOG || from == DDFS_DDFORMAT_UPGRADING)
+		upgrade_inplace(img, device, from);
+	else
+		upgrade_rehash(img, device, from);
+
+	ddimage_close(img);
+	free(img);
+	return (0);
+}
@@ -3,7 +3,9 @@
 
 #ifdef _KERNEL
 #include <sys/types.h>
+#include <sys/lock.h>
 #include <sys/malloc.h>
+#include <sys/mutex.h>
 
 #include <vm/uma.h>
 #else /* ! _KERNEL */
@@ -42,6 +44,10 @@ struct __attribute__((packed)) kvfs_superblock {
 
 	uint64_t flags;	  /* filesystem flags */
 	uint64_t fs_size; /* actual filesystem size */
+
+	/* key index. filesystems made before it existed have 0 buckets */
+	off_t index_off;	/* block offset of key index */
+	uint32_t index_buckets; /* number of key index buckets */
 };
 
 /* kvfs inode. On-disk representation of a file.  */
@@ -52,11 +58,51 @@ struct __attribute__((packed)) kvfs_inode {
 	uint64_t timestamp; /* modification time in nanoseconds */
 };
 
+/* Key index. A hash table of the keys in use, following the inode table.
+ * Each bucket is one sector, so looking up a key reads its bucket and the
+ * inode sector of each entry whose tag matches. A key goes in the bucket
+ * given by its first 32 bits (keys are SHA-1 hashes, so they are already
+ * uniformly distributed), or in the next one with room if that is full. */
+#define KVFS_INDEX_BUCKETSIZE 512
+#define KVFS_INDEX_ENTRIES 63
+
+/* one bucket per this many blocks, so a full filesystem fills half of each */
+#define KVFS_INDEX_LOAD 32
+
+/* bucket flags */
+#define KVFS_INDEX_OVERFLOW 0x0001 /* was full: look in the next bucket too */
+
+struct __attribute__((packed)) kvfs_index_entry {
+	uint32_t index; /* inode index + 1, or 0 if the entry is empty */
+	uint32_t tag;	/* second 32 bits of the key */
+};
+
+struct __attribute__((packed)) kvfs_index_bucket {
+	uint32_t flags; /* bucket flags */
+	uint32_t unused;
+	struct kvfs_index_entry entries[KVFS_INDEX_ENTRIES];
+};
+
+/* number of key index buckets for a filesystem of `blocks` blocks */
+#define KVFS_INDEX_BUCKETS(blocks) CEIL((blocks), KVFS_INDEX_LOAD)
+
+/* big-endian 32-bit word `i` of a key */
+#define KVFS_KEY_WORD(key, i)                                    \
+	((uint32_t)(key)[4 * (i)] << 24 |                        \
+	    (uint32_t)(key)[4 * (i) + 1] << 16 |                 \
+	    (uint32_t)(key)[4 * (i) + 2] << 8 | (key)[4 * (i) + 3])
+
+/* home bucket and tag of a key */
+#define KVFS_INDEX_HOME(key, buckets) (KVFS_KEY_WORD(key, 0) % (buckets))
+#define KVFS_INDEX_TAG(key) KVFS_KEY_WORD(key, 1)
+
 /* ==================
  * Kernel-only structures
  * ================== */
 #ifdef _KERNEL
 
+struct buf;
+
 extern struct vop_vector kvfs_vnodeops;
 extern uma_zone_t kvfs_zone_node;
 
@@ -76,10 +122,32 @@ struct kvfs_memnode {
 	struct kvfs_inode inode; /* fields in kvfs inode */
 };
 
-/* represents a free key-value (inode, block) pair */
-struct kvfs_freelist_entry {
-	ino_t ino;	       /* index of this inode on disk */
-	LIST_ENTRY(kvfs_freelist_entry) entries;
+/* range of blocks a CPU allocates from, in ascending order */
+struct kvfs_allocwin {
+	uint32_t next; /* next block to try */
+	uint32_t end;  /* end of the window */
+};
+
+/* blocks in each allocation window: 16KiB of inodes, 2MiB of data */
+#define KVFS_ALLOC_WINDOW 512
+
+/* on async mounts, the buffer at `before` must reach the disk before the
+ * buffer at `after` does (see kvfs_deps.c) */
+struct kvfs_dep {
+	daddr_t before;	 /* block number of the buffer to write first */
+	int before_size; /* size of that buffer */
+	daddr_t after;	 /* block number of the buffer that waits for it */
+	int flushing;	 /* `after` is being written */
+	LIST_ENTRY(kvfs_dep) entries;
+};
+
+/* in-memory map from key to inode, built at mount (see kvfs_keymap.c) */
+struct kvfs_keymap {
+	uint8_t (*keys)[20]; /* key of each inode in use, by inode index */
+	uint32_t *slots;     /* hash table of inode index + 1, 0 if empty */
+	uint32_t mask;	     /* number of slots - 1 */
+	uint32_t count;	     /* number of keys in the map */
+	size_t size;	     /* bytes allocated for keys and slots */
 };
 
 /* Convert between vnode and memnode pointers*/
@@ -98,9 +166,23 @@ struct kvfs_mount {
 	off_t data_off;	      /* data offset of data blocks */
 	uint32_t block_count; /* number of data blocks in this filesystem. */
 	uint64_t flags;
+	off_t index_off;	 /* data offset of key index */
+	uint32_t index_buckets; /* number of key index buckets, 0 if none */
 
-	LIST_HEAD(freelist_head, kvfs_freelist_entry) freelist_head;
+	/* copy of the free bitmap, one bit per block, set if in use */
+	uint64_t *freemap;
+	uint32_t freemap_words;	 /* number of 64-bit words in freemap */
+	uint32_t freemap_hint;	 /* word to start the next window from */
 	uint32_t freelist_count; /* number of free blocks */
+	struct kvfs_allocwin *freemap_windows; /* one per CPU */
+
+	struct kvfs_keymap keymap; /* key map, slots is NULL if there is none */
+
+	int async; /* delayed, ordered metadata writes (mount -o async) */
+	LIST_HEAD(kvfs_dephead, kvfs_dep) *deps; /* hashed by `after` */
+	u_long deps_mask;		  /* number of hash chains - 1 */
+	struct mtx deps_lock;		  /* protects deps */
+	struct buf_ops *orig_bufops; /* device bufobj ops replaced by ours */
 };
 
 /* ==================
@@ -118,6 +200,65 @@ int key_to_str(const uint8_t *key, char *out_str);
 int kvfs_vget_internal(struct mount *mp, ino_t ino, int flags,
     struct vnode **vpp, const char *key);
 
+/* find the inode of `key` through the key index. returns ENOENT if absent */
+int kvfs_index_lookup(struct kvfs_mount *mp, const uint8_t *key,
+    ino_t *out_ino);
+
+/* add `key`, held by inode `ino`, to the key index */
+int kvfs_index_insert(struct kvfs_mount *mp, const uint8_t *key, ino_t ino);
+
+/* remove `key`, held by inode `ino`, from the key index */
+int kvfs_index_remove(struct kvfs_mount *mp, const uint8_t *key, ino_t ino);
+
+/* read the free bitmap of a mount into memory */
+int kvfs_freemap_load(struct kvfs_mount *mp);
+
+/* free the in-memory free bitmap of a mount */
+void kvfs_freemap_free(struct kvfs_mount *mp);
+
+/* take a free (inode, block) pair, marking it in use on disk. returns
+ * ENOSPC if there are none */
+int kvfs_freemap_alloc(struct kvfs_mount *mp, ino_t *out_ino);
+
+/* give the (inode, block) pair of `ino` back, marking it free on disk */
+int kvfs_freemap_release(struct kvfs_mount *mp, ino_t ino);
+
+/* build the key map of a mount by reading the inode table. on error the
+ * filesystem is used without one */
+int kvfs_keymap_build(struct kvfs_mount *mp);
+
+/* free the key map of a mount, if it has one */
+void kvfs_keymap_free(struct kvfs_mount *mp);
+
+/* find the inode of `key` in the key map. returns ENOENT if absent */
+int kvfs_keymap_lookup(struct kvfs_mount *mp, const uint8_t *key,
+    ino_t *out_ino);
+
+/* add `key`, held by inode `ino`, to the key map */
+void kvfs_keymap_insert(struct kvfs_mount *mp, const uint8_t *key, ino_t ino);
+
+/* remove `key` from the key map */
+void kvfs_keymap_remove(struct kvfs_mount *mp, const uint8_t *key);
+
+/* on async mounts, start recording write dependencies */
+void kvfs_deps_init(struct kvfs_mount *mp);
+
+/* on async mounts, write out all delayed buffers and stop recording
+ * write dependencies */
+int kvfs_deps_uninit(struct kvfs_mount *mp);
+
+/* write a buffer of the device: delayed on async mounts, synchronously
+ * otherwise */
+int kvfs_bwrite(struct kvfs_mount *mp, struct buf *bp);
+
+/* write the buffer at `blkno` now if it is cached and dirty */
+int kvfs_flushblk(struct kvfs_mount *mp, daddr_t blkno, int size);
+
+/* on async mounts, make the buffer at `before` reach the disk before the
+ * buffer at `after`. must be called before `after` is read and changed */
+void kvfs_dep_order(struct kvfs_mount *mp, daddr_t before, int size,
+    daddr_t after);
+
 /* unpack a packed uint64_t nanosecond epoch into timespec */
 void uint64_to_timespec(uint64_t packed, struct timespec *ts);
 
@@ -127,6 +268,12 @@ uint64_t timespec_to_uint64(struct timespec *ts);
 /* convert ino to block index */
 #define INO_TO_BLOCKNUM(ino) (((ino) / sizeof(struct kvfs_inode)) * BLOCKSIZE)
 
+/* convert ino to the block number of its inode sector */
+#define INO_TO_SECTOR(ino, mp) btodb((mp)->inode_off + (ino))
+
+/* convert ino to the block number of its data block */
+#define INO_TO_LBN(ino, mp) btodb((mp)->data_off + INO_TO_BLOCKNUM(ino))
+
 /* convert ino to free block byte offset */
 #define INO_TO_FREE_BYTE(ino, mp) \
 	(((ino) / sizeof(struct kvfs_inode) / 8) + mp->freelist_off)
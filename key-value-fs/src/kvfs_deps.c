@@ -0,0 +1,233 @@
+/*
+ * Ordered, delayed metadata writes for kvfs.
+ *
+ * Normally every buffer kvfs changes is written with bwrite(9) before the
+ * next step of an operation, which is what keeps the "soft update" order
+ * described in kvfs_vnops.c. On filesystems mounted with `-o async`, buffers
+ * are written with bdwrite(9) instead, so many creates or removes touching
+ * the same bitmap, index and inode sectors cost one write each, made later
+ * by the syncer.
+ *
+ * The order is kept by recording dependencies between buffers of the device:
+ * "the buffer at `before` must reach the disk before the buffer at `after`".
+ * kvfs replaces the write routine of the device's bufobj (as FFS does), and
+ * before any buffer is written, every buffer it depends on that is still
+ * dirty is written synchronously first. A dependency that would close a cycle
+ * (say, an inode sector waiting on a bitmap sector which already waits on
+ * that inode sector) is not recorded: the `before` buffer is written right
+ * away instead. Dependencies must be added before the `after` buffer is read
+ * and changed, so that this write never waits on a buffer we hold.
+ * */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/buf.h>
+#include <sys/conf.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/vnode.h>
+
+#include <geom/geom.h>
+#include <geom/geom_vfs.h>
+
+#include "kvfs.h"
+
+MALLOC_DEFINE(M_KVFSDEP, "kvfs_dep", "kvfs buffer write dependencies");
+
+/* number of hash chains of the dependency table */
+#define KVFS_DEP_HASHSIZE 1024
+
+/* dependencies are followed this deep looking for a cycle. anything deeper
+ * is treated as a cycle */
+#define KVFS_DEP_DEPTH 4
+
+/* chain of dependencies of the buffer at `after` */
+#define DEP_HASH(mp, after) (&(mp)->deps[(after) & (mp)->deps_mask])
+
+static int kvfs_bufwrite(struct buf *bp);
+
+static struct buf_ops kvfs_bufops = {
+	.bop_name = "kvfs",
+	.bop_write = kvfs_bufwrite,
+	.bop_strategy = g_vfs_strategy,
+	.bop_sync = bufsync,
+	.bop_bdflush = bufbdflush,
+};
+
+/* check if the buffer at `blk` waits, directly or not, for the buffer at
+ * `target`. called with deps_lock held */
+static int
+dep_waits_for(struct kvfs_mount *mp, daddr_t blk, daddr_t target, int depth)
+{
+	struct kvfs_dep *d;
+
+	if (depth == 0) {
+		return (1);
+	}
+	LIST_FOREACH (d, DEP_HASH(mp, blk), entries) {
+		if (d->after != blk) {
+			continue;
+		}
+		if (d->before == target ||
+		    dep_waits_for(mp, d->before, target, depth - 1)) {
+			return (1);
+		}
+	}
+	return (0);
+}
+
+void
+kvfs_deps_init(struct kvfs_mount *mp)
+{
+	struct bufobj *bo = &mp->devvp->v_bufobj;
+
+	if (!mp->async) {
+		return;
+	}
+	mtx_init(&mp->deps_lock, "kvfs deps", NULL, MTX_DEF);
+	mp->deps = hashinit(KVFS_DEP_HASHSIZE, M_KVFSDEP, &mp->deps_mask);
+	mp->orig_bufops = bo->bo_ops;
+	bo->bo_ops = &kvfs_bufops;
+}
+
+int
+kvfs_deps_uninit(struct kvfs_mount *mp)
+{
+	struct bufobj *bo = &mp->devvp->v_bufobj;
+	struct kvfs_dep *d;
+	int error;
+
+	if (!mp->async) {
+		return (0);
+	}
+	/* write out every delayed buffer while we can still order them */
+	vn_lock(mp->devvp, LK_EXCLUSIVE | LK_RETRY);
+	error = VOP_FSYNC(mp->devvp, MNT_WAIT, curthread);
+	VOP_UNLOCK(mp->devvp);
+
+	bo->bo_ops = mp->orig_bufops;
+	for (u_long i = 0; i <= mp->deps_mask; i++) {
+		while ((d = LIST_FIRST(&mp->deps[i])) != NULL) {
+			LIST_REMOVE(d, entries);
+			free(d, M_KVFSDEP);
+		}
+	}
+	hashdestroy(mp->deps, M_KVFSDEP, mp->deps_mask);
+	mtx_destroy(&mp->deps_lock);
+	return (error);
+}
+
+int
+kvfs_bwrite(struct kvfs_mount *mp, struct buf *bp)
+{
+	if (mp->async) {
+		bdwrite(bp);
+		return (0);
+	}
+	return (bwrite(bp));
+}
+
+int
+kvfs_flushblk(struct kvfs_mount *mp, daddr_t blkno, int size)
+{
+	struct buf *bp;
+
+	/* if it is not cached, it is on disk already */
+	bp = getblk(mp->devvp, blkno, size, 0, 0, GB_NOCREAT);
+	if (bp == NULL) {
+		return (0);
+	}
+	if ((bp->b_flags & B_DELWRI) == 0) {
+		brelse(bp);
+		return (0);
+	}
+	return (bwrite(bp));
+}
+
+void
+kvfs_dep_order(struct kvfs_mount *mp, daddr_t before, int size, daddr_t after)
+{
+	struct kvfs_dep *d, *new;
+	int cycle;
+
+	if (!mp->async || before == after) {
+		return;
+	}
+	new = malloc(sizeof(*new), M_KVFSDEP, M_WAITOK);
+	new->before = before;
+	new->before_size = size;
+	new->after = after;
+	new->flushing = 0;
+
+	mtx_lock(&mp->deps_lock);
+	cycle = dep_waits_for(mp, before, after, KVFS_DEP_DEPTH);
+	if (!cycle) {
+		LIST_FOREACH (d, DEP_HASH(mp, after), entries) {
+			if (d->after == after && d->before == before &&
+			    !d->flushing) {
+				break;
+			}
+		}
+		if (d == NULL) {
+			LIST_INSERT_HEAD(DEP_HASH(mp, after), new, entries);
+			new = NULL;
+		}
+	}
+	mtx_unlock(&mp->deps_lock);
+	free(new, M_KVFSDEP);
+
+	if (cycle) {
+		kvfs_flushblk(mp, before, size);
+	}
+}
+
+/* write routine of the device's bufobj: write every buffer `bp` depends on,
+ * then `bp` itself */
+static int
+kvfs_bufwrite(struct buf *bp)
+{
+	struct kvfs_mount *mp = bp->b_vp->v_rdev->si_mountpt->mnt_data;
+	daddr_t blk = bp->b_lblkno;
+	struct kvfs_dep *d, *next;
+	daddr_t before;
+	int size, error;
+
+	/* The dependencies stay in the table until bp is on its way, so that
+	 * none can be added that would make a buffer we wait for wait on bp.
+	 * New ones added meanwhile are for bp's next write, and are kept. */
+	for (;;) {
+		mtx_lock(&mp->deps_lock);
+		LIST_FOREACH (d, DEP_HASH(mp, blk), entries) {
+			if (d->after == blk && !d->flushing) {
+				break;
+			}
+		}
+		if (d == NULL) {
+			mtx_unlock(&mp->deps_lock);
+			break;
+		}
+		d->flushing = 1;
+		before = d->before;
+		size = d->before_size;
+		mtx_unlock(&mp->deps_lock);
+
+		kvfs_flushblk(mp, before, size);
+	}
+
+	error = bufwrite(bp);
+
+	mtx_lock(&mp->deps_lock);
+	LIST_FOREACH_SAFE (d, DEP_HASH(mp, blk), entries, next) {
+		if (d->after == blk && d->flushing) {
+			LIST_REMOVE(d, entries);
+			free(d, M_KVFSDEP);
+		}
+	}
+	mtx_unlock(&mp->deps_lock);
+	return (error);
+}
@@ -0,0 +1,193 @@
+/*
+ * Free block allocator for kvfs.
+ *
+ * The on-disk free bitmap (bit i of byte j set if block j * 8 + i is in use)
+ * is copied into memory at mount as an array of 64-bit words, so a free block
+ * is found a word at a time with ffsll(3).
+ *
+ * To keep the files created together close together on disk, each CPU
+ * allocates from its own window of KVFS_ALLOC_WINDOW blocks, in ascending
+ * order. A batch of creates then fills adjacent inode sectors, bitmap bytes
+ * and data blocks, which the buffer cache and the disk can merge. When a
+ * window is used up, the CPU claims the next window from a cursor going round
+ * the disk, starting at the first word with a free block; since the cursor
+ * only moves forward, allocation is O(1) amortized. Creates are serialized by
+ * the lock on the root vnode, so the CPU only picks the window to use and the
+ * windows need no locking of their own.
+ *
+ * Every change is written through to the on-disk bitmap before returning
+ * (delayed on async mounts). A block is only marked in use on disk before its
+ * inode is written, and only marked free after its inode and data are gone.
+ * */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/buf.h>
+#include <sys/endian.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/pcpu.h>
+#include <sys/smp.h>
+#include <sys/vnode.h>
+
+#include "kvfs.h"
+
+/* read the bitmap this many bytes at a time */
+#define FREEMAP_READSIZE MAXBSIZE
+
+/* word and bit of the in-memory bitmap for ino */
+#define INO_TO_WORD(ino) ((ino) / sizeof(struct kvfs_inode) / 64)
+#define INO_TO_BIT(ino) ((ino) / sizeof(struct kvfs_inode) % 64)
+
+/* set or clear the bit of `ino` in the on-disk bitmap */
+static int
+freemap_write(struct kvfs_mount *mp, ino_t ino, int inuse)
+{
+	off_t free_byte = INO_TO_FREE_BYTE(ino, mp);
+	uint8_t mask = INO_TO_FREE_BIT_MASK(ino);
+	struct buf *bp;
+	int error;
+
+	if (!inuse) {
+		kvfs_dep_order(mp, INO_TO_SECTOR(ino, mp), DEV_BSIZE,
+		    btodb(free_byte));
+		kvfs_dep_order(mp, INO_TO_LBN(ino, mp), BLOCKSIZE,
+		    btodb(free_byte));
+	}
+	error = bread(mp->devvp, btodb(free_byte), DEV_BSIZE, NOCRED, &bp);
+	if (error != 0) {
+		return (error);
+	}
+	if (inuse) {
+		bp->b_data[free_byte % DEV_BSIZE] |= mask;
+	} else {
+		bp->b_data[free_byte % DEV_BSIZE] &= ~mask;
+	}
+	error = kvfs_bwrite(mp, bp);
+	if (inuse) {
+		kvfs_dep_order(mp, btodb(free_byte), DEV_BSIZE,
+		    INO_TO_SECTOR(ino, mp));
+	}
+	return (error);
+}
+
+int
+kvfs_freemap_load(struct kvfs_mount *mp)
+{
+	off_t bytes = CEIL(mp->block_count, 8);
+	uint32_t nwords = CEIL(mp->block_count, 64);
+	uint8_t *map;
+	struct buf *bp;
+	int error;
+
+	map = malloc((size_t)nwords * sizeof(uint64_t), M_KVFSFREE,
+	    M_WAITOK | M_ZERO);
+	for (off_t off = 0; off < bytes; off += FREEMAP_READSIZE) {
+		long size = MIN(FREEMAP_READSIZE, PAD(bytes - off));
+		error = bread(mp->devvp, btodb(mp->freelist_off + off), size,
+		    NOCRED, &bp);
+		if (error != 0) {
+			free(map, M_KVFSFREE);
+			return (error);
+		}
+		memcpy(map + off, bp->b_data, MIN(size, bytes - off));
+		brelse(bp);
+	}
+	mp->freemap = (uint64_t *)map;
+	mp->freemap_words = nwords;
+	mp->freemap_hint = 0;
+	mp->freemap_windows = malloc((mp_maxid + 1) *
+	    sizeof(struct kvfs_allocwin), M_KVFSFREE, M_WAITOK | M_ZERO);
+
+	/* the bitmap is little-endian. mark the bits past the last block as
+	 * used, so they are never handed out */
+	mp->freelist_count = 0;
+	for (uint32_t w = 0; w < nwords; w++) {
+		mp->freemap[w] = le64toh(mp->freemap[w]);
+		if (w == nwords - 1 && mp->block_count % 64 != 0) {
+			mp->freemap[w] |= ~0ULL << (mp->block_count % 64);
+		}
+		mp->freelist_count += 64 - bitcount64(mp->freemap[w]);
+	}
+	return (0);
+}
+
+void
+kvfs_freemap_free(struct kvfs_mount *mp)
+{
+	free(mp->freemap, M_KVFSFREE);
+	free(mp->freemap_windows, M_KVFSFREE);
+	mp->freemap = NULL;
+	mp->freemap_windows = NULL;
+}
+
+/* take the first free block of window `win`. returns 0 if it is used up */
+static int
+window_alloc(struct kvfs_mount *mp, struct kvfs_allocwin *win, uint32_t *out)
+{
+	uint32_t b = win->next;
+
+	while (b < win->end) {
+		uint32_t w = b / 64;
+		uint64_t avail = ~mp->freemap[w] & (~0ULL << (b % 64));
+		if (avail != 0) {
+			b = w * 64 + ffsll(avail) - 1;
+			if (b >= win->end) {
+				break;
+			}
+			mp->freemap[w] |= 1ULL << (b % 64);
+			win->next = b + 1;
+			*out = b;
+			return (1);
+		}
+		b = (w + 1) * 64;
+	}
+	win->next = win->end;
+	return (0);
+}
+
+/* give window `win` the next run of blocks with a free one at its start */
+static void
+window_claim(struct kvfs_mount *mp, struct kvfs_allocwin *win)
+{
+	uint32_t w = mp->freemap_hint;
+
+	/* there is a free block, so this finds it within one lap */
+	while (mp->freemap[w] == ~0ULL) {
+		if (++w == mp->freemap_words) {
+			w = 0;
+		}
+	}
+	win->next = w * 64;
+	win->end = MIN(win->next + KVFS_ALLOC_WINDOW, mp->block_count);
+	mp->freemap_hint = CEIL(win->end, 64) % mp->freemap_words;
+}
+
+int
+kvfs_freemap_alloc(struct kvfs_mount *mp, ino_t *out_ino)
+{
+	struct kvfs_allocwin *win = &mp->freemap_windows[curcpu];
+	uint32_t b;
+	ino_t ino;
+
+	if (mp->freelist_count == 0) {
+		return (ENOSPC);
+	}
+	/* a freshly claimed window always has a free block */
+	while (!window_alloc(mp, win, &b)) {
+		window_claim(mp, win);
+	}
+	mp->freelist_count--;
+
+	ino = (ino_t)b * sizeof(struct kvfs_inode);
+	*out_ino = ino;
+	return (freemap_write(mp, ino, 1));
+}
+
+int
+kvfs_freemap_release(struct kvfs_mount *mp, ino_t ino)
+{
+	mp->freemap[INO_TO_WORD(ino)] &= ~(1ULL << INO_TO_BIT(ino));
+	mp->freelist_count++;
+	return (freemap_write(mp, ino, 0));
+}
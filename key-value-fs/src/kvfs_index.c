@@ -0,0 +1,186 @@
+/*
+ * On-disk key index for kvfs.
+ *
+ * The index is a hash table of one-sector buckets, laid out by mkkvfs after
+ * the inode table (see struct kvfs_index_bucket). Entries hold the index of
+ * an inode and a tag of its key, so a lookup reads the key's home bucket and
+ * only the inode sectors of entries whose tag matches. A key goes in the first
+ * bucket with an empty entry from its home bucket on; the full buckets it
+ * passes are marked with KVFS_INDEX_OVERFLOW, and lookups go on to the next
+ * bucket only from a marked one.
+ *
+ * An index entry is always added before the inode holding its key is written,
+ * and removed after, so the index never misses a key on disk. On async mounts
+ * this order is kept with write dependencies (see kvfs_deps.c). The inode an
+ * entry points to is checked for the key, so entries left behind by a crash
+ * are harmless.
+ * */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/buf.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+
+#include "kvfs.h"
+
+CTASSERT(sizeof(struct kvfs_index_bucket) == KVFS_INDEX_BUCKETSIZE);
+CTASSERT(KVFS_INDEX_BUCKETSIZE == DEV_BSIZE);
+
+/* convert ino to the value of its index entries */
+#define INO_TO_INDEX(ino) ((ino) / sizeof(struct kvfs_inode) + 1)
+
+/* block number of key index bucket `b` */
+#define INDEX_BLKNO(mp, b) \
+	btodb((mp)->index_off + (off_t)(b) * KVFS_INDEX_BUCKETSIZE)
+
+/* read key index bucket `b` */
+static int
+index_bread(struct kvfs_mount *mp, uint32_t b, struct buf **bpp)
+{
+	return (bread(mp->devvp, INDEX_BLKNO(mp, b), DEV_BSIZE, NOCRED, bpp));
+}
+
+/* check if inode `ino` is in use and holds `key`. returns ENOENT if not */
+static int
+inode_haskey(struct kvfs_mount *mp, ino_t ino, const uint8_t *key)
+{
+	struct kvfs_inode inode;
+	struct buf *bp;
+	off_t loc = mp->inode_off + ino;
+	int error;
+
+	error = bread(mp->devvp, btodb(loc), DEV_BSIZE, NOCRED, &bp);
+	if (error != 0) {
+		return (error);
+	}
+	memcpy(&inode, bp->b_data + (loc % DEV_BSIZE), sizeof(inode));
+	brelse(bp);
+	if ((inode.flags & KVFS_INODE_FREE) != 0 ||
+	    memcmp(inode.key, key, sizeof(inode.key)) != 0) {
+		return (ENOENT);
+	}
+	return (0);
+}
+
+int
+kvfs_index_lookup(struct kvfs_mount *mp, const uint8_t *key, ino_t *out_ino)
+{
+	uint32_t b = KVFS_INDEX_HOME(key, mp->index_buckets);
+	uint32_t tag = KVFS_INDEX_TAG(key);
+	struct kvfs_index_bucket *bucket;
+	struct buf *bp;
+	ino_t ino;
+	int error, overflow;
+
+	for (uint32_t n = 0; n < mp->index_buckets; n++) {
+		error = index_bread(mp, b, &bp);
+		if (error != 0) {
+			return (error);
+		}
+		bucket = (struct kvfs_index_bucket *)bp->b_data;
+		for (int i = 0; i < KVFS_INDEX_ENTRIES; i++) {
+			struct kvfs_index_entry *e = &bucket->entries[i];
+			if (e->index == 0 || e->tag != tag) {
+				continue;
+			}
+			ino = (ino_t)(e->index - 1) * sizeof(struct kvfs_inode);
+			error = inode_haskey(mp, ino, key);
+			if (error != ENOENT) {
+				brelse(bp);
+				if (error == 0) {
+					*out_ino = ino;
+				}
+				return (error);
+			}
+		}
+		overflow = bucket->flags & KVFS_INDEX_OVERFLOW;
+		brelse(bp);
+		if (!overflow) {
+			break;
+		}
+		if (++b == mp->index_buckets) {
+			b = 0;
+		}
+	}
+	return (ENOENT);
+}
+
+int
+kvfs_index_insert(struct kvfs_mount *mp, const uint8_t *key, ino_t ino)
+{
+	uint32_t b = KVFS_INDEX_HOME(key, mp->index_buckets);
+	struct kvfs_index_bucket *bucket;
+	struct buf *bp;
+	int error;
+
+	for (uint32_t n = 0; n < mp->index_buckets; n++) {
+		error = index_bread(mp, b, &bp);
+		if (error != 0) {
+			return (error);
+		}
+		bucket = (struct kvfs_index_bucket *)bp->b_data;
+		for (int i = 0; i < KVFS_INDEX_ENTRIES; i++) {
+			struct kvfs_index_entry *e = &bucket->entries[i];
+			if (e->index == 0) {
+				e->index = INO_TO_INDEX(ino);
+				e->tag = KVFS_INDEX_TAG(key);
+				error = kvfs_bwrite(mp, bp);
+				kvfs_dep_order(mp, INDEX_BLKNO(mp, b), DEV_BSIZE,
+				    INO_TO_SECTOR(ino, mp));
+				return (error);
+			}
+		}
+		/* full: the key goes on in the next bucket */
+		if ((bucket->flags & KVFS_INDEX_OVERFLOW) == 0) {
+			bucket->flags |= KVFS_INDEX_OVERFLOW;
+			error = kvfs_bwrite(mp, bp);
+			if (error != 0) {
+				return (error);
+			}
+		} else {
+			brelse(bp);
+		}
+		if (++b == mp->index_buckets) {
+			b = 0;
+		}
+	}
+	return (ENOSPC);
+}
+
+int
+kvfs_index_remove(struct kvfs_mount *mp, const uint8_t *key, ino_t ino)
+{
+	uint32_t b = KVFS_INDEX_HOME(key, mp->index_buckets);
+	struct kvfs_index_bucket *bucket;
+	struct buf *bp;
+	int error, overflow;
+
+	for (uint32_t n = 0; n < mp->index_buckets; n++) {
+		/* the entry may only go once the inode no longer has the key */
+		kvfs_dep_order(mp, INO_TO_SECTOR(ino, mp), DEV_BSIZE,
+		    INDEX_BLKNO(mp, b));
+		error = index_bread(mp, b, &bp);
+		if (error != 0) {
+			return (error);
+		}
+		bucket = (struct kvfs_index_bucket *)bp->b_data;
+		for (int i = 0; i < KVFS_INDEX_ENTRIES; i++) {
+			struct kvfs_index_entry *e = &bucket->entries[i];
+			if (e->index == INO_TO_INDEX(ino) &&
+			    e->tag == KVFS_INDEX_TAG(key)) {
+				bzero(e, sizeof(*e));
+				return (kvfs_bwrite(mp, bp));
+			}
+		}
+		overflow = bucket->flags & KVFS_INDEX_OVERFLOW;
+		brelse(bp);
+		if (!overflow) {
+			break;
+		}
+		if (++b == mp->index_buckets) {
+			b = 0;
+		}
+	}
+	return (ENOENT);
+}
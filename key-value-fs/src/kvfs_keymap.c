@@ -0,0 +1,225 @@
+/*
+ * In-memory key map for kvfs.
+ *
+ * At mount, the inode table is read once and every key in use is put in a
+ * per-mount hash table, so lookups afterwards do no I/O at all. The map keeps
+ * a copy of the key of every inode (by inode index), and an open-addressed
+ * table of inode indices probed linearly from the key's first 32 bits. There
+ * is one key per block at most, so the table is sized at mount for a full
+ * filesystem and never grows: 25 to 31 bytes of RAM per block, or 6-8GiB per
+ * TiB of disk.
+ *
+ * The map only mirrors the inode table, so it is never written to disk. If
+ * it cannot be allocated, or vfs.kvfs.keymap is 0, lookups use the on-disk
+ * key index instead.
+ * */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/buf.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/vnode.h>
+
+#include "kvfs.h"
+
+MALLOC_DEFINE(M_KVFSKEYMAP, "kvfs_keymap", "kvfs in-memory key map");
+
+static SYSCTL_NODE(_vfs, OID_AUTO, kvfs, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "kvfs filesystem");
+
+static int kvfs_keymap_enable = 1;
+SYSCTL_INT(_vfs_kvfs, OID_AUTO, keymap, CTLFLAG_RWTUN, &kvfs_keymap_enable, 0,
+    "Build an in-memory key map when mounting");
+
+static uint64_t kvfs_keymap_bytes;
+SYSCTL_U64(_vfs_kvfs, OID_AUTO, keymap_bytes, CTLFLAG_RD, &kvfs_keymap_bytes,
+    0, "Memory used by the key maps of all kvfs mounts");
+
+static uint64_t kvfs_keymap_keys;
+SYSCTL_U64(_vfs_kvfs, OID_AUTO, keymap_keys, CTLFLAG_RD, &kvfs_keymap_keys, 0,
+    "Keys in the key maps of all kvfs mounts");
+
+static uint64_t kvfs_keymap_build_usec;
+SYSCTL_U64(_vfs_kvfs, OID_AUTO, keymap_build_usec, CTLFLAG_RD,
+    &kvfs_keymap_build_usec, 0,
+    "Time taken to build the most recently built key map, in microseconds");
+
+/* read the inode table this many bytes at a time */
+#define KEYMAP_READSIZE MAXBSIZE
+
+/* slot of the table a key is probed from */
+#define KEYMAP_HOME(km, key) (KVFS_KEY_WORD(key, 0) & (km)->mask)
+
+/* find the slot holding `key`, or return -1 */
+static int64_t
+keymap_find(struct kvfs_keymap *km, const uint8_t *key)
+{
+	uint32_t i = KEYMAP_HOME(km, key);
+
+	while (km->slots[i] != 0) {
+		if (memcmp(km->keys[km->slots[i] - 1], key, 20) == 0) {
+			return (i);
+		}
+		i = (i + 1) & km->mask;
+	}
+	return (-1);
+}
+
+/* put inode `index` in the table, its key already being in km->keys */
+static void
+keymap_add(struct kvfs_keymap *km, uint32_t index)
+{
+	uint32_t i = KEYMAP_HOME(km, km->keys[index]);
+
+	while (km->slots[i] != 0) {
+		i = (i + 1) & km->mask;
+	}
+	km->slots[i] = index + 1;
+	km->count++;
+}
+
+int
+kvfs_keymap_build(struct kvfs_mount *mp)
+{
+	struct kvfs_keymap *km = &mp->keymap;
+	struct kvfs_inode *inode;
+	struct buf *bp;
+	sbintime_t start = sbinuptime();
+	off_t table_size = PAD((off_t)mp->block_count * sizeof(*inode));
+	uint32_t nslots;
+	int error;
+
+	if (!kvfs_keymap_enable) {
+		return (EOPNOTSUPP);
+	}
+
+	/* at most 3/4 of the slots are ever used */
+	nslots = 1;
+	while (nslots < mp->block_count + mp->block_count / 3 + 1) {
+		nslots <<= 1;
+	}
+	km->mask = nslots - 1;
+	km->count = 0;
+	km->size = (size_t)nslots * sizeof(*km->slots) +
+	    (size_t)mp->block_count * sizeof(*km->keys);
+	km->slots = malloc((size_t)nslots * sizeof(*km->slots), M_KVFSKEYMAP,
+	    M_NOWAIT | M_ZERO);
+	km->keys = malloc((size_t)mp->block_count * sizeof(*km->keys),
+	    M_KVFSKEYMAP, M_NOWAIT);
+	if (km->slots == NULL || km->keys == NULL) {
+		error = ENOMEM;
+		goto error_exit;
+	}
+
+	for (off_t off = 0; off < table_size; off += KEYMAP_READSIZE) {
+		long size = MIN(KEYMAP_READSIZE, table_size - off);
+		error = bread(mp->devvp, btodb(mp->inode_off + off), size,
+		    NOCRED, &bp);
+		if (error != 0) {
+			goto error_exit;
+		}
+		uint32_t first = off / sizeof(*inode);
+		for (uint32_t i = 0; i < size / sizeof(*inode) &&
+		     first + i < mp->block_count; i++) {
+			inode = (struct kvfs_inode *)bp->b_data + i;
+			if (inode->flags & KVFS_INODE_FREE) {
+				continue;
+			}
+			memcpy(km->keys[first + i], inode->key, 20);
+			keymap_add(km, first + i);
+		}
+		brelse(bp);
+	}
+
+	kvfs_keymap_build_usec = (sbinuptime() - start) / SBT_1US;
+	atomic_add_64(&kvfs_keymap_bytes, km->size);
+	atomic_add_64(&kvfs_keymap_keys, km->count);
+	printf("Key map: %u keys, %zu bytes, built in %ju us\n", km->count,
+	    km->size, (uintmax_t)kvfs_keymap_build_usec);
+	return (0);
+
+error_exit:
+	free(km->slots, M_KVFSKEYMAP);
+	free(km->keys, M_KVFSKEYMAP);
+	km->slots = NULL;
+	km->keys = NULL;
+	return (error);
+}
+
+void
+kvfs_keymap_free(struct kvfs_mount *mp)
+{
+	struct kvfs_keymap *km = &mp->keymap;
+
+	if (km->slots == NULL) {
+		return;
+	}
+	atomic_subtract_64(&kvfs_keymap_bytes, km->size);
+	atomic_subtract_64(&kvfs_keymap_keys, km->count);
+	free(km->slots, M_KVFSKEYMAP);
+	free(km->keys, M_KVFSKEYMAP);
+	km->slots = NULL;
+	km->keys = NULL;
+}
+
+int
+kvfs_keymap_lookup(struct kvfs_mount *mp, const uint8_t *key, ino_t *out_ino)
+{
+	struct kvfs_keymap *km = &mp->keymap;
+	int64_t i = keymap_find(km, key);
+
+	if (i < 0) {
+		return (ENOENT);
+	}
+	*out_ino = (ino_t)(km->slots[i] - 1) * sizeof(struct kvfs_inode);
+	return (0);
+}
+
+void
+kvfs_keymap_insert(struct kvfs_mount *mp, const uint8_t *key, ino_t ino)
+{
+	struct kvfs_keymap *km = &mp->keymap;
+	uint32_t index = ino / sizeof(struct kvfs_inode);
+
+	memcpy(km->keys[index], key, 20);
+	keymap_add(km, index);
+	atomic_add_64(&kvfs_keymap_keys, 1);
+}
+
+void
+kvfs_keymap_remove(struct kvfs_mount *mp, const uint8_t *key)
+{
+	struct kvfs_keymap *km = &mp->keymap;
+	int64_t found = keymap_find(km, key);
+	uint32_t i, j, home;
+
+	if (found < 0) {
+		return;
+	}
+	km->count--;
+	atomic_subtract_64(&kvfs_keymap_keys, 1);
+
+	/* Empty the slot, then move back any later key in the same run that
+	 * could not be found from its home slot across the gap. This keeps
+	 * every key reachable without leaving tombstones behind. */
+	i = found;
+	j = i;
+	for (;;) {
+		j = (j + 1) & km->mask;
+		if (km->slots[j] == 0) {
+			break;
+		}
+		home = KEYMAP_HOME(km, km->keys[km->slots[j] - 1]);
+		/* leave the key where it is if its home is in (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			continue;
+		}
+		km->slots[i] = km->slots[j];
+		i = j;
+	}
+	km->slots[i] = 0;
+}
@@ -19,7 +19,7 @@
 #include "kvfs.h"
 
 MALLOC_DEFINE(M_KVFSMOUNT, "kvfs_mount", "kvfs mount structure");
-MALLOC_DEFINE(M_KVFSFREE, "kvfs_freelist", "kvfs free list entries");
+MALLOC_DEFINE(M_KVFSFREE, "kvfs_freemap", "kvfs free block bitmap");
 
 uma_zone_t kvfs_zone_node = NULL;
 
@@ -155,55 +155,41 @@ kvfs_mount(struct mount *mp)
 		goto error_exit;
 	}
 	brelse(bp);
+	bp = NULL;
 
 	kvfsmp->flags = sb.flags;
 	kvfsmp->inode_off = sb.inode_off;
 	kvfsmp->freelist_off = sb.freelist_off;
 	kvfsmp->data_off = sb.data_off;
 	kvfsmp->block_count = sb.block_count;
+	kvfsmp->index_off = sb.index_off;
+	kvfsmp->index_buckets = sb.index_buckets;
+	if (kvfsmp->index_buckets == 0) {
+		printf("No key index, lookups will scan the inode table\n");
+	}
 
-	/* init free list */
-	LIST_INIT(&kvfsmp->freelist_head);
-	/* read free list from location found in superblock */
-	uint32_t freelist_bytes = CEIL(kvfsmp->block_count, 8);
-	error = bread(devvp, btodb(kvfsmp->freelist_off), PAD(freelist_bytes),
-	    NOCRED, &bp);
+	/* read free bitmap from location found in superblock */
+	error = kvfs_freemap_load(kvfsmp);
 	if (error != 0) {
 		goto error_exit;
 	}
+	printf("Found %d free blocks\n", kvfsmp->freelist_count);
 
-	/* read freelist byte by byte */
-	for (int i = 0; i < freelist_bytes; i++) {
-		/* each byte represents 8 indoe or block entries */
-		ino_t curr_inode = (i * 8 * sizeof(struct kvfs_inode));
-		uint8_t byte = bp->b_data[i];
-		/* read msb to lsb */
-		for (uint8_t mask = 1 << 7, j = 0; mask != 0; mask >>= 1, j++) {
-			/* if bit not set in the free bitmap, create
-			 * entry in the free list */
-			if ((byte & mask) == 0) {
-				/* the number of bytes in the free list bitmap
-				 * is padded to CEIL(blocks/8). if the number of
-				 * blocks is not divisible by 8, make sure not
-				 * to read "aux" bits at the end of the padded
-				 * byte */
-				if (i * 8 + j >= kvfsmp->block_count) {
-					break;
-				}
-				struct kvfs_freelist_entry *e =
-				    malloc(sizeof(struct kvfs_freelist_entry),
-					M_KVFSFREE, M_WAITOK);
-				e->ino = curr_inode +
-				    (j * sizeof(struct kvfs_inode));
-				LIST_INSERT_HEAD(&kvfsmp->freelist_head, e,
-				    entries);
-				kvfsmp->freelist_count++;
-			}
-		}
+	/* read every key into memory, so lookups don't need any I/O */
+	error = kvfs_keymap_build(kvfsmp);
+	if (error != 0) {
+		printf("No key map (error %d), lookups will read the disk\n",
+		    error);
+		error = 0;
+	}
+
+	/* with -o async, metadata writes are delayed but kept in order */
+	kvfsmp->async = (mp->mnt_flag & MNT_ASYNC) != 0;
+	kvfs_deps_init(kvfsmp);
+	if (kvfsmp->async) {
+		printf("Delaying metadata writes\n");
 	}
-	printf("Found %d free blocks\n", kvfsmp->freelist_count);
 
-	brelse(bp);
 	/* mount fs */
 	vfs_mountedfrom(mp, from);
 
@@ -241,6 +227,13 @@ kvfs_unmount(struct mount *mp, int mntflags)
 		return (error);
 	}
 
+	/* write out delayed buffers, in order */
+	error = kvfs_deps_uninit(kvfsmp);
+	if (error != 0) {
+		printf("Error %d writing out delayed buffers\n", error);
+		error = 0;
+	}
+
 	g_topology_lock();
 	g_vfs_close(kvfsmp->cp);
 	g_topology_unlock();
@@ -248,14 +241,9 @@ kvfs_unmount(struct mount *mp, int mntflags)
 	vrele(kvfsmp->devvp);
 	dev_rel(kvfsmp->cdev);
 
-	/* free up freelist */
-	struct kvfs_freelist_entry *curr, *next;
-	curr = LIST_FIRST(&kvfsmp->freelist_head);
-	while (curr != NULL) {
-		next = LIST_NEXT(curr, entries);
-		free(curr, M_KVFSFREE);
-		curr = next;
-	}
+	/* free up free bitmap */
+	kvfs_freemap_free(kvfsmp);
+	kvfs_keymap_free(kvfsmp);
 	free(kvfsmp, M_KVFSMOUNT);
 	mp->mnt_data = NULL;
 	MNT_ILOCK(mp);
@@ -298,33 +286,24 @@ kvfs_statfs(struct mount *mp, struct statfs *sbp)
 	return (0);
 }
 
+/* Sync the filesystem. Every buffer kvfs writes belongs to the device vnode,
+ * and the superblock never changes, so this syncs the device. The syncer
+ * already flushes the device's delayed buffers by itself, so lazy syncs have
+ * nothing to do. */
 static int
 kvfs_sync(struct mount *mp, int waitfor)
 {
 	printf("sync\n");
-	/* TODO: sync and fsync are really broken */
-#if 0
-	// loop over all vnodes and fsync() them (based on ext2 and FAT)
-	int error = 0;
-	struct vnode *mvp, *vp;
-loop:
-	MNT_VNODE_FOREACH_ALL(vp, mp, mvp) {
-		error = vget(vp, LK_EXCLUSIVE | LK_NOWAIT | LK_INTERLOCK);
-		if (error) {
-			// abort if vnode does not exist
-			if (error == ENOENT) {
-				MNT_VNODE_FOREACH_ALL_ABORT(mp, mvp);
-				goto loop;
-			}
-			continue;
-		}
-		error = VOP_FSYNC(vp, waitfor, curthread);
-		VOP_UNLOCK(vp);
-		vrele(vp);
+	struct kvfs_mount *kvfsmp = mp->mnt_data;
+	int error;
+
+	if (waitfor == MNT_LAZY || !kvfsmp->async) {
+		return (0);
 	}
-	// TODO write back superblock here?
-#endif
-	return (0);
+	vn_lock(kvfsmp->devvp, LK_EXCLUSIVE | LK_RETRY);
+	error = VOP_FSYNC(kvfsmp->devvp, waitfor, curthread);
+	VOP_UNLOCK(kvfsmp->devvp);
+	return (error);
 }
 static int
 kvfs_vget(struct mount *mp, ino_t ino, int flags, struct vnode **vpp)
@@ -442,7 +421,7 @@ kvfs_vget_internal(struct mount *mp, ino_t ino, int flags, struct vnode **vpp,
 
 			/* copy allocated inode back into buffer */
 			memcpy(buf_ptr, &knp->inode, sizeof(struct kvfs_inode));
-			bwrite(bp);
+			kvfs_bwrite(kvfsmp, bp);
 		} else {
 			/* inode exists on disk, so we don't need to allocate it
 			 */
@@ -52,7 +52,38 @@ memnode_update(struct kvfs_memnode *knode, struct kvfs_inode *inode)
 
 	caddr_t ptr = bp->b_data + (ino % DEV_BSIZE);
 	memcpy(ptr, inode, sizeof(struct kvfs_inode));
-	return (bwrite(bp));
+	return (kvfs_bwrite(mp, bp));
+}
+
+/* find the inode of `key` by reading every inode from disk, on filesystems
+ * made without a key index. returns ENOENT if absent */
+static int
+kvfs_scan_lookup(struct kvfs_mount *kvfsmp, const uint8_t *key, ino_t *out_ino)
+{
+	struct buf *bp;
+	int error = bread(kvfsmp->devvp, btodb(kvfsmp->inode_off),
+	    PAD(kvfsmp->block_count * sizeof(struct kvfs_inode)), NOCRED, &bp);
+	if (error != 0) {
+		return error;
+	}
+
+	/* go through each inode on disk */
+	struct kvfs_inode inode;
+	for (int i = 0; i < kvfsmp->block_count; i++) {
+		ino_t idx = i * sizeof(struct kvfs_inode);
+		memcpy(&inode, bp->b_data + idx, sizeof(struct kvfs_inode));
+		/* if this inode is free we just skip it */
+		if (inode.flags & KVFS_INODE_FREE) {
+			continue;
+		}
+		if (memcmp(key, inode.key, 20) == 0) {
+			brelse(bp);
+			*out_ino = idx;
+			return (0);
+		}
+	}
+	brelse(bp);
+	return (ENOENT);
 }
 
 static int
@@ -96,60 +127,48 @@ kvfs_lookup(struct vop_lookup_args *ap)
 		return (EINVAL);
 	}
 
-	printf("  bread\n");
-	/* bread() every single inode from disk */
-	struct buf *bp;
-	error = bread(kvfsmp->devvp, btodb(kvfsmp->inode_off),
-	    PAD(kvfsmp->block_count * sizeof(struct kvfs_inode)), NOCRED, &bp);
-	if (error != 0) {
-		return error;
-	}
-
-	/* go through each inode on disk */
-	printf("  look through inodes\n");
-	struct kvfs_inode inode;
-	for (int i = 0; i < kvfsmp->block_count; i++) {
-		ino_t idx = i * sizeof(struct kvfs_inode);
-		memcpy(&inode, bp->b_data + idx, sizeof(struct kvfs_inode));
-		/* if this inode is free we just skip it */
-		if (inode.flags & KVFS_INODE_FREE) {
-			continue;
-		}
-		if (memcmp(key, inode.key, 20) == 0) {
-			/* found the inode for our file, get the locked vnode
-			   associated with it. */
-			brelse(bp);
-			int error = VFS_VGET(vdp->v_mount, idx, cnp->cn_lkflags,
-			    vpp);
-			if (error != 0) {
-				printf("  got vget error: %d\n", error);
-				return (error);
-			}
-			goto found;
+	/* the key map needs no I/O, and the key index reads a sector or two;
+	 * without either, read every inode */
+	ino_t ino;
+	if (kvfsmp->keymap.slots != NULL) {
+		error = kvfs_keymap_lookup(kvfsmp, key, &ino);
+	} else if (kvfsmp->index_buckets != 0) {
+		error = kvfs_index_lookup(kvfsmp, key, &ino);
+	} else {
+		error = kvfs_scan_lookup(kvfsmp, key, &ino);
+	}
+	if (error == ENOENT) {
+		/* special case: as per VOP_LOOKUP(9),
+		 * if operation is CREATE or RENAME, we return EJUSTRETURN */
+		if ((cnp->cn_flags & ISLASTCN) &&
+		    (cnp->cn_nameiop == CREATE || cnp->cn_nameiop == RENAME)) {
+			return (EJUSTRETURN);
 		}
+		return (ENOENT);
+	} else if (error != 0) {
+		return (error);
 	}
 
-	/* not found */
-	brelse(bp);
-	/* special case: as per VOP_LOOKUP(9),
-	 * if operation is CREATE or RENAME, we return EJUSTRETURN */
-	if ((cnp->cn_flags & ISLASTCN) &&
-	    (cnp->cn_nameiop == CREATE || cnp->cn_nameiop == RENAME)) {
-		return (EJUSTRETURN);
+	/* found the inode for our file, get the locked vnode associated with
+	 * it. */
+	error = VFS_VGET(vdp->v_mount, ino, cnp->cn_lkflags, vpp);
+	if (error != 0) {
+		printf("  got vget error: %d\n", error);
+		return (error);
 	}
-	return (ENOENT);
-
-found:
 	printf("  found inode\n");
 	return (0);
 }
 
 /* Creating a file.
- * Done in "soft update" order:
- *	1. pop entry from free list
- *	2. update free bitmap
- *	3. allocate vnode and inode
- *	4. write inode to disk
+ * Done in "soft update" order (on async mounts, the order is kept with write
+ * dependencies):
+ *	1. take a block from the free bitmap
+ *	2. update free bitmap on disk
+ *	3. add key to the key index
+ *	4. allocate vnode and inode
+ *	5. write inode to disk
+ *	6. add key to the key map
  *	*/
 static int
 kvfs_create(struct vop_create_args *ap)
@@ -163,40 +182,51 @@ kvfs_create(struct vop_create_args *ap)
 
 	int error;
 
-	struct kvfs_freelist_entry *entry = LIST_FIRST(&mp->freelist_head);
-	if (entry == NULL) {
+	/* lookup has checked the name already */
+	uint8_t key[20];
+	if (str_to_key(cnp->cn_nameptr, key) != 0) {
+		*vpp = NULL;
+		return (EINVAL);
+	}
+	ino_t existing;
+	if (mp->keymap.slots != NULL &&
+	    kvfs_keymap_lookup(mp, key, &existing) == 0) {
 		*vpp = NULL;
-		return (ENOSPC);
+		return (EEXIST);
 	}
-	ino_t ino = entry->ino;
-	off_t free_byte = INO_TO_FREE_BYTE(ino, mp);
-	uint8_t mask = INO_TO_FREE_BIT_MASK(ino);
-
-	printf("found inode in free list: %zu, at freelist byte %zu/lbn %zu, with mask %d\n",
-	    ino, free_byte, btodb(free_byte), mask);
-	/* pop entry from free list */
-	LIST_REMOVE(entry, entries);
-	free(entry, M_KVFSFREE);
-	mp->freelist_count--;
 
-	/* update free bitmap to mark that we now own this inode */
-	struct buf *bp;
-	error = bread(mp->devvp, btodb(free_byte), DEV_BSIZE, NOCRED, &bp);
+	/* take a free block, and mark it in use in the free bitmap */
+	ino_t ino;
+	error = kvfs_freemap_alloc(mp, &ino);
 	if (error != 0) {
-		return 0;
+		*vpp = NULL;
+		return (error);
+	}
+	printf("allocated inode %zu from free bitmap\n", ino);
+
+	if (mp->index_buckets != 0) {
+		error = kvfs_index_insert(mp, key, ino);
+		if (error != 0) {
+			kvfs_freemap_release(mp, ino);
+			*vpp = NULL;
+			return (error);
+		}
 	}
-	/* set the bit corresponding to the newly allocated block in the on-disk
-	 * free list */
-	bp->b_data[free_byte % DEV_BSIZE] |= mask;
-	bwrite(bp);
 
 	/* allocate inode and vnode. This routine also writes the inode to a
 	 * buf, which should be flushed to filesystem. */
 	error = kvfs_vget_internal(vdp->v_mount, ino, LK_EXCLUSIVE, vpp,
 	    cnp->cn_nameptr);
 	if (error) {
+		if (mp->index_buckets != 0) {
+			kvfs_index_remove(mp, key, ino);
+		}
+		kvfs_freemap_release(mp, ino);
 		return (error);
 	}
+	if (mp->keymap.slots != NULL) {
+		kvfs_keymap_insert(mp, key, ino);
+	}
 
 	return (0);
 }
@@ -375,41 +405,50 @@ kvfs_write(struct vop_write_args *ap)
 			return (error);
 		}
 	}
-	/* write back the block */
-	bwrite(bp);
-	return (0);
+	/* write back the block. on async mounts, the syncer writes it later
+	 * unless the caller asked for a synchronous write */
+	if (mp->async && (ioflag & IO_SYNC) == 0) {
+		bdwrite(bp);
+		return (0);
+	}
+	return (bwrite(bp));
 }
 
+/* Sync a file. All of our buffers belong to the device vnode, so this writes
+ * the file's data block and inode sector if they are dirty. The write
+ * dependencies of the inode sector make sure the free bitmap and key index
+ * reach the disk first. Syncing the root syncs the whole device. */
 static int
 kvfs_fsync(struct vop_fsync_args *ap)
 {
 	printf("kvfs_fsync\n");
-	/* TODO: sync and fsync are really broken */
-#if 0
-	// Doing it how Ext2 does it
-	vop_stdfsync(ap);
-	struct kvfs_memnode *knp = ap->a_vp->v_data;
-
+	struct vnode *vp = ap->a_vp;
+	struct kvfs_memnode *knp = vp->v_data;
+	struct kvfs_mount *mp = knp->mp;
 	int error;
-	if (ap->a_waitfor != MNT_NOWAIT) {
-		struct vnode *devvp = knp->mp->devvp;
-		vn_lock(devvp, LK_EXCLUSIVE | LK_RETRY);
-		error = VOP_FSYNC(devvp, MNT_WAIT, ap->a_td);
-		VOP_UNLOCK(devvp);
-	} else {
-		error = 0;
+
+	if (vp->v_vflag & VV_ROOT) {
+		vn_lock(mp->devvp, LK_EXCLUSIVE | LK_RETRY);
+		error = VOP_FSYNC(mp->devvp, ap->a_waitfor, ap->a_td);
+		VOP_UNLOCK(mp->devvp);
+		return (error);
 	}
-	/* TODO try to sync inode? */
-#endif
-	return (0);
+
+	error = kvfs_flushblk(mp, knp->lbn, BLOCKSIZE);
+	if (error != 0) {
+		return (error);
+	}
+	return (kvfs_flushblk(mp, INO_TO_SECTOR(knp->ino, mp), DEV_BSIZE));
 }
 
 /* Remove a file.
- * Synchronously zeroes out the data block and inode.
- * Performed in a "soft update" manner:
+ * Zeroes out the data block and inode, synchronously unless mounted async.
+ * Performed in a "soft update" manner (on async mounts, the order is kept
+ * with write dependencies):
  *	1. zero out inode
- *	2. zero out data blocks
- *	3. add block to free list
+ *	2. remove key from the key index and key map
+ *	3. zero out data blocks
+ *	4. add block to free bitmap
  */
 static int
 kvfs_remove(struct vop_remove_args *ap)
@@ -419,38 +458,26 @@ kvfs_remove(struct vop_remove_args *ap)
 	struct kvfs_memnode *knode = vp->v_data;
 	struct kvfs_mount *mp = knode->mp;
 	ino_t ino = knode->ino;
-	int error = 0;
 
 	/* write an empty inode to this file */
 	struct kvfs_inode empty = { 0 };
 	empty.flags |= KVFS_INODE_FREE;
 	memnode_update(knode, &empty);
+	if (mp->index_buckets != 0) {
+		kvfs_index_remove(mp, knode->inode.key, ino);
+	}
+	if (mp->keymap.slots != NULL) {
+		kvfs_keymap_remove(mp, knode->inode.key);
+	}
 
 	/* zero out data block */
 	struct buf *bp;
 	bp = getblk(mp->devvp, knode->lbn, BLOCKSIZE, 0, 0, 0);
 	bzero(bp->b_data, BLOCKSIZE);
-	bwrite(bp);
-
-	/* add (inode, block) to filesystem free list */
-	uint32_t free_byte = INO_TO_FREE_BYTE(ino, mp);
-	uint32_t mask = INO_TO_FREE_BIT_MASK(ino);
-	struct kvfs_freelist_entry *e =
-		malloc(sizeof(struct kvfs_freelist_entry),
-		M_KVFSFREE, M_WAITOK);
-	e->ino = ino;
-	LIST_INSERT_HEAD(&mp->freelist_head, e, entries);
-	mp->freelist_count++;
-
-	/* update free bitmap to mark that inode is free now own this inode */
-	error = bread(mp->devvp, btodb(free_byte), DEV_BSIZE, NOCRED, &bp);
-	if (error != 0) {
-		return 0;
-	}
-	/* free the bit corresponding to the freed block in the on-disk
-	 * free list */
-	bp->b_data[free_byte % DEV_BSIZE] &= ~mask;
-	bwrite(bp);
+	kvfs_bwrite(mp, bp);
+
+	/* give (inode, block) back to the free bitmap, in memory and on disk */
+	kvfs_freemap_release(mp, ino);
 
 	/* XXX remove vnode from hash, so if the file is created again,
 	 * it will be re-allocated. */
@@ -507,10 +534,28 @@ kvfs_rename(struct vop_rename_args *ap)
 	if ((error = vn_lock(fvp, LK_EXCLUSIVE)) != 0) {
 		goto out;
 	}
+	/* the new key is indexed before the inode holds it, and the old one
+	 * removed after */
+	uint8_t oldkey[20];
+	memcpy(oldkey, from->inode.key, 20 * sizeof(uint8_t));
+	if (from->mp->index_buckets != 0) {
+		error = kvfs_index_insert(from->mp, testkey, from->ino);
+		if (error != 0) {
+			VOP_UNLOCK(fvp);
+			goto out;
+		}
+	}
 	memcpy(from->inode.key, testkey, 20 * sizeof(uint8_t));
 
 	/* Update inode on disk */
 	memnode_update(from, &from->inode);
+	if (from->mp->index_buckets != 0) {
+		kvfs_index_remove(from->mp, oldkey, from->ino);
+	}
+	if (from->mp->keymap.slots != NULL) {
+		kvfs_keymap_remove(from->mp, oldkey);
+		kvfs_keymap_insert(from->mp, testkey, from->ino);
+	}
 
 	/* Unlock source file */
 	VOP_UNLOCK(fvp);
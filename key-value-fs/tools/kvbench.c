@@ -0,0 +1,341 @@
+/*
+ * kvbench: benchmark kvfs key lookups on an image file.
+ *
+ * Makes a kvfs image with every one of `-n` blocks in use, then looks keys up
+ * through the key index the way kvfs_lookup does, reading the image with
+ * pread(2): each lookup reads the key's bucket, and the inode sector of each
+ * entry whose tag matches. For comparison, a few lookups also read the whole
+ * inode table, which is how kvfs looks up keys on a filesystem without an
+ * index. The data blocks are left as a hole in the image file.
+ * */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvfs.h"
+
+#define SECTOR_SIZE 512
+
+/* counts of one kind of lookup */
+struct result {
+	uint64_t lookups;
+	uint64_t found;
+	uint64_t reads; /* sectors read */
+	double secs;
+};
+
+void
+usage()
+{
+	printf("kvbench -f image [-n keys] [-l lookups] [-s scans]\n");
+	printf("-f image\t\tThe image file to create\n");
+	printf("-n keys\t\t\tNumber of keys in the image (default 1000000)\n");
+	printf("-l lookups\t\tIndex lookups of each kind (default 1000000)\n");
+	printf("-s scans\t\tLookups reading the inode table (default 10)\n");
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* the key of block `i`: keys are SHA-1 hashes, so any random bytes will do */
+static void
+key_for(uint64_t i, uint8_t *key)
+{
+	for (int w = 0; w < 3; w++) {
+		/* splitmix64 */
+		uint64_t z = (i * 3 + w + 1) * 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		memcpy(key + w * 8, &z, w == 2 ? 4 : 8);
+	}
+}
+
+/* write a buffer to fd at off, or exit */
+static void
+writebuf(int fd, const void *buf, size_t size, off_t off)
+{
+	if (pwrite(fd, buf, size, off) != (ssize_t)size) {
+		err(1, "write");
+	}
+}
+
+/* read sector `off` of the image into buf, or exit */
+static void
+readsector(int fd, void *buf, off_t off)
+{
+	if (pread(fd, buf, SECTOR_SIZE, off) != SECTOR_SIZE) {
+		err(1, "read");
+	}
+}
+
+/* add the key of block `i` to the in-memory index, like kvfs_index_insert */
+static void
+index_insert(uint8_t *index, uint32_t buckets, const uint8_t *key, uint32_t i)
+{
+	uint32_t b = KVFS_INDEX_HOME(key, buckets);
+
+	for (uint32_t n = 0; n < buckets; n++) {
+		struct kvfs_index_bucket *bucket = (struct kvfs_index_bucket *)(
+		    index + (size_t)b * KVFS_INDEX_BUCKETSIZE);
+		for (int e = 0; e < KVFS_INDEX_ENTRIES; e++) {
+			if (bucket->entries[e].index == 0) {
+				bucket->entries[e].index = i + 1;
+				bucket->entries[e].tag = KVFS_INDEX_TAG(key);
+				return;
+			}
+		}
+		bucket->flags |= KVFS_INDEX_OVERFLOW;
+		if (++b == buckets) {
+			b = 0;
+		}
+	}
+	errx(1, "key index is full");
+}
+
+/* Make an image of `n` blocks, all in use. It is laid out like mkkvfs lays out
+ * a disk of exactly that many blocks. */
+static void
+mkimage(int fd, uint32_t n, struct kvfs_superblock *sb)
+{
+	uint8_t buf[BLOCKSIZE];
+	uint8_t *index;
+	off_t bitmap_size = CEIL(n, 8);
+	off_t index_size;
+	uint32_t overflowed = 0;
+
+	memset(sb, 0, sizeof(*sb));
+	sb->magicnum = KVFS_SUPERBLOCK_MAGIC;
+	sb->superblock_size = sizeof(struct kvfs_superblock);
+	sb->block_count = n;
+	sb->freelist_off = BLOCKSIZE;
+	sb->inode_off = PAD(bitmap_size) + sb->freelist_off;
+	sb->index_off = PAD((off_t)n * sizeof(struct kvfs_inode)) + sb->inode_off;
+	sb->index_buckets = KVFS_INDEX_BUCKETS(n);
+	index_size = (off_t)sb->index_buckets * KVFS_INDEX_BUCKETSIZE;
+	sb->data_off = PAD(index_size) + sb->index_off;
+	sb->fs_size = sb->data_off + (off_t)n * BLOCKSIZE;
+
+	if (ftruncate(fd, 0) != 0 || ftruncate(fd, sb->fs_size) != 0) {
+		err(1, "ftruncate");
+	}
+	memset(buf, 0, BLOCKSIZE);
+	memcpy(buf, sb, sizeof(*sb));
+	writebuf(fd, buf, BLOCKSIZE, 0);
+
+	/* every block is in use */
+	memset(buf, 0xff, BLOCKSIZE);
+	for (off_t off = 0; off < bitmap_size; off += BLOCKSIZE) {
+		writebuf(fd, buf, MIN(BLOCKSIZE, bitmap_size - off),
+		    sb->freelist_off + off);
+	}
+
+	if ((index = calloc(1, index_size)) == NULL) {
+		err(1, "key index");
+	}
+	struct kvfs_inode *inodes = (struct kvfs_inode *)buf;
+	int per_block = BLOCKSIZE / sizeof(struct kvfs_inode);
+	for (uint32_t i = 0; i < n; i += per_block) {
+		memset(buf, 0, BLOCKSIZE);
+		for (int j = 0; j < per_block && i + j < n; j++) {
+			key_for(i + j, inodes[j].key);
+			inodes[j].flags = KVFS_INODE_ACTIVE;
+			inodes[j].ref_count = 1;
+			index_insert(index, sb->index_buckets, inodes[j].key,
+			    i + j);
+		}
+		writebuf(fd, buf, BLOCKSIZE,
+		    sb->inode_off + (off_t)i * sizeof(struct kvfs_inode));
+	}
+	writebuf(fd, index, index_size, sb->index_off);
+	for (uint32_t b = 0; b < sb->index_buckets; b++) {
+		struct kvfs_index_bucket *bucket = (struct kvfs_index_bucket *)(
+		    index + (size_t)b * KVFS_INDEX_BUCKETSIZE);
+		if (bucket->flags & KVFS_INDEX_OVERFLOW) {
+			overflowed++;
+		}
+	}
+	free(index);
+	printf("key index: %u buckets, %.1f%% full, %u overflowed\n",
+	    sb->index_buckets,
+	    100.0 * n / ((double)sb->index_buckets * KVFS_INDEX_ENTRIES),
+	    overflowed);
+}
+
+/* look `key` up through the key index, like kvfs_index_lookup */
+static int
+index_lookup(int fd, const struct kvfs_superblock *sb, const uint8_t *key,
+    uint64_t *reads)
+{
+	struct kvfs_index_bucket bucket;
+	struct kvfs_inode inode;
+	uint8_t sector[SECTOR_SIZE];
+	uint32_t b = KVFS_INDEX_HOME(key, sb->index_buckets);
+	uint32_t tag = KVFS_INDEX_TAG(key);
+
+	for (uint32_t n = 0; n < sb->index_buckets; n++) {
+		readsector(fd, &bucket,
+		    sb->index_off + (off_t)b * KVFS_INDEX_BUCKETSIZE);
+		(*reads)++;
+		for (int i = 0; i < KVFS_INDEX_ENTRIES; i++) {
+			struct kvfs_index_entry *e = &bucket.entries[i];
+			if (e->index == 0 || e->tag != tag) {
+				continue;
+			}
+			off_t loc = sb->inode_off +
+			    (off_t)(e->index - 1) * sizeof(struct kvfs_inode);
+			readsector(fd, sector, loc - loc % SECTOR_SIZE);
+			(*reads)++;
+			memcpy(&inode, sector + loc % SECTOR_SIZE,
+			    sizeof(inode));
+			if ((inode.flags & KVFS_INODE_FREE) == 0 &&
+			    memcmp(inode.key, key, sizeof(inode.key)) == 0) {
+				return (1);
+			}
+		}
+		if ((bucket.flags & KVFS_INDEX_OVERFLOW) == 0) {
+			break;
+		}
+		if (++b == sb->index_buckets) {
+			b = 0;
+		}
+	}
+	return (0);
+}
+
+/* look `key` up by reading the whole inode table, like kvfs without an index */
+static int
+scan_lookup(int fd, const struct kvfs_superblock *sb, const uint8_t *key,
+    uint64_t *reads)
+{
+	size_t size = PAD((off_t)sb->block_count * sizeof(struct kvfs_inode));
+	struct kvfs_inode *inodes;
+	int found = 0;
+
+	if ((inodes = malloc(size)) == NULL) {
+		err(1, "inode table");
+	}
+	if (pread(fd, inodes, size, sb->inode_off) != (ssize_t)size) {
+		err(1, "read");
+	}
+	*reads += size / SECTOR_SIZE;
+	for (uint32_t i = 0; i < sb->block_count; i++) {
+		if ((inodes[i].flags & KVFS_INODE_FREE) == 0 &&
+		    memcmp(inodes[i].key, key, sizeof(inodes[i].key)) == 0) {
+			found = 1;
+			break;
+		}
+	}
+	free(inodes);
+	return (found);
+}
+
+/* look up `count` keys of blocks `first` to `first + range - 1` */
+static void
+run(int fd, const struct kvfs_superblock *sb, uint64_t count, uint64_t first,
+    uint64_t range, int scan, struct result *r)
+{
+	uint8_t key[20];
+	uint64_t x = 88172645463325252ULL;
+	double start = now();
+
+	memset(r, 0, sizeof(*r));
+	for (uint64_t i = 0; i < count; i++) {
+		/* xorshift64, so lookups go all over the index */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		key_for(first + x % range, key);
+		if (scan) {
+			r->found += scan_lookup(fd, sb, key, &r->reads);
+		} else {
+			r->found += index_lookup(fd, sb, key, &r->reads);
+		}
+		r->lookups++;
+	}
+	r->secs = now() - start;
+}
+
+static void
+report(const char *what, const struct result *r)
+{
+	printf("%-16s %10ju lookups, %10ju found, %8.3f s, %12.0f lookups/s, "
+	       "%.2f sectors/lookup\n",
+	    what, (uintmax_t)r->lookups, (uintmax_t)r->found, r->secs,
+	    r->lookups / (r->secs > 0 ? r->secs : 1e-9),
+	    (double)r->reads / (r->lookups ? r->lookups : 1));
+}
+
+int
+main(int argc, char **argv)
+{
+	int ch;
+	char *image = NULL;
+	uint32_t n = 1000000;
+	uint64_t lookups = 1000000, scans = 10;
+	struct kvfs_superblock sb;
+	struct result r;
+
+	while ((ch = getopt(argc, argv, "hf:n:l:s:")) != -1) {
+		switch (ch) {
+		case 'f':
+			image = optarg;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lookups = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			scans = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			exit(1);
+		}
+	}
+	if (image == NULL || n == 0 || n > (1U << 30)) {
+		usage();
+		exit(1);
+	}
+
+	int fd = open(image, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		err(1, "%s", image);
+	}
+	double start = now();
+	mkimage(fd, n, &sb);
+	if (fsync(fd) != 0) {
+		err(1, "fsync");
+	}
+	printf("made %s with %u keys in %.3f s\n", image, n, now() - start);
+
+	run(fd, &sb, lookups, 0, n, 0, &r);
+	report("index, present", &r);
+	run(fd, &sb, lookups, n, n, 0, &r);
+	report("index, absent", &r);
+	if (scans > 0) {
+		run(fd, &sb, scans, 0, n, 1, &r);
+		report("table scan", &r);
+	}
+
+	close(fd);
+	return (0);
+}
@@ -26,10 +26,11 @@ void
 printsblock(struct kvfs_superblock *sblock)
 {
 	printf(
-	    "magicnum: 0x%.4x, superblock_size: 0x%.4x, freelist_off: 0x%.16jx, inode_off: 0x%.16jx, data_off: 0x%.16jx, block_count: 0x%.8x, flags: 0x%.16lx, fs_size:0x%.16lx\n",
+	    "magicnum: 0x%.4x, superblock_size: 0x%.4x, freelist_off: 0x%.16jx, inode_off: 0x%.16jx, data_off: 0x%.16jx, block_count: 0x%.8x, flags: 0x%.16lx, fs_size:0x%.16lx, index_off: 0x%.16jx, index_buckets: 0x%.8x\n",
 	    sblock->magicnum, sblock->superblock_size, sblock->freelist_off,
 	    sblock->inode_off, sblock->data_off, sblock->block_count,
-	    sblock->flags, sblock->fs_size);
+	    sblock->flags, sblock->fs_size, sblock->index_off,
+	    sblock->index_buckets);
 }
 
 /*
@@ -46,14 +47,15 @@ init_superblock(off_t disksize, struct kvfs_superblock *sb)
 	off_t blocks = (disksize - superblock_size) / BLOCKSIZE / 2;
 	off_t delta = disksize / 16;
 
-	off_t inode_count, free_bitmap, sum;
+	off_t inode_count, free_bitmap, index_size, sum;
 	while (1) {
 		/* TODO: locate free bitmap inside superblock */
 		inode_count = blocks;
 		free_bitmap = CEIL(blocks, 8);
+		index_size = KVFS_INDEX_BUCKETS(blocks) * KVFS_INDEX_BUCKETSIZE;
 		sum = superblock_size + blocks * BLOCKSIZE +
 		    PAD(inode_count * sizeof(struct kvfs_inode)) +
-		    PAD(free_bitmap);
+		    PAD(free_bitmap) + PAD(index_size);
 
 		/* check if we found the solution */
 		if (disksize - sum == 0) {
@@ -87,8 +89,11 @@ init_superblock(off_t disksize, struct kvfs_superblock *sb)
 	 * block*/
 	sb->freelist_off = BLOCKSIZE;
 	sb->inode_off = PAD(free_bitmap) + sb->freelist_off;
-	sb->data_off = PAD(inode_count * sizeof(struct kvfs_inode)) +
+	/* the key index follows the inode table */
+	sb->index_off = PAD(inode_count * sizeof(struct kvfs_inode)) +
 	    sb->inode_off;
+	sb->index_buckets = KVFS_INDEX_BUCKETS(blocks);
+	sb->data_off = PAD(index_size) + sb->index_off;
 }
 
 /* write a buffer to fd. assumes fd is open */
@@ -216,13 +221,21 @@ main(int argc, char **argv)
 	for (int i = 0; i < BLOCKSIZE; i += sizeof(struct kvfs_inode)) {
 		memcpy(buf + i, &inode, sizeof(struct kvfs_inode));
 	}
-	for (off_t ptr = sblock.inode_off; ptr < sblock.data_off;
+	for (off_t ptr = sblock.inode_off; ptr < sblock.index_off;
 	     ptr += sizeof(struct kvfs_inode)) {
 		if (ptr % BLOCKSIZE == 0) {
 			writebuf(fd, buf, BLOCKSIZE);
 		}
 	}
 
+	printf("Writing key index (%u buckets)...\n", sblock.index_buckets);
+	/* every bucket starts out empty */
+	bzero(buf, BLOCKSIZE);
+	for (off_t ptr = sblock.index_off; ptr < sblock.data_off;
+	     ptr += BLOCKSIZE) {
+		writebuf(fd, buf, BLOCKSIZE);
+	}
+
 	printf("Writing data blocks...\n");
 	/* write free space zeroes to disk */
 	bzero(buf, BLOCKSIZE);